@@ -9,9 +9,15 @@ MODELS=\
 	models/srcs/Server.cpp\
 	models/srcs/Container.cpp\
 	models/srcs/LocationConfig.cpp\
+	models/srcs/LocationIndex.cpp\
+	models/srcs/RegexSet.cpp\
+	models/srcs/ResolvedLocation.cpp\
+	models/srcs/VhostRouter.cpp\
 	models/srcs/parser.cpp\
 	models/srcs/lexer.cpp\
 	models/srcs/readFile.cpp\
+	models/srcs/ConfigLoader.cpp\
+	models/srcs/ConfigCache.cpp\
 	models/srcs/SocketManager.cpp\
 	models/srcs/HttpUtils.cpp\
 	models/srcs/HttpResponse.cpp\
@@ -20,8 +26,28 @@ MODELS=\
 	models/srcs/requestContext.cpp\
 	models/srcs/ResourceGuards.cpp\
 	models/srcs/CgiHandle.cpp\
+	models/srcs/CgiSession.cpp\
+	models/srcs/ProxyPass.cpp\
+	models/srcs/ProxyBuffering.cpp\
+	models/srcs/ProxyCacheRule.cpp\
+	models/srcs/ProxyCache.cpp\
+	models/srcs/ProxySession.cpp\
+	models/srcs/ProxyHandler.cpp\
+	models/srcs/UpstreamPool.cpp\
+	models/srcs/UpstreamBalancer.cpp\
+	models/srcs/CgiDispatch.cpp\
+	models/srcs/CgiAdmission.cpp\
+	models/srcs/LimitReq.cpp\
+	models/srcs/RequestLimiter.cpp\
+	models/srcs/LimitConn.cpp\
+	models/srcs/ConnectionLimiter.cpp\
+	models/srcs/AccessList.cpp\
+	models/srcs/VariableMap.cpp\
+	models/srcs/CgiCache.cpp\
+	models/srcs/ConfigSnapshot.cpp\
 
 TEMPLATES=\
+	HashTable.hpp\
 
 HEADERS=\
 	models/headers/BaseBlock.hpp\
@@ -29,7 +55,13 @@ HEADERS=\
 	models/headers/Server.hpp\
 	models/headers/Container.hpp\
 	models/headers/LocationConfig.hpp\
+	models/headers/LocationIndex.hpp\
+	models/headers/RegexSet.hpp\
+	models/headers/ResolvedLocation.hpp\
+	models/headers/VhostRouter.hpp\
 	models/headers/parser.hpp\
+	models/headers/ConfigLoader.hpp\
+	models/headers/ConfigCache.hpp\
 	models/headers/SocketManager.hpp\
 	models/headers/HttpUtils.hpp\
 	models/headers/HttpResponse.hpp\
@@ -38,3 +70,22 @@ HEADERS=\
 	models/headers/requestContext.hpp\
 	models/headers/ResourceGuards.hpp\
 	models/headers/CgiHandle.hpp\
+	models/headers/CgiSession.hpp\
+	models/headers/ProxyPass.hpp\
+	models/headers/ProxyBuffering.hpp\
+	models/headers/ProxyCacheRule.hpp\
+	models/headers/ProxyCache.hpp\
+	models/headers/ProxySession.hpp\
+	models/headers/ProxyHandler.hpp\
+	models/headers/UpstreamPool.hpp\
+	models/headers/UpstreamBalancer.hpp\
+	models/headers/CgiDispatch.hpp\
+	models/headers/CgiAdmission.hpp\
+	models/headers/LimitReq.hpp\
+	models/headers/RequestLimiter.hpp\
+	models/headers/LimitConn.hpp\
+	models/headers/ConnectionLimiter.hpp\
+	models/headers/AccessList.hpp\
+	models/headers/VariableMap.hpp\
+	models/headers/CgiCache.hpp\
+	models/headers/ConfigSnapshot.hpp\
@@ -0,0 +1,383 @@
+// CGI load driver for webserv.
+//
+// Starts the server with a benchmark config (or attaches to a running one),
+// then keeps a fixed number of HTTP/1.0 requests in flight over loopback for
+// each scenario and concurrency level. Reports throughput, latency
+// percentiles, an estimate of the CGI spawn cost and the server's peak RSS.
+//
+//   make bench
+//   ./bench/cgi_bench [-s ./webserv] [-c config/cgi_bench.conf] [-p 8089]
+//                     [-d seconds] [-l 1,8,32] [-m fork] [-P pid]
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define BENCH_CHUNK 65536
+
+struct Scenario {
+  const char* name;
+  const char* method;
+  const char* path;
+  size_t bodySize;
+};
+
+// "static" is not a CGI request: it is the baseline the spawn estimate is
+// measured against
+static const Scenario kScenarios[] = {
+    {"static", "GET", "/index.html", 0},
+    {"get", "GET", "/cgi-bin/bench_hello.sh?q=1", 0},
+    {"post_small", "POST", "/cgi-bin/bench_sink.sh", 1024},
+    {"post_large", "POST", "/cgi-bin/bench_sink.sh", 8 * 1024 * 1024},
+};
+
+struct Options {
+  std::string server;
+  std::string config;
+  int port;
+  double duration;
+  std::vector<int> levels;
+  std::string mode;
+  pid_t pid;
+};
+
+struct Result {
+  std::vector<double> latencies;  // milliseconds
+  size_t errors;
+  double elapsed;                 // seconds
+};
+
+struct Slot {
+  int fd;
+  std::string head;
+  size_t headSent;
+  size_t bodySent;
+  std::string status;
+  double start;
+};
+
+static char gBody[BENCH_CHUNK];
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static std::vector<int> parseLevels(const std::string& list) {
+  std::vector<int> levels;
+  std::istringstream in(list);
+  std::string item;
+  while (std::getline(in, item, ','))
+    if (std::atoi(item.c_str()) > 0)
+      levels.push_back(std::atoi(item.c_str()));
+  return levels;
+}
+
+static int connectLoopback(int port, bool blocking) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+  if (!blocking)
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+  struct sockaddr_in addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 &&
+      errno != EINPROGRESS) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static pid_t launchServer(const Options& opt) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    execl(opt.server.c_str(), opt.server.c_str(), opt.config.c_str(),
+          (char*)NULL);
+    std::exit(127);
+  }
+  for (int attempt = 0; pid > 0 && attempt < 50; ++attempt) {
+    int fd = connectLoopback(opt.port, true);
+    if (fd != -1) {
+      close(fd);
+      return pid;
+    }
+    usleep(100000);
+  }
+  if (pid > 0) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+  }
+  return -1;
+}
+
+// Peak resident set of the server process, in kB
+static long peakRss(pid_t pid) {
+  std::ostringstream path;
+  path << "/proc/" << pid << "/status";
+  std::ifstream status(path.str().c_str());
+  std::string line;
+  while (std::getline(status, line))
+    if (line.compare(0, 6, "VmHWM:") == 0)
+      return std::atol(line.c_str() + 6);
+  return -1;
+}
+
+static bool openSlot(Slot& slot, const Scenario& sc, int port, int epfd,
+                     int index) {
+  slot.fd = connectLoopback(port, false);
+  if (slot.fd == -1)
+    return false;
+
+  std::ostringstream head;
+  head << sc.method << " " << sc.path << " HTTP/1.0\r\n"
+       << "Host: 127.0.0.1\r\n";
+  if (sc.bodySize)
+    head << "Content-Type: application/octet-stream\r\n"
+         << "Content-Length: " << sc.bodySize << "\r\n";
+  head << "\r\n";
+  slot.head = head.str();
+  slot.headSent = 0;
+  slot.bodySent = 0;
+  slot.status.clear();
+  slot.start = now();
+
+  struct epoll_event ev;
+  ev.events = EPOLLOUT;
+  ev.data.u32 = index;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, slot.fd, &ev);
+  return true;
+}
+
+static void closeSlot(Slot& slot, int epfd) {
+  epoll_ctl(epfd, EPOLL_CTL_DEL, slot.fd, NULL);
+  close(slot.fd);
+  slot.fd = -1;
+}
+
+// Returns false once the request failed on the way out
+static bool sendSlot(Slot& slot, const Scenario& sc) {
+  while (slot.headSent < slot.head.size()) {
+    ssize_t n = send(slot.fd, slot.head.data() + slot.headSent,
+                     slot.head.size() - slot.headSent, MSG_NOSIGNAL);
+    if (n <= 0)
+      return n == -1 && errno == EAGAIN;
+    slot.headSent += n;
+  }
+  while (slot.bodySent < sc.bodySize) {
+    size_t want = std::min(sc.bodySize - slot.bodySent, (size_t)BENCH_CHUNK);
+    ssize_t n = send(slot.fd, gBody, want, MSG_NOSIGNAL);
+    if (n <= 0)
+      return n == -1 && errno == EAGAIN;
+    slot.bodySent += n;
+  }
+  return true;
+}
+
+static void watchInput(Slot& slot, int epfd, int index) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.u32 = index;
+  epoll_ctl(epfd, EPOLL_CTL_MOD, slot.fd, &ev);
+}
+
+// Reads until EOF. Returns 1 when the response is complete, 0 when more is
+// expected and -1 on a socket error.
+static int readSlot(Slot& slot) {
+  char buffer[BENCH_CHUNK];
+  while (true) {
+    ssize_t n = recv(slot.fd, buffer, sizeof(buffer), 0);
+    if (n > 0) {
+      if (slot.status.size() < 12)
+        slot.status.append(buffer, std::min((size_t)n, 12 - slot.status.size()));
+    } else if (n == 0) {
+      return 1;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return 0;
+    } else {
+      return -1;
+    }
+  }
+}
+
+static Result runScenario(const Scenario& sc, int concurrency, const Options& opt) {
+  Result result;
+  result.errors = 0;
+
+  int epfd = epoll_create1(0);
+  std::vector<Slot> slots(concurrency);
+  std::vector<struct epoll_event> events(concurrency);
+  double begin = now();
+  double deadline = begin + opt.duration;
+  int active = 0;
+
+  for (int i = 0; i < concurrency; ++i) {
+    if (openSlot(slots[i], sc, opt.port, epfd, i))
+      ++active;
+    else
+      ++result.errors;
+  }
+  while (active > 0) {
+    int n = epoll_wait(epfd, &events[0], events.size(), 1000);
+    for (int e = 0; e < n; ++e) {
+      int index = events[e].data.u32;
+      Slot& slot = slots[index];
+      bool done = false;
+      bool failed = false;
+
+      if (events[e].events & EPOLLOUT) {
+        if (!sendSlot(slot, sc))
+          failed = true;
+        else if (slot.bodySent == sc.bodySize &&
+                 slot.headSent == slot.head.size())
+          watchInput(slot, epfd, index);
+      }
+      if (!failed && (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        int state = readSlot(slot);
+        failed = state == -1;
+        done = state == 1;
+      }
+      if (!done && !failed)
+        continue;
+
+      if (done && slot.status.size() == 12 &&
+          slot.status.compare(9, 3, "200") == 0)
+        result.latencies.push_back((now() - slot.start) * 1000.0);
+      else
+        ++result.errors;
+      closeSlot(slot, epfd);
+      --active;
+      if (now() < deadline) {
+        if (openSlot(slot, sc, opt.port, epfd, index))
+          ++active;
+        else
+          ++result.errors;
+      }
+    }
+  }
+  result.elapsed = now() - begin;
+  close(epfd);
+  return result;
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+  if (sorted.empty())
+    return 0;
+  size_t index = (size_t)std::ceil(p * sorted.size());
+  if (index > 0)
+    --index;
+  return sorted[std::min(index, sorted.size() - 1)];
+}
+
+static void usage(const char* name) {
+  std::cerr << "usage: " << name
+            << " [-s server] [-c config] [-p port] [-d seconds] [-l 1,8,32]"
+               " [-m mode] [-P pid]\n";
+  std::exit(2);
+}
+
+int main(int argc, char** argv) {
+  Options opt;
+  opt.server = "./webserv";
+  opt.config = "config/cgi_bench.conf";
+  opt.port = 8089;
+  opt.duration = 3;
+  opt.levels = parseLevels("1,8,32");
+  opt.mode = "fork";
+  opt.pid = -1;
+
+  int c;
+  while ((c = getopt(argc, argv, "s:c:p:d:l:m:P:")) != -1) {
+    if (c == 's')
+      opt.server = optarg;
+    else if (c == 'c')
+      opt.config = optarg;
+    else if (c == 'p')
+      opt.port = std::atoi(optarg);
+    else if (c == 'd')
+      opt.duration = std::atof(optarg);
+    else if (c == 'l')
+      opt.levels = parseLevels(optarg);
+    else if (c == 'm')
+      opt.mode = optarg;
+    else if (c == 'P')
+      opt.pid = std::atoi(optarg);
+    else
+      usage(argv[0]);
+  }
+  if (opt.levels.empty() || opt.duration <= 0)
+    usage(argv[0]);
+
+  signal(SIGPIPE, SIG_IGN);
+  std::memset(gBody, 'x', sizeof(gBody));
+
+  bool launched = opt.pid == -1;
+  if (launched) {
+    opt.pid = launchServer(opt);
+    if (opt.pid == -1) {
+      std::cerr << "cgi_bench: could not start " << opt.server << " "
+                << opt.config << " on port " << opt.port << "\n";
+      return 1;
+    }
+  }
+
+  std::printf("%-6s %-11s %5s %9s %9s %9s %9s %7s %10s\n", "mode", "scenario",
+              "conc", "req/s", "p50_ms", "p99_ms", "p999_ms", "errors",
+              "peak_rss");
+  double staticP50 = -1;
+  double getP50 = -1;
+  size_t count = sizeof(kScenarios) / sizeof(kScenarios[0]);
+  for (size_t s = 0; s < count; ++s) {
+    for (size_t l = 0; l < opt.levels.size(); ++l) {
+      Result r = runScenario(kScenarios[s], opt.levels[l], opt);
+      std::sort(r.latencies.begin(), r.latencies.end());
+      double p50 = percentile(r.latencies, 0.50);
+      if (opt.levels[l] == 1 && s == 0)
+        staticP50 = p50;
+      if (opt.levels[l] == 1 && s == 1)
+        getP50 = p50;
+      std::printf("%-6s %-11s %5d %9.1f %9.2f %9.2f %9.2f %7lu %8ldkB\n",
+                  opt.mode.c_str(), kScenarios[s].name, opt.levels[l],
+                  r.latencies.size() / r.elapsed, p50,
+                  percentile(r.latencies, 0.99), percentile(r.latencies, 0.999),
+                  (unsigned long)r.errors, peakRss(opt.pid));
+      std::fflush(stdout);
+    }
+  }
+  // Same request path with and without a child process: the difference is
+  // what starting the script costs
+  if (staticP50 >= 0 && getP50 >= 0)
+    std::printf("spawn latency (%s, p50 get - p50 static at conc 1): %.2f ms\n",
+                opt.mode.c_str(), getP50 - staticP50);
+
+  if (launched) {
+    kill(opt.pid, SIGTERM);
+    waitpid(opt.pid, NULL, 0);
+  }
+  return 0;
+}
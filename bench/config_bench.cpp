@@ -0,0 +1,211 @@
+// Config loading benchmark for webserv.
+//
+// Generates configs with an increasing number of server blocks (each with a
+// few locations, names and error pages), writes them to a temporary file and
+// times every startup phase the server goes through: readFile, lexer,
+// checks, parser and building the runtime snapshot (vhost tables). Startup
+// should scale linearly, so the per-server cost must stay flat as the
+// config grows. The last column is the same startup from the compiled
+// config ("webserv -c"): checking and mapping it plus the snapshot.
+//
+//   make bench
+//   ./bench/config_bench [-n 1000,2000,5000,10000,20000] [-r 3] [-o /tmp/x.conf]
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "ConfigCache.hpp"
+#include "ConfigLoader.hpp"
+#include "ConfigSnapshot.hpp"
+#include "Container.hpp"
+#include "parser.hpp"
+
+struct Options {
+  std::vector<size_t> counts;
+  int rounds;
+  std::string output;
+};
+
+struct Timing {
+  double read;
+  double lex;
+  double check;
+  double parse;
+  double snapshot;
+  double compiled;
+
+  Timing() : read(0), lex(0), check(0), parse(0), snapshot(0), compiled(0) {}
+  double total() const { return read + lex + check + parse + snapshot; }
+};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static std::string generate(size_t servers) {
+  std::ostringstream conf;
+
+  conf << "http {\n";
+  for (size_t i = 0; i < servers; ++i) {
+    conf << "    server {\n"
+         << "        listen " << 20000 + i % 16 << ";\n"
+         << "        server_name s" << i << ".example.com www.s" << i
+         << ".example.com;\n"
+         << "        root www/;\n"
+         << "        index index.html index.htm;\n"
+         << "        error_page 404 /errors/404.html;\n"
+         << "        client_max_body_size 1M;\n"
+         << "        location / {\n"
+         << "            allow_methods GET POST;\n"
+         << "        }\n"
+         << "        location /api" << i << " {\n"
+         << "            return 301 /v2/api" << i << ";\n"
+         << "        }\n"
+         << "        location = /health {\n"
+         << "            return 301 /ok;\n"
+         << "        }\n"
+         << "        location ~ \\.php$ {\n"
+         << "            allow_methods GET;\n"
+         << "        }\n"
+         << "    }\n";
+  }
+  conf << "}\n";
+  return conf.str();
+}
+
+static Timing measure(const std::string& path) {
+  Timing t;
+
+  double start = now();
+  std::string content = readFile(path);
+  double read = now();
+  std::vector<Token> tokens = lexer(content);
+  double lexed = now();
+  checks(tokens);
+  double checked = now();
+  Container container = parser(tokens);
+  double parsed = now();
+  std::vector<Server> servers;
+  container.releaseServers(servers);
+  ConfigSnapshot snapshot(servers);
+  double done = now();
+
+  t.read = read - start;
+  t.lex = lexed - read;
+  t.check = checked - lexed;
+  t.parse = parsed - checked;
+  t.snapshot = done - parsed;
+
+  start = now();
+  if (!ConfigCache::read(ConfigCache::pathFor(path), servers))
+    throw std::runtime_error("compiled config was not used");
+  ConfigSnapshot compiled(servers);
+  t.compiled = now() - start;
+  return t;
+}
+
+static void compile(const std::string& path) {
+  ConfigLoader loader;
+  Container container = parser(loader.load(path));
+  std::vector<Server> servers;
+  container.releaseServers(servers);
+  ConfigCache::write(ConfigCache::pathFor(path), servers, loader);
+}
+
+static void usage(const char* name) {
+  std::cerr << "usage: " << name
+            << " [-n 1000,2000,5000,10000,20000] [-r rounds] [-o file]"
+            << std::endl;
+  exit(1);
+}
+
+static Options parseOptions(int argc, char** argv) {
+  Options opt;
+  opt.rounds = 3;
+  std::ostringstream output;
+  output << "/tmp/config_bench_" << getpid() << ".conf";
+  opt.output = output.str();
+  std::string counts = "1000,2000,5000,10000,20000";
+
+  int c;
+  while ((c = getopt(argc, argv, "n:r:o:")) != -1) {
+    if (c == 'n')
+      counts = optarg;
+    else if (c == 'r')
+      opt.rounds = atoi(optarg);
+    else if (c == 'o')
+      opt.output = optarg;
+    else
+      usage(argv[0]);
+  }
+  std::istringstream list(counts);
+  std::string item;
+  while (std::getline(list, item, ','))
+    if (atoi(item.c_str()) > 0)
+      opt.counts.push_back(atoi(item.c_str()));
+  if (opt.counts.empty() || opt.rounds < 1)
+    usage(argv[0]);
+  return opt;
+}
+
+int main(int argc, char** argv) {
+  Options opt = parseOptions(argc, argv);
+
+  printf("%8s %10s %8s %8s %8s %9s %9s %9s %10s %9s\n", "servers", "bytes",
+         "read", "lex", "checks", "parse", "snapshot", "total", "us/server",
+         "compiled");
+
+  std::vector<double> perServer;
+  for (size_t n = 0; n < opt.counts.size(); ++n) {
+    size_t servers = opt.counts[n];
+    std::string content = generate(servers);
+    {
+      std::ofstream out(opt.output.c_str(), std::ios::binary);
+      out << content;
+    }
+
+    // Best of several rounds, so page cache and allocator warm-up do not
+    // show up as non-linearity
+    Timing best;
+    for (int r = 0; r < opt.rounds; ++r) {
+      Timing t;
+      try {
+        if (r == 0)
+          compile(opt.output);
+        t = measure(opt.output);
+      } catch (const std::exception& e) {
+        std::cerr << "config with " << servers << " servers failed: "
+                  << e.what() << std::endl;
+        unlink(opt.output.c_str());
+        unlink(ConfigCache::pathFor(opt.output).c_str());
+        return 1;
+      }
+      if (r == 0 || t.total() < best.total())
+        best = t;
+      if (r > 0 && t.compiled < best.compiled)
+        best.compiled = t.compiled;
+    }
+    perServer.push_back(best.total() * 1000.0 / servers);
+    printf("%8zu %10zu %8.1f %8.1f %8.1f %9.1f %9.1f %9.1f %10.2f %9.1f\n",
+           servers, content.size(), best.read, best.lex, best.check,
+           best.parse, best.snapshot, best.total(), perServer.back(),
+           best.compiled);
+  }
+  unlink(opt.output.c_str());
+  unlink(ConfigCache::pathFor(opt.output).c_str());
+
+  if (perServer.size() > 1)
+    printf("per-server cost at %zu servers is %.2fx the cost at %zu "
+           "(1.00x = linear)\n",
+           opt.counts.back(), perServer.back() / perServer.front(),
+           opt.counts.front());
+  return 0;
+}
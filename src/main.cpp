@@ -1,5 +1,8 @@
+#include <csignal>
 #include <cstring>
 #include <iostream>
+#include "ConfigCache.hpp"
+#include "ConfigLoader.hpp"
 #include "Container.hpp"
 #include "SocketManager.hpp"
 #include "parser.hpp"
@@ -8,7 +11,32 @@
 std::vector<ServerSocketInfo> convertServersToSocketInfo(
     const std::vector<Server>& servers);
 
+// -c/--compile: parse and validate the config once and store the result
+// next to it, for startup and reloads to load instead of parsing
+static int compileConfig(int argc, char** argv) {
+  try {
+    std::string path = initValidation(argc - 1, argv + 1);
+    ConfigLoader loader;
+    Container container = parser(loader.load(path));
+    std::vector<Server> servers;
+    container.releaseServers(servers);
+    std::string compiled = ConfigCache::pathFor(path);
+    ConfigCache::write(compiled, servers, loader);
+    std::cout << "Compiled " << servers.size() << " server(s) from "
+              << loader.getSources().size() << " file(s) into " << compiled
+              << std::endl;
+  } catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
 int main(int argc, char** argv) {
+  if (argc == 3 && (std::strcmp(argv[1], "-c") == 0 ||
+                    std::strcmp(argv[1], "--compile") == 0))
+    return compileConfig(argc, argv);
+
   // if no config file found ->> load default built-in confing and print
   //"Warning: No config file provided. Using default configuration."
   if (argc != 2) {
@@ -16,18 +44,23 @@ int main(int argc, char** argv) {
     return 1;
   }
 
+  // A CGI script that exits before reading its stdin must not take the
+  // server down with it
+  signal(SIGPIPE, SIG_IGN);
+
   try {
     initValidation(argc, argv);
-    std::string content = readFile(argv[1]);
-    std::vector<Token> tokens = lexer(content);
-    checks(tokens);
-    Container container = parser(tokens);
+    SocketManager socketManager;
+    socketManager.setConfigPath(argv[1]);
+    std::vector<Server> servers;
+    socketManager.loadServers(servers);
 
     std::vector<ServerSocketInfo> socketInfos =
-        convertServersToSocketInfo(container.getServers());
+        convertServersToSocketInfo(servers);
 
-    SocketManager socketManager;
-    socketManager.setServers(container.getServers());
+    socketManager.setServers(servers);
+    socketManager.setBinaryPath(argv[0]);
+    socketManager.inheritListeners();
 
     if (!socketManager.initSockets(socketInfos))
       throw std::runtime_error("Failed to initialize sockets.");
@@ -35,6 +68,7 @@ int main(int argc, char** argv) {
     // Check
     std::cout << "Server initialized. Waiting for clients..." << std::endl;
     socketManager.handleClients();
+    std::cout << "Server stopped." << std::endl;
   } catch (const std::exception& e) {
     std::cerr << "Error: " << e.what() << std::endl;
     return 1;
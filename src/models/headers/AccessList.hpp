@@ -0,0 +1,65 @@
+#ifndef ACCESSLIST_HPP
+#define ACCESSLIST_HPP
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class CacheReader;
+class CacheWriter;
+
+// allow <address>[/<bits>] | all; deny <address>[/<bits>] | all;
+// IPv4 rules, checked in the order they are written: the first one
+// matching the client decides, and a client no rule matches is let in.
+// Listeners only accept IPv4, so IPv6 rules are refused when the config
+// is loaded. Addresses are stored as IPv4-mapped IPv6 ones in one
+// path-compressed binary trie over 128 bits. Each node keeps the
+// earliest rule written for its prefix; a lookup walks the prefixes of
+// the address from the shortest and keeps the earliest rule it meets,
+// which is the first match in written order at a cost bounded by the
+// address length, however many rules there are.
+class AccessList {
+ private:
+  struct Rule {
+    uint8_t addr[16];
+    unsigned bits;
+    bool allow;
+  };
+
+  struct Node {
+    uint8_t prefix[16];
+    unsigned bits;
+    uint32_t child[2];
+    uint32_t rule;  // earliest rule with exactly this prefix
+  };
+
+  std::vector<Rule> _rules;
+  std::vector<Node> _nodes;  // _nodes[0] is the root, the empty prefix
+
+  static bool parse(const std::string& spec, uint8_t addr[16],
+                    unsigned& bits);
+  static unsigned bitAt(const uint8_t addr[16], unsigned bit);
+  static bool matches(const uint8_t prefix[16], const uint8_t addr[16],
+                      unsigned bits);
+  uint32_t newNode(const uint8_t addr[16], unsigned bits, uint32_t rule);
+  void insert(const uint8_t addr[16], unsigned bits, uint32_t rule);
+
+ public:
+  AccessList();
+
+  // Throws on a malformed address or prefix length, or an IPv6 address
+  void add(bool allow, const std::string& spec);
+  bool empty() const;
+  size_t size() const;
+  bool allows(const in_addr& addr) const;
+  bool allows(const uint8_t addr[16]) const;
+  // Same rules in the same order
+  bool operator==(const AccessList& other) const;
+
+  // Only the rules are written; the trie is built again when read
+  void writeTo(CacheWriter& out) const;
+  void readFrom(CacheReader& in);
+};
+
+#endif
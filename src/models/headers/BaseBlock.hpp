@@ -1,25 +1,70 @@
 #ifndef BLOCKSERVER_HPP
 #define BLOCKSERVER_HPP
 
+#include <AccessList.hpp>
+#include <CgiDispatch.hpp>
 #include <CommonExceptions.hpp>
+#include <ConfigCache.hpp>
+#include <LimitReq.hpp>
 #include <utils.hpp>
 
+// add_header <name> <value> [always]; added to 2xx and 3xx responses, or
+// to every one with always. The value may use request and map variables.
+struct AddHeader {
+  std::string name;
+  std::string value;
+  bool always;
+};
+
+// Every configured field is also written to compiled configs by writeBlock();
+// add new ones there and bump CONFIG_CACHE_VERSION
 class BaseBlock {
  protected:
   std::string _root;
   std::pair<u_int16_t, std::string> _returnData;
   size_t _clientMaxBodySize;
+  bool _clientMaxBodySizeExplicitlySet;
   std::vector<std::string> _indexFiles;
   std::map<u_int16_t, std::string> _errorPages;
   bool _autoIndex;
   bool _cgiEnabled;
   bool _cgiExplicitlySet;
   std::map<std::string, std::string> _cgiPassMap;
+  bool _cgiCacheEnabled;
+  time_t _cgiCacheValid;
+  time_t _cgiCacheLockTimeout;
+  size_t _cgiCacheMaxSize;
+  bool _cgiCacheExplicitlySet;
+  bool _cgiCacheValidExplicitlySet;
+  bool _cgiCacheLockTimeoutExplicitlySet;
+  bool _cgiCacheMaxSizeExplicitlySet;
+  size_t _cgiMaxConcurrent;
+  size_t _cgiQueueSize;
+  time_t _cgiQueueTimeout;
+  bool _cgiMaxConcurrentExplicitlySet;
+  bool _cgiQueueExplicitlySet;
+  std::vector<LimitReqRule> _limitReqs;
+  u_int16_t _limitReqStatus;
+  bool _limitReqStatusExplicitlySet;
+  AccessList _access;
+  std::vector<AddHeader> _addHeaders;
+  size_t _limitRate;
+  size_t _limitRateAfter;
+  bool _limitRateExplicitlySet;
+  bool _limitRateAfterExplicitlySet;
+  CgiDispatch _cgiDispatch;
   BaseBlock();
   BaseBlock(const BaseBlock& obj);
+  void writeBlock(CacheWriter& out) const;
+  void readBlock(CacheReader& in);
   virtual ~BaseBlock();
 
  public:
+  // "30", "30s", "5m", "2h" or "1d"; throws unless positive
+  static time_t parseSeconds(const std::string& seconds);
+  // "512", "8k", "1M" or "2g" in bytes; throws when malformed
+  static size_t parseSize(std::string& sSize);
+
   void setRoot(const std::string& root);
   void setClientMaxBodySize(std::string& sSize);
   void setReturn(u_int16_t code, const std::string& url);
@@ -30,17 +75,62 @@ class BaseBlock {
   const std::pair<u_int16_t, std::string>& getReturnData() const;
   bool hasReturn() const;
   size_t getClientMaxBodySize() const;
+  void inheritClientMaxBodySize(size_t parentClientMaxBodySize);
   bool isCgiEnabled() const;
   void setCgiEnabled(bool enabled);
   bool isCgiExplicitlySet() const;
   void inheritCgiFromParent(bool parentCgiEnabled);
   void setCgiPassMapping(const std::string& extension,
                          const std::string& interpreterPath);
-  std::map<std::string, std::string> getCgiPassMap() const;
+  const std::map<std::string, std::string>& getCgiPassMap() const;
   void inheritCgiPassFromParent(
       const std::map<std::string, std::string>& parentCgiPassMap);
+  void setCgiCache(bool enabled);
+  bool isCgiCacheEnabled() const;
+  void setCgiCacheValid(const std::string& seconds);
+  time_t getCgiCacheValid() const;
+  // How long identical requests wait on a running script before running
+  // it themselves
+  void setCgiCacheLockTimeout(const std::string& seconds);
+  time_t getCgiCacheLockTimeout() const;
+  void setCgiCacheMaxSize(std::string& sSize);
+  size_t getCgiCacheMaxSize() const;
+  void inheritCgiCacheFromParent(const BaseBlock& parent);
+  void setCgiMaxConcurrent(const std::string& limit);
+  size_t getCgiMaxConcurrent() const;
+  void setCgiQueue(const std::string& size, const std::string& timeout);
+  size_t getCgiQueueSize() const;
+  time_t getCgiQueueTimeout() const;
+  void inheritCgiLimitsFromParent(const BaseBlock& parent);
+  void addLimitReq(const std::vector<std::string>& args);
+  const std::vector<LimitReqRule>& getLimitReqs() const;
+  // 429 or any 4xx/5xx; throws otherwise
+  void setLimitReqStatus(const std::string& code);
+  u_int16_t getLimitReqStatus() const;
+  // Throws when a limit_req names an undeclared zone; false when the block
+  // has none
+  bool linkLimitReqs(const std::map<std::string, LimitReqZone>& zones);
+  // allow/deny; throws on a malformed address
+  void addAccessRule(bool allow, const std::string& spec);
+  const AccessList& getAccess() const;
+  // Throws unless given a name, a value and optionally "always"
+  void addHeader(const std::vector<std::string>& args);
+  const std::vector<AddHeader>& getAddHeaders() const;
+  // Bytes per second sent to each connection, 0 for no limit
+  void setLimitRate(std::string& sSize);
+  size_t getLimitRate() const;
+  // Bytes of each response sent before limit_rate applies
+  void setLimitRateAfter(std::string& sSize);
+  size_t getLimitRateAfter() const;
+  // What a location without its own limit_req, allow/deny, add_header or
+  // limit_rate takes from its server. Runs once the server block is fully
+  // parsed, as those may be written after the locations that inherit them.
+  void inheritFromServer(const BaseBlock& server);
+  void buildCgiDispatch(const Server& server);
+  const CgiDispatch& getCgiDispatch() const;
   const std::vector<std::string>& getIndexFiles() const;
   const std::string* getErrorPage(const u_int16_t code) const;
+  const std::map<u_int16_t, std::string>& getErrorPages() const;
   bool getAutoIndex() const;
 };
 
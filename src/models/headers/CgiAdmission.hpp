@@ -0,0 +1,56 @@
+#ifndef CGIADMISSION_HPP
+#define CGIADMISSION_HPP
+
+#include <ctime>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+class BaseBlock;
+class CgiSession;
+
+#define CGI_QUEUE_DEFAULT_TIMEOUT 10
+
+// Per-location admission control for CGI children. Each location (or server,
+// when no location matched) may cap how many scripts run at once; excess
+// requests wait in a bounded FIFO and are turned away with a pre-built 503
+// once it is full or their wait exceeds the queue timeout.
+class CgiAdmission {
+ public:
+  enum Decision { ADMIT, QUEUE, REJECT };
+
+ private:
+  struct Pool {
+    std::string name;
+    size_t maxConcurrent;
+    size_t queueSize;
+    time_t queueTimeout;
+    std::set<CgiSession*> active;
+    std::deque<std::pair<CgiSession*, time_t> > queue;
+    size_t rejected;
+    std::string busyResponse;
+  };
+
+  std::map<const BaseBlock*, Pool> _pools;
+
+  Pool& poolFor(const CgiSession* session);
+  static const BaseBlock* blockOf(const CgiSession* session);
+
+ public:
+  CgiAdmission();
+  ~CgiAdmission();
+
+  Decision admit(CgiSession* session, time_t now);
+  bool release(CgiSession* session);
+  CgiSession* next(CgiSession* released);
+  void expire(time_t now, std::vector<CgiSession*>& expired);
+  void collect(std::set<CgiSession*>& sessions) const;
+  void drop(const BaseBlock* block);
+
+  const std::string& getBusyResponse(const CgiSession* session);
+  std::string report() const;
+};
+
+#endif
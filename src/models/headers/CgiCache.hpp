@@ -0,0 +1,51 @@
+#ifndef CGICACHE_HPP
+#define CGICACHE_HPP
+
+#include <ctime>
+#include <list>
+#include <map>
+#include <string>
+
+class HttpResponse;
+
+#define CGI_CACHE_DEFAULT_VALID 1
+#define CGI_CACHE_DEFAULT_LOCK_TIMEOUT 5
+#define CGI_CACHE_DEFAULT_SIZE (16 * 1048576)
+
+// Microcache for CGI output. Entries are complete serialized responses keyed
+// on method + host + path + normalized query, expire after their TTL and are
+// evicted least-recently-used first once the memory budget is exceeded.
+class CgiCache {
+ private:
+  struct Entry {
+    std::string response;
+    time_t expires;
+    std::list<std::string>::iterator lruPos;
+  };
+
+  std::map<std::string, Entry> _entries;
+  std::list<std::string> _lru;  // most recently used first
+  size_t _maxSize;
+  size_t _size;
+
+  void erase(std::map<std::string, Entry>::iterator it);
+
+ public:
+  CgiCache();
+  ~CgiCache();
+
+  void setMaxSize(size_t maxSize);
+  void clear();
+  size_t getMaxSize() const;
+  size_t getSize() const;
+
+  const std::string* lookup(const std::string& key, time_t now);
+  void store(const std::string& key,
+             const std::string& response,
+             time_t ttl,
+             time_t now);
+
+  static time_t ttlFor(const HttpResponse& res, time_t defaultTtl);
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef CGIDISPATCH_HPP
+#define CGIDISPATCH_HPP
+
+#include <ctime>
+#include <map>
+#include <string>
+
+class BaseBlock;
+class Server;
+
+// How long a script's stat() result is trusted before it is looked up again
+#define CGI_SCRIPT_CACHE_VALID 1
+#define CGI_SCRIPT_CACHE_MAX 1024
+
+// CGI lookup data for one server or location, compiled once after the block
+// is parsed: the extension -> interpreter table and the environment variables
+// that are the same for every request. Per request only the dynamic variables
+// are added, and script executability comes from a short-lived stat cache.
+class CgiDispatch {
+ public:
+  enum ScriptStatus { SCRIPT_OK, SCRIPT_MISSING, SCRIPT_DIRECTORY,
+                      SCRIPT_NOT_EXECUTABLE };
+
+ private:
+  struct ScriptEntry {
+    ScriptStatus status;
+    time_t checked;
+  };
+
+  std::map<std::string, std::string> _interpreters;
+  std::map<std::string, std::string> _staticEnv;
+  mutable std::map<std::string, ScriptEntry> _scripts;
+
+ public:
+  CgiDispatch();
+  CgiDispatch(const CgiDispatch& other);
+  CgiDispatch& operator=(const CgiDispatch& other);
+  ~CgiDispatch();
+
+  void compile(const BaseBlock& block, const Server& server);
+
+  // Interpreter registered for the script's extension, or an empty string
+  // when the script is executed directly
+  const std::string& findInterpreter(const std::string& scriptPath) const;
+  const std::map<std::string, std::string>& getStaticEnv() const;
+  ScriptStatus checkScript(const std::string& scriptPath, time_t now) const;
+};
+
+#endif
@@ -24,13 +24,10 @@ class CgiHandle{
 
   public:
   CgiHandle();
-    void buildCgiEnvironment(const HttpRequest& request,const RequestContext& ctx,const std::string& scriptPath, u_int16_t serverPort,const std::string& clientIP,const std::string &serverName,std::map<std::string, std::string>& envVars);
-    std::string readCgiResponse(const std::string &inputData, int stdinPipe, int stdoutPipe, int epollFd, pid_t childPid);
-    void getInterpreterForScript(const std::map<std::string, std::string> &cgiPassMap, const std::string &scriptPath, std::string &interpreterPath);
+    void buildCgiEnvironment(const HttpRequest& request,const CgiDispatch& dispatch,const std::string& scriptPath,const std::string& clientIP,const std::string &serverName,std::map<std::string, std::string>& envVars);
     void getDirectoryFromPath(const std::string &path, std::string &directoryPath);
     void buildCgiScript(const std::string &scriptPath, const RequestContext &ctx, HttpResponse &res, HttpRequest &request, sockaddr_in &clientAddr, int epollFd);
-    std::string executeCgiScript(const std::string &scriptPath, const std::map<std::string, std::string> &envVars, const std::string &inputData, const std::map<std::string, std::string> &cgiPassMap, int epollFd);
-    void sendCgiOutputToClient(const std::string &cgiOutput, HttpResponse &res);
+    pid_t spawnCgiProcess(const std::string &scriptPath, const std::string &interpreterPath, const std::map<std::string, std::string> &envVars, int &stdinFd, int &stdoutFd);
     void parseCgiResponse(const std::string &cgiOutput, HttpResponse &res);
 
 
@@ -0,0 +1,93 @@
+#ifndef CGISESSION_HPP
+#define CGISESSION_HPP
+
+#include <sys/types.h>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+#include "requestContext.hpp"
+
+// Upper bound for a single splice() from the client socket into the CGI
+// stdin pipe (the default pipe capacity on Linux).
+#define CGI_SPLICE_CHUNK 65536
+
+// One running CGI child, driven by the SocketManager event loop instead of a
+// blocking read loop. The request body reaches the script's stdin as it
+// arrives: first the bytes that were already buffered with the headers, then
+// the rest of the Content-Length straight from the client socket through
+// splice(), so large uploads never sit in server memory.
+class CgiSession {
+ private:
+  RequestContext _ctx;
+  int _clientFd;
+  pid_t _pid;
+  int _stdinFd;
+  int _stdoutFd;
+  std::string _scriptPath;
+  std::string _interpreterPath;
+  std::map<std::string, std::string> _envVars;
+  std::string _body;
+  size_t _bodyOffset;
+  size_t _bodyRemaining;
+  bool _useSplice;
+  std::string _output;
+  time_t _lastActivity;
+  std::string _cacheKey;
+  time_t _cacheTtl;
+  std::vector<int> _waiters;
+  time_t _lockDeadline;
+
+  CgiSession(const CgiSession& other);
+  CgiSession& operator=(const CgiSession& other);
+
+ public:
+  CgiSession(const RequestContext& ctx,
+             const std::string& scriptPath,
+             const std::string& interpreterPath,
+             const std::map<std::string, std::string>& envVars);
+  ~CgiSession();
+
+  void setClientFd(int fd);
+  void setBody(const std::string& buffered, size_t remaining);
+  void spawn();
+
+  // Microcache: identical requests arriving while this one runs are parked
+  // as waiters and answered with the same response
+  void setCache(const std::string& key, time_t ttl);
+  const std::string& getCacheKey() const;
+  time_t getCacheTtl() const;
+  void addWaiter(int fd);
+  void removeWaiter(int fd);
+  const std::vector<int>& getWaiters() const;
+  // A parked request runs on its own, uncached, once this passes
+  void setLockDeadline(time_t deadline);
+  time_t getLockDeadline() const;
+
+  const RequestContext& getContext() const;
+  int getClientFd() const;
+  int getStdinFd() const;
+  int getStdoutFd() const;
+  time_t getLastActivity() const;
+  const std::string& getOutput() const;
+
+  // Body bytes held in memory that the script has not consumed yet.
+  bool hasBufferedInput() const;
+  // Body bytes that are still waiting on the client socket.
+  bool isStreamingBody() const;
+
+  ssize_t writeBufferedInput();
+  ssize_t pumpClientBody();
+  bool readOutput();
+
+  void closeStdin();
+  void closeStdout();
+  // Closes the pipes and SIGKILLs a child that still runs, without waiting
+  // for it: its pid is returned (-1 if none) for the caller to reap
+  pid_t terminate();
+  // Reaps the child without blocking: false while it still runs, else code
+  // is its exit code, or -1 if it did not exit normally
+  bool reap(int& code);
+};
+
+#endif
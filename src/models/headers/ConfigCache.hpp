@@ -0,0 +1,84 @@
+#ifndef CONFIGCACHE_HPP
+#define CONFIGCACHE_HPP
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <map>
+#include <string>
+#include <vector>
+
+class ConfigLoader;
+class Server;
+
+// Bump whenever a field is added to what BaseBlock, Server or
+// LocationConfig write, so older compiled files are ignored
+#define CONFIG_CACHE_VERSION 11
+#define CONFIG_CACHE_SUFFIX ".compiled"
+
+// Appends fixed-width native-endian values and length-prefixed strings
+class CacheWriter {
+ private:
+  std::string _data;
+
+ public:
+  CacheWriter();
+
+  void u8(unsigned value);
+  void u16(u_int16_t value);
+  void u64(uint64_t value);
+  void str(const std::string& value);
+  void strings(const std::vector<std::string>& values);
+  void stringMap(const std::map<std::string, std::string>& values);
+  void errorPages(const std::map<u_int16_t, std::string>& values);
+
+  const std::string& data() const;
+};
+
+// Reads what CacheWriter wrote straight out of the mapped file; running off
+// the end throws, which makes a truncated file count as stale
+class CacheReader {
+ private:
+  const char* _pos;
+  const char* _end;
+
+  const char* take(size_t size);
+
+ public:
+  CacheReader(const char* begin, const char* end);
+
+  unsigned u8();
+  u_int16_t u16();
+  uint64_t u64();
+  std::string str();
+  std::vector<std::string> strings();
+  std::map<std::string, std::string> stringMap();
+  std::map<u_int16_t, std::string> errorPages();
+  bool atEnd() const;
+};
+
+// The compiled form of a configuration: every server with its locations,
+// already validated, behind a header naming the files (and include globs)
+// it was built from with their content hashes. "webserv -c file.conf"
+// writes it next to the config; startup and reloads map it and use it
+// instead of parsing when nothing it depends on changed, and fall back to
+// the parser otherwise. Lookup tables (location index, CGI dispatch,
+// resolved locations, vhost routes) hold pointers and compiled regexes, so
+// they are rebuilt in memory from the loaded servers; that needs no file
+// system access.
+class ConfigCache {
+ private:
+  ConfigCache();
+
+ public:
+  static std::string pathFor(const std::string& configPath);
+
+  // Throws on I/O errors; the file is replaced atomically
+  static void write(const std::string& path,
+                    const std::vector<Server>& servers,
+                    const ConfigLoader& loader);
+  // False when the file is missing, of another version or stale; servers
+  // is only filled on success
+  static bool read(const std::string& path, std::vector<Server>& servers);
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef CONFIGLOADER_HPP
+#define CONFIGLOADER_HPP
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+#include "parser.hpp"
+
+// Turns a configuration file into the token stream the parser reads, with
+// every "include <path|glob>;" replaced by the tokens of the files it names.
+// Relative includes are resolved against the directory of the including
+// file and globs expand in sorted order, so the result does not depend on
+// the directory listing. Including a file that is already being included
+// is an error.
+//
+// Each file is tokenized (and checked) once and kept, keyed on its real
+// path; later loads only re-read files whose mtime, size or inode changed.
+// A reload of a config split over thousands of vhost files therefore costs
+// one stat() per file plus the parse itself.
+class ConfigLoader {
+ public:
+  // What the last load() depended on: a config whose files still hash the
+  // same and whose globs still match the same files loads identically
+  struct Source {
+    std::string path;  // real path
+    uint64_t hash;
+  };
+  struct GlobMatch {
+    std::string pattern;
+    std::vector<std::string> paths;
+  };
+
+ private:
+  struct CachedFile {
+    time_t mtime;
+    long mtimeNsec;
+    off_t size;
+    ino_t inode;
+    uint64_t hash;
+    std::string name;  // as first included; what errors are reported with
+    std::vector<Token> tokens;
+    bool used;
+  };
+
+  std::map<std::string, CachedFile> _files;  // real path -> tokens
+  std::vector<std::string> _including;       // real paths, outermost first
+  std::vector<GlobMatch> _globs;
+  size_t _hits;
+  size_t _misses;
+
+  ConfigLoader(const ConfigLoader& other);
+  ConfigLoader& operator=(const ConfigLoader& other);
+
+  const CachedFile& tokenize(const std::string& real,
+                             const std::string& name,
+                             const Token* from);
+  void expand(const std::string& path,
+              const Token* from,
+              std::vector<Token>& out);
+  void expandInclude(const Token& include,
+                     const std::string& pattern,
+                     const std::string& baseDir,
+                     std::vector<Token>& out);
+
+ public:
+  ConfigLoader();
+  ~ConfigLoader();
+
+  // Throws ConfigError ("file:line: ...") on unreadable files, lexer and
+  // check errors, malformed includes and include cycles
+  std::vector<Token> load(const std::string& path);
+
+  // Files served from / re-read into the cache by the last load()
+  size_t getHits() const;
+  size_t getMisses() const;
+  std::vector<Source> getSources() const;
+  const std::vector<GlobMatch>& getGlobs() const;
+
+  // FNV-1a over a file's content
+  static uint64_t hashContent(const std::string& content);
+  // Sorted matches of an include pattern; empty when nothing matches
+  static std::vector<std::string> expandGlob(const std::string& pattern);
+};
+
+#endif
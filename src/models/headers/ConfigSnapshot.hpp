@@ -0,0 +1,42 @@
+#ifndef CONFIGSNAPSHOT_HPP
+#define CONFIGSNAPSHOT_HPP
+
+#include <string>
+#include <vector>
+#include "Server.hpp"
+#include "VhostRouter.hpp"
+
+// One loaded configuration: the servers and the vhost tables routing to
+// them. It is never modified after construction. A reload builds a new
+// snapshot for new connections while every connection and CGI child still
+// holding the old one keeps using it; the last one to let go deletes it.
+class ConfigSnapshot {
+ private:
+  std::vector<Server> _servers;
+  VhostRouter _router;
+  size_t _refs;
+
+  ConfigSnapshot(const ConfigSnapshot& other);
+  ConfigSnapshot& operator=(const ConfigSnapshot& other);
+
+ public:
+  // Takes the servers over by swapping; the vector is left empty
+  explicit ConfigSnapshot(std::vector<Server>& servers);
+  ~ConfigSnapshot();
+
+  const std::vector<Server>& getServers() const;
+  Server& getServer(size_t index);
+  const VhostRouter& getRouter() const;
+  // "addr:port" of every listen directive, without duplicates
+  std::vector<std::string> getListenKeys() const;
+  // Largest cgi_cache_max_size asked for by a cache-enabled block
+  size_t getCgiCacheBudget() const;
+  // Longest shutdown_timeout any server asks for
+  time_t getShutdownTimeout() const;
+
+  void retain();
+  // Returns true when that was the last reference
+  bool release();
+};
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef CONNECTIONLIMITER_HPP
+#define CONNECTIONLIMITER_HPP
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "LimitConn.hpp"
+
+class Server;
+
+// Open connection counts of the limit_conn zones, kept across reloads. A
+// zone is a table of fixed size allocated when it is opened: counters
+// chained into hash buckets by the 64-bit hash of their key, one lookup
+// per accept and per close. A counter goes back to the free list when its
+// last connection closes. What each descriptor holds is kept in a vector
+// indexed by the descriptor, so releasing one costs no search either.
+class ConnectionLimiter {
+ private:
+  struct Node {
+    uint64_t hash;
+    uint32_t count;
+    uint32_t next;  // in the bucket, or in the free list
+  };
+
+  struct Zone {
+    LimitConnZone config;
+    unsigned generation;  // holds on an older table are not released on it
+    std::vector<Node> nodes;
+    std::vector<uint32_t> buckets;
+    uint32_t free;
+    uint32_t used;
+  };
+
+  struct Hold {
+    std::string zone;
+    unsigned generation;
+    uint64_t hash;
+  };
+
+  std::map<std::string, Zone> _zones;
+  std::vector<std::vector<Hold> > _held;  // fd -> counters it holds
+  unsigned _generation;
+  std::map<const Server*, std::string> _responses;
+
+  static uint32_t find(const Zone& zone, uint64_t hash);
+  static uint32_t insert(Zone& zone, uint64_t hash);
+  static void remove(Zone& zone, uint32_t index);
+  Zone& zoneFor(const LimitConnZone& config);
+
+ public:
+  ConnectionLimiter();
+  ~ConnectionLimiter();
+
+  // Allocates the zone's table (room for one key at least), or keeps its
+  // counts when neither its size nor its key changed
+  void open(const LimitConnZone& zone);
+  // Frees the zones not in names
+  void prune(const std::set<std::string>& names);
+
+  // Counts fd against every rule (keys[i] is the key of rules[i]); false,
+  // with nothing counted, when one is at its limit or its zone is full
+  bool acquire(int fd, const std::vector<LimitConnRule>& rules,
+               const std::vector<std::string>& keys);
+  void release(int fd);
+  // Whether fd has been counted in any zone
+  bool holds(int fd) const;
+
+  // Built once per server
+  const std::string& getRejectResponse(const Server& server);
+  void drop(const Server* server);
+};
+
+#endif
@@ -6,12 +6,37 @@
 class Container : public BaseBlock {
   private:
     std::vector<Server> _servers;
+    std::map<std::string, UpstreamGroup> _upstreams;
+    std::map<std::string, ProxyCacheZone> _cacheZones;
+    std::map<std::string, LimitReqZone> _limitReqZones;
+    std::map<std::string, LimitConnZone> _limitConnZones;
+    std::map<std::string, VariableMap> _maps;  // by variable name
 
   public:
     Container();
     ~Container();
     void insertServer(const Server &server);
+    // Appends an empty server for the parser to fill in place
+    Server &newServer();
+    void reserveServers(size_t count);
     const std::vector<Server> &getServers() const;
+    // Throws when an upstream of that name exists already
+    UpstreamGroup &newUpstream(const std::string &name);
+    const std::map<std::string, UpstreamGroup> &getUpstreams() const;
+    // Throws when the zone name or its directory is taken already
+    void addCacheZone(const ProxyCacheZone &zone);
+    // Throw when the zone name is taken already
+    void addLimitReqZone(const LimitReqZone &zone);
+    void addLimitConnZone(const LimitConnZone &zone);
+    // Throws when another map sets the same variable
+    void addMap(const VariableMap &map);
+    // Upstream blocks and zones may follow the servers that use them, so
+    // proxy_pass targets and proxy_cache, limit_req and limit_conn zones are
+    // looked up once everything is parsed, and so are maps; throws when
+    // maps refer to each other in a loop
+    void linkUpstreams();
+    // Hands the servers over without copying them; the container is left empty
+    void releaseServers(std::vector<Server> &out);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -12,11 +12,12 @@
 #include "requestContext.hpp"
 class HttpResponse;
 class Server;
+class CgiSession;
 
 class HttpRequest
 {
 protected:
-    const RequestContext _ctx;
+    RequestContext _ctx;
     std::string method;
     std::string path;
     std::string version;
@@ -24,9 +25,13 @@ protected:
     std::string body;
     std::map<std::string, std::string> query;
     bool enabledCgi;
+    size_t pendingBody;
+    u_int16_t localPort; // port of the listen address the request came in on
+    CgiSession *cgiSession;
 
     void handleGetOrHead(HttpResponse &res, bool includeBody, sockaddr_in &clientAddr, int epollFd);
     bool isCgiEnabledForRequest() const;
+    const CgiDispatch &getCgiDispatch() const;
 
 private:
     // Prevent copying
@@ -44,6 +49,9 @@ public:
     const std::map<std::string, std::string> &getHeaders() const;
     const std::string &getBody() const;
     const std::map<std::string, std::string> &getQuery() const;
+    size_t getPendingBody() const;
+    u_int16_t getLocalPort() const;
+    const RequestContext &getContext() const;
 
     // Setters (for parser)
     void setMethod(const std::string &m);
@@ -53,6 +61,16 @@ public:
     void appendBody(const std::string &data);
     void setQuery(const std::map<std::string, std::string> &q);
     void setEnabledCgi(bool enabled);
+    void setPendingBody(size_t remaining);
+    void setLocalPort(u_int16_t port);
+    // Once the headers are in: root, return and add_header of the location
+    // get their variables expanded for this request
+    void expandVariables(const std::string &rawRequest, const sockaddr_in &clientAddr);
+
+    // CGI handoff: a handler that starts a script parks it here and the
+    // event loop takes ownership once handle() returns
+    void setCgiSession(CgiSession *session);
+    CgiSession *releaseCgiSession();
 
     // Helpers
     bool isChunked() const;
@@ -119,6 +137,17 @@ public:
     virtual void handle(HttpResponse &res, sockaddr_in &clientAddr, int epollFd);
 };
 
+// Any method sent to a proxy_pass location. The event loop forwards it
+// upstream as a ProxySession; handle() only runs if that could not start.
+class ProxyRequest : public HttpRequest
+{
+public:
+    ProxyRequest(const RequestContext &ctx);
+    virtual ~ProxyRequest();
+
+    virtual void handle(HttpResponse &res, sockaddr_in &clientAddr, int epollFd);
+};
+
 // Factory function
 HttpRequest *makeRequestByMethod(const std::string &m, const RequestContext &ctx);
 
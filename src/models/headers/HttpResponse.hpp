@@ -1,6 +1,7 @@
 #ifndef HTTPRESPONSE_HPP
 #define HTTPRESPONSE_HPP
 
+#include <sys/types.h>
 #include <map>
 #include <string>
 #include <vector>
@@ -17,6 +18,11 @@ class HttpResponse {
   std::string body;
   std::string version;
   std::string statusMessage;
+  int bodyFile;  // open file the body is sent from instead, owned until taken
+  off_t bodyFileSize;
+
+  HttpResponse(const HttpResponse&);
+  HttpResponse& operator=(const HttpResponse&);
 
  public:
   HttpResponse();
@@ -27,8 +33,13 @@ class HttpResponse {
   void setHeader(const std::string& key, const std::string& value);
   void setBody(const std::string& b);
   void setVersion(const std::string& v);
+  // The body goes out of the file with sendfile after build()'s head
+  void setBodyFile(int fd, off_t size);
+  int takeBodyFile(off_t& size);
   void addSetCookieHeader(const std::string& value);
   std::string getHostHeader() const;
+  std::string getHeader(const std::string& key) const;
+  int getStatusCode() const;
   std::vector<std::string> getSetCookieHeaders() const;
 
   std::string build() const;
@@ -0,0 +1,54 @@
+#ifndef LIMITCONN_HPP
+#define LIMITCONN_HPP
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+class CacheReader;
+class CacheWriter;
+
+#define LIMIT_CONN_DEFAULT_STATUS 503
+
+// limit_conn_zone <key> zone=<name>:<size>;
+// Open connections are counted per value of key: $binary_remote_addr or
+// $remote_addr for one count per client, $server_name for one per server
+// block (its first name, or the address it listens on when it has none).
+// No request variable is available: a connection is counted at most once,
+// before its first request is handled. size bounds the table; while it is full,
+// connections with keys not in it yet are refused.
+struct LimitConnZone {
+  std::string name;
+  std::string key;
+  uint64_t size;
+
+  LimitConnZone();
+
+  // Throws on unknown or invalid parameters
+  static LimitConnZone parse(const std::vector<std::string>& args);
+};
+
+// limit_conn <zone> <number>; limit_conn_status <code>;
+// Server level only. On an address a single server listens on, connections
+// are counted as they are accepted, before anything is read. Where vhosts
+// share an address, a connection is counted against the server its Host
+// header routes it to, once the headers are in. Connections over any of
+// the limits get the limit_conn_status response (503 unless set) and are
+// closed at once.
+struct LimitConnRule {
+  std::string zoneName;
+  LimitConnZone zone;  // filled in by link()
+  uint64_t limit;
+
+  LimitConnRule();
+
+  static LimitConnRule parse(const std::vector<std::string>& args);
+  // Throws when no limit_conn_zone declares the zone
+  void link(const std::map<std::string, LimitConnZone>& zones);
+
+  void writeTo(CacheWriter& out) const;
+  void readFrom(CacheReader& in);
+};
+
+#endif
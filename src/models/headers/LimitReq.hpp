@@ -0,0 +1,55 @@
+#ifndef LIMITREQ_HPP
+#define LIMITREQ_HPP
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <map>
+#include <string>
+#include <vector>
+
+class CacheReader;
+class CacheWriter;
+
+#define LIMIT_REQ_DEFAULT_STATUS 503
+
+// limit_req_zone <key> zone=<name>:<size> rate=<n>r/s | <n>r/m;
+// Requests are counted per value of key, a template of request variables
+// ($binary_remote_addr, $remote_addr, $http_<header>, $cookie_<name>, ...).
+// Requests whose key expands to nothing are not counted. size bounds the
+// memory the zone's state table may use; once it is full the least
+// recently seen keys make room for new ones.
+struct LimitReqZone {
+  std::string name;
+  std::string key;
+  uint64_t size;  // bytes of state
+  uint64_t rate;  // requests per 1000 seconds
+
+  LimitReqZone();
+
+  // Throws on unknown or invalid parameters
+  static LimitReqZone parse(const std::vector<std::string>& args);
+};
+
+// limit_req zone=<name> [burst=<n>] [nodelay]; limit_req_status <code>;
+// A leaky bucket per key draining at the zone's rate. Up to burst requests
+// above the rate are held back until their turn comes (or served at once
+// with nodelay); beyond that they are answered with limit_req_status, 503
+// unless set. A block may name several zones and every one has to admit
+// the request. Locations without limit_req of their own use the server's.
+struct LimitReqRule {
+  std::string zoneName;
+  LimitReqZone zone;  // filled in by link()
+  uint64_t burst;
+  bool nodelay;
+
+  LimitReqRule();
+
+  static LimitReqRule parse(const std::vector<std::string>& args);
+  // Throws when no limit_req_zone declares the zone
+  void link(const std::map<std::string, LimitReqZone>& zones);
+
+  void writeTo(CacheWriter& out) const;
+  void readFrom(CacheReader& in);
+};
+
+#endif
@@ -2,6 +2,9 @@
 #define LOCATIONCONFIG_HPP
 
 #include <BaseBlock.hpp>
+#include <ProxyBuffering.hpp>
+#include <ProxyCacheRule.hpp>
+#include <ProxyPass.hpp>
 #include <vector>
 
 enum MatchType {
@@ -20,6 +23,12 @@ class LocationConfig : public BaseBlock {
   std::vector<std::string> _methods;
   std::string _uploadDir;
   bool _chunked_transfer_encoding;
+  bool _cgiStatus;  // answers with the CGI admission counters
+  bool _hasProxyPass;
+  ProxyPass _proxyPass;
+  bool _hasProxyCache;
+  ProxyCacheRule _proxyCache;
+  ProxyBuffering _proxyBuffering;
   // _cgiPassMap moved to BaseBlock for server-level inheritance
 
  public:
@@ -36,6 +45,23 @@ class LocationConfig : public BaseBlock {
   void setMethods(const std::vector<std::string>& methods);
   void setUploadDir(const std::string& dir);
   void setTransferEncoding(bool enabled);
+  void setCgiStatus(bool enabled);
+  void setProxyPass(const std::string& spec);
+  // "off" or the name of a proxy_cache_path zone
+  void setProxyCache(const std::string& zone);
+  void setProxyCacheKey(const std::string& key);
+  void addProxyCacheValid(const std::vector<std::string>& args);
+  void setProxyCacheUseStale(const std::vector<std::string>& args);
+  void setProxyCacheLock(const std::string& value);
+  void setProxyCacheLockTimeout(const std::string& value);
+  void setProxyBuffering(const std::string& value);
+  void setProxyBuffers(const std::vector<std::string>& args);
+  void setProxyMaxTempFileSize(const std::string& value);
+  // Once every upstream block and cache zone is known; throws when the
+  // target is neither an upstream nor a resolvable address, or the zone
+  // does not exist
+  void linkProxyPass(const std::map<std::string, UpstreamGroup>& upstreams,
+                     const std::map<std::string, ProxyCacheZone>& zones);
   // setCgiPassMapping and getCgiPassMap inherited from BaseBlock
 
   // Getters
@@ -44,6 +70,16 @@ class LocationConfig : public BaseBlock {
   const std::vector<std::string>& getMethods() const;
   bool isMethodAllowed(const std::string& method) const;
   const std::string& getUploadDir() const;
+  bool isCgiStatus() const;
+  bool hasProxyPass() const;
+  const ProxyPass& getProxyPass() const;
+  bool hasProxyCache() const;
+  const ProxyCacheRule& getProxyCache() const;
+  const ProxyBuffering& getProxyBuffering() const;
+
+  // Compiled config (de)serialization
+  void writeTo(CacheWriter& out) const;
+  void readFrom(CacheReader& in);
 };
 
 #endif
\ No newline at end of file
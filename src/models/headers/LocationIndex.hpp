@@ -0,0 +1,48 @@
+#ifndef LOCATIONINDEX_HPP
+#define LOCATIONINDEX_HPP
+
+#include <HashTable.hpp>
+#include <LocationConfig.hpp>
+#include <RegexSet.hpp>
+#include <string>
+#include <vector>
+
+// Lookup structure over a server's locations, compiled once at config load.
+// Follows nginx precedence:
+//   1. "= /path" exact matches, from a hash table
+//   2. the longest prefix ("/path" or "^~ /path"), from a radix trie; a "^~"
+//      winner is returned without looking at regexes
+//   3. "~" / "~*" regexes, first match in declaration order, all matched
+//      together by one RegexSet; their captures are handed back for $n
+//      substitution
+//   4. otherwise the longest prefix from step 2
+// Named ("@name") locations never match a request URI.
+// Entries are indices into the server's location vector, so the index stays
+// valid when the Server is copied.
+class LocationIndex {
+ private:
+  struct PrefixNode {
+    std::string label;
+    long location;
+    std::vector<size_t> children;
+  };
+
+  HashTable<size_t> _exact;
+  std::vector<PrefixNode> _nodes;
+  RegexSet _regexes;
+  std::vector<size_t> _regexLocations;
+
+  void insertPrefix(const std::string& path, size_t location);
+  long longestPrefix(const std::string& path) const;
+
+ public:
+  LocationIndex();
+  ~LocationIndex();
+
+  void build(const std::vector<LocationConfig>& locations);
+  long find(const std::string& path,
+            const std::vector<LocationConfig>& locations,
+            std::vector<std::string>* captures) const;
+};
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef PROXYBUFFERING_HPP
+#define PROXYBUFFERING_HPP
+
+#include <stdint.h>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+class CacheReader;
+class CacheWriter;
+
+// proxy_buffering on | off; proxy_buffers <number> <size>;
+// proxy_max_temp_file_size <size>;
+// Buffered (the default), the response is read from the upstream as fast
+// as it arrives: into memory up to number * size, then into a temporary
+// file the client is served from, so the upstream connection is free again
+// as soon as the whole response is in. Only a full temporary file (or, with
+// a size of 0, full memory buffers) makes the upstream wait for the client.
+// Unbuffered, bytes go to the client as they come and a slow client holds
+// the upstream back, which is what server-sent events and long polling
+// want; bodies that need no decoding are then moved with splice().
+struct ProxyBuffering {
+  bool enabled;
+  size_t buffers;
+  size_t bufferSize;
+  uint64_t maxTempFileSize;  // 0: no temporary file
+
+  ProxyBuffering();
+
+  void setEnabled(const std::string& value);
+  void setBuffers(const std::vector<std::string>& args);
+  void setMaxTempFileSize(const std::string& value);
+  size_t memoryLimit() const;
+
+  void writeTo(CacheWriter& out) const;
+  void readFrom(CacheReader& in);
+};
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef PROXYCACHE_HPP
+#define PROXYCACHE_HPP
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <ctime>
+#include <list>
+#include <map>
+#include <string>
+#include "ProxyCacheRule.hpp"
+
+// One proxy_cache_path zone: responses on disk, one file per key, and an
+// index of them in memory so a lookup never touches the disk. A file is
+// a fixed header (expiry, where the response head and body start), the key,
+// then the response exactly as the client gets it; the head is read with
+// one pread on a hit and the body goes out with sendfile.
+//
+// Responses are written to a temporary file while they stream to the
+// client and renamed into place once complete, so a file at a key's path
+// is always whole. The index is rebuilt from the files when the zone is
+// opened. manage() is the cache manager: run from the event loop about once
+// a second, it drops entries unused for the zone's inactive time and then
+// the least recently used ones until the zone fits max_size.
+class ProxyCache {
+ public:
+  struct Entry {
+    std::string file;
+    uint64_t size;  // of the file, what counts against max_size
+    time_t created;
+    time_t expires;
+    time_t lastUsed;
+    bool updating;  // a background request is refreshing it
+    std::list<std::string>::iterator lruPos;
+  };
+
+  // A response on its way into the cache
+  class Fill {
+   private:
+    std::string _key;
+    std::string _temp;
+    int _fd;
+    time_t _created;
+    time_t _expires;
+    uint64_t _written;
+    uint64_t _headLength;  // status line and headers, blank line excluded
+    bool _failed;
+
+    Fill(const Fill& other);
+    Fill& operator=(const Fill& other);
+
+    friend class ProxyCache;
+
+   public:
+    Fill(const std::string& key, const std::string& temp, int fd,
+         time_t created, time_t expires);
+    // Removes the temporary file unless the fill was committed
+    ~Fill();
+
+    // The first call must hold the whole response head
+    void write(const char* data, size_t length);
+  };
+
+ private:
+  ProxyCacheZone _zone;
+  std::map<std::string, Entry> _entries;
+  std::list<std::string> _lru;  // most recently used first
+  uint64_t _size;
+  unsigned _temps;
+  time_t _lastManaged;
+
+  ProxyCache(const ProxyCache& other);
+  ProxyCache& operator=(const ProxyCache& other);
+
+  std::string pathFor(const std::string& key) const;
+  void load(const std::string& dir, unsigned depth, time_t now);
+  void insert(const std::string& key, const Entry& entry);
+  void erase(std::map<std::string, Entry>::iterator it);
+
+ public:
+  // Creates the directory when missing and indexes what is in it; throws
+  // when it cannot be created
+  explicit ProxyCache(const ProxyCacheZone& zone);
+  ~ProxyCache();
+
+  // A reload may change max_size, inactive and the key limit; the
+  // directory and levels stay what the zone was opened with
+  void setLimits(const ProxyCacheZone& zone);
+  const ProxyCacheZone& getZone() const;
+
+  // The entry, fresh or stale, marked as used; NULL when there is none
+  Entry* find(const std::string& key, time_t now);
+  static bool isFresh(const Entry& entry, time_t now);
+  void setUpdating(const std::string& key, bool updating);
+  // Opens the entry's file and reads its head (without the blank line that
+  // ends it) into head. Returns the descriptor, or -1 after dropping an
+  // entry whose file went missing or does not hold that key any more.
+  int open(const std::string& key, std::string& head, off_t& bodyStart,
+           off_t& bodyEnd);
+  void remove(const std::string& key);
+
+  // NULL when the temporary file cannot be created
+  Fill* startFill(const std::string& key, time_t expires);
+  // Moves a complete response into place and indexes it; a failed or
+  // oversized one is discarded
+  void commit(Fill* fill);
+
+  void manage(time_t now);
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef PROXYCACHERULE_HPP
+#define PROXYCACHERULE_HPP
+
+#include <stdint.h>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+class CacheReader;
+class CacheWriter;
+
+// proxy_cache_path <dir> keys_zone=<name>[:<size>] [levels=1:2]
+//                  [max_size=<size>] [inactive=<time>];
+// Responses are files under dir, named by a hash of their key and spread
+// over up to three levels of subdirectories (levels=1:2 puts a key hashing
+// to ...e4fa3c in dir/c/a3/). max_size bounds the files on disk, the
+// keys_zone size the number of keys indexed (about 8000 per megabyte), and
+// entries not used for inactive are dropped however fresh they are.
+struct ProxyCacheZone {
+  std::string name;
+  std::string path;
+  std::vector<unsigned> levels;
+  uint64_t maxSize;     // 0: unbounded
+  uint64_t maxEntries;  // 0: unbounded
+  time_t inactive;
+
+  ProxyCacheZone();
+
+  // Throws on unknown or invalid parameters
+  static ProxyCacheZone parse(const std::vector<std::string>& args);
+};
+
+// proxy_cache <zone>; proxy_cache_key <template>;
+// proxy_cache_valid [<code> ... | any] <time>;
+// proxy_cache_use_stale off | error | timeout | updating | http_500
+//                       | http_502 | http_503 | http_504 ...;
+// proxy_cache_lock on | off; proxy_cache_lock_timeout <time>;
+// A cached response is reused until its time is up; after that it is stale
+// and use_stale says when it may still be sent: when the upstream cannot be
+// reached (error), does not answer (timeout), answers with one of the
+// listed 5xx codes, or while another request refreshes it (updating).
+// With the lock on (the default) only the first miss for a key goes to the
+// upstream; identical requests wait for it to fill the entry, and past the
+// lock timeout go to the upstream themselves without storing the response.
+struct ProxyCacheRule {
+  enum UseStale {
+    STALE_ERROR = 1 << 0,
+    STALE_TIMEOUT = 1 << 1,
+    STALE_UPDATING = 1 << 2,
+    STALE_HTTP_500 = 1 << 3,
+    STALE_HTTP_502 = 1 << 4,
+    STALE_HTTP_503 = 1 << 5,
+    STALE_HTTP_504 = 1 << 6
+  };
+
+  std::string zoneName;
+  ProxyCacheZone zone;  // filled in by link()
+  std::string key;      // default "$scheme$proxy_host$request_uri"
+  std::map<int, time_t> valid;  // status -> time to live, 0 for any
+  unsigned useStale;
+  bool lock;
+  time_t lockTimeout;
+
+  ProxyCacheRule();
+
+  // Only variables ProxySession::requestVariable knows are accepted
+  void setKey(const std::string& key);
+  void addValid(const std::vector<std::string>& args);
+  void setUseStale(const std::vector<std::string>& args);
+  void setLock(const std::string& value);
+  void setLockTimeout(const std::string& value);
+  // Throws when no proxy_cache_path declares the zone
+  void link(const std::map<std::string, ProxyCacheZone>& zones);
+
+  // Seconds a response may be reused; 0 when it must not be stored.
+  // Cache-Control from the upstream wins over proxy_cache_valid, and
+  // responses setting cookies are never stored.
+  time_t ttlFor(int status, const std::string& cacheControl,
+                bool setsCookie) const;
+  // True when an upstream status is to be answered from a stale entry
+  bool staleOnStatus(int status) const;
+
+  void writeTo(CacheWriter& out) const;
+  void readFrom(CacheReader& in);
+};
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef PROXYHANDLER_HPP
+#define PROXYHANDLER_HPP
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "UpstreamBalancer.hpp"
+#include "UpstreamPool.hpp"
+
+class ConfigSnapshot;
+class HttpRequest;
+class ProxyCache;
+class ProxySession;
+class SocketManager;
+struct ProxyCacheZone;
+
+// Drives the proxy_pass sessions of a SocketManager: upstream connections
+// and their pool, peer selection, response streaming to the client (in
+// memory, spilled to a file, or spliced), and the proxy_cache lookup, fill,
+// lock and stale answers. The SocketManager hands it the events of the
+// descriptors it owns and keeps the clients themselves: what is sent to
+// them, their limit_rate and when they are closed.
+class ProxyHandler {
+ private:
+  static const int TIMEOUT = 60;
+
+  SocketManager& _manager;
+  std::map<int, ProxySession*> _upstreams;  // upstream fd -> session
+  std::map<int, ProxySession*> _clients;    // client fd -> session
+  std::map<ProxySession*, ConfigSnapshot*> _configs;
+  std::map<std::string, ProxySession*> _inFlight;  // cache dir + key -> filler
+  std::map<int, ProxySession*> _waiting;  // client fd -> session it waits on
+  std::map<int, ProxySession*> _parked;   // waiting client fd -> own request
+  UpstreamPool _pool;
+  UpstreamBalancer _balancer;
+  std::map<std::string, ProxyCache*> _caches;  // cache dir -> zone or NULL
+
+  ProxyHandler(const ProxyHandler& other);
+  ProxyHandler& operator=(const ProxyHandler& other);
+
+  void run(ProxySession* session, int epfd);
+  bool connectUpstream(ProxySession* session, int epfd);
+  void writeRequest(ProxySession* session, int epfd);
+  void readResponse(ProxySession* session, int epfd);
+  bool bufferResponse(ProxySession* session, std::string& out, size_t before,
+                      int epfd);
+  bool hasRoom(ProxySession* session, int fd);
+  void retry(ProxySession* session, int epfd);
+  void failOver(ProxySession* session, int epfd);
+  void releasePeer(ProxySession* session, bool failed);
+  void finish(ProxySession* session, int epfd);
+  void fail(ProxySession* session, int code, int epfd);
+  void release(ProxySession* session, int epfd);
+  void setUpstreamEvents(ProxySession* session, uint32_t events, int epfd);
+
+  bool lookupCache(ProxySession* session, const std::string& rawRequest,
+                   const HttpRequest& request, const sockaddr_in& clientAddr,
+                   int epfd);
+  bool sendCached(int fd, ProxyCache* cache, const std::string& key,
+                  const std::string& status, bool headOnly, int epfd);
+  void startRefresh(ProxySession* session, int epfd);
+  bool lock(ProxySession* session, int epfd);
+  void releaseLock(ProxySession* session, std::vector<int>& waiters);
+  ProxySession* unpark(int fd);
+  void resumeWaiter(ProxySession* session, int epfd);
+  void cacheResponse(ProxySession* session, std::string& out, size_t before);
+  bool serveStale(ProxySession* session, int epfd);
+
+ public:
+  explicit ProxyHandler(SocketManager& manager);
+  ~ProxyHandler();
+
+  // Answers the request from the cache, parks it on a cache lock, or sends
+  // it to the upstream; the handler owns the session from here on
+  void start(ProxySession* session, const std::string& rawRequest,
+             const HttpRequest& request, const sockaddr_in& clientAddr,
+             int epfd);
+
+  bool isUpstream(int fd) const;
+  // A client with a proxied request under way or parked on a cache lock
+  bool hasClient(int fd) const;
+  ProxySession* findClient(int fd) const;
+
+  void handleEvent(int fd, uint32_t events, int epfd);
+  void streamBody(ProxySession* session, int epfd);
+  void spliceResponse(ProxySession* session, int epfd);
+  void resumeUpstream(ProxySession* session, int fd, int epfd);
+  // The client is being closed: its session ends with it unless others
+  // wait on the cache entry it fills
+  void dropClient(int fd, int epfd);
+  void handleTimeouts(int epfd);
+
+  // proxy_cache zones, kept across reloads; pruneCaches forgets the ones
+  // that failed to open so they get another try
+  ProxyCache* openCache(const ProxyCacheZone& zone);
+  void pruneCaches();
+
+  // Frees every session at exit and adds the snapshots they held
+  void collect(std::set<ConfigSnapshot*>& snapshots);
+};
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef PROXYPASS_HPP
+#define PROXYPASS_HPP
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+class CacheReader;
+class CacheWriter;
+
+// Where a proxied request goes. The host is resolved once when the config is
+// loaded, so connecting never blocks the event loop on DNS.
+struct UpstreamAddress {
+  std::string key;   // "127.0.0.1:8081" or "unix:/run/app.sock"; pool key
+  std::string host;  // Host header for clients that did not send one
+  struct sockaddr_storage addr;
+  socklen_t addrLen;
+
+  UpstreamAddress();
+
+  // "host:port", "host" (port 80) or "unix:/path"; throws when the host does
+  // not resolve
+  static UpstreamAddress parse(const std::string& spec);
+};
+
+// server <address> [weight=N] [max_fails=N] [fail_timeout=Ns];
+// A peer that fails max_fails times within fail_timeout is left out for
+// fail_timeout; max_fails=0 never takes it out, nor is the only peer of a
+// group ever taken out.
+struct UpstreamPeer {
+  std::string spec;
+  UpstreamAddress address;
+  unsigned weight;
+  unsigned maxFails;
+  time_t failTimeout;
+
+  UpstreamPeer();
+
+  // Throws on unknown or invalid parameters
+  static UpstreamPeer parse(const std::string& spec,
+                            const std::vector<std::string>& params);
+};
+
+// upstream <name> { [least_conn; | hash <key> [consistent]; |
+//                    random two;] server ...; }
+// Round-robin (smooth, weighted) unless another method is set. hash keys:
+// $request_uri, $uri, $remote_addr or $cookie_<name>; the mapping is always
+// consistent, so adding a peer only moves the keys it takes over.
+struct UpstreamGroup {
+  enum Balance { ROUND_ROBIN, LEAST_CONN, HASH, RANDOM_TWO };
+
+  std::string name;
+  Balance balance;
+  std::string hashKey;
+  std::vector<UpstreamPeer> peers;
+  // Changes whenever peers, their order or their weights change; runtime
+  // state of an older definition is then discarded. Set once linked.
+  std::string signature;
+
+  UpstreamGroup();
+
+  void setHashKey(const std::string& key);
+  // The group of a proxy_pass that names an address instead of an upstream
+  static UpstreamGroup single(const std::string& spec);
+  void sign();
+};
+
+// proxy_pass http://host:port[/uri] | http://unix:/path[:/uri] | unix:/path
+//          | http://<upstream name>[/uri]
+// With a URI part, the part of the request path matched by the location is
+// replaced with it; without one the request URI is passed on unchanged.
+struct ProxyPass {
+  std::string spec;    // as configured
+  std::string target;  // address or upstream name
+  std::string host;    // Host header for clients that did not send one
+  UpstreamGroup group;
+  std::string uri;
+  bool hasUri;
+
+  ProxyPass();
+
+  // Only splits the spec; link() picks the peers
+  static ProxyPass parse(const std::string& spec);
+  // Uses the upstream block named like the target, or the target as a
+  // single address (resolved here)
+  void link(const std::map<std::string, UpstreamGroup>& upstreams);
+
+  // Compiled config: the linked group is stored with it, addresses are
+  // resolved again on load
+  void writeTo(CacheWriter& out) const;
+  void readFrom(CacheReader& in);
+};
+
+#endif
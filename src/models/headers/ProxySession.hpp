@@ -0,0 +1,217 @@
+#ifndef PROXYSESSION_HPP
+#define PROXYSESSION_HPP
+
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <ctime>
+#include <string>
+#include <vector>
+#include "ProxyCache.hpp"
+#include "ProxyPass.hpp"
+#include "requestContext.hpp"
+
+// Upper bound for one read from the upstream or the client body, for what
+// may sit in an unbuffered client's send buffer before the upstream stops
+// being read, and for what is held in the splice pipe (its default size)
+#define PROXY_CHUNK 65536
+
+class HttpRequest;
+
+// One request forwarded to a proxy_pass upstream, driven by the
+// ProxyHandler from the event loop like a CgiSession. The upstream speaks
+// HTTP/1.1 with keep-alive so its connection can go back to the
+// UpstreamPool; the client gets the response rewritten to HTTP/1.0
+// (hop-by-hop headers dropped, chunked bodies decoded) and streamed as it
+// arrives rather than buffered whole.
+//
+// With proxy_cache the response is also written into the zone while it
+// streams (a Fill) and committed once complete. A session may run without a
+// client at all: that is a background refresh of a stale entry, whose
+// response only goes to the cache.
+//
+// How much of the response may pile up for a slow client is the
+// ProxyHandler's call (see ProxyBuffering). Unbuffered, a body that needs
+// no decoding and is not being cached is moved upstream socket -> pipe ->
+// client socket with splice() once the head is out, never entering user
+// space.
+class ProxySession {
+ public:
+  enum Result { AGAIN, DONE, ERROR };
+
+ private:
+  enum State {
+    READ_HEAD,
+    LENGTH,
+    CHUNK_SIZE,
+    CHUNK_DATA,
+    CHUNK_CRLF,
+    TRAILERS,
+    UNTIL_CLOSE,
+    COMPLETE
+  };
+
+  RequestContext _ctx;
+  int _clientFd;
+  int _upstreamFd;
+  bool _connected;
+  bool _reused;
+  std::string _original;  // head and buffered body, kept for one retry
+  std::string _request;   // what is still to be written upstream
+  size_t _requestOffset;
+  size_t _bodyRemaining;  // body bytes still on the client socket
+  bool _bodyStreamed;
+  bool _headOnly;
+  State _state;
+  std::string _input;
+  size_t _remaining;
+  bool _keepAlive;
+  bool _responseStarted;
+  time_t _lastActivity;
+  std::string _balanceKey;
+  int _peer;                // index into the group, -1 before one is picked
+  std::vector<bool> _tried; // peers that already failed this request
+  int _status;
+  std::string _cacheControl;  // lowercased
+  bool _private;              // Set-Cookie or Vary: *
+  ProxyCache* _cache;
+  std::string _cacheKey;
+  ProxyCache::Fill* _fill;
+  bool _updating;  // holds the entry's updating mark
+  std::vector<int> _waiters;  // clients parked on this fill of the key
+  time_t _lockDeadline;
+  int _pipe[2];   // splice() buffer, -1 until the body is spliced
+  size_t _piped;  // bytes in it
+
+  ProxySession(const ProxySession& other);
+  ProxySession& operator=(const ProxySession& other);
+
+  bool parseHead(std::string& out);
+  Result parseBody(std::string& out);
+
+ public:
+  ProxySession(const RequestContext& ctx, int clientFd,
+               const std::string& request, size_t bodyRemaining,
+               bool headOnly, const std::string& balanceKey);
+  ~ProxySession();
+
+  // The request line and headers sent upstream: HTTP/1.1 keep-alive, the
+  // location prefix replaced by the proxy_pass URI when it has one,
+  // hop-by-hop headers dropped and X-Forwarded-For added
+  static std::string buildRequestHead(const std::string& rawRequest,
+                                      const HttpRequest& request,
+                                      const sockaddr_in& clientAddr);
+
+  // Value of a request variable (name without the '$'): scheme, host,
+  // proxy_host, request_uri, uri, args, request_method, remote_addr,
+  // binary_remote_addr, cookie_<name>, http_<header> or one set by a map;
+  // empty when the request has none
+  static std::string requestVariable(const std::string& name,
+                                     const std::string& rawRequest,
+                                     const HttpRequest& request,
+                                     const sockaddr_in& clientAddr);
+  // Value of the group's hash key for this request ($request_uri, $uri,
+  // $remote_addr or $cookie_<name>); empty when the group does not hash
+  static std::string balanceKey(const std::string& rawRequest,
+                                const HttpRequest& request,
+                                const sockaddr_in& clientAddr);
+  // pattern with every $variable replaced by its value
+  static std::string expandVariables(const std::string& pattern,
+                                     const std::string& rawRequest,
+                                     const HttpRequest& request,
+                                     const sockaddr_in& clientAddr);
+  // proxy_cache_key with its variables expanded
+  static std::string cacheKey(const std::string& rawRequest,
+                              const HttpRequest& request,
+                              const sockaddr_in& clientAddr);
+
+  const RequestContext& getContext() const;
+  const UpstreamGroup& getGroup() const;
+  const std::string& getBalanceKey() const;
+  const std::vector<bool>& getTried() const;
+  bool hasPeer() const;
+  size_t getPeer() const;
+  void setPeer(size_t peer);
+  // Forgets the current peer and never picks it again for this request
+  void dropPeer();
+  // Address of the current peer
+  const UpstreamAddress& getUpstream() const;
+  int getClientFd() const;
+  // Turns the session into a background refresh; its response only goes
+  // to the cache
+  void detachClient();
+  int getUpstreamFd() const;
+  time_t getLastActivity() const;
+  bool isConnected() const;
+  bool isHeadOnly() const;
+  bool isKeepAlive() const;
+  bool hasResponseStarted() const;
+  bool hasPendingRequest() const;
+  bool isStreamingBody() const;
+  // A pooled connection that failed before anything came back was most
+  // likely closed by the upstream while idle; the request is sent again on
+  // a fresh one unless part of its body was already consumed from the client
+  bool canRetry() const;
+  // Nothing was sent to the client and the body can still be replayed, so
+  // the request may go to another peer of the group
+  bool canFailOver() const;
+
+  // Status and caching headers of the response, once it started
+  int getStatus() const;
+  const std::string& getCacheControl() const;
+  bool isPrivate() const;
+
+  void setCache(ProxyCache* cache, const std::string& key);
+  ProxyCache* getCache() const;
+  const std::string& getCacheKey() const;
+  // Marks the entry as being refreshed until the session ends
+  void setUpdating();
+  // Starts writing the response into the cache; false when the zone
+  // cannot take it
+  bool startFill(time_t expires);
+  ProxyCache::Fill* getFill() const;
+  // Response complete: moves it into the cache
+  void commitFill();
+
+  // Cache lock: identical requests arriving while this one fills the key
+  // are parked as waiters and answered from the entry it leaves
+  void addWaiter(int fd);
+  void removeWaiter(int fd);
+  const std::vector<int>& getWaiters() const;
+  // A parked request goes to the upstream itself once this passes
+  void setLockDeadline(time_t deadline);
+  time_t getLockDeadline() const;
+
+  // The rest of the body can be spliced: it goes to a client only, needs
+  // no decoding, and nothing read from the upstream is pending
+  bool canSplice() const;
+  // False when no pipe could be made; the body is then copied as before
+  bool startSplice();
+  bool isSplicing() const;
+  // Upstream -> pipe while the pipe has room; DONE once the whole body
+  // went in, which may be before the client got it
+  Result spliceFromUpstream();
+  // Pipe -> client, max bytes at most (limit_rate); -1 with errno set when
+  // the client cannot take more
+  ssize_t spliceToClient(size_t max);
+  bool hasPipedData() const;
+  bool hasPipeRoom() const;
+
+  // Takes an idle pooled connection
+  void useConnection(int fd);
+  // Starts a non-blocking connect; throws when it fails right away
+  void connectUpstream();
+  // Result of the connect once the socket became writable
+  bool finishConnect();
+  void resetForRetry();
+
+  ssize_t writeRequest();
+  ssize_t pumpClientBody();
+  Result readResponse(std::string& out);
+
+  // Hands the upstream descriptor over (for the pool); the session no
+  // longer closes it
+  int releaseUpstream();
+  void closeUpstream();
+};
+
+#endif
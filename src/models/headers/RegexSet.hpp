@@ -0,0 +1,59 @@
+#ifndef REGEXSET_HPP
+#define REGEXSET_HPP
+
+#include <regex.h>
+#include <string>
+#include <vector>
+
+// Maximum number of capture groups ($0..$9) handed back to callers
+#define REGEX_MAX_CAPTURES 10
+
+// An ordered set of POSIX extended regexes matched together. Every pattern
+// contributes the longest literal it cannot match without; those literals are
+// compiled into one Aho-Corasick automaton, so a single pass over the subject
+// tells which patterns can possibly match. Only those candidates (and the
+// patterns without a usable literal) are then run through regexec(), in
+// insertion order, and the first match wins.
+class RegexSet {
+ private:
+  struct Pattern {
+    std::string source;
+    int flags;
+    regex_t compiled;
+    bool hasLiteral;
+  };
+
+  struct State {
+    std::vector<std::pair<unsigned char, int> > next;
+    int fail;
+    std::vector<size_t> output;
+  };
+
+  std::vector<Pattern> _patterns;
+  std::vector<State> _states;
+
+  static std::string requiredLiteral(const std::string& pattern);
+  int step(int state, unsigned char c) const;
+  int child(int state, unsigned char c) const;
+  void addLiteral(const std::string& literal, size_t pattern);
+  void buildAutomaton();
+  void compileAll();
+  void freeAll();
+
+ public:
+  RegexSet();
+  RegexSet(const RegexSet& other);
+  RegexSet& operator=(const RegexSet& other);
+  ~RegexSet();
+
+  void add(const std::string& pattern, bool caseInsensitive);
+  void build();
+  size_t size() const;
+
+  // Index of the first pattern matching subject, or -1. When captures is
+  // given it receives $0..$n of that match.
+  long match(const std::string& subject,
+             std::vector<std::string>* captures) const;
+};
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef REQUESTLIMITER_HPP
+#define REQUESTLIMITER_HPP
+
+#include <stdint.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "LimitReq.hpp"
+
+class BaseBlock;
+class RequestContext;
+
+// State of the limit_req zones, kept across reloads. Each zone is a table
+// of fixed size allocated when the zone is opened: nodes chained into hash
+// buckets by the 64-bit FNV-1a hash of their key and kept in least recently
+// used order, so a lookup costs one hash and a short chain walk and a full
+// table recycles its oldest node instead of growing. Every server of the
+// process shares a zone's state.
+//
+// Rejections go out as a response built once per block, like the CGI
+// pool's 503: shedding load must not cost more than serving it.
+class RequestLimiter {
+ public:
+  enum Decision { PASS, DELAY, REJECT };
+
+ private:
+  struct Node {
+    uint64_t hash;
+    uint64_t last;    // ms of the last request let through
+    uint64_t excess;  // requests above the rate, in thousandths
+    uint32_t next;    // in the bucket
+    uint32_t newer;
+    uint32_t older;
+  };
+
+  struct Zone {
+    LimitReqZone config;
+    std::vector<Node> nodes;
+    std::vector<uint32_t> buckets;
+    uint32_t used;
+    uint32_t newest;
+    uint32_t oldest;
+  };
+
+  std::map<std::string, Zone> _zones;
+  std::map<const BaseBlock*, std::string> _responses;
+
+  static void unlinkLru(Zone& zone, uint32_t index);
+  static void pushNewest(Zone& zone, uint32_t index);
+  static Node& lookup(Zone& zone, uint64_t hash, uint64_t now,
+                      bool& created);
+  Zone& zoneFor(const LimitReqZone& config);
+
+ public:
+  RequestLimiter();
+  ~RequestLimiter();
+
+  // Allocates the zone's table (room for one key at least), or keeps its
+  // state when neither its size nor its key changed
+  void open(const LimitReqZone& zone);
+  // Frees the zones not in names
+  void prune(const std::set<std::string>& names);
+
+  static uint64_t hashKey(const std::string& key);
+  // keys[i] is the expanded key of rules[i], "" for requests it does not
+  // count. Nothing is charged to any zone unless every one admits the
+  // request; delay is set to the longest wait one of them asks for (ms).
+  Decision check(const std::vector<LimitReqRule>& rules,
+                 const std::vector<std::string>& keys, uint64_t now,
+                 uint64_t& delay);
+
+  const std::string& getRejectResponse(const RequestContext& ctx);
+  void drop(const BaseBlock* block);
+};
+
+#endif
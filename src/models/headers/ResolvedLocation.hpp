@@ -0,0 +1,77 @@
+#ifndef RESOLVEDLOCATION_HPP
+#define RESOLVEDLOCATION_HPP
+
+#include <sys/types.h>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+#include "AccessList.hpp"
+#include "BaseBlock.hpp"
+#include "LimitReq.hpp"
+#include "ProxyBuffering.hpp"
+#include "ProxyCacheRule.hpp"
+#include "ProxyPass.hpp"
+
+class LocationConfig;
+class Server;
+
+// allow_methods as bits; anything outside this list sets METHOD_OTHER and is
+// checked against the configured names
+enum MethodBit {
+  METHOD_GET = 1 << 0,
+  METHOD_HEAD = 1 << 1,
+  METHOD_POST = 1 << 2,
+  METHOD_PUT = 1 << 3,
+  METHOD_DELETE = 1 << 4,
+  METHOD_PATCH = 1 << 5,
+  METHOD_OPTIONS = 1 << 6,
+  METHOD_OTHER = 1 << 7
+};
+
+// The settings a request actually uses, with server -> location inheritance
+// already applied. One is compiled per location (and one for requests that
+// match no location) when the config is loaded, and only read afterwards,
+// so request handlers never branch between the two blocks.
+struct ResolvedLocation {
+  unsigned methods;
+  size_t root;  // index into the server's interned root pool
+  std::vector<std::string> indexFiles;
+  std::map<u_int16_t, std::string> errorPages;
+  bool autoIndex;
+  size_t clientMaxBodySize;
+  bool hasReturn;
+  std::pair<u_int16_t, std::string> returnData;
+  std::string uploadDir;
+  bool cgiEnabled;
+  bool cgiCacheEnabled;
+  time_t cgiCacheValid;
+  time_t cgiCacheLockTimeout;
+  bool cgiStatus;
+  bool proxyEnabled;
+  ProxyPass proxy;
+  bool proxyCacheEnabled;
+  ProxyCacheRule proxyCache;
+  ProxyBuffering proxyBuffering;
+  std::vector<LimitReqRule> limitReqs;
+  u_int16_t limitReqStatus;
+  AccessList access;
+  std::vector<AddHeader> addHeaders;
+  size_t limitRate;  // bytes per second, 0 for no limit
+  size_t limitRateAfter;
+  // root, return or add_header refer to variables, which each request
+  // expands (RequestContext::expandVariables)
+  bool hasVariables;
+
+  ResolvedLocation();
+
+  void resolve(const Server& server,
+               const LocationConfig* location,
+               size_t internedRoot);
+  bool isMethodAllowed(const std::string& method,
+                       const LocationConfig* location) const;
+
+  static unsigned methodBit(const std::string& method);
+};
+
+#endif
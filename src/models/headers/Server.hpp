@@ -2,12 +2,22 @@
 #define SERVER_HPP
 
 #include <BaseBlock.hpp>
+#include <LimitConn.hpp>
 #include <LocationConfig.hpp>
+#include <LocationIndex.hpp>
+#include <ResolvedLocation.hpp>
+#include <VariableMap.hpp>
+
+// How long SIGTERM/SIGQUIT waits for in-flight requests before exiting
+#define SHUTDOWN_DEFAULT_TIMEOUT 30
 
 struct ListenCtx {
   u_int16_t port;
   std::string addr;
-  
+  bool defaultServer;
+
+  ListenCtx() : port(80), addr("0.0.0.0"), defaultServer(false) {}
+
   bool operator==(const ListenCtx &other) const {
       return this->port == other.port && this->addr == other.addr;
   }
@@ -23,9 +33,18 @@ class Server : public BaseBlock {
     std::vector<ListenCtx> _listens;
     std::vector<std::string> _serverNames;
     std::string _root;
+    time_t _shutdownTimeout;
+    std::vector<LimitConnRule> _limitConns;
+    u_int16_t _limitConnStatus;
     std::vector<LocationConfig> _locations;
+    LocationIndex _locationIndex;
+    std::vector<std::string> _rootPool;
+    ResolvedLocation _resolvedServer;
+    std::vector<ResolvedLocation> _resolved;  // parallel to _locations
+    std::vector<VariableMap> _maps;  // the ones its blocks refer to
 
     bool validateAddress(const std::string &addr) const;
+    size_t internRoot(const std::string &root);
 
   public:
     Server();
@@ -36,6 +55,7 @@ class Server : public BaseBlock {
     const std::vector<std::string> &getServerNames() const;
     const std::string &getMatchingServerName(const std::string &hostHeader) const;
     void insertListen(u_int16_t port = 80, const std::string &addr = "0.0.0.0");
+    void setDefaultServer();
     void insertServerNames(const std::string &serverName);
     void setRoot(const std::string &root = "www/");
     const std::string &getRoot() const;
@@ -43,12 +63,46 @@ class Server : public BaseBlock {
     void setIndexFiles(const std::vector<std::string> &indexFiles);
     const std::vector<std::string> &getIndexFiles() const;
     void enableCgi(bool enabled);
+    void setShutdownTimeout(const std::string &seconds);
+    time_t getShutdownTimeout() const;
     bool isCgiEnabled() const;
+    void addLimitConn(const std::vector<std::string> &args);
+    const std::vector<LimitConnRule> &getLimitConns() const;
+    void setLimitConnStatus(const std::string &code);
+    u_int16_t getLimitConnStatus() const;
+    // Throws when a limit_conn names an undeclared zone
+    void linkLimitConns(const std::map<std::string, LimitConnZone> &zones);
+    // Keeps the maps that root, return and add_header of the server and its
+    // locations refer to, and the ones those maps refer to in turn
+    void linkMaps(const std::map<std::string, VariableMap> &maps);
+    // The map setting $name, or NULL
+    const VariableMap *findMap(const std::string &name) const;
 
     // Location management
     void addLocation(const LocationConfig &location);
+    // Appends a location for the parser to fill in place; the reference is
+    // valid until the next location is added
+    LocationConfig &newLocation(const std::string &path, MatchType matchType);
+    void reserveLocations(size_t count);
     const std::vector<LocationConfig> &getLocations() const;
     const LocationConfig *findLocation(const std::string &path) const;
+    const LocationConfig *findLocation(const std::string &path, std::vector<std::string> &captures) const;
+    void compileCgiDispatch();
+    void buildLocationIndex();
+    void resolveLocations();
+    // Points every proxy_pass location at its upstream block (or address)
+    // and its proxy_cache zone, and every limit_req at its zone, and
+    // resolves the locations again if there was any
+    void linkUpstreams(const std::map<std::string, UpstreamGroup> &upstreams,
+                       const std::map<std::string, ProxyCacheZone> &zones,
+                       const std::map<std::string, LimitReqZone> &limitZones);
+    const ResolvedLocation &getResolved(const LocationConfig *location) const;
+    const std::string &getInternedRoot(size_t root) const;
+
+    // Compiled config (de)serialization; the lookup tables are not written
+    // and have to be rebuilt after readFrom()
+    void writeTo(CacheWriter &out) const;
+    void readFrom(CacheReader &in);
 };
 
 #endif
\ No newline at end of file
@@ -2,19 +2,34 @@
 #define SOCKETMANAGER_HPP
 
 #include <arpa/inet.h>
+#include <stdint.h>
 #include <map>
 #include <memory>
 #include <netinet/in.h>
+#include <set>
 #include <string>
 #include <sys/socket.h>
 #include <vector>
+#include "CgiAdmission.hpp"
+#include "CgiCache.hpp"
+#include "ConfigLoader.hpp"
+#include "ConnectionLimiter.hpp"
+#include "ProxyHandler.hpp"
+#include "RequestLimiter.hpp"
 
 class HttpParser;
 class HttpRequest;
 class HttpResponse;
 class Server;
+class CgiSession;
+struct AddHeader;
+class ConfigSnapshot;
 
 #define EPOLL_DEFAULT 0
+// Binary upgrade handoff: "addr:port=fd;..." of the inherited listeners and
+// the pid of the process that handed them over
+#define UPGRADE_LISTEN_FDS_ENV "WEBSERV_LISTEN_FDS"
+#define UPGRADE_PARENT_ENV "WEBSERV_UPGRADE_PARENT"
 #define MAX_HEADER_SIZE 4096                               // 4 KB
 #define MAX_BODY_SIZE 65536                                // 64 KB
 #define MAX_REQUEST_SIZE (MAX_HEADER_SIZE + MAX_BODY_SIZE) // 68 KB
@@ -31,6 +46,37 @@ struct ServerSocketInfo
   }
 };
 
+// A response body sent straight from a file with sendfile once what is in
+// the send buffer (the response head) went out
+struct FileBody
+{
+  int fd;
+  off_t offset;
+  off_t end;
+};
+
+// A request limit_req holds back; it is processed again from its raw bytes
+// once due (monotonic ms) and the connection is left alone until then
+struct DelayedRequest
+{
+  uint64_t due;
+  std::string raw;
+};
+
+// limit_rate of a connection: after bytes go out at once, then rate
+// bytes per second counted from start (monotonic ms). A connection ahead of
+// its rate loses EPOLLOUT until due; events is what it asked for meanwhile.
+struct SendRate
+{
+  size_t rate;
+  size_t after;
+  uint64_t sent;
+  uint64_t start;
+  uint64_t due;
+  bool paused;
+  uint32_t events;
+};
+
 class SocketManager
 {
 private:
@@ -38,9 +84,44 @@ private:
   std::map<int, std::string> requestBuffers;
   std::map<int, time_t> lastActivity;
   std::map<int, std::string> sendBuffers;
+  std::map<int, FileBody> sendFiles; // client fd -> body still to send from a file, or a proxy spill file
   std::map<int, sockaddr_in> clientAddresses;
   static const int CLIENT_TIMEOUT = 60;
-  std::vector<Server> serverList;
+  static const int CGI_TIMEOUT = 5;
+  std::map<std::string, int> listenerKeys; // "addr:port" -> listening fd
+  std::string configPath;
+  ConfigLoader configLoader; // keeps every included file's tokens across reloads
+  std::string binaryPath;
+  int signalFd;
+  pid_t upgradePid;    // new binary started by SIGUSR2, until it takes over
+  pid_t upgradeParent; // old binary to retire once this one is serving
+  ConfigSnapshot *config;                         // handed to new connections
+  std::map<int, ConfigSnapshot *> clientConfigs;  // client fd -> snapshot it was accepted under
+  std::map<CgiSession *, ConfigSnapshot *> cgiConfigs; // running CGI -> snapshot its context lives in
+  std::map<int, long> clientRoutes;    // client fd -> routing table of its listen address
+  std::map<int, size_t> clientServers; // client fd -> server picked from its Host header
+  bool shuttingDown;
+  time_t shutdownDeadline;
+  size_t drainConnections; // last counts reported while draining
+  size_t drainChildren;
+  std::map<int, CgiSession *> cgiPipes;   // stdin/stdout pipe fd -> session
+  std::map<int, CgiSession *> cgiClients; // client fd -> session
+  std::set<CgiSession *> cgiExiting;      // output read, child not reaped yet
+  std::vector<pid_t> cgiKilled;           // children of released sessions, reaped on SIGCHLD
+  CgiCache cgiCache;
+  std::map<std::string, CgiSession *> cgiInFlight; // cache key -> running session
+  std::map<int, CgiSession *> cgiWaiting;          // client fd -> session it waits on
+  std::map<int, CgiSession *> cgiParked;           // waiting client fd -> its own request, run on lock timeout
+  CgiAdmission cgiAdmission;
+  ProxyHandler proxies; // proxy_pass sessions and proxy_cache zones
+  RequestLimiter requestLimiter;
+  std::map<int, DelayedRequest> limitDelayed; // client fd -> request held back by limit_req
+  std::multimap<uint64_t, int> limitQueue;     // due -> client fd, soonest first
+  std::map<int, SendRate> sendRates;           // client fd -> limit_rate state
+  std::multimap<uint64_t, int> rateQueue;      // due -> paused client fd, soonest first
+  ConnectionLimiter connectionLimiter;
+  std::map<const Server *, std::string> forbiddenResponses; // 403 sent by allow/deny at accept
+  int spareFd; // given up to accept and drop a connection when out of descriptors
 
   std::auto_ptr<HttpParser> httpParser;
   std::auto_ptr<HttpResponse> responseBuilder;
@@ -50,10 +131,35 @@ public:
   ~SocketManager();
 
   // Server management
-  void setServers(const std::vector<Server> &servers);
+  // Takes the servers over; the vector is left empty
+  void setServers(std::vector<Server> &servers);
   Server &selectServerForClient(int clientFd);
 
+  // Configuration reload (SIGHUP)
+  void setConfigPath(const std::string &path);
+  // Servers of the config file: from its compiled form when that is still
+  // current (returns true), otherwise parsed with includes expanded, reading
+  // only files that changed since the last call
+  bool loadServers(std::vector<Server> &servers);
+  void installConfig(ConfigSnapshot *snapshot);
+  void releaseConfig(ConfigSnapshot *snapshot);
+  bool reloadConfig(int epfd);
+  void handleSignal(int epfd);
+
+  // Binary upgrade (SIGUSR2)
+  void setBinaryPath(const std::string &fallback);
+  void inheritListeners();
+  void startUpgrade();
+  void checkUpgrade();
+  void announceReady();
+
+  // Graceful shutdown (SIGTERM/SIGQUIT)
+  void beginShutdown(int epfd);
+  bool isDrained();
+
   bool initSockets(const std::vector<ServerSocketInfo> &servers);
+  int openListener(const std::string &host, const std::string &port);
+  void closeListener(const std::string &key, int epfd);
   void closeSocket();
 
   bool isServerSocket(int fd) const;
@@ -62,8 +168,13 @@ public:
   void handleClients();
   void handleRequest(int readyServerFd, int epoll_fd);
   void acceptNewClient(int readyServerFd, int epoll_fd);
+  bool limitConnection(int fd, const Server &server, const sockaddr_in &clientAddr, const sockaddr_in &localAddr);
+  bool limitRoutedConnection(int fd, const Server &server, const sockaddr_in &clientAddr, int epfd);
+  const std::string &getForbiddenResponse(const Server &server);
+  void shedConnection(int listenFd);
   void handleTimeouts(int epoll_fd);
   void sendBuffer(int fd, int epfd);
+  void sendFileBody(int fd, int epfd);
   bool isRequestTooLarge(int fd);
   bool isHeaderTooLarge(int fd);
   bool isRequestLineMalformed(int fd);
@@ -71,10 +182,54 @@ public:
   bool hasNonPrintableCharacters(int fd);
   bool validateRequestSize(int fd, int epfd);
   void sendHttpError(int fd, const std::string &status, int epfd);
-  bool isBodyTooLarge(int fd);
+  bool isBodyTooLarge(int fd, size_t limit);
+  size_t getBodyLimit(int fd);
   bool hasInvalidPercentEncoding(int fd);
   HttpRequest *fillRequest(const std::string &rawRequest, Server &server);
-  void processFullRequest(int readyServerFd, int epfd, const std::string &rawRequest, sockaddr_in &clientAddr);
+  // admitted: limit_req already let the request through
+  void processFullRequest(int readyServerFd, int epfd, const std::string &rawRequest, sockaddr_in &clientAddr,
+                          bool admitted = false);
+  void queueResponse(int fd, HttpResponse &res, int epfd);
+  static void addHeaders(HttpResponse &res, const std::vector<AddHeader> &headers);
+  void setClientEvents(int fd, uint32_t events, int epfd);
+  void closeClient(int fd, int epfd);
+
+  // What is queued for a client, for the handlers that produce it
+  std::string &getSendBuffer(int fd);
+  FileBody *findFileBody(int fd);
+  FileBody &addFileBody(int fd, const FileBody &body);
+  bool hasPendingOutput(int fd) const;
+  ConfigSnapshot *getClientConfig(int fd);
+
+  // limit_req: requests over the rate are held back or turned away
+  bool admitRequest(int fd, const HttpRequest &request, const std::string &rawRequest,
+                    const sockaddr_in &clientAddr, int epfd);
+  void handleLimitDelays(int epfd);
+  int nextTimeout() const;
+
+  // limit_rate: bytes the connection may send now; below a useful amount
+  // it is paused until the rate allows more and 0 is returned
+  size_t sendAllowance(int fd, int epfd);
+  void chargeSend(int fd, size_t bytes);
+  void handleRateDelays(int epfd);
+
+  // CGI children run inside the event loop
+  void startCgiSession(CgiSession *session, int epfd);
+  void runCgiSession(CgiSession *session, int epfd);
+  void rejectCgiSession(CgiSession *session, int epfd);
+  void sendCgiStatus(int fd, int epfd);
+  void handleCgiEvent(int fd, uint32_t events, int epfd);
+  void streamCgiBody(CgiSession *session, int epfd);
+  void finishCgiSession(CgiSession *session, int epfd);
+  void completeCgiSession(CgiSession *session, int code, int epfd);
+  void reapCgiSessions(int epfd);
+  void deliverCgiResponse(CgiSession *session, HttpResponse &res, int epfd);
+  void sendToCgiClients(CgiSession *session, const std::string &raw, int epfd);
+  void failCgiSession(CgiSession *session, int code, int epfd);
+  void releaseCgiStdin(CgiSession *session, int epfd);
+  void releaseCgiSession(CgiSession *session, int epfd);
+  CgiSession *unparkCgiWaiter(int fd);
+  void handleCgiTimeouts(int epfd);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,74 @@
+#ifndef UPSTREAMBALANCER_HPP
+#define UPSTREAMBALANCER_HPP
+
+#include <stdint.h>
+#include <ctime>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include "ProxyPass.hpp"
+
+// Runtime side of the upstream groups: which peer the next request goes to,
+// how many requests each one has in flight and which ones are failing.
+// State is kept per group name and outlives config reloads as long as the
+// group keeps its peers and weights; a changed group starts over.
+//
+// Health is passive: a request that could not connect, timed out or got a
+// broken response counts as a failure of its peer, and max_fails of those
+// within fail_timeout take the peer out for fail_timeout. No probe requests
+// are sent; a peer comes back when its time is up and is dropped again if
+// it still fails. A group whose peers are all down brings them all back at
+// once instead of refusing requests.
+class UpstreamBalancer {
+ private:
+  struct PeerState {
+    unsigned active;
+    unsigned fails;
+    time_t firstFail;
+    time_t downUntil;
+    long currentWeight;  // smooth weighted round-robin
+
+    PeerState();
+  };
+
+  struct GroupState {
+    std::string signature;
+    std::vector<PeerState> peers;
+    // Consistent hash ring: point -> peer, sorted by point
+    std::vector<std::pair<uint32_t, size_t> > ring;
+  };
+
+  std::map<std::string, GroupState> _groups;
+  uint32_t _random;
+
+  GroupState& stateFor(const UpstreamGroup& group);
+  GroupState* findState(const UpstreamGroup& group);
+  uint32_t nextRandom();
+
+  int roundRobin(const UpstreamGroup& group, GroupState& state,
+                 const std::vector<bool>& candidates);
+  int leastConnections(const UpstreamGroup& group, GroupState& state,
+                       const std::vector<bool>& candidates);
+  int hashed(const UpstreamGroup& group, GroupState& state,
+             const std::vector<bool>& candidates, const std::string& key);
+  int twoChoices(const UpstreamGroup& group, GroupState& state,
+                 const std::vector<bool>& candidates);
+
+ public:
+  UpstreamBalancer();
+
+  static uint32_t hash(const std::string& value);
+
+  // Index of the peer for a request, or -1 when every peer is in tried.
+  // When all the untried ones are down they are brought back first. The
+  // peer counts as busy until release().
+  int select(const UpstreamGroup& group, const std::string& hashKey,
+             const std::vector<bool>& tried, time_t now);
+  void release(const UpstreamGroup& group, size_t peer);
+  void succeed(const UpstreamGroup& group, size_t peer);
+  // True when this failure took the peer out of rotation
+  bool fail(const UpstreamGroup& group, size_t peer, time_t now);
+};
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef UPSTREAMPOOL_HPP
+#define UPSTREAMPOOL_HPP
+
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+#define UPSTREAM_KEEPALIVE_MAX 32
+#define UPSTREAM_KEEPALIVE_TIMEOUT 60
+
+// Idle keep-alive connections to upstreams, per upstream address. A
+// proxied request takes the most recently used one and hands it back once
+// the response was read to its end, so busy upstreams see a few long-lived
+// connections instead of a connect per request. Idle connections are not
+// polled; one the upstream closed meanwhile is noticed (and dropped) when it
+// is taken.
+class UpstreamPool {
+ private:
+  struct Idle {
+    int fd;
+    time_t since;
+  };
+
+  std::map<std::string, std::vector<Idle> > _idle;
+  size_t _maxPerUpstream;
+  time_t _timeout;
+
+  UpstreamPool(const UpstreamPool& other);
+  UpstreamPool& operator=(const UpstreamPool& other);
+
+ public:
+  UpstreamPool();
+  ~UpstreamPool();
+
+  // An open connection to key, or -1 when none is idle
+  int acquire(const std::string& key, time_t now);
+  // Keeps fd for reuse; closes it when the pool for key is full
+  void release(const std::string& key, int fd, time_t now);
+  // Closes connections idle for longer than the keep-alive timeout
+  void expire(time_t now);
+  void clear();
+  size_t size() const;
+};
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef VARIABLEMAP_HPP
+#define VARIABLEMAP_HPP
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "RegexSet.hpp"
+
+class CacheReader;
+class CacheWriter;
+class HttpRequest;
+
+// map <source> $<variable> {
+//     [default <value>;] [hostnames;]
+//     <key> <value>; ~<regex> <value>; ~*<regex> <value>; ...
+// }
+// $variable takes the value of the first entry matching source, a template
+// of request variables, or default ("" unless set). Matching is nginx's:
+//   1. exact keys, compared without case, from a perfect hash table built
+//      when the config is loaded: one hash, one probe, one comparison
+//   2. with hostnames, the longest leading wildcard ("*.example.com"), then
+//      the longest trailing one ("www.example.*"), from label tries
+//   3. the regexes in the order written (~* ignores case); a value may use
+//      their captures as $1..$9
+// Values may use request variables, other maps' ones included.
+class VariableMap {
+ private:
+  struct Entry {
+    std::string key;  // as written
+    std::string value;
+  };
+
+  struct LabelNode {
+    std::map<std::string, size_t> children;
+    long entry;
+  };
+
+  std::string _variable;
+  std::string _source;
+  std::string _default;
+  bool _hostnames;
+  std::vector<Entry> _entries;
+
+  // Built from _entries; entry indices throughout
+  std::vector<std::string> _exactKeys;  // lowercased, by slot
+  std::vector<uint32_t> _exactEntries;  // by slot
+  std::vector<uint32_t> _displacements;  // by bucket
+  std::vector<LabelNode> _leading;       // labels stored right to left
+  std::vector<LabelNode> _trailing;      // labels stored left to right
+  RegexSet _regexes;
+  std::vector<size_t> _regexEntries;
+
+  static uint64_t hashKey(const std::string& key);
+  static void insertLabels(std::vector<LabelNode>& trie,
+                           const std::vector<std::string>& labels,
+                           size_t entry);
+  static long longestLabels(const std::vector<LabelNode>& trie,
+                            const std::vector<std::string>& labels);
+  bool buildPerfectHash(const std::vector<std::pair<std::string, size_t> >&
+                            keys,
+                        size_t slots);
+  long findExact(const std::string& key) const;
+  void build();
+  std::string expandValue(const std::string& value,
+                          const std::vector<std::string>& captures,
+                          const std::string& rawRequest,
+                          const HttpRequest& request,
+                          const sockaddr_in& clientAddr) const;
+
+ public:
+  VariableMap();
+
+  // Throw on a malformed source or variable, or a variable the server
+  // provides itself
+  void setSource(const std::string& source);
+  void setVariable(const std::string& variable);
+  // One line of the block; throws on a duplicate key or a bad regex
+  void addEntry(const std::vector<std::string>& args);
+  // Compiles the entries; call once they are all added
+  void compile();
+
+  const std::string& getVariable() const;
+  size_t size() const;
+  // Variable names (without '$') the source and values refer to
+  std::set<std::string> getReferences() const;
+
+  std::string evaluate(const std::string& rawRequest,
+                       const HttpRequest& request,
+                       const sockaddr_in& clientAddr) const;
+
+  // Only the entries are written; the tables are built again when read
+  void writeTo(CacheWriter& out) const;
+  void readFrom(CacheReader& in);
+};
+
+// Names of the $variables pattern refers to ($1..$9 excluded)
+std::set<std::string> variableReferences(const std::string& pattern);
+
+#endif
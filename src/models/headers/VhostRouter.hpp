@@ -0,0 +1,70 @@
+#ifndef VHOSTROUTER_HPP
+#define VHOSTROUTER_HPP
+
+#include <HashTable.hpp>
+#include <sys/types.h>
+#include <map>
+#include <string>
+#include <vector>
+
+class Server;
+
+// Name-based virtual hosting: one routing table per listen address, compiled
+// once from the server list. A connection looks up its table when it is
+// accepted; each request then maps its Host header to a server with nginx
+// precedence:
+//   1. exact name, from a hash table
+//   2. the longest leading wildcard ("*.example.com"), from a label trie
+//   3. the longest trailing wildcard ("www.example.*"), from a label trie
+//   4. the default_server of that address, or the first server listed on it
+// ".example.com" is shorthand for "example.com" plus "*.example.com".
+// Entries are indices into the server vector, so neither lookup depends on
+// how many server blocks exist.
+class VhostRouter {
+ private:
+  struct LabelNode {
+    std::map<std::string, size_t> children;
+    long server;
+  };
+
+  struct Table {
+    HashTable<size_t> exact;
+    std::vector<LabelNode> leading;   // labels stored right to left
+    std::vector<LabelNode> trailing;  // labels stored left to right
+    long defaultServer;
+    bool explicitDefault;
+    long firstServer;
+    bool oneServer;
+    bool sharedAccess;  // every server on the address has one allow/deny
+  };
+
+  std::vector<Table> _tables;
+  HashTable<size_t> _byListen;  // "addr:port" -> table
+
+  static void insertLabels(std::vector<LabelNode>& trie,
+                           const std::vector<std::string>& labels,
+                           size_t server);
+  static long longestLabels(const std::vector<LabelNode>& trie,
+                            const std::vector<std::string>& labels);
+  void insertName(Table& table, std::string name, size_t server);
+
+ public:
+  VhostRouter();
+  ~VhostRouter();
+
+  void build(const std::vector<Server>& servers);
+
+  // Table for the local address a connection was accepted on, falling back
+  // to the wildcard address on the same port; -1 if none is configured
+  long findTable(const std::string& addr, u_int16_t port) const;
+  // Server index for a Host header value (port and case are ignored)
+  size_t route(long table, const std::string& host) const;
+  // Whether the servers of a table all have the same server-level
+  // allow/deny, so a connection can be checked before its Host is known
+  bool sharesAccess(long table) const;
+  // Whether a single server listens on a table's address, so every
+  // connection there is routed to it whatever its Host header
+  bool servesOne(long table) const;
+};
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef PARSER_HPP
 #define PARSER_HPP
 
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -12,12 +13,24 @@ struct Token {
   TokenType type;
   std::string value;
   int quoted;
+  const std::string* file;  // owned by whoever lexed it; NULL if unnamed
+  size_t line;
 };
 
+// Errors located in the configuration, already prefixed with "file:line: "
+class ConfigError : public std::runtime_error {
+ public:
+  explicit ConfigError(const std::string& what);
+};
+
+// "file:line: what", the form every located config error takes
+std::string locate(const Token& token, const std::string& what);
+
 // Forward declaration to avoid circular includes
 class Container;
 
-std::vector<Token> lexer(const std::string& content);
+std::vector<Token> lexer(const std::string& content,
+                         const std::string* file = NULL);
 std::string readFile(const std::string& filename);
 void checks(const std::vector<Token>& tokens);
 int isAllowedTokens(const std::vector<Token>& tokens);
@@ -1,17 +1,25 @@
 #ifndef REQUESTCONTEXT_HPP
 #define REQUESTCONTEXT_HPP
 
+#include <netinet/in.h>
 #include <string>
 #include "LocationConfig.hpp"
 #include "Server.hpp"
 
+class HttpRequest;
+
 class RequestContext {
  public:
   const Server& server;
   const LocationConfig* location;
+  const ResolvedLocation& resolved;  // compiled settings for location
   std::string rootDir;
+  std::vector<std::string> captures;  // $0..$9 of a regex location match
 
   RequestContext(const Server& srv, const LocationConfig* loc);
+  RequestContext(const Server& srv,
+                 const LocationConfig* loc,
+                 const std::vector<std::string>& regexCaptures);
   const std::vector<std::string>& getIndexFiles() const;
   size_t getClientMaxBodySize() const;
   bool getAutoIndex() const;
@@ -21,6 +29,22 @@ class RequestContext {
   std::string getErrorPageContent(u_int16_t code) const;
   bool hasReturn() const;
   const std::pair<u_int16_t, std::string>& getReturnData() const;
+  const std::string& getUploadDir() const;
+  bool isCgiEnabled() const;
+  const CgiDispatch& getCgiDispatch() const;
+  const std::vector<AddHeader>& getAddHeaders() const;
+  // Expands the variables of root, return and add_header for this request;
+  // nothing to do unless the resolved location has any
+  void expandVariables(const std::string& rawRequest,
+                       const HttpRequest& request,
+                       const sockaddr_in& clientAddr);
+
+ private:
+  std::pair<u_int16_t, std::string> _expandedReturn;
+  bool _returnExpanded;
+  std::vector<AddHeader> _expandedHeaders;
+  bool _headersExpanded;
+  std::string expandCaptures(const std::string& value) const;
 };
 
 #endif
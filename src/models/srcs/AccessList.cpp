@@ -0,0 +1,214 @@
+#include <AccessList.hpp>
+#include <ConfigCache.hpp>
+#include <arpa/inet.h>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#define ACCESS_NONE 0xffffffffu
+
+AccessList::AccessList() : _rules(), _nodes() {}
+
+// "all", "10.0.0.0/8", "192.168.1.7", "2001:db8::/32" into a 128-bit
+// address (IPv4 mapped into ::ffff:0:0/96) with the host bits cleared
+bool AccessList::parse(const std::string& spec, uint8_t addr[16],
+                       unsigned& bits) {
+  std::memset(addr, 0, 16);
+  if (spec == "all") {
+    bits = 0;
+    return true;
+  }
+  std::string::size_type slash = spec.find('/');
+  std::string host = spec.substr(0, slash);
+  unsigned offset = 0;
+  unsigned maxBits = 128;
+  if (host.find(':') == std::string::npos) {
+    in_addr v4;
+    if (inet_pton(AF_INET, host.c_str(), &v4) != 1)
+      return false;
+    addr[10] = 0xff;
+    addr[11] = 0xff;
+    std::memcpy(addr + 12, &v4, 4);
+    offset = 96;
+    maxBits = 32;
+  } else if (inet_pton(AF_INET6, host.c_str(), addr) != 1) {
+    return false;
+  }
+
+  bits = maxBits;
+  if (slash != std::string::npos) {
+    const char* start = spec.c_str() + slash + 1;
+    char* end = NULL;
+    unsigned long length = std::strtoul(start, &end, 10);
+    if (end == start || *end || length > maxBits)
+      return false;
+    bits = length;
+  }
+  bits += offset;
+  for (unsigned bit = bits; bit < 128; ++bit)
+    addr[bit / 8] &= ~(0x80 >> (bit % 8));
+  return true;
+}
+
+unsigned AccessList::bitAt(const uint8_t addr[16], unsigned bit) {
+  return (addr[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+bool AccessList::matches(const uint8_t prefix[16], const uint8_t addr[16],
+                         unsigned bits) {
+  if (std::memcmp(prefix, addr, bits / 8) != 0)
+    return false;
+  if (bits % 8 == 0)
+    return true;
+  uint8_t mask = 0xff << (8 - bits % 8);
+  return (prefix[bits / 8] & mask) == (addr[bits / 8] & mask);
+}
+
+uint32_t AccessList::newNode(const uint8_t addr[16], unsigned bits,
+                             uint32_t rule) {
+  Node node;
+  std::memcpy(node.prefix, addr, 16);
+  for (unsigned bit = bits; bit < 128; ++bit)
+    node.prefix[bit / 8] &= ~(0x80 >> (bit % 8));
+  node.bits = bits;
+  node.child[0] = ACCESS_NONE;
+  node.child[1] = ACCESS_NONE;
+  node.rule = rule;
+  this->_nodes.push_back(node);
+  return this->_nodes.size() - 1;
+}
+
+// Nodes are addressed by index: pushing a node may move them all
+void AccessList::insert(const uint8_t addr[16], unsigned bits,
+                        uint32_t rule) {
+  if (this->_nodes.empty())
+    newNode(addr, 0, ACCESS_NONE);
+  uint32_t current = 0;
+  while (true) {
+    if (this->_nodes[current].bits == bits) {
+      if (this->_nodes[current].rule == ACCESS_NONE)
+        this->_nodes[current].rule = rule;
+      return;
+    }
+    unsigned side = bitAt(addr, this->_nodes[current].bits);
+    uint32_t child = this->_nodes[current].child[side];
+    if (child == ACCESS_NONE) {
+      uint32_t leaf = newNode(addr, bits, rule);
+      this->_nodes[current].child[side] = leaf;
+      return;
+    }
+
+    // Leading bits the child's prefix shares with the address
+    const Node& next = this->_nodes[child];
+    unsigned limit = next.bits < bits ? next.bits : bits;
+    unsigned common = this->_nodes[current].bits;
+    while (common < limit && bitAt(next.prefix, common) == bitAt(addr, common))
+      ++common;
+    if (common == next.bits) {
+      current = child;
+      continue;
+    }
+
+    // The address branches off inside the edge to the child: split it
+    unsigned childSide = bitAt(next.prefix, common);
+    uint32_t split;
+    if (common == bits) {
+      split = newNode(addr, bits, rule);
+    } else {
+      split = newNode(addr, common, ACCESS_NONE);
+      uint32_t leaf = newNode(addr, bits, rule);
+      this->_nodes[split].child[!childSide] = leaf;
+    }
+    this->_nodes[split].child[childSide] = child;
+    this->_nodes[current].child[side] = split;
+    return;
+  }
+}
+
+void AccessList::add(bool allow, const std::string& spec) {
+  Rule rule;
+  // Listeners are IPv4 only, so an IPv6 rule could never match a client
+  if (spec.substr(0, spec.find('/')).find(':') != std::string::npos)
+    throw std::runtime_error("IPv6 address for '" +
+                             std::string(allow ? "allow" : "deny") +
+                             "' is not supported: " + spec);
+  if (!parse(spec, rule.addr, rule.bits))
+    throw std::runtime_error("Invalid address for '" +
+                             std::string(allow ? "allow" : "deny") +
+                             "': " + spec);
+  rule.allow = allow;
+  this->_rules.push_back(rule);
+  insert(rule.addr, rule.bits, this->_rules.size() - 1);
+}
+
+bool AccessList::empty() const {
+  return this->_rules.empty();
+}
+
+size_t AccessList::size() const {
+  return this->_rules.size();
+}
+
+bool AccessList::allows(const in_addr& addr) const {
+  uint8_t mapped[16] = {0};
+  mapped[10] = 0xff;
+  mapped[11] = 0xff;
+  std::memcpy(mapped + 12, &addr, 4);
+  return allows(mapped);
+}
+
+bool AccessList::allows(const uint8_t addr[16]) const {
+  uint32_t first = ACCESS_NONE;
+  uint32_t current = this->_nodes.empty() ? ACCESS_NONE : 0;
+  while (current != ACCESS_NONE) {
+    const Node& node = this->_nodes[current];
+    if (!matches(node.prefix, addr, node.bits))
+      break;
+    if (node.rule < first)
+      first = node.rule;
+    if (node.bits == 128)
+      break;
+    current = node.child[bitAt(addr, node.bits)];
+  }
+  return first == ACCESS_NONE || this->_rules[first].allow;
+}
+
+bool AccessList::operator==(const AccessList& other) const {
+  if (this->_rules.size() != other._rules.size())
+    return false;
+  for (size_t i = 0; i < this->_rules.size(); ++i) {
+    const Rule& a = this->_rules[i];
+    const Rule& b = other._rules[i];
+    if (a.bits != b.bits || a.allow != b.allow ||
+        std::memcmp(a.addr, b.addr, 16) != 0)
+      return false;
+  }
+  return true;
+}
+
+void AccessList::writeTo(CacheWriter& out) const {
+  out.u64(this->_rules.size());
+  for (size_t i = 0; i < this->_rules.size(); ++i) {
+    out.str(std::string(reinterpret_cast<const char*>(this->_rules[i].addr),
+                        16));
+    out.u8(this->_rules[i].bits);
+    out.u8(this->_rules[i].allow);
+  }
+}
+
+void AccessList::readFrom(CacheReader& in) {
+  this->_rules.clear();
+  this->_nodes.clear();
+  uint64_t count = in.u64();
+  for (uint64_t i = 0; i < count; ++i) {
+    Rule rule;
+    std::string addr = in.str();
+    if (addr.size() != 16)
+      throw std::runtime_error("Corrupt access list");
+    std::memcpy(rule.addr, addr.data(), 16);
+    rule.bits = in.u8();
+    rule.allow = in.u8();
+    this->_rules.push_back(rule);
+    insert(rule.addr, rule.bits, this->_rules.size() - 1);
+  }
+}
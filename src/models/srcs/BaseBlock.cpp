@@ -1,27 +1,79 @@
 #include <BaseBlock.hpp>
+#include <CgiAdmission.hpp>
+#include <CgiCache.hpp>
 #include <cerrno>
+#include <stdexcept>
 
 BaseBlock::BaseBlock()
     : _root(DEFAULT_ROOT_PATH),
       _returnData(404, ""),
       _clientMaxBodySize(1048576),
+      _clientMaxBodySizeExplicitlySet(false),
       _indexFiles(),
       _errorPages(),
       _autoIndex(false),
       _cgiEnabled(false),
       _cgiExplicitlySet(false),
-      _cgiPassMap() {}
+      _cgiPassMap(),
+      _cgiCacheEnabled(false),
+      _cgiCacheValid(CGI_CACHE_DEFAULT_VALID),
+      _cgiCacheLockTimeout(CGI_CACHE_DEFAULT_LOCK_TIMEOUT),
+      _cgiCacheMaxSize(CGI_CACHE_DEFAULT_SIZE),
+      _cgiCacheExplicitlySet(false),
+      _cgiCacheValidExplicitlySet(false),
+      _cgiCacheLockTimeoutExplicitlySet(false),
+      _cgiCacheMaxSizeExplicitlySet(false),
+      _cgiMaxConcurrent(0),
+      _cgiQueueSize(0),
+      _cgiQueueTimeout(CGI_QUEUE_DEFAULT_TIMEOUT),
+      _cgiMaxConcurrentExplicitlySet(false),
+      _cgiQueueExplicitlySet(false),
+      _limitReqs(),
+      _limitReqStatus(LIMIT_REQ_DEFAULT_STATUS),
+      _limitReqStatusExplicitlySet(false),
+      _access(),
+      _addHeaders(),
+      _limitRate(0),
+      _limitRateAfter(0),
+      _limitRateExplicitlySet(false),
+      _limitRateAfterExplicitlySet(false),
+      _cgiDispatch() {}
 
 BaseBlock::BaseBlock(const BaseBlock& obj)
     : _root(obj._root),
       _returnData(obj._returnData),
       _clientMaxBodySize(obj._clientMaxBodySize),
+      _clientMaxBodySizeExplicitlySet(obj._clientMaxBodySizeExplicitlySet),
       _indexFiles(obj._indexFiles),
       _errorPages(obj._errorPages),
       _autoIndex(obj._autoIndex),
       _cgiEnabled(obj._cgiEnabled),
       _cgiExplicitlySet(obj._cgiExplicitlySet),
-      _cgiPassMap(obj._cgiPassMap) {}
+      _cgiPassMap(obj._cgiPassMap),
+      _cgiCacheEnabled(obj._cgiCacheEnabled),
+      _cgiCacheValid(obj._cgiCacheValid),
+      _cgiCacheLockTimeout(obj._cgiCacheLockTimeout),
+      _cgiCacheMaxSize(obj._cgiCacheMaxSize),
+      _cgiCacheExplicitlySet(obj._cgiCacheExplicitlySet),
+      _cgiCacheValidExplicitlySet(obj._cgiCacheValidExplicitlySet),
+      _cgiCacheLockTimeoutExplicitlySet(
+          obj._cgiCacheLockTimeoutExplicitlySet),
+      _cgiCacheMaxSizeExplicitlySet(obj._cgiCacheMaxSizeExplicitlySet),
+      _cgiMaxConcurrent(obj._cgiMaxConcurrent),
+      _cgiQueueSize(obj._cgiQueueSize),
+      _cgiQueueTimeout(obj._cgiQueueTimeout),
+      _cgiMaxConcurrentExplicitlySet(obj._cgiMaxConcurrentExplicitlySet),
+      _cgiQueueExplicitlySet(obj._cgiQueueExplicitlySet),
+      _limitReqs(obj._limitReqs),
+      _limitReqStatus(obj._limitReqStatus),
+      _limitReqStatusExplicitlySet(obj._limitReqStatusExplicitlySet),
+      _access(obj._access),
+      _addHeaders(obj._addHeaders),
+      _limitRate(obj._limitRate),
+      _limitRateAfter(obj._limitRateAfter),
+      _limitRateExplicitlySet(obj._limitRateExplicitlySet),
+      _limitRateAfterExplicitlySet(obj._limitRateAfterExplicitlySet),
+      _cgiDispatch(obj._cgiDispatch) {}
 
 void BaseBlock::setRoot(const std::string& root) {
   this->_root.clear();
@@ -48,9 +100,11 @@ bool BaseBlock::hasReturn() const {
 
 BaseBlock::~BaseBlock() {};
 
-void BaseBlock::setClientMaxBodySize(std::string& sSize) {
+// Parses sizes such as "512", "8k", "1M" or "2g" into bytes
+size_t BaseBlock::parseSize(std::string& sSize) {
   char sizeCategory = 0;
   char* endptr;
+  size_t size;
 
   if (sSize.empty() || sSize.find('.') != std::string::npos)
     throw CommonExceptions::InvalidValue();
@@ -58,32 +112,39 @@ void BaseBlock::setClientMaxBodySize(std::string& sSize) {
     sizeCategory = tolower(str_back(sSize));
     sSize.erase(sSize.size() - 1);
   }
-  this->_clientMaxBodySize = strtoul(sSize.c_str(), &endptr, 10);
+  size = strtoul(sSize.c_str(), &endptr, 10);
   if (*endptr || errno == ERANGE)
     throw CommonExceptions::InvalidValue();
   switch (sizeCategory) {
     case 0:
-      return;
+      return size;
     case 'k':
-      if (this->_clientMaxBodySize > MAX_KILOBYTE)
+      if (size > MAX_KILOBYTE)
         throw CommonExceptions::InvalidValue();
-      this->_clientMaxBodySize *= KILOBYTE;
-      return;
+      return size * KILOBYTE;
     case 'm':
-      if (this->_clientMaxBodySize > MAX_MEGABYTE)
+      if (size > MAX_MEGABYTE)
         throw CommonExceptions::InvalidValue();
-      this->_clientMaxBodySize *= MEGABYTE;
-      return;
+      return size * MEGABYTE;
     case 'g':
-      if (this->_clientMaxBodySize > MAX_GIGABYTE)
+      if (size > MAX_GIGABYTE)
         throw CommonExceptions::InvalidValue();
-      this->_clientMaxBodySize *= GIGABYTE;
-      return;
+      return size * GIGABYTE;
     default:
       throw CommonExceptions::InvalidValue();
   }
 }
 
+void BaseBlock::setClientMaxBodySize(std::string& sSize) {
+  this->_clientMaxBodySize = parseSize(sSize);
+  this->_clientMaxBodySizeExplicitlySet = true;
+}
+
+void BaseBlock::inheritClientMaxBodySize(size_t parentClientMaxBodySize) {
+  if (!this->_clientMaxBodySizeExplicitlySet)
+    this->_clientMaxBodySize = parentClientMaxBodySize;
+}
+
 void BaseBlock::setCgiEnabled(bool enabled) {
   this->_cgiEnabled = enabled;
   this->_cgiExplicitlySet = true;
@@ -109,7 +170,7 @@ void BaseBlock::setCgiPassMapping(const std::string& extension,
   this->_cgiPassMap[extension] = interpreterPath;
 }
 
-std::map<std::string, std::string> BaseBlock::getCgiPassMap() const {
+const std::map<std::string, std::string>& BaseBlock::getCgiPassMap() const {
   return this->_cgiPassMap;
 }
 
@@ -128,6 +189,229 @@ void BaseBlock::inheritCgiPassFromParent(
   }
 }
 
+void BaseBlock::setCgiCache(bool enabled) {
+  this->_cgiCacheEnabled = enabled;
+  this->_cgiCacheExplicitlySet = true;
+}
+
+bool BaseBlock::isCgiCacheEnabled() const {
+  return this->_cgiCacheEnabled;
+}
+
+// Accepts a number of seconds, or of minutes, hours or days with an m, h
+// or d suffix
+time_t BaseBlock::parseSeconds(const std::string& seconds) {
+  char* endptr;
+
+  if (seconds.empty() || !isdigit(seconds[0]))
+    throw CommonExceptions::InvalidValue();
+  long value = strtol(seconds.c_str(), &endptr, 10);
+  long unit = 1;
+  if (*endptr && !endptr[1]) {
+    switch (*endptr) {
+      case 's':
+        unit = 1;
+        break;
+      case 'm':
+        unit = 60;
+        break;
+      case 'h':
+        unit = 3600;
+        break;
+      case 'd':
+        unit = 86400;
+        break;
+      default:
+        throw CommonExceptions::InvalidValue();
+    }
+    ++endptr;
+  }
+  if (*endptr || value <= 0 || (unit > 1 && value > 0x7fffffffL / unit))
+    throw CommonExceptions::InvalidValue();
+  return value * unit;
+}
+
+void BaseBlock::setCgiCacheValid(const std::string& seconds) {
+  this->_cgiCacheValid = parseSeconds(seconds);
+  this->_cgiCacheValidExplicitlySet = true;
+}
+
+time_t BaseBlock::getCgiCacheValid() const {
+  return this->_cgiCacheValid;
+}
+
+void BaseBlock::setCgiCacheLockTimeout(const std::string& seconds) {
+  this->_cgiCacheLockTimeout = parseSeconds(seconds);
+  this->_cgiCacheLockTimeoutExplicitlySet = true;
+}
+
+time_t BaseBlock::getCgiCacheLockTimeout() const {
+  return this->_cgiCacheLockTimeout;
+}
+
+void BaseBlock::setCgiCacheMaxSize(std::string& sSize) {
+  this->_cgiCacheMaxSize = parseSize(sSize);
+  this->_cgiCacheMaxSizeExplicitlySet = true;
+}
+
+size_t BaseBlock::getCgiCacheMaxSize() const {
+  return this->_cgiCacheMaxSize;
+}
+
+void BaseBlock::inheritCgiCacheFromParent(const BaseBlock& parent) {
+  if (!this->_cgiCacheExplicitlySet)
+    this->_cgiCacheEnabled = parent._cgiCacheEnabled;
+  if (!this->_cgiCacheValidExplicitlySet)
+    this->_cgiCacheValid = parent._cgiCacheValid;
+  if (!this->_cgiCacheLockTimeoutExplicitlySet)
+    this->_cgiCacheLockTimeout = parent._cgiCacheLockTimeout;
+  if (!this->_cgiCacheMaxSizeExplicitlySet)
+    this->_cgiCacheMaxSize = parent._cgiCacheMaxSize;
+}
+
+static size_t parseCount(const std::string& count) {
+  char* endptr;
+
+  if (count.empty() || !isdigit(count[0]))
+    throw CommonExceptions::InvalidValue();
+  unsigned long value = strtoul(count.c_str(), &endptr, 10);
+  if (*endptr)
+    throw CommonExceptions::InvalidValue();
+  return value;
+}
+
+// 0 leaves the number of simultaneous CGI children unbounded
+void BaseBlock::setCgiMaxConcurrent(const std::string& limit) {
+  this->_cgiMaxConcurrent = parseCount(limit);
+  this->_cgiMaxConcurrentExplicitlySet = true;
+}
+
+size_t BaseBlock::getCgiMaxConcurrent() const {
+  return this->_cgiMaxConcurrent;
+}
+
+void BaseBlock::setCgiQueue(const std::string& size,
+                            const std::string& timeout) {
+  this->_cgiQueueSize = parseCount(size);
+  if (!timeout.empty())
+    this->_cgiQueueTimeout = parseSeconds(timeout);
+  this->_cgiQueueExplicitlySet = true;
+}
+
+size_t BaseBlock::getCgiQueueSize() const {
+  return this->_cgiQueueSize;
+}
+
+time_t BaseBlock::getCgiQueueTimeout() const {
+  return this->_cgiQueueTimeout;
+}
+
+void BaseBlock::inheritCgiLimitsFromParent(const BaseBlock& parent) {
+  if (!this->_cgiMaxConcurrentExplicitlySet)
+    this->_cgiMaxConcurrent = parent._cgiMaxConcurrent;
+  if (!this->_cgiQueueExplicitlySet) {
+    this->_cgiQueueSize = parent._cgiQueueSize;
+    this->_cgiQueueTimeout = parent._cgiQueueTimeout;
+  }
+}
+
+void BaseBlock::addLimitReq(const std::vector<std::string>& args) {
+  LimitReqRule rule = LimitReqRule::parse(args);
+  for (size_t i = 0; i < this->_limitReqs.size(); ++i)
+    if (this->_limitReqs[i].zoneName == rule.zoneName)
+      throw std::runtime_error("Duplicate limit_req zone: " + rule.zoneName);
+  this->_limitReqs.push_back(rule);
+}
+
+const std::vector<LimitReqRule>& BaseBlock::getLimitReqs() const {
+  return this->_limitReqs;
+}
+
+void BaseBlock::setLimitReqStatus(const std::string& code) {
+  size_t status = parseCount(code);
+  if (status < 400 || status > 599)
+    throw std::runtime_error("Invalid value for 'limit_req_status': " + code);
+  this->_limitReqStatus = status;
+  this->_limitReqStatusExplicitlySet = true;
+}
+
+u_int16_t BaseBlock::getLimitReqStatus() const {
+  return this->_limitReqStatus;
+}
+
+bool BaseBlock::linkLimitReqs(
+    const std::map<std::string, LimitReqZone>& zones) {
+  for (size_t i = 0; i < this->_limitReqs.size(); ++i)
+    this->_limitReqs[i].link(zones);
+  return !this->_limitReqs.empty();
+}
+
+void BaseBlock::addAccessRule(bool allow, const std::string& spec) {
+  this->_access.add(allow, spec);
+}
+
+const AccessList& BaseBlock::getAccess() const {
+  return this->_access;
+}
+
+void BaseBlock::addHeader(const std::vector<std::string>& args) {
+  if (args.size() < 2 || args.size() > 3 ||
+      (args.size() == 3 && args[2] != "always") || args[0].empty() ||
+      args[0].find_first_of(": \t\r\n") != std::string::npos)
+    throw std::runtime_error("Invalid arguments for 'add_header'");
+  AddHeader header;
+  header.name = args[0];
+  header.value = args[1];
+  header.always = args.size() == 3;
+  this->_addHeaders.push_back(header);
+}
+
+const std::vector<AddHeader>& BaseBlock::getAddHeaders() const {
+  return this->_addHeaders;
+}
+
+void BaseBlock::setLimitRate(std::string& sSize) {
+  this->_limitRate = parseSize(sSize);
+  this->_limitRateExplicitlySet = true;
+}
+
+size_t BaseBlock::getLimitRate() const {
+  return this->_limitRate;
+}
+
+void BaseBlock::setLimitRateAfter(std::string& sSize) {
+  this->_limitRateAfter = parseSize(sSize);
+  this->_limitRateAfterExplicitlySet = true;
+}
+
+size_t BaseBlock::getLimitRateAfter() const {
+  return this->_limitRateAfter;
+}
+
+void BaseBlock::inheritFromServer(const BaseBlock& server) {
+  if (this->_limitReqs.empty())
+    this->_limitReqs = server._limitReqs;
+  if (!this->_limitReqStatusExplicitlySet)
+    this->_limitReqStatus = server._limitReqStatus;
+  if (this->_access.empty())
+    this->_access = server._access;
+  if (this->_addHeaders.empty())
+    this->_addHeaders = server._addHeaders;
+  if (!this->_limitRateExplicitlySet)
+    this->_limitRate = server._limitRate;
+  if (!this->_limitRateAfterExplicitlySet)
+    this->_limitRateAfter = server._limitRateAfter;
+}
+
+// Must run once the block and its parent server are fully parsed
+void BaseBlock::buildCgiDispatch(const Server& server) {
+  this->_cgiDispatch.compile(*this, server);
+}
+
+const CgiDispatch& BaseBlock::getCgiDispatch() const {
+  return this->_cgiDispatch;
+}
+
 void BaseBlock::insertIndex(const std::vector<std::string>& indexFiles) {
   _indexFiles.clear();
   for (size_t i = 0; i < indexFiles.size(); ++i) {
@@ -158,6 +442,10 @@ const std::string* BaseBlock::getErrorPage(const u_int16_t code) const {
   return &cIt->second;
 }
 
+const std::map<u_int16_t, std::string>& BaseBlock::getErrorPages() const {
+  return this->_errorPages;
+}
+
 void BaseBlock::activateAutoIndex() {
   this->_autoIndex = true;
 }
@@ -180,4 +468,89 @@ const std::vector<std::string>& BaseBlock::getIndexFiles() const {
 
 bool BaseBlock::getAutoIndex() const {
   return this->_autoIndex;
-}
\ No newline at end of file
+}
+void BaseBlock::writeBlock(CacheWriter& out) const {
+  out.str(this->_root);
+  out.u16(this->_returnData.first);
+  out.str(this->_returnData.second);
+  out.u64(this->_clientMaxBodySize);
+  out.u8(this->_clientMaxBodySizeExplicitlySet);
+  out.strings(this->_indexFiles);
+  out.errorPages(this->_errorPages);
+  out.u8(this->_autoIndex);
+  out.u8(this->_cgiEnabled);
+  out.u8(this->_cgiExplicitlySet);
+  out.stringMap(this->_cgiPassMap);
+  out.u8(this->_cgiCacheEnabled);
+  out.u64(this->_cgiCacheValid);
+  out.u64(this->_cgiCacheMaxSize);
+  out.u8(this->_cgiCacheExplicitlySet);
+  out.u8(this->_cgiCacheValidExplicitlySet);
+  out.u8(this->_cgiCacheMaxSizeExplicitlySet);
+  out.u64(this->_cgiCacheLockTimeout);
+  out.u8(this->_cgiCacheLockTimeoutExplicitlySet);
+  out.u64(this->_cgiMaxConcurrent);
+  out.u64(this->_cgiQueueSize);
+  out.u64(this->_cgiQueueTimeout);
+  out.u8(this->_cgiMaxConcurrentExplicitlySet);
+  out.u8(this->_cgiQueueExplicitlySet);
+  out.u64(this->_limitReqs.size());
+  for (size_t i = 0; i < this->_limitReqs.size(); ++i)
+    this->_limitReqs[i].writeTo(out);
+  out.u16(this->_limitReqStatus);
+  out.u8(this->_limitReqStatusExplicitlySet);
+  this->_access.writeTo(out);
+  out.u64(this->_addHeaders.size());
+  for (size_t i = 0; i < this->_addHeaders.size(); ++i) {
+    out.str(this->_addHeaders[i].name);
+    out.str(this->_addHeaders[i].value);
+    out.u8(this->_addHeaders[i].always);
+  }
+  out.u64(this->_limitRate);
+  out.u64(this->_limitRateAfter);
+  out.u8(this->_limitRateExplicitlySet);
+  out.u8(this->_limitRateAfterExplicitlySet);
+}
+
+void BaseBlock::readBlock(CacheReader& in) {
+  this->_root = in.str();
+  this->_returnData.first = in.u16();
+  this->_returnData.second = in.str();
+  this->_clientMaxBodySize = in.u64();
+  this->_clientMaxBodySizeExplicitlySet = in.u8();
+  this->_indexFiles = in.strings();
+  this->_errorPages = in.errorPages();
+  this->_autoIndex = in.u8();
+  this->_cgiEnabled = in.u8();
+  this->_cgiExplicitlySet = in.u8();
+  this->_cgiPassMap = in.stringMap();
+  this->_cgiCacheEnabled = in.u8();
+  this->_cgiCacheValid = in.u64();
+  this->_cgiCacheMaxSize = in.u64();
+  this->_cgiCacheExplicitlySet = in.u8();
+  this->_cgiCacheValidExplicitlySet = in.u8();
+  this->_cgiCacheMaxSizeExplicitlySet = in.u8();
+  this->_cgiCacheLockTimeout = in.u64();
+  this->_cgiCacheLockTimeoutExplicitlySet = in.u8();
+  this->_cgiMaxConcurrent = in.u64();
+  this->_cgiQueueSize = in.u64();
+  this->_cgiQueueTimeout = in.u64();
+  this->_cgiMaxConcurrentExplicitlySet = in.u8();
+  this->_cgiQueueExplicitlySet = in.u8();
+  this->_limitReqs.assign(in.u64(), LimitReqRule());
+  for (size_t i = 0; i < this->_limitReqs.size(); ++i)
+    this->_limitReqs[i].readFrom(in);
+  this->_limitReqStatus = in.u16();
+  this->_limitReqStatusExplicitlySet = in.u8();
+  this->_access.readFrom(in);
+  this->_addHeaders.assign(in.u64(), AddHeader());
+  for (size_t i = 0; i < this->_addHeaders.size(); ++i) {
+    this->_addHeaders[i].name = in.str();
+    this->_addHeaders[i].value = in.str();
+    this->_addHeaders[i].always = in.u8();
+  }
+  this->_limitRate = in.u64();
+  this->_limitRateAfter = in.u64();
+  this->_limitRateExplicitlySet = in.u8();
+  this->_limitRateAfterExplicitlySet = in.u8();
+}
@@ -0,0 +1,153 @@
+#include "CgiAdmission.hpp"
+#include <sstream>
+#include "CgiSession.hpp"
+#include "HttpResponse.hpp"
+
+CgiAdmission::CgiAdmission() : _pools() {}
+
+CgiAdmission::~CgiAdmission() {}
+
+// Limits are configured on the matched location, or on the server block
+// when the script was reached without one
+const BaseBlock* CgiAdmission::blockOf(const CgiSession* session) {
+  const RequestContext& ctx = session->getContext();
+  if (ctx.location)
+    return ctx.location;
+  return &ctx.server;
+}
+
+CgiAdmission::Pool& CgiAdmission::poolFor(const CgiSession* session) {
+  const BaseBlock* block = blockOf(session);
+  std::map<const BaseBlock*, Pool>::iterator it = this->_pools.find(block);
+  if (it != this->_pools.end())
+    return it->second;
+
+  const RequestContext& ctx = session->getContext();
+  Pool& pool = this->_pools[block];
+  if (ctx.location)
+    pool.name = ctx.location->getPath();
+  else if (!ctx.server.getServerNames().empty())
+    pool.name = "server " + ctx.server.getServerNames()[0];
+  else
+    pool.name = "server";
+  pool.maxConcurrent = block->getCgiMaxConcurrent();
+  pool.queueSize = block->getCgiQueueSize();
+  pool.queueTimeout = block->getCgiQueueTimeout();
+  pool.rejected = 0;
+
+  // Built once per pool: shedding load must not cost more than serving it
+  std::ostringstream retryAfter;
+  retryAfter << (pool.queueSize ? pool.queueTimeout : 1);
+  HttpResponse res;
+  res.setErrorFromContext(503, ctx);
+  res.setHeader("Retry-After", retryAfter.str());
+  res.setVersion("HTTP/1.0");
+  pool.busyResponse = res.build();
+  return pool;
+}
+
+CgiAdmission::Decision CgiAdmission::admit(CgiSession* session, time_t now) {
+  Pool& pool = poolFor(session);
+
+  if (!pool.maxConcurrent || pool.active.size() < pool.maxConcurrent) {
+    pool.active.insert(session);
+    return ADMIT;
+  }
+  if (pool.queue.size() < pool.queueSize) {
+    pool.queue.push_back(std::make_pair(session, now));
+    return QUEUE;
+  }
+  ++pool.rejected;
+  return REJECT;
+}
+
+// Forgets a session that is going away. Returns true if it held a running
+// slot, in which case the caller should start next() in its place.
+bool CgiAdmission::release(CgiSession* session) {
+  std::map<const BaseBlock*, Pool>::iterator it =
+      this->_pools.find(blockOf(session));
+  if (it == this->_pools.end())
+    return false;
+  Pool& pool = it->second;
+
+  if (pool.active.erase(session))
+    return true;
+  for (std::deque<std::pair<CgiSession*, time_t> >::iterator q =
+           pool.queue.begin();
+       q != pool.queue.end(); ++q) {
+    if (q->first == session) {
+      pool.queue.erase(q);
+      break;
+    }
+  }
+  return false;
+}
+
+// Hands the freed slot to the oldest queued request of the same pool
+CgiSession* CgiAdmission::next(CgiSession* released) {
+  std::map<const BaseBlock*, Pool>::iterator it =
+      this->_pools.find(blockOf(released));
+  if (it == this->_pools.end())
+    return NULL;
+  Pool& pool = it->second;
+
+  if (pool.queue.empty() ||
+      (pool.maxConcurrent && pool.active.size() >= pool.maxConcurrent))
+    return NULL;
+  CgiSession* session = pool.queue.front().first;
+  pool.queue.pop_front();
+  pool.active.insert(session);
+  return session;
+}
+
+// Removes every request that waited longer than its queue timeout. The queue
+// is FIFO, so each pool only has to look at its head.
+void CgiAdmission::expire(time_t now, std::vector<CgiSession*>& expired) {
+  for (std::map<const BaseBlock*, Pool>::iterator it = this->_pools.begin();
+       it != this->_pools.end(); ++it) {
+    Pool& pool = it->second;
+    while (!pool.queue.empty() &&
+           now - pool.queue.front().second > pool.queueTimeout) {
+      expired.push_back(pool.queue.front().first);
+      pool.queue.pop_front();
+      ++pool.rejected;
+    }
+  }
+}
+
+void CgiAdmission::collect(std::set<CgiSession*>& sessions) const {
+  for (std::map<const BaseBlock*, Pool>::const_iterator it =
+           this->_pools.begin();
+       it != this->_pools.end(); ++it) {
+    sessions.insert(it->second.active.begin(), it->second.active.end());
+    for (size_t i = 0; i < it->second.queue.size(); ++i)
+      sessions.insert(it->second.queue[i].first);
+  }
+}
+
+// Called when the config a block belongs to is freed, so a later block
+// allocated at the same address does not inherit its pool
+void CgiAdmission::drop(const BaseBlock* block) {
+  this->_pools.erase(block);
+}
+
+const std::string& CgiAdmission::getBusyResponse(const CgiSession* session) {
+  return poolFor(session).busyResponse;
+}
+
+// One line per pool that has seen traffic, e.g.
+// "/cgi-bin/ active=4 queued=2 rejected=17 max_concurrent=4 queue=8"
+std::string CgiAdmission::report() const {
+  std::ostringstream out;
+
+  for (std::map<const BaseBlock*, Pool>::const_iterator it =
+           this->_pools.begin();
+       it != this->_pools.end(); ++it) {
+    const Pool& pool = it->second;
+    out << pool.name << " active=" << pool.active.size()
+        << " queued=" << pool.queue.size() << " rejected=" << pool.rejected
+        << " max_concurrent=" << pool.maxConcurrent
+        << " queue=" << pool.queueSize << "\n";
+  }
+  return out.str();
+}
@@ -0,0 +1,90 @@
+#include "CgiCache.hpp"
+#include <cstdlib>
+#include "HttpResponse.hpp"
+#include "HttpUtils.hpp"
+
+CgiCache::CgiCache() : _maxSize(CGI_CACHE_DEFAULT_SIZE), _size(0) {}
+
+CgiCache::~CgiCache() {}
+
+void CgiCache::setMaxSize(size_t maxSize) {
+  this->_maxSize = maxSize;
+}
+
+// Drops every entry, e.g. after a reload changed what the scripts answer
+void CgiCache::clear() {
+  this->_entries.clear();
+  this->_lru.clear();
+  this->_size = 0;
+}
+
+size_t CgiCache::getMaxSize() const {
+  return this->_maxSize;
+}
+
+size_t CgiCache::getSize() const {
+  return this->_size;
+}
+
+void CgiCache::erase(std::map<std::string, Entry>::iterator it) {
+  this->_size -= it->first.size() + it->second.response.size();
+  this->_lru.erase(it->second.lruPos);
+  this->_entries.erase(it);
+}
+
+const std::string* CgiCache::lookup(const std::string& key, time_t now) {
+  std::map<std::string, Entry>::iterator it = this->_entries.find(key);
+  if (it == this->_entries.end())
+    return NULL;
+  if (it->second.expires <= now) {
+    erase(it);
+    return NULL;
+  }
+  this->_lru.splice(this->_lru.begin(), this->_lru, it->second.lruPos);
+  return &it->second.response;
+}
+
+void CgiCache::store(const std::string& key,
+                     const std::string& response,
+                     time_t ttl,
+                     time_t now) {
+  size_t cost = key.size() + response.size();
+  if (ttl <= 0 || cost > this->_maxSize)
+    return;
+
+  std::map<std::string, Entry>::iterator it = this->_entries.find(key);
+  if (it != this->_entries.end())
+    erase(it);
+  while (!this->_lru.empty() && this->_size + cost > this->_maxSize)
+    erase(this->_entries.find(this->_lru.back()));
+
+  this->_lru.push_front(key);
+  Entry& entry = this->_entries[key];
+  entry.response = response;
+  entry.expires = now + ttl;
+  entry.lruPos = this->_lru.begin();
+  this->_size += cost;
+}
+
+// How long a CGI response may be reused: nothing but plain 200s without
+// cookies, and the script's Cache-Control wins over the configured TTL.
+time_t CgiCache::ttlFor(const HttpResponse& res, time_t defaultTtl) {
+  if (res.getStatusCode() != 200 || !res.getSetCookieHeaders().empty())
+    return 0;
+
+  std::string cacheControl = toLowerStr(res.getHeader("Cache-Control"));
+  if (cacheControl.empty())
+    return defaultTtl;
+  if (cacheControl.find("no-store") != std::string::npos ||
+      cacheControl.find("no-cache") != std::string::npos ||
+      cacheControl.find("private") != std::string::npos)
+    return 0;
+
+  size_t pos = cacheControl.find("s-maxage=");
+  if (pos != std::string::npos)
+    return std::atol(cacheControl.c_str() + pos + 9);
+  pos = cacheControl.find("max-age=");
+  if (pos != std::string::npos)
+    return std::atol(cacheControl.c_str() + pos + 8);
+  return defaultTtl;
+}
@@ -0,0 +1,80 @@
+#include "CgiDispatch.hpp"
+#include <sys/stat.h>
+#include "Server.hpp"
+
+CgiDispatch::CgiDispatch() : _interpreters(), _staticEnv(), _scripts() {}
+
+// The stat cache belongs to the block it was filled for; copies start cold
+CgiDispatch::CgiDispatch(const CgiDispatch& other)
+    : _interpreters(other._interpreters),
+      _staticEnv(other._staticEnv),
+      _scripts() {}
+
+CgiDispatch& CgiDispatch::operator=(const CgiDispatch& other) {
+  if (this != &other) {
+    this->_interpreters = other._interpreters;
+    this->_staticEnv = other._staticEnv;
+    this->_scripts.clear();
+  }
+  return *this;
+}
+
+CgiDispatch::~CgiDispatch() {}
+
+void CgiDispatch::compile(const BaseBlock& block, const Server& server) {
+  this->_interpreters = block.getCgiPassMap();
+  this->_scripts.clear();
+
+  this->_staticEnv.clear();
+  this->_staticEnv["GATEWAY_INTERFACE"] = "CGI/1.1";
+  this->_staticEnv["REDIRECT_STATUS"] = "200";  // Required for PHP-CGI
+  this->_staticEnv["DOCUMENT_ROOT"] = server.getRoot();
+}
+
+const std::string& CgiDispatch::findInterpreter(
+    const std::string& scriptPath) const {
+  static const std::string none;
+
+  size_t dotPos = scriptPath.find_last_of('.');
+  if (dotPos == std::string::npos)
+    return none;
+  std::map<std::string, std::string>::const_iterator it =
+      this->_interpreters.find(scriptPath.substr(dotPos));
+  if (it == this->_interpreters.end())
+    return none;
+  return it->second;
+}
+
+const std::map<std::string, std::string>& CgiDispatch::getStaticEnv() const {
+  return this->_staticEnv;
+}
+
+CgiDispatch::ScriptStatus CgiDispatch::checkScript(
+    const std::string& scriptPath,
+    time_t now) const {
+  std::map<std::string, ScriptEntry>::iterator it =
+      this->_scripts.find(scriptPath);
+  if (it != this->_scripts.end() &&
+      now - it->second.checked < CGI_SCRIPT_CACHE_VALID)
+    return it->second.status;
+
+  struct stat scriptStat;
+  ScriptStatus status;
+  if (stat(scriptPath.c_str(), &scriptStat) != 0)
+    status = SCRIPT_MISSING;
+  else if (S_ISDIR(scriptStat.st_mode))
+    status = SCRIPT_DIRECTORY;
+  else if (!(scriptStat.st_mode & S_IXUSR))
+    status = SCRIPT_NOT_EXECUTABLE;
+  else
+    status = SCRIPT_OK;
+
+  if (it == this->_scripts.end()) {
+    if (this->_scripts.size() >= CGI_SCRIPT_CACHE_MAX)
+      this->_scripts.clear();
+    it = this->_scripts.insert(std::make_pair(scriptPath, ScriptEntry())).first;
+  }
+  it->second.status = status;
+  it->second.checked = now;
+  return status;
+}
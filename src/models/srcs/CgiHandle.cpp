@@ -1,7 +1,9 @@
 #include "CgiHandle.hpp"
 #include "HttpResponse.hpp"
+#include "CgiSession.hpp"
+#include "HttpUtils.hpp"
 #include <fcntl.h>
-#include <sys/epoll.h>
+#include <signal.h>
 
 
 const char *CgiHandle::CgiExecutionException::what() const throw() {
@@ -57,15 +59,18 @@ std::string urlEncode(const std::string &value) {
 }
 
 
+// Only the per-request variables are computed here; the rest come prebuilt
+// from the block's CgiDispatch
 void CgiHandle::buildCgiEnvironment(
     const HttpRequest& request,
-    const RequestContext& ctx,
+    const CgiDispatch& dispatch,
     const std::string& scriptPath,
-    u_int16_t serverPort,
     const std::string& clientIP,
     const std::string &serverName,
     std::map<std::string, std::string>& envVars)
 {
+    envVars = dispatch.getStaticEnv();
+
     // 1. REQUEST_METHOD
     envVars["REQUEST_METHOD"] = request.getMethod();
 
@@ -112,16 +117,12 @@ void CgiHandle::buildCgiEnvironment(
     // 7. Server info (from context)
     envVars["SERVER_NAME"] = serverName;
     std::ostringstream portStream;
-    portStream << serverPort;
+    portStream << request.getLocalPort();
     envVars["SERVER_PORT"] = portStream.str();
     envVars["REMOTE_ADDR"] = clientIP;
     
     // 8. Script-specific variables (REQUIRED by subject)
     envVars["SCRIPT_FILENAME"] = scriptPath;
-    envVars["REDIRECT_STATUS"] = "200";      // Required for PHP-CGI security
-    envVars["GATEWAY_INTERFACE"] = "CGI/1.1"; // CGI version
-    
-    envVars["DOCUMENT_ROOT"] = ctx.server.getRoot();
 
     // 10. All HTTP headers with HTTP_ prefix (REQUIRED: full request to CGI)
     for (it = headers.begin(); it != headers.end(); ++it) {
@@ -134,153 +135,6 @@ void CgiHandle::buildCgiEnvironment(
     }
 }
 
-std::string CgiHandle::readCgiResponse(const std::string &inputData, int stdinPipe, int stdoutPipe, int epollFd, pid_t childPid) {
-    int flags = fcntl(stdinPipe, F_GETFL, 0);
-    fcntl(stdinPipe, F_SETFL, flags | O_NONBLOCK);
-    flags = fcntl(stdoutPipe, F_GETFL, 0);
-    fcntl(stdoutPipe, F_SETFL, flags | O_NONBLOCK);
-    
-    struct epoll_event event;
-    
-    event.events = EPOLLIN | EPOLLET; 
-    event.data.fd = stdoutPipe;
-    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, stdoutPipe, &event) == -1) {
-        close(stdinPipe);
-        close(stdoutPipe);
-        throw CgiExecutionException();
-    }
-    
-    bool needToWrite = !inputData.empty();
-    size_t bytesWritten = 0;
-    if (needToWrite) {
-        event.events = EPOLLOUT | EPOLLET;
-        event.data.fd = stdinPipe;
-        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, stdinPipe, &event) == -1) {
-            epoll_ctl(epollFd, EPOLL_CTL_DEL, stdoutPipe, NULL);
-            close(stdinPipe);
-            close(stdoutPipe);
-            throw CgiExecutionException();
-        }
-    } else {
-        close(stdinPipe);
-    }
-    
-    std::string output;
-    char buffer[4096];
-    time_t startTime = time(NULL);
-    int timeout = 5; // 5 second timeout
-    bool stdoutClosed = false;
-    
-    struct epoll_event events[2];
-    
-    while (!stdoutClosed) {
-        // Check for timeout
-        if (time(NULL) - startTime > timeout) {
-            if (needToWrite) {
-                epoll_ctl(epollFd, EPOLL_CTL_DEL, stdinPipe, NULL);
-                close(stdinPipe);
-            }
-            epoll_ctl(epollFd, EPOLL_CTL_DEL, stdoutPipe, NULL);
-            close(stdoutPipe);
-            kill(childPid, SIGKILL);
-            waitpid(childPid, NULL, 0);
-            throw CgiTimeoutException();
-        }
-
-        int nfds = epoll_wait(epollFd, events, 2, 100);
-
-        if (nfds == -1) {
-            if (needToWrite) {
-                epoll_ctl(epollFd, EPOLL_CTL_DEL, stdinPipe, NULL);
-                close(stdinPipe);
-            }
-            epoll_ctl(epollFd, EPOLL_CTL_DEL, stdoutPipe, NULL);
-            close(stdoutPipe);
-            throw CgiExecutionException();
-        }
-        
-        for (int i = 0; i < nfds; i++) {
-            if (events[i].data.fd == stdinPipe && (events[i].events & EPOLLOUT)) {
-                ssize_t written = write(stdinPipe, inputData.c_str() + bytesWritten, 
-                                       inputData.length() - bytesWritten);
-                if (written > 0) {
-                    bytesWritten += written;
-                    if (bytesWritten >= inputData.length()) {
-                        epoll_ctl(epollFd, EPOLL_CTL_DEL, stdinPipe, NULL);
-                        close(stdinPipe);
-                        needToWrite = false;
-                    }
-                } else if (written == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                    epoll_ctl(epollFd, EPOLL_CTL_DEL, stdinPipe, NULL);
-                    close(stdinPipe);
-                    epoll_ctl(epollFd, EPOLL_CTL_DEL, stdoutPipe, NULL);
-                    close(stdoutPipe);
-                    throw CgiExecutionException();
-                }
-            }
-            
-            if (events[i].data.fd == stdoutPipe && (events[i].events & EPOLLIN)) {
-                while (true) {
-                    ssize_t bytesRead = read(stdoutPipe, buffer, sizeof(buffer));
-                    if (bytesRead > 0) {
-                        output.append(buffer, bytesRead);
-                    } else if (bytesRead == 0) {
-                        epoll_ctl(epollFd, EPOLL_CTL_DEL, stdoutPipe, NULL);
-                        close(stdoutPipe);
-                        stdoutClosed = true;
-                        break;
-                    } else if (bytesRead == -1) {
-                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                            break;
-                        } else {
-                            epoll_ctl(epollFd, EPOLL_CTL_DEL, stdoutPipe, NULL);
-                            close(stdoutPipe);
-                            if (needToWrite) {
-                                epoll_ctl(epollFd, EPOLL_CTL_DEL, stdinPipe, NULL);
-                                close(stdinPipe);
-                            }
-                            throw CgiExecutionException();
-                        }
-                    }
-                }
-            }
-            
-            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
-                if (events[i].data.fd == stdoutPipe) {
-                    epoll_ctl(epollFd, EPOLL_CTL_DEL, stdoutPipe, NULL);
-                    close(stdoutPipe);
-                    stdoutClosed = true;
-                }
-                if (events[i].data.fd == stdinPipe && needToWrite) {
-                    epoll_ctl(epollFd, EPOLL_CTL_DEL, stdinPipe, NULL);
-                    close(stdinPipe);
-                    needToWrite = false;
-                }
-            }
-        }
-    }
-    
-    if (needToWrite) {
-        epoll_ctl(epollFd, EPOLL_CTL_DEL, stdinPipe, NULL);
-        close(stdinPipe);
-    }
-    
-    return output;
-}
-
-void CgiHandle::getInterpreterForScript(const std::map<std::string, std::string> &cgiPassMap, const std::string &scriptPath, std::string &interpreterPath) {
-    size_t dotPos = scriptPath.find_last_of('.');
-    if (dotPos != std::string::npos) {
-        std::string extension = scriptPath.substr(dotPos);
-        std::map<std::string, std::string>::const_iterator it = cgiPassMap.find(extension);
-        if (it != cgiPassMap.end()) {
-            interpreterPath = it->second;
-            return;
-        }
-    }
-    interpreterPath = "";
-}
-
 void CgiHandle::getDirectoryFromPath(const std::string &path, std::string &directoryPath) {
     size_t pos = path.find_last_of('/');
     if (pos != std::string::npos) {
@@ -373,19 +227,17 @@ void CgiHandle::parseCgiResponse(const std::string &cgiOutput, HttpResponse &res
     res.setBody(body);
 }
 
-void CgiHandle::sendCgiOutputToClient(const std::string &cgiOutput, HttpResponse &res) {
-    parseCgiResponse(cgiOutput, res);
-    res.build();
-}
-
-std::string CgiHandle::executeCgiScript(const std::string &scriptPath, const std::map<std::string, std::string> &envVars, const std::string &inputData,
-    const std::map<std::string, std::string> &cgiPassMap, int epollFd) {
+pid_t CgiHandle::spawnCgiProcess(const std::string &scriptPath, const std::string &interpreterPath,
+    const std::map<std::string, std::string> &envVars, int &stdinFd, int &stdoutFd) {
 
     int stdinPipe[2];
     int stdoutPipe[2];
-    std::string interpreterPath;
 
-    if (pipe(stdinPipe) == -1 || pipe(stdoutPipe) == -1) {
+    if (pipe(stdinPipe) == -1)
+        throw CgiExecutionException();
+    if (pipe(stdoutPipe) == -1) {
+        close(stdinPipe[0]);
+        close(stdinPipe[1]);
         throw CgiExecutionException();
     }
 
@@ -411,6 +263,11 @@ std::string CgiHandle::executeCgiScript(const std::string &scriptPath, const std
         for (int fd = 3; fd < 1024; fd++) {
             close(fd);
         }
+        // The server blocks the signals it reads through signalfd; the
+        // script must not inherit that mask
+        sigset_t noSignals;
+        sigemptyset(&noSignals);
+        sigprocmask(SIG_SETMASK, &noSignals, NULL);
 
         std::string scriptDir;
         getDirectoryFromPath(scriptPath, scriptDir);
@@ -419,7 +276,6 @@ std::string CgiHandle::executeCgiScript(const std::string &scriptPath, const std
         }
 
         char **envp = convertMapToCharArray(envVars);
-        getInterpreterForScript(cgiPassMap, scriptPath, interpreterPath);
         if (!interpreterPath.empty()) {
             char *argv[3];
             argv[0] = const_cast<char *>(interpreterPath.c_str());
@@ -436,53 +292,44 @@ std::string CgiHandle::executeCgiScript(const std::string &scriptPath, const std
         execve(scriptPath.c_str(), argv, envp);
         freeCharArray(envp, envVars.size());
         std::exit(1);
-    } else {
-        close(stdinPipe[0]);
-        close(stdoutPipe[1]);
-        
-        std::string cgiOutput = readCgiResponse(inputData, stdinPipe[1], stdoutPipe[0], epollFd, pid);
-        
-        int status;
-        pid_t result = waitpid(pid, &status, 0);
-
-        if (result == -1) {
-            throw CgiExecutionException();
-        }
-        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
-            throw CgiExecutionException();
-        }
-        return cgiOutput;
     }
+
+    close(stdinPipe[0]);
+    close(stdoutPipe[1]);
+    fcntl(stdinPipe[1], F_SETFL, fcntl(stdinPipe[1], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(stdoutPipe[0], F_SETFL, fcntl(stdoutPipe[0], F_GETFL, 0) | O_NONBLOCK);
+    stdinFd = stdinPipe[1];
+    stdoutFd = stdoutPipe[0];
+    return pid;
 }
 
+// Prepares the CGI child for this request. The script is not started here:
+// the session is handed to the event loop through the request, which spawns
+// it and feeds the body (buffered part first, then the socket) as it arrives.
 void CgiHandle::buildCgiScript(const std::string &scriptPath, const RequestContext &ctx, HttpResponse &res, HttpRequest &request,
     sockaddr_in &clientAddr, int epollFd) {
+    (void)epollFd;
+    const CgiDispatch &dispatch = ctx.getCgiDispatch();
     std::map<std::string, std::string> envVars;
-    std::string serverName = ctx.server.getMatchingServerName(res.getHostHeader());
-    u_int16_t serverPort = ctx.server.getServerPort(serverName);
+    const std::string &serverName = ctx.server.getMatchingServerName(res.getHostHeader());
     std::string clientIP = inet_ntoa(clientAddr.sin_addr);
-    buildCgiEnvironment(request, ctx, scriptPath, serverPort, clientIP, serverName, envVars);
-    try
-    {
-        std::string cgiOutput = executeCgiScript(scriptPath, envVars, request.getBody(), ctx.location->getCgiPassMap(), epollFd);
-        sendCgiOutputToClient(cgiOutput, res);
-    } 
-    catch (const CgiTimeoutException& e) {
-        std::cerr << "CGI Timeout: " << e.what() << '\n';
-        res.setErrorFromContext(504, ctx); // Gateway Timeout
-    }
-    catch (const CgiInvalidResponseException& e) {
-        std::cerr << "Invalid CGI Response: " << e.what() << '\n';
-        res.setErrorFromContext(502, ctx); // Bad Gateway
-    }
-    catch (const CgiExecutionException& e) {
-        std::cerr << "CGI Execution Error: " << e.what() << '\n';
-        res.setErrorFromContext(500, ctx); // Internal Server Error
+    buildCgiEnvironment(request, dispatch, scriptPath, clientIP, serverName, envVars);
+
+    CgiSession *session = new CgiSession(ctx, scriptPath, dispatch.findInterpreter(scriptPath), envVars);
+    session->setBody(request.getBody(), request.getPendingBody());
+
+    // Only bodiless requests are cacheable, since the body is not part of
+    // the key: a GET or HEAD that carries one runs uncached. The query is
+    // already normalized (sorted, re-encoded) in QUERY_STRING
+    bool hasBody = request.contentLength() > 0 || request.getHeaders().count("transfer-encoding");
+    if (ctx.resolved.cgiCacheEnabled && !hasBody &&
+        (request.getMethod() == "GET" || request.getMethod() == "HEAD")) {
+        std::map<std::string, std::string>::const_iterator host = request.getHeaders().find("host");
+        std::string key = request.getMethod() + " ";
+        if (host != request.getHeaders().end())
+            key += toLowerStr(host->second);
+        key += request.getPath() + "?" + envVars["QUERY_STRING"];
+        session->setCache(key, ctx.resolved.cgiCacheValid);
     }
-    catch (const std::exception& e) {
-        std::cerr << "Unknown error: " << e.what() << '\n';
-        res.setErrorFromContext(500, ctx);
-    }
-    
+    request.setCgiSession(session);
 }
-
@@ -0,0 +1,227 @@
+#include "CgiSession.hpp"
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include "CgiHandle.hpp"
+
+CgiSession::CgiSession(const RequestContext& ctx,
+                       const std::string& scriptPath,
+                       const std::string& interpreterPath,
+                       const std::map<std::string, std::string>& envVars)
+    : _ctx(ctx),
+      _clientFd(-1),
+      _pid(-1),
+      _stdinFd(-1),
+      _stdoutFd(-1),
+      _scriptPath(scriptPath),
+      _interpreterPath(interpreterPath),
+      _envVars(envVars),
+      _body(),
+      _bodyOffset(0),
+      _bodyRemaining(0),
+      _useSplice(true),
+      _output(),
+      _lastActivity(time(NULL)),
+      _cacheKey(),
+      _cacheTtl(0),
+      _waiters(),
+      _lockDeadline(0) {}
+
+CgiSession::~CgiSession() {
+  terminate();
+}
+
+void CgiSession::setClientFd(int fd) {
+  this->_clientFd = fd;
+}
+
+void CgiSession::setBody(const std::string& buffered, size_t remaining) {
+  this->_body = buffered;
+  this->_bodyOffset = 0;
+  this->_bodyRemaining = remaining;
+}
+
+void CgiSession::spawn() {
+  CgiHandle cgiHandler;
+  this->_pid = cgiHandler.spawnCgiProcess(this->_scriptPath,
+                                          this->_interpreterPath,
+                                          this->_envVars, this->_stdinFd,
+                                          this->_stdoutFd);
+  this->_lastActivity = time(NULL);
+}
+
+void CgiSession::setCache(const std::string& key, time_t ttl) {
+  this->_cacheKey = key;
+  this->_cacheTtl = ttl;
+}
+
+const std::string& CgiSession::getCacheKey() const {
+  return this->_cacheKey;
+}
+
+time_t CgiSession::getCacheTtl() const {
+  return this->_cacheTtl;
+}
+
+void CgiSession::addWaiter(int fd) {
+  this->_waiters.push_back(fd);
+}
+
+void CgiSession::removeWaiter(int fd) {
+  std::vector<int>::iterator it =
+      std::find(this->_waiters.begin(), this->_waiters.end(), fd);
+  if (it != this->_waiters.end())
+    this->_waiters.erase(it);
+}
+
+const std::vector<int>& CgiSession::getWaiters() const {
+  return this->_waiters;
+}
+
+void CgiSession::setLockDeadline(time_t deadline) {
+  this->_lockDeadline = deadline;
+}
+
+time_t CgiSession::getLockDeadline() const {
+  return this->_lockDeadline;
+}
+
+const RequestContext& CgiSession::getContext() const {
+  return this->_ctx;
+}
+
+int CgiSession::getClientFd() const {
+  return this->_clientFd;
+}
+
+int CgiSession::getStdinFd() const {
+  return this->_stdinFd;
+}
+
+int CgiSession::getStdoutFd() const {
+  return this->_stdoutFd;
+}
+
+time_t CgiSession::getLastActivity() const {
+  return this->_lastActivity;
+}
+
+const std::string& CgiSession::getOutput() const {
+  return this->_output;
+}
+
+bool CgiSession::hasBufferedInput() const {
+  return this->_bodyOffset < this->_body.size();
+}
+
+bool CgiSession::isStreamingBody() const {
+  return this->_bodyRemaining > 0;
+}
+
+ssize_t CgiSession::writeBufferedInput() {
+  ssize_t written = write(this->_stdinFd, this->_body.data() + this->_bodyOffset,
+                          this->_body.size() - this->_bodyOffset);
+  if (written > 0) {
+    this->_bodyOffset += written;
+    this->_lastActivity = time(NULL);
+    if (this->_bodyOffset >= this->_body.size()) {
+      this->_body.clear();
+      this->_bodyOffset = 0;
+    }
+  }
+  return written;
+}
+
+// Moves the next part of the body from the client socket into the stdin pipe.
+// splice() keeps the bytes in the kernel; if the socket/pipe pair does not
+// support it we fall back to a bounded recv() that is then written out like
+// the buffered prefix, so memory use stays at one chunk either way.
+ssize_t CgiSession::pumpClientBody() {
+  size_t want = this->_bodyRemaining;
+  if (want > CGI_SPLICE_CHUNK)
+    want = CGI_SPLICE_CHUNK;
+
+  ssize_t moved = -1;
+  if (this->_useSplice) {
+    moved = splice(this->_clientFd, NULL, this->_stdinFd, NULL, want,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (moved == -1 && errno == EINVAL)
+      this->_useSplice = false;
+  }
+  if (!this->_useSplice) {
+    char buffer[CGI_SPLICE_CHUNK];
+    moved = recv(this->_clientFd, buffer, want, 0);
+    if (moved > 0) {
+      this->_body.assign(buffer, moved);
+      this->_bodyOffset = 0;
+    }
+  }
+  if (moved > 0) {
+    this->_bodyRemaining -= moved;
+    this->_lastActivity = time(NULL);
+  }
+  return moved;
+}
+
+// Drains whatever the script has written so far. Returns true once stdout
+// reached EOF.
+bool CgiSession::readOutput() {
+  char buffer[4096];
+
+  while (true) {
+    ssize_t bytesRead = read(this->_stdoutFd, buffer, sizeof(buffer));
+    if (bytesRead > 0) {
+      this->_output.append(buffer, bytesRead);
+      this->_lastActivity = time(NULL);
+    } else if (bytesRead == 0) {
+      return true;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return false;
+    } else {
+      throw CgiHandle::CgiExecutionException();
+    }
+  }
+}
+
+void CgiSession::closeStdin() {
+  if (this->_stdinFd != -1) {
+    close(this->_stdinFd);
+    this->_stdinFd = -1;
+  }
+}
+
+void CgiSession::closeStdout() {
+  if (this->_stdoutFd != -1) {
+    close(this->_stdoutFd);
+    this->_stdoutFd = -1;
+  }
+}
+
+pid_t CgiSession::terminate() {
+  closeStdin();
+  closeStdout();
+  pid_t pid = this->_pid;
+  if (pid > 0)
+    kill(pid, SIGKILL);
+  this->_pid = -1;
+  return pid;
+}
+
+bool CgiSession::reap(int& code) {
+  int status;
+
+  code = -1;
+  if (this->_pid <= 0)
+    return true;
+  pid_t result = waitpid(this->_pid, &status, WNOHANG);
+  if (result == 0)
+    return false;
+  this->_pid = -1;
+  if (result != -1 && WIFEXITED(status))
+    code = WEXITSTATUS(status);
+  return true;
+}
@@ -0,0 +1,248 @@
+#include <ConfigCache.hpp>
+#include <ConfigLoader.hpp>
+#include <Server.hpp>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#define CONFIG_CACHE_MAGIC "WEBSERVC"
+
+CacheWriter::CacheWriter() : _data() {}
+
+void CacheWriter::u8(unsigned value) {
+  this->_data.push_back(static_cast<char>(value));
+}
+
+void CacheWriter::u16(u_int16_t value) {
+  this->_data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void CacheWriter::u64(uint64_t value) {
+  this->_data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void CacheWriter::str(const std::string& value) {
+  u64(value.size());
+  this->_data.append(value);
+}
+
+void CacheWriter::strings(const std::vector<std::string>& values) {
+  u64(values.size());
+  for (size_t i = 0; i < values.size(); ++i)
+    str(values[i]);
+}
+
+void CacheWriter::stringMap(const std::map<std::string, std::string>& values) {
+  u64(values.size());
+  for (std::map<std::string, std::string>::const_iterator it = values.begin();
+       it != values.end(); ++it) {
+    str(it->first);
+    str(it->second);
+  }
+}
+
+void CacheWriter::errorPages(const std::map<u_int16_t, std::string>& values) {
+  u64(values.size());
+  for (std::map<u_int16_t, std::string>::const_iterator it = values.begin();
+       it != values.end(); ++it) {
+    u16(it->first);
+    str(it->second);
+  }
+}
+
+const std::string& CacheWriter::data() const {
+  return this->_data;
+}
+
+CacheReader::CacheReader(const char* begin, const char* end)
+    : _pos(begin), _end(end) {}
+
+const char* CacheReader::take(size_t size) {
+  if (static_cast<size_t>(this->_end - this->_pos) < size)
+    throw std::runtime_error("Truncated compiled configuration");
+  const char* at = this->_pos;
+  this->_pos += size;
+  return at;
+}
+
+unsigned CacheReader::u8() {
+  return static_cast<unsigned char>(*take(1));
+}
+
+u_int16_t CacheReader::u16() {
+  u_int16_t value;
+  std::memcpy(&value, take(sizeof(value)), sizeof(value));
+  return value;
+}
+
+uint64_t CacheReader::u64() {
+  uint64_t value;
+  std::memcpy(&value, take(sizeof(value)), sizeof(value));
+  return value;
+}
+
+std::string CacheReader::str() {
+  uint64_t size = u64();
+  const char* at = take(size);
+  return std::string(at, size);
+}
+
+std::vector<std::string> CacheReader::strings() {
+  std::vector<std::string> values(u64());
+  for (size_t i = 0; i < values.size(); ++i)
+    values[i] = str();
+  return values;
+}
+
+std::map<std::string, std::string> CacheReader::stringMap() {
+  std::map<std::string, std::string> values;
+  for (uint64_t count = u64(); count > 0; --count) {
+    std::string key = str();
+    values[key] = str();
+  }
+  return values;
+}
+
+std::map<u_int16_t, std::string> CacheReader::errorPages() {
+  std::map<u_int16_t, std::string> values;
+  for (uint64_t count = u64(); count > 0; --count) {
+    u_int16_t code = u16();
+    values[code] = str();
+  }
+  return values;
+}
+
+bool CacheReader::atEnd() const {
+  return this->_pos == this->_end;
+}
+
+std::string ConfigCache::pathFor(const std::string& configPath) {
+  return configPath + CONFIG_CACHE_SUFFIX;
+}
+
+static std::string currentDirectory() {
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) == NULL)
+    return "";
+  return cwd;
+}
+
+void ConfigCache::write(const std::string& path,
+                        const std::vector<Server>& servers,
+                        const ConfigLoader& loader) {
+  CacheWriter out;
+  out.str(CONFIG_CACHE_MAGIC);
+  out.u64(CONFIG_CACHE_VERSION);
+  // Relative roots are resolved against the working directory
+  out.str(currentDirectory());
+
+  std::vector<ConfigLoader::Source> sources = loader.getSources();
+  out.u64(sources.size());
+  for (size_t i = 0; i < sources.size(); ++i) {
+    out.str(sources[i].path);
+    out.u64(sources[i].hash);
+  }
+  const std::vector<ConfigLoader::GlobMatch>& globs = loader.getGlobs();
+  out.u64(globs.size());
+  for (size_t i = 0; i < globs.size(); ++i) {
+    out.str(globs[i].pattern);
+    out.strings(globs[i].paths);
+  }
+
+  out.u64(servers.size());
+  for (size_t i = 0; i < servers.size(); ++i)
+    servers[i].writeTo(out);
+
+  std::string tmp = path + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    throw std::runtime_error("Could not create " + tmp + ": " +
+                             strerror(errno));
+  const std::string& data = out.data();
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+    if (n <= 0) {
+      close(fd);
+      unlink(tmp.c_str());
+      throw std::runtime_error("Could not write " + tmp);
+    }
+    written += n;
+  }
+  close(fd);
+  if (rename(tmp.c_str(), path.c_str()) != 0) {
+    unlink(tmp.c_str());
+    throw std::runtime_error("Could not replace " + path + ": " +
+                             strerror(errno));
+  }
+}
+
+// The header: every source file must still hash the same and every include
+// glob must still match the same files
+static bool isCurrent(CacheReader& in) {
+  if (in.str() != CONFIG_CACHE_MAGIC || in.u64() != CONFIG_CACHE_VERSION)
+    return false;
+  if (in.str() != currentDirectory())
+    return false;
+
+  for (uint64_t count = in.u64(); count > 0; --count) {
+    std::string path = in.str();
+    uint64_t hash = in.u64();
+    if (ConfigLoader::hashContent(readFile(path)) != hash)
+      return false;
+  }
+  for (uint64_t count = in.u64(); count > 0; --count) {
+    std::string pattern = in.str();
+    if (ConfigLoader::expandGlob(pattern) != in.strings())
+      return false;
+  }
+  return true;
+}
+
+bool ConfigCache::read(const std::string& path, std::vector<Server>& servers) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  const char* begin = static_cast<const char*>(map);
+  std::vector<Server> loaded;
+  bool ok = false;
+  try {
+    CacheReader in(begin, begin + st.st_size);
+    if (isCurrent(in)) {
+      // Copies of one default server: constructing each would stat the
+      // default root again
+      Server prototype;
+      loaded.assign(in.u64(), prototype);
+      for (size_t i = 0; i < loaded.size(); ++i) {
+        loaded[i].readFrom(in);
+        loaded[i].buildLocationIndex();
+        loaded[i].compileCgiDispatch();
+        loaded[i].resolveLocations();
+      }
+      ok = in.atEnd();
+    }
+  } catch (const std::exception&) {
+    ok = false;
+  }
+  munmap(map, st.st_size);
+
+  if (ok)
+    servers.swap(loaded);
+  return ok;
+}
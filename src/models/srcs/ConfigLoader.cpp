@@ -0,0 +1,212 @@
+#include <ConfigLoader.hpp>
+#include <glob.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+ConfigLoader::ConfigLoader()
+    : _files(), _including(), _globs(), _hits(0), _misses(0) {}
+
+ConfigLoader::~ConfigLoader() {}
+
+static ConfigError errorAt(const Token* from, const std::string& what) {
+  if (from)
+    return ConfigError(locate(*from, what));
+  return ConfigError(what);
+}
+
+static bool hasGlob(const std::string& pattern) {
+  return pattern.find_first_of("*?[") != std::string::npos;
+}
+
+static std::string directoryOf(const std::string& path) {
+  std::string::size_type slash = path.rfind('/');
+  if (slash == std::string::npos)
+    return "";
+  return path.substr(0, slash + 1);
+}
+
+const ConfigLoader::CachedFile& ConfigLoader::tokenize(
+    const std::string& real,
+    const std::string& name,
+    const Token* from) {
+  struct stat st;
+  if (stat(real.c_str(), &st) == -1 || !S_ISREG(st.st_mode))
+    throw errorAt(from, "Could not open file: " + name);
+
+  std::map<std::string, CachedFile>::iterator it = this->_files.find(real);
+  if (it != this->_files.end() && it->second.mtime == st.st_mtim.tv_sec &&
+      it->second.mtimeNsec == st.st_mtim.tv_nsec &&
+      it->second.size == st.st_size && it->second.inode == st.st_ino) {
+    it->second.used = true;
+    ++this->_hits;
+    return it->second;
+  }
+
+  // Tokens point at the entry's name, so it is filled in place; a file that
+  // fails to lex leaves no entry behind
+  CachedFile& file = this->_files[real];
+  try {
+    std::string content;
+    try {
+      content = readFile(real);
+    } catch (const std::exception& e) {
+      throw errorAt(from, e.what());
+    }
+    // Errors name files the way the config wrote them
+    if (file.name.empty())
+      file.name = name;
+    std::vector<Token> tokens = lexer(content, &file.name);
+    checks(tokens);
+    file.tokens.swap(tokens);
+    file.hash = hashContent(content);
+  } catch (...) {
+    this->_files.erase(real);
+    throw;
+  }
+  file.mtime = st.st_mtim.tv_sec;
+  file.mtimeNsec = st.st_mtim.tv_nsec;
+  file.size = st.st_size;
+  file.inode = st.st_ino;
+  file.used = true;
+  ++this->_misses;
+  return file;
+}
+
+void ConfigLoader::expand(const std::string& path,
+                          const Token* from,
+                          std::vector<Token>& out) {
+  char resolved[PATH_MAX];
+  if (!realpath(path.c_str(), resolved))
+    throw errorAt(from, "Could not open file: " + path);
+  std::string real(resolved);
+
+  if (std::find(this->_including.begin(), this->_including.end(), real) !=
+      this->_including.end()) {
+    std::string chain;
+    for (size_t i = 0; i < this->_including.size(); ++i)
+      chain += this->_including[i] + " -> ";
+    throw errorAt(from, "Include cycle: " + chain + real);
+  }
+
+  const CachedFile& file = tokenize(real, path, from);
+  this->_including.push_back(real);
+
+  const std::vector<Token>& tokens = file.tokens;
+  std::string baseDir = directoryOf(path);
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    if (tokens[i].type != ATTRIBUTE || tokens[i].value != "include") {
+      out.push_back(tokens[i]);
+      continue;
+    }
+    if (i + 2 >= tokens.size() || tokens[i + 1].type == SYMBOL ||
+        tokens[i + 2].value != ";")
+      throw ConfigError(locate(tokens[i], "Expected 'include <path>;'"));
+    expandInclude(tokens[i], tokens[i + 1].value, baseDir, out);
+    i += 2;
+  }
+  this->_including.pop_back();
+}
+
+void ConfigLoader::expandInclude(const Token& include,
+                                 const std::string& pattern,
+                                 const std::string& baseDir,
+                                 std::vector<Token>& out) {
+  std::string full = pattern[0] == '/' ? pattern : baseDir + pattern;
+  if (!hasGlob(full)) {
+    expand(full, &include, out);
+    return;
+  }
+
+  std::vector<std::string> paths;
+  try {
+    paths = expandGlob(full);
+  } catch (const std::exception& e) {
+    throw ConfigError(locate(include, e.what()));
+  }
+  this->_globs.push_back(GlobMatch());
+  this->_globs.back().pattern = full;
+  this->_globs.back().paths = paths;
+
+  for (size_t i = 0; i < paths.size(); ++i) {
+    struct stat st;
+    if (stat(paths[i].c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+      continue;
+    expand(paths[i], &include, out);
+  }
+}
+
+std::vector<Token> ConfigLoader::load(const std::string& path) {
+  for (std::map<std::string, CachedFile>::iterator it = this->_files.begin();
+       it != this->_files.end(); ++it)
+    it->second.used = false;
+  this->_including.clear();
+  this->_globs.clear();
+  this->_hits = 0;
+  this->_misses = 0;
+
+  std::vector<Token> tokens;
+  expand(path, NULL, tokens);
+
+  // Forget files no longer included; none of the returned tokens point at
+  // them
+  std::map<std::string, CachedFile>::iterator it = this->_files.begin();
+  while (it != this->_files.end()) {
+    if (it->second.used)
+      ++it;
+    else
+      this->_files.erase(it++);
+  }
+  return tokens;
+}
+
+size_t ConfigLoader::getHits() const {
+  return this->_hits;
+}
+
+size_t ConfigLoader::getMisses() const {
+  return this->_misses;
+}
+
+std::vector<ConfigLoader::Source> ConfigLoader::getSources() const {
+  std::vector<Source> sources;
+  for (std::map<std::string, CachedFile>::const_iterator it =
+           this->_files.begin();
+       it != this->_files.end(); ++it) {
+    sources.push_back(Source());
+    sources.back().path = it->first;
+    sources.back().hash = it->second.hash;
+  }
+  return sources;
+}
+
+const std::vector<ConfigLoader::GlobMatch>& ConfigLoader::getGlobs() const {
+  return this->_globs;
+}
+
+uint64_t ConfigLoader::hashContent(const std::string& content) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < content.size(); ++i) {
+    h ^= static_cast<unsigned char>(content[i]);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// A pattern that matches nothing is not an error, so an empty vhost
+// directory still loads; glob() sorts the matches
+std::vector<std::string> ConfigLoader::expandGlob(const std::string& pattern) {
+  std::vector<std::string> paths;
+  glob_t matches;
+  int rc = glob(pattern.c_str(), 0, NULL, &matches);
+  if (rc != 0 && rc != GLOB_NOMATCH) {
+    globfree(&matches);
+    throw std::runtime_error("Could not expand include: " + pattern);
+  }
+  if (rc == 0)
+    for (size_t i = 0; i < matches.gl_pathc; ++i)
+      paths.push_back(matches.gl_pathv[i]);
+  globfree(&matches);
+  return paths;
+}
@@ -0,0 +1,76 @@
+#include "ConfigSnapshot.hpp"
+#include <algorithm>
+#include <set>
+#include <sstream>
+
+// Builds the vhost tables right away so a config they reject (e.g. two
+// default_server on one address) fails here, before anything is swapped
+ConfigSnapshot::ConfigSnapshot(std::vector<Server>& servers)
+    : _servers(), _router(), _refs(0) {
+  this->_servers.swap(servers);
+  this->_router.build(this->_servers);
+}
+
+ConfigSnapshot::~ConfigSnapshot() {}
+
+const std::vector<Server>& ConfigSnapshot::getServers() const {
+  return this->_servers;
+}
+
+Server& ConfigSnapshot::getServer(size_t index) {
+  return this->_servers[index];
+}
+
+const VhostRouter& ConfigSnapshot::getRouter() const {
+  return this->_router;
+}
+
+std::vector<std::string> ConfigSnapshot::getListenKeys() const {
+  std::vector<std::string> keys;
+  std::set<std::string> seen;
+
+  for (size_t i = 0; i < this->_servers.size(); ++i) {
+    const std::vector<ListenCtx>& listens = this->_servers[i].getListens();
+    for (size_t j = 0; j < listens.size(); ++j) {
+      std::ostringstream key;
+      key << listens[j].addr << ":" << listens[j].port;
+      if (seen.insert(key.str()).second)
+        keys.push_back(key.str());
+    }
+  }
+  return keys;
+}
+
+size_t ConfigSnapshot::getCgiCacheBudget() const {
+  size_t budget = 0;
+
+  for (size_t i = 0; i < this->_servers.size(); ++i) {
+    if (this->_servers[i].isCgiCacheEnabled())
+      budget = std::max(budget, this->_servers[i].getCgiCacheMaxSize());
+    const std::vector<LocationConfig>& locations =
+        this->_servers[i].getLocations();
+    for (size_t j = 0; j < locations.size(); ++j) {
+      if (locations[j].isCgiCacheEnabled())
+        budget = std::max(budget, locations[j].getCgiCacheMaxSize());
+    }
+  }
+  return budget;
+}
+
+time_t ConfigSnapshot::getShutdownTimeout() const {
+  time_t timeout = 0;
+
+  for (size_t i = 0; i < this->_servers.size(); ++i)
+    timeout = std::max(timeout, this->_servers[i].getShutdownTimeout());
+  if (!timeout)
+    timeout = SHUTDOWN_DEFAULT_TIMEOUT;
+  return timeout;
+}
+
+void ConfigSnapshot::retain() {
+  ++this->_refs;
+}
+
+bool ConfigSnapshot::release() {
+  return --this->_refs == 0;
+}
@@ -0,0 +1,163 @@
+#include "ConnectionLimiter.hpp"
+#include "HttpResponse.hpp"
+#include "RequestLimiter.hpp"
+#include "requestContext.hpp"
+
+#define LIMIT_CONN_NONE 0xffffffffu
+
+ConnectionLimiter::ConnectionLimiter()
+    : _zones(), _held(), _generation(0), _responses() {}
+
+ConnectionLimiter::~ConnectionLimiter() {}
+
+void ConnectionLimiter::open(const LimitConnZone& config) {
+  size_t capacity = config.size / (sizeof(Node) + sizeof(uint32_t));
+  if (!capacity)
+    capacity = 1;
+
+  std::map<std::string, Zone>::iterator it = this->_zones.find(config.name);
+  if (it != this->_zones.end() && it->second.nodes.size() == capacity &&
+      it->second.config.key == config.key)
+    return;
+  Zone& zone = this->_zones[config.name];
+  zone.config = config;
+  zone.generation = ++this->_generation;
+  std::vector<Node>(capacity).swap(zone.nodes);
+  std::vector<uint32_t>(capacity, LIMIT_CONN_NONE).swap(zone.buckets);
+  zone.free = LIMIT_CONN_NONE;
+  zone.used = 0;
+}
+
+void ConnectionLimiter::prune(const std::set<std::string>& names) {
+  for (std::map<std::string, Zone>::iterator it = this->_zones.begin();
+       it != this->_zones.end();) {
+    if (names.count(it->first))
+      ++it;
+    else
+      this->_zones.erase(it++);
+  }
+}
+
+ConnectionLimiter::Zone& ConnectionLimiter::zoneFor(
+    const LimitConnZone& config) {
+  std::map<std::string, Zone>::iterator it = this->_zones.find(config.name);
+  if (it != this->_zones.end())
+    return it->second;
+  open(config);
+  return this->_zones[config.name];
+}
+
+uint32_t ConnectionLimiter::find(const Zone& zone, uint64_t hash) {
+  uint32_t i = zone.buckets[hash % zone.buckets.size()];
+  while (i != LIMIT_CONN_NONE && zone.nodes[i].hash != hash)
+    i = zone.nodes[i].next;
+  return i;
+}
+
+// LIMIT_CONN_NONE when the zone is full
+uint32_t ConnectionLimiter::insert(Zone& zone, uint64_t hash) {
+  uint32_t index;
+  if (zone.free != LIMIT_CONN_NONE) {
+    index = zone.free;
+    zone.free = zone.nodes[index].next;
+  } else if (zone.used < zone.nodes.size()) {
+    index = zone.used++;
+  } else {
+    return LIMIT_CONN_NONE;
+  }
+  uint32_t& head = zone.buckets[hash % zone.buckets.size()];
+  zone.nodes[index].hash = hash;
+  zone.nodes[index].count = 0;
+  zone.nodes[index].next = head;
+  head = index;
+  return index;
+}
+
+void ConnectionLimiter::remove(Zone& zone, uint32_t index) {
+  uint32_t* link =
+      &zone.buckets[zone.nodes[index].hash % zone.buckets.size()];
+  while (*link != index)
+    link = &zone.nodes[*link].next;
+  *link = zone.nodes[index].next;
+  zone.nodes[index].next = zone.free;
+  zone.free = index;
+}
+
+bool ConnectionLimiter::acquire(int fd, const std::vector<LimitConnRule>& rules,
+                                const std::vector<std::string>& keys) {
+  // Checked for every rule before anything is counted
+  for (size_t i = 0; i < rules.size(); ++i) {
+    if (keys[i].empty())
+      continue;
+    Zone& zone = zoneFor(rules[i].zone);
+    uint32_t index = find(zone, RequestLimiter::hashKey(keys[i]));
+    if (index == LIMIT_CONN_NONE) {
+      if (zone.free == LIMIT_CONN_NONE && zone.used == zone.nodes.size())
+        return false;
+    } else if (zone.nodes[index].count >= rules[i].limit) {
+      return false;
+    }
+  }
+
+  if (static_cast<size_t>(fd) >= this->_held.size())
+    this->_held.resize(fd + 1);
+  std::vector<Hold>& held = this->_held[fd];
+  for (size_t i = 0; i < rules.size(); ++i) {
+    if (keys[i].empty())
+      continue;
+    Zone& zone = this->_zones[rules[i].zone.name];
+    Hold hold;
+    hold.zone = rules[i].zone.name;
+    hold.generation = zone.generation;
+    hold.hash = RequestLimiter::hashKey(keys[i]);
+    uint32_t index = find(zone, hold.hash);
+    if (index == LIMIT_CONN_NONE)
+      index = insert(zone, hold.hash);
+    // Two rules on one zone and key, with the zone one short of full
+    if (index == LIMIT_CONN_NONE)
+      continue;
+    ++zone.nodes[index].count;
+    held.push_back(hold);
+  }
+  return true;
+}
+
+bool ConnectionLimiter::holds(int fd) const {
+  return fd >= 0 && static_cast<size_t>(fd) < this->_held.size() &&
+         !this->_held[fd].empty();
+}
+
+void ConnectionLimiter::release(int fd) {
+  if (fd < 0 || static_cast<size_t>(fd) >= this->_held.size())
+    return;
+  std::vector<Hold>& held = this->_held[fd];
+  for (size_t i = 0; i < held.size(); ++i) {
+    std::map<std::string, Zone>::iterator it = this->_zones.find(held[i].zone);
+    if (it == this->_zones.end() ||
+        it->second.generation != held[i].generation)
+      continue;
+    Zone& zone = it->second;
+    uint32_t index = find(zone, held[i].hash);
+    if (index != LIMIT_CONN_NONE && !--zone.nodes[index].count)
+      remove(zone, index);
+  }
+  held.clear();
+}
+
+const std::string& ConnectionLimiter::getRejectResponse(const Server& server) {
+  std::map<const Server*, std::string>::iterator it =
+      this->_responses.find(&server);
+  if (it != this->_responses.end())
+    return it->second;
+
+  RequestContext ctx(server, NULL);
+  HttpResponse res;
+  res.setErrorFromContext(server.getLimitConnStatus(), ctx);
+  res.setHeader("Connection", "close");
+  res.setVersion("HTTP/1.0");
+  return this->_responses[&server] = res.build();
+}
+
+void ConnectionLimiter::drop(const Server* server) {
+  this->_responses.erase(server);
+}
@@ -1,4 +1,5 @@
 #include <Container.hpp>
+#include <stdexcept>
 
 Container::Container()
 {
@@ -13,7 +14,102 @@ void Container::insertServer(const Server &server)
     this->_servers.push_back(server);
 }
 
+Server &Container::newServer()
+{
+    this->_servers.push_back(Server());
+    return this->_servers.back();
+}
+
+void Container::reserveServers(size_t count)
+{
+    this->_servers.reserve(count);
+}
+
 const std::vector<Server> &Container::getServers() const
 {
     return this->_servers;
-}
\ No newline at end of file
+}
+
+UpstreamGroup &Container::newUpstream(const std::string &name)
+{
+    if (this->_upstreams.count(name))
+        throw std::runtime_error("Duplicate upstream: " + name);
+    UpstreamGroup &group = this->_upstreams[name];
+    group.name = name;
+    return group;
+}
+
+const std::map<std::string, UpstreamGroup> &Container::getUpstreams() const
+{
+    return this->_upstreams;
+}
+
+void Container::addCacheZone(const ProxyCacheZone &zone)
+{
+    if (this->_cacheZones.count(zone.name))
+        throw std::runtime_error("Duplicate proxy_cache zone: " + zone.name);
+    for (std::map<std::string, ProxyCacheZone>::const_iterator it = this->_cacheZones.begin();
+         it != this->_cacheZones.end(); ++it)
+    {
+        if (it->second.path == zone.path)
+            throw std::runtime_error("Cache directory " + zone.path + " is used by zone " + it->first);
+    }
+    this->_cacheZones[zone.name] = zone;
+}
+
+void Container::addLimitReqZone(const LimitReqZone &zone)
+{
+    if (this->_limitReqZones.count(zone.name))
+        throw std::runtime_error("Duplicate limit_req zone: " + zone.name);
+    this->_limitReqZones[zone.name] = zone;
+}
+
+void Container::addLimitConnZone(const LimitConnZone &zone)
+{
+    if (this->_limitConnZones.count(zone.name))
+        throw std::runtime_error("Duplicate limit_conn zone: " + zone.name);
+    this->_limitConnZones[zone.name] = zone;
+}
+
+void Container::addMap(const VariableMap &map)
+{
+    if (this->_maps.count(map.getVariable()))
+        throw std::runtime_error("Duplicate map variable: $" + map.getVariable());
+    this->_maps[map.getVariable()] = map;
+}
+
+// Depth-first walk of the maps a map refers to; one met again while still
+// on the path would recurse forever at request time
+static void checkMapLoop(const std::map<std::string, VariableMap> &maps, const std::string &name,
+                         std::set<std::string> &path, std::set<std::string> &done)
+{
+    std::map<std::string, VariableMap>::const_iterator it = maps.find(name);
+    if (it == maps.end() || done.count(name))
+        return;
+    if (!path.insert(name).second)
+        throw std::runtime_error("Maps refer to each other in a loop through $" + name);
+    std::set<std::string> references = it->second.getReferences();
+    for (std::set<std::string>::const_iterator ref = references.begin(); ref != references.end(); ++ref)
+        checkMapLoop(maps, *ref, path, done);
+    path.erase(name);
+    done.insert(name);
+}
+
+void Container::linkUpstreams()
+{
+    std::set<std::string> path, done;
+    for (std::map<std::string, VariableMap>::const_iterator it = this->_maps.begin(); it != this->_maps.end(); ++it)
+        checkMapLoop(this->_maps, it->first, path, done);
+    for (size_t i = 0; i < this->_servers.size(); ++i)
+    {
+        this->_servers[i].linkLimitConns(this->_limitConnZones);
+        this->_servers[i].linkMaps(this->_maps);
+        this->_servers[i].linkUpstreams(this->_upstreams, this->_cacheZones, this->_limitReqZones);
+    }
+}
+
+void Container::releaseServers(std::vector<Server> &out)
+{
+    out.clear();
+    out.swap(this->_servers);
+}
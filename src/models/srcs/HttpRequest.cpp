@@ -5,6 +5,7 @@
 #include <sys/stat.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <cstring>
 #include <ctime>
@@ -14,10 +15,12 @@
 #include <sstream>
 
 #include "CgiHandle.hpp"
+#include "CgiSession.hpp"
 #include "HttpResponse.hpp"
 #include "HttpUtils.hpp"
 
-HttpRequest::HttpRequest(const RequestContext& ctx) : _ctx(ctx) {}
+HttpRequest::HttpRequest(const RequestContext& ctx)
+    : _ctx(ctx), pendingBody(0), localPort(0), cgiSession(NULL) {}
 
 // Copy assignment operator (private - not meant to be used)
 // Note: _ctx cannot be reassigned as it's a const reference
@@ -36,16 +39,18 @@ HttpRequest& HttpRequest::operator=(const HttpRequest& other) {
   return *this;
 }
 
-HttpRequest::~HttpRequest() {}
+HttpRequest::~HttpRequest() {
+  delete cgiSession;
+}
 
 bool HttpRequest::isCgiEnabledForRequest() const {
-  // Location-level setting overrides server-level setting
-  // If no location matches, use server-level setting
-  // Note: Locations inherit from server if not explicitly set during parsing
-  if (_ctx.location) {
-    return _ctx.location->isCgiEnabled();
-  }
-  return _ctx.server.isCgiEnabled();
+  // Location-level setting overrides server-level setting; resolved at
+  // config load
+  return _ctx.isCgiEnabled();
+}
+
+const CgiDispatch& HttpRequest::getCgiDispatch() const {
+  return _ctx.getCgiDispatch();
 }
 
 const std::string& HttpRequest::getMethod() const {
@@ -72,6 +77,23 @@ const std::map<std::string, std::string>& HttpRequest::getQuery() const {
   return query;
 }
 
+size_t HttpRequest::getPendingBody() const {
+  return pendingBody;
+}
+
+u_int16_t HttpRequest::getLocalPort() const {
+  return localPort;
+}
+
+void HttpRequest::expandVariables(const std::string& rawRequest,
+                                  const sockaddr_in& clientAddr) {
+  _ctx.expandVariables(rawRequest, *this, clientAddr);
+}
+
+const RequestContext& HttpRequest::getContext() const {
+  return _ctx;
+}
+
 void HttpRequest::setMethod(const std::string& m) {
   method = m;
 }
@@ -88,6 +110,25 @@ void HttpRequest::setEnabledCgi(bool enabled) {
   enabledCgi = enabled;
 }
 
+void HttpRequest::setPendingBody(size_t remaining) {
+  pendingBody = remaining;
+}
+
+void HttpRequest::setLocalPort(u_int16_t port) {
+  localPort = port;
+}
+
+void HttpRequest::setCgiSession(CgiSession* session) {
+  delete cgiSession;
+  cgiSession = session;
+}
+
+CgiSession* HttpRequest::releaseCgiSession() {
+  CgiSession* session = cgiSession;
+  cgiSession = NULL;
+  return session;
+}
+
 void HttpRequest::addHeader(const std::string& k, const std::string& v) {
   headers[k] = v;
 }
@@ -171,6 +212,8 @@ bool HttpRequest::parseHeaderLine(const std::string& line,
 
 HttpRequest* makeRequestByMethod(const std::string& method,
                                  const RequestContext& ctx) {
+  if (ctx.resolved.proxyEnabled)
+    return new ProxyRequest(ctx);
   if (method == "GET" || method == "HEAD")
     return new GetHeadRequest(ctx);
   if (method == "POST")
@@ -180,6 +223,19 @@ HttpRequest* makeRequestByMethod(const std::string& method,
   return 0;
 }
 
+//--------------------------PROXY--------------------------
+ProxyRequest::ProxyRequest(const RequestContext& ctx) : HttpRequest(ctx) {}
+
+ProxyRequest::~ProxyRequest() {}
+
+void ProxyRequest::handle(HttpResponse& res,
+                          sockaddr_in& clientAddr,
+                          int epollFd) {
+  (void)clientAddr;
+  (void)epollFd;
+  res.setErrorFromContext(502, _ctx);
+}
+
 //--------------------------GET--------------------------
 bool GetHeadRequest::validate(std::string& err) const {
   if (!body.empty()) {
@@ -221,30 +277,33 @@ void HttpRequest::handleGetOrHead(HttpResponse& res,
   struct stat fileStat;
   std::memset(&fileStat, 0, sizeof(fileStat));
 
-  if (stat(fullPath.c_str(), &fileStat) != 0) {
-    res.setErrorFromContext(404, _ctx);
-    return;
-  }
-
-  // Check if CGI is enabled (location overrides server setting) and file is not
-  // a directory
-  if (isCgiEnabledForRequest() && !S_ISDIR(fileStat.st_mode)) {
-    // Handle CGI requests
-    CgiHandle cgiHandler;
-    std::string scriptPath = _ctx.getFullPath(path);
-    if (scriptPath.empty()) {
+  // Check if CGI is enabled (location overrides server setting); the script
+  // lookup is served from the block's stat cache, directories fall through
+  if (isCgiEnabledForRequest()) {
+    if (fullPath.empty()) {
       res.setErrorFromContext(500, _ctx);
       return;
     }
-    struct stat scriptStat;
-    std::memset(&scriptStat, 0, sizeof(scriptStat));
-    if (stat(scriptPath.c_str(), &scriptStat) != 0 ||
-        !(scriptStat.st_mode & S_IXUSR)) {
+    CgiDispatch::ScriptStatus status =
+        getCgiDispatch().checkScript(fullPath, std::time(0));
+    if (status == CgiDispatch::SCRIPT_MISSING) {
+      res.setErrorFromContext(404, _ctx);
+      return;
+    }
+    if (status == CgiDispatch::SCRIPT_NOT_EXECUTABLE) {
       res.setErrorFromContext(403, _ctx);
       return;
     }
-    cgiHandler.buildCgiScript(scriptPath, _ctx, res, *this, clientAddr,
-                              epollFd);
+    if (status == CgiDispatch::SCRIPT_OK) {
+      CgiHandle cgiHandler;
+      cgiHandler.buildCgiScript(fullPath, _ctx, res, *this, clientAddr,
+                                epollFd);
+      return;
+    }
+  }
+
+  if (stat(fullPath.c_str(), &fileStat) != 0) {
+    res.setErrorFromContext(404, _ctx);
     return;
   }
 
@@ -282,15 +341,17 @@ void HttpRequest::handleGetOrHead(HttpResponse& res,
     }
   }
 
-  std::ifstream file(fullPath.c_str(), std::ios::binary);
-  if (!file.is_open()) {
+  // The body is not read here: the event loop sends it from the file
+  int file = open(fullPath.c_str(), O_RDONLY | O_CLOEXEC);
+  if (file == -1) {
     res.setErrorFromContext(403, _ctx);
     return;
   }
-
-  std::ostringstream content;
-  if (includeBody)
-    content << file.rdbuf();
+  if (fstat(file, &fileStat) != 0) {
+    close(file);
+    res.setErrorFromContext(500, _ctx);
+    return;
+  }
 
   std::ostringstream lenStream;
   lenStream << fileStat.st_size;
@@ -298,8 +359,10 @@ void HttpRequest::handleGetOrHead(HttpResponse& res,
   res.setStatus(200, "OK");
   res.setHeader("Content-Length", lenStream.str());
   res.setHeader("Content-Type", getMimeType(fullPath));
-  if (includeBody)
-    res.setBody(content.str());
+  if (includeBody && fileStat.st_size > 0)
+    res.setBodyFile(file, fileStat.st_size);
+  else
+    close(file);
 }
 
 //--------------------------POST--------------------------
@@ -341,10 +404,8 @@ void PostRequest::handle(HttpResponse& res,
       res.setErrorFromContext(500, _ctx);
       return;
     }
-    struct stat scriptStat;
-    std::memset(&scriptStat, 0, sizeof(scriptStat));  // Initialize to zero
-    if (stat(scriptPath.c_str(), &scriptStat) != 0 ||
-        !(scriptStat.st_mode & S_IXUSR)) {
+    if (getCgiDispatch().checkScript(scriptPath, std::time(0)) !=
+        CgiDispatch::SCRIPT_OK) {
       res.setErrorFromContext(403, _ctx);
       return;
     }
@@ -353,12 +414,7 @@ void PostRequest::handle(HttpResponse& res,
                               epollFd);
     return;
   }
-  std::string uploadDir;
-  if (_ctx.location && !_ctx.location->getUploadDir().empty()) {
-    uploadDir = _ctx.location->getUploadDir();
-  } else {
-    uploadDir = _ctx.server.getRoot();
-  }
+  std::string uploadDir = _ctx.getUploadDir();
 
   if (!uploadDir.empty() && uploadDir[uploadDir.size() - 1] != '/')
     uploadDir += '/';
@@ -1,13 +1,19 @@
 #include "HttpResponse.hpp"
+#include <unistd.h>
 #include <sstream>
 #include <string>
 #include "HttpRequest.hpp"
+#include "HttpUtils.hpp"
 #include "Server.hpp"
 #include "requestContext.hpp"
 
-HttpResponse::HttpResponse() : statusCode(200), statusMessage("OK") {}
+HttpResponse::HttpResponse()
+    : statusCode(200), statusMessage("OK"), bodyFile(-1), bodyFileSize(0) {}
 
-HttpResponse::~HttpResponse() {}
+HttpResponse::~HttpResponse() {
+  if (bodyFile != -1)
+    close(bodyFile);
+}
 
 void HttpResponse::setStatus(int code, const std::string& reason) {
   statusCode = code;
@@ -26,6 +32,20 @@ void HttpResponse::setVersion(const std::string& v) {
   version = v;
 }
 
+void HttpResponse::setBodyFile(int fd, off_t size) {
+  if (bodyFile != -1)
+    close(bodyFile);
+  bodyFile = fd;
+  bodyFileSize = size;
+}
+
+int HttpResponse::takeBodyFile(off_t& size) {
+  int fd = bodyFile;
+  size = bodyFileSize;
+  bodyFile = -1;
+  return fd;
+}
+
 void HttpResponse::addSetCookieHeader(const std::string& value) {
   setCookieHeaders.push_back(value);
 }
@@ -85,6 +105,8 @@ static std::string getStatusMessage(int code) {
       return "Method Not Allowed";
     case 413:
       return "Payload Too Large";
+    case 429:
+      return "Too Many Requests";
     case 431:
       return "Request Header Fields Too Large";
     // Server error codes
@@ -144,6 +166,21 @@ std::string HttpResponse::getHostHeader() const {
   return "";
 }
 
+// Header names coming from CGI scripts keep whatever case the script used
+std::string HttpResponse::getHeader(const std::string& key) const {
+  std::string wanted = toLowerStr(key);
+  std::map<std::string, std::string>::const_iterator it = headers.begin();
+  for (; it != headers.end(); ++it) {
+    if (toLowerStr(it->first) == wanted)
+      return it->second;
+  }
+  return "";
+}
+
+int HttpResponse::getStatusCode() const {
+  return statusCode;
+}
+
 void HttpResponse::setRedirect(int code, const std::string& location) {
   setStatus(code, getStatusMessage(code));
   setHeader("Location", location);
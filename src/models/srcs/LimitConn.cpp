@@ -0,0 +1,78 @@
+#include <BaseBlock.hpp>
+#include <ConfigCache.hpp>
+#include <LimitConn.hpp>
+#include <cstdlib>
+#include <stdexcept>
+
+LimitConnZone::LimitConnZone() : name(), key(), size(0) {}
+
+LimitConnZone LimitConnZone::parse(const std::vector<std::string>& args) {
+  LimitConnZone zone;
+  if (args.empty())
+    throw std::runtime_error("Missing key for 'limit_conn_zone'");
+  if (args[0] != "$binary_remote_addr" && args[0] != "$remote_addr" &&
+      args[0] != "$server_name")
+    throw std::runtime_error("Unsupported key for 'limit_conn_zone': " +
+                             args[0]);
+  zone.key = args[0];
+
+  for (size_t i = 1; i < args.size(); ++i) {
+    if (args[i].compare(0, 5, "zone=") != 0)
+      throw std::runtime_error("Unknown limit_conn_zone parameter: " +
+                               args[i]);
+    std::string value = args[i].substr(5);
+    std::string::size_type colon = value.find(':');
+    if (colon == std::string::npos)
+      throw std::runtime_error("Missing size for zone " + value);
+    zone.name = value.substr(0, colon);
+    std::string size = value.substr(colon + 1);
+    try {
+      zone.size = BaseBlock::parseSize(size);
+    } catch (const std::exception&) {
+      throw std::runtime_error("Invalid value for 'zone': " + value);
+    }
+  }
+  if (zone.name.empty())
+    throw std::runtime_error("Missing zone for 'limit_conn_zone'");
+  if (!zone.size)
+    throw std::runtime_error("Zone " + zone.name + " has no room");
+  return zone;
+}
+
+LimitConnRule::LimitConnRule() : zoneName(), zone(), limit(0) {}
+
+LimitConnRule LimitConnRule::parse(const std::vector<std::string>& args) {
+  LimitConnRule rule;
+  if (args.size() != 2)
+    throw std::runtime_error("Invalid arguments for 'limit_conn'");
+  rule.zoneName = args[0];
+  char* end = NULL;
+  rule.limit = std::strtoul(args[1].c_str(), &end, 10);
+  if (*end || !rule.limit)
+    throw std::runtime_error("Invalid value for 'limit_conn': " + args[1]);
+  return rule;
+}
+
+void LimitConnRule::link(const std::map<std::string, LimitConnZone>& zones) {
+  std::map<std::string, LimitConnZone>::const_iterator it =
+      zones.find(this->zoneName);
+  if (it == zones.end())
+    throw std::runtime_error("Unknown limit_conn zone: " + this->zoneName);
+  this->zone = it->second;
+}
+
+void LimitConnRule::writeTo(CacheWriter& out) const {
+  out.str(this->zoneName);
+  out.str(this->zone.name);
+  out.str(this->zone.key);
+  out.u64(this->zone.size);
+  out.u64(this->limit);
+}
+
+void LimitConnRule::readFrom(CacheReader& in) {
+  this->zoneName = in.str();
+  this->zone.name = in.str();
+  this->zone.key = in.str();
+  this->zone.size = in.u64();
+  this->limit = in.u64();
+}
@@ -0,0 +1,134 @@
+#include <BaseBlock.hpp>
+#include <ConfigCache.hpp>
+#include <LimitReq.hpp>
+#include <cctype>
+#include <cstdlib>
+#include <stdexcept>
+
+LimitReqZone::LimitReqZone() : name(), key(), size(0), rate(0) {}
+
+// The request variables a zone key may use
+static bool isKeyVariable(const std::string& name) {
+  return name == "binary_remote_addr" || name == "remote_addr" ||
+         name == "host" || name == "uri" || name == "request_uri" ||
+         name == "args" || name == "request_method" ||
+         (name.compare(0, 7, "cookie_") == 0 && name.size() > 7) ||
+         (name.compare(0, 5, "http_") == 0 && name.size() > 5);
+}
+
+static void checkKey(const std::string& key) {
+  if (key.empty() || key.find('$') == std::string::npos)
+    throw std::runtime_error("Missing key for 'limit_req_zone'");
+  for (std::string::size_type pos = key.find('$'); pos != std::string::npos;
+       pos = key.find('$', pos + 1)) {
+    std::string::size_type end = pos + 1;
+    while (end < key.size() &&
+           (std::isalnum(static_cast<unsigned char>(key[end])) ||
+            key[end] == '_'))
+      ++end;
+    if (!isKeyVariable(key.substr(pos + 1, end - pos - 1)))
+      throw std::runtime_error("Unsupported variable in 'limit_req_zone': " +
+                               key.substr(pos, end - pos));
+  }
+}
+
+// "10r/s" or "30r/m"
+static uint64_t parseRate(const std::string& value) {
+  char* end = NULL;
+  unsigned long count = std::strtoul(value.c_str(), &end, 10);
+  std::string unit(end);
+  if (end == value.c_str() || !count || (unit != "r/s" && unit != "r/m"))
+    throw std::runtime_error("Invalid value for 'rate': " + value);
+  uint64_t rate = static_cast<uint64_t>(count) * 1000;
+  if (unit == "r/m")
+    rate /= 60;
+  return rate ? rate : 1;
+}
+
+LimitReqZone LimitReqZone::parse(const std::vector<std::string>& args) {
+  LimitReqZone zone;
+  if (args.empty())
+    throw std::runtime_error("Missing key for 'limit_req_zone'");
+  checkKey(args[0]);
+  zone.key = args[0];
+
+  for (size_t i = 1; i < args.size(); ++i) {
+    std::string::size_type eq = args[i].find('=');
+    std::string name = args[i].substr(0, eq);
+    std::string value = eq == std::string::npos ? "" : args[i].substr(eq + 1);
+    if (name == "zone") {
+      std::string::size_type colon = value.find(':');
+      if (colon == std::string::npos)
+        throw std::runtime_error("Missing size for zone " + value);
+      zone.name = value.substr(0, colon);
+      std::string size = value.substr(colon + 1);
+      try {
+        zone.size = BaseBlock::parseSize(size);
+      } catch (const std::exception&) {
+        throw std::runtime_error("Invalid value for 'zone': " + value);
+      }
+    } else if (name == "rate") {
+      zone.rate = parseRate(value);
+    } else {
+      throw std::runtime_error("Unknown limit_req_zone parameter: " + args[i]);
+    }
+  }
+  if (zone.name.empty())
+    throw std::runtime_error("Missing zone for 'limit_req_zone'");
+  if (!zone.size)
+    throw std::runtime_error("Zone " + zone.name + " has no room");
+  if (!zone.rate)
+    throw std::runtime_error("Missing rate for 'limit_req_zone'");
+  return zone;
+}
+
+LimitReqRule::LimitReqRule() : zoneName(), zone(), burst(0), nodelay(false) {}
+
+LimitReqRule LimitReqRule::parse(const std::vector<std::string>& args) {
+  LimitReqRule rule;
+  for (size_t i = 0; i < args.size(); ++i) {
+    if (args[i] == "nodelay") {
+      rule.nodelay = true;
+    } else if (args[i].compare(0, 5, "zone=") == 0 && args[i].size() > 5) {
+      rule.zoneName = args[i].substr(5);
+    } else if (args[i].compare(0, 6, "burst=") == 0) {
+      char* end = NULL;
+      rule.burst = std::strtoul(args[i].c_str() + 6, &end, 10);
+      if (*end || end == args[i].c_str() + 6)
+        throw std::runtime_error("Invalid value for 'burst': " + args[i]);
+    } else {
+      throw std::runtime_error("Unknown limit_req parameter: " + args[i]);
+    }
+  }
+  if (rule.zoneName.empty())
+    throw std::runtime_error("Missing zone for 'limit_req'");
+  return rule;
+}
+
+void LimitReqRule::link(const std::map<std::string, LimitReqZone>& zones) {
+  std::map<std::string, LimitReqZone>::const_iterator it =
+      zones.find(this->zoneName);
+  if (it == zones.end())
+    throw std::runtime_error("Unknown limit_req zone: " + this->zoneName);
+  this->zone = it->second;
+}
+
+void LimitReqRule::writeTo(CacheWriter& out) const {
+  out.str(this->zoneName);
+  out.str(this->zone.name);
+  out.str(this->zone.key);
+  out.u64(this->zone.size);
+  out.u64(this->zone.rate);
+  out.u64(this->burst);
+  out.u8(this->nodelay);
+}
+
+void LimitReqRule::readFrom(CacheReader& in) {
+  this->zoneName = in.str();
+  this->zone.name = in.str();
+  this->zone.key = in.str();
+  this->zone.size = in.u64();
+  this->zone.rate = in.u64();
+  this->burst = in.u64();
+  this->nodelay = in.u8();
+}
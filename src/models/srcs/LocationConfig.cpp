@@ -1,6 +1,6 @@
 #include <LocationConfig.hpp>
 
-LocationConfig::LocationConfig() : BaseBlock(), _path("/"), _matchType(PREFIX)
+LocationConfig::LocationConfig() : BaseBlock(), _path("/"), _matchType(PREFIX), _cgiStatus(false), _hasProxyPass(false), _proxyPass(), _hasProxyCache(false), _proxyCache(), _proxyBuffering()
 {
     // Default allowed methods
     _methods.push_back("GET");
@@ -8,7 +8,7 @@ LocationConfig::LocationConfig() : BaseBlock(), _path("/"), _matchType(PREFIX)
     _methods.push_back("DELETE");
 }
 
-LocationConfig::LocationConfig(const std::string &path) : BaseBlock(), _path(path), _matchType(PREFIX)
+LocationConfig::LocationConfig(const std::string &path) : BaseBlock(), _path(path), _matchType(PREFIX), _cgiStatus(false), _hasProxyPass(false), _proxyPass(), _hasProxyCache(false), _proxyCache(), _proxyBuffering()
 {
     // Default allowed methods
     _methods.push_back("GET");
@@ -16,7 +16,7 @@ LocationConfig::LocationConfig(const std::string &path) : BaseBlock(), _path(pat
     _methods.push_back("DELETE");
 }
 
-LocationConfig::LocationConfig(const std::string &path, MatchType matchType) : BaseBlock(), _path(path), _matchType(matchType)
+LocationConfig::LocationConfig(const std::string &path, MatchType matchType) : BaseBlock(), _path(path), _matchType(matchType), _cgiStatus(false), _hasProxyPass(false), _proxyPass(), _hasProxyCache(false), _proxyCache(), _proxyBuffering()
 {
     // Default allowed methods
     _methods.push_back("GET");
@@ -24,7 +24,7 @@ LocationConfig::LocationConfig(const std::string &path, MatchType matchType) : B
     _methods.push_back("DELETE");
 }
 
-LocationConfig::LocationConfig(const LocationConfig &obj) : BaseBlock(obj), _path(obj._path), _matchType(obj._matchType), _methods(obj._methods), _uploadDir(obj._uploadDir), _chunked_transfer_encoding(obj._chunked_transfer_encoding)
+LocationConfig::LocationConfig(const LocationConfig &obj) : BaseBlock(obj), _path(obj._path), _matchType(obj._matchType), _methods(obj._methods), _uploadDir(obj._uploadDir), _chunked_transfer_encoding(obj._chunked_transfer_encoding), _cgiStatus(obj._cgiStatus), _hasProxyPass(obj._hasProxyPass), _proxyPass(obj._proxyPass), _hasProxyCache(obj._hasProxyCache), _proxyCache(obj._proxyCache), _proxyBuffering(obj._proxyBuffering)
 {
 }
 
@@ -55,6 +55,112 @@ const std::string& LocationConfig::getUploadDir() const {
     return _uploadDir;
 }
 
+void LocationConfig::setCgiStatus(bool enabled)
+{
+    this->_cgiStatus = enabled;
+}
+
+bool LocationConfig::isCgiStatus() const
+{
+    return this->_cgiStatus;
+}
+
+// Throws when the target is malformed
+void LocationConfig::setProxyPass(const std::string &spec)
+{
+    this->_proxyPass = ProxyPass::parse(spec);
+    this->_hasProxyPass = true;
+}
+
+void LocationConfig::setProxyCache(const std::string &zone)
+{
+    this->_hasProxyCache = zone != "off";
+    this->_proxyCache.zoneName = this->_hasProxyCache ? zone : "";
+}
+
+void LocationConfig::setProxyCacheKey(const std::string &key)
+{
+    this->_proxyCache.setKey(key);
+}
+
+void LocationConfig::addProxyCacheValid(const std::vector<std::string> &args)
+{
+    this->_proxyCache.addValid(args);
+}
+
+void LocationConfig::setProxyCacheUseStale(const std::vector<std::string> &args)
+{
+    this->_proxyCache.setUseStale(args);
+}
+
+void LocationConfig::setProxyCacheLock(const std::string &value)
+{
+    this->_proxyCache.setLock(value);
+}
+
+void LocationConfig::setProxyCacheLockTimeout(const std::string &value)
+{
+    this->_proxyCache.setLockTimeout(value);
+}
+
+void LocationConfig::setProxyBuffering(const std::string &value)
+{
+    this->_proxyBuffering.setEnabled(value);
+}
+
+void LocationConfig::setProxyBuffers(const std::vector<std::string> &args)
+{
+    this->_proxyBuffering.setBuffers(args);
+}
+
+void LocationConfig::setProxyMaxTempFileSize(const std::string &value)
+{
+    this->_proxyBuffering.setMaxTempFileSize(value);
+}
+
+void LocationConfig::linkProxyPass(const std::map<std::string, UpstreamGroup> &upstreams,
+                                   const std::map<std::string, ProxyCacheZone> &zones)
+{
+    try
+    {
+        if (this->_hasProxyCache && !this->_hasProxyPass)
+            throw std::runtime_error("proxy_cache without proxy_pass");
+        if (this->_hasProxyPass)
+            this->_proxyPass.link(upstreams);
+        if (this->_hasProxyCache)
+            this->_proxyCache.link(zones);
+    }
+    catch (const std::exception &e)
+    {
+        throw std::runtime_error("location " + this->_path + ": " + e.what());
+    }
+}
+
+bool LocationConfig::hasProxyPass() const
+{
+    return this->_hasProxyPass;
+}
+
+const ProxyPass &LocationConfig::getProxyPass() const
+{
+    return this->_proxyPass;
+}
+
+bool LocationConfig::hasProxyCache() const
+{
+    return this->_hasProxyCache;
+}
+
+const ProxyCacheRule &LocationConfig::getProxyCache() const
+{
+    return this->_proxyCache;
+}
+
+const ProxyBuffering &LocationConfig::getProxyBuffering() const
+{
+    return this->_proxyBuffering;
+}
+
 void LocationConfig::addMethod(const std::string &method)
 {
     // Check if method already exists to avoid duplicates
@@ -95,4 +201,39 @@ bool LocationConfig::isMethodAllowed(const std::string &method) const
             return true;
     }
     return false;
-}
\ No newline at end of file
+}
+void LocationConfig::writeTo(CacheWriter &out) const
+{
+    writeBlock(out);
+    out.str(_path);
+    out.u8(_matchType);
+    out.strings(_methods);
+    out.str(_uploadDir);
+    out.u8(_chunked_transfer_encoding);
+    out.u8(_cgiStatus);
+    out.u8(_hasProxyPass);
+    if (_hasProxyPass)
+        _proxyPass.writeTo(out);
+    out.u8(_hasProxyCache);
+    if (_hasProxyCache)
+        _proxyCache.writeTo(out);
+    _proxyBuffering.writeTo(out);
+}
+
+void LocationConfig::readFrom(CacheReader &in)
+{
+    readBlock(in);
+    _path = in.str();
+    _matchType = static_cast<MatchType>(in.u8());
+    _methods = in.strings();
+    _uploadDir = in.str();
+    _chunked_transfer_encoding = in.u8();
+    _cgiStatus = in.u8();
+    _hasProxyPass = in.u8();
+    if (_hasProxyPass)
+        _proxyPass.readFrom(in);
+    _hasProxyCache = in.u8();
+    if (_hasProxyCache)
+        _proxyCache.readFrom(in);
+    _proxyBuffering.readFrom(in);
+}
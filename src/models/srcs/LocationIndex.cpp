@@ -0,0 +1,135 @@
+#include <LocationIndex.hpp>
+#include <stdexcept>
+
+LocationIndex::LocationIndex()
+    : _exact(), _nodes(1), _regexes(), _regexLocations() {
+  this->_nodes[0].location = -1;
+}
+
+LocationIndex::~LocationIndex() {}
+
+// Radix trie insert: walks down shared labels and splits an edge where the
+// new path diverges from it
+void LocationIndex::insertPrefix(const std::string& path, size_t location) {
+  size_t node = 0;
+  size_t pos = 0;
+
+  while (true) {
+    if (pos == path.size()) {
+      if (this->_nodes[node].location != -1)
+        throw std::runtime_error("Duplicate location: " + path);
+      this->_nodes[node].location = location;
+      return;
+    }
+
+    size_t child = 0;
+    bool found = false;
+    for (size_t i = 0; i < this->_nodes[node].children.size(); ++i) {
+      child = this->_nodes[node].children[i];
+      if (this->_nodes[child].label[0] == path[pos]) {
+        found = true;
+        break;
+      }
+    }
+    if (!found) {
+      PrefixNode leaf;
+      leaf.label = path.substr(pos);
+      leaf.location = location;
+      this->_nodes.push_back(leaf);
+      this->_nodes[node].children.push_back(this->_nodes.size() - 1);
+      return;
+    }
+
+    const std::string label = this->_nodes[child].label;
+    size_t common = 0;
+    while (common < label.size() && pos + common < path.size() &&
+           label[common] == path[pos + common])
+      ++common;
+    if (common < label.size()) {
+      // Split "label" into "label[0, common)" -> "label[common, end)"
+      PrefixNode tail;
+      tail.label = label.substr(common);
+      tail.location = this->_nodes[child].location;
+      tail.children = this->_nodes[child].children;
+      this->_nodes.push_back(tail);
+      this->_nodes[child].label = label.substr(0, common);
+      this->_nodes[child].location = -1;
+      this->_nodes[child].children.assign(1, this->_nodes.size() - 1);
+    }
+    node = child;
+    pos += common;
+  }
+}
+
+long LocationIndex::longestPrefix(const std::string& path) const {
+  long best = this->_nodes[0].location;
+  size_t node = 0;
+  size_t pos = 0;
+
+  while (pos < path.size()) {
+    const PrefixNode* next = NULL;
+    for (size_t i = 0; i < this->_nodes[node].children.size(); ++i) {
+      size_t child = this->_nodes[node].children[i];
+      if (this->_nodes[child].label[0] == path[pos]) {
+        next = &this->_nodes[child];
+        node = child;
+        break;
+      }
+    }
+    if (!next || path.compare(pos, next->label.size(), next->label) != 0)
+      break;
+    pos += next->label.size();
+    if (next->location != -1)
+      best = next->location;
+  }
+  return best;
+}
+
+void LocationIndex::build(const std::vector<LocationConfig>& locations) {
+  this->_exact.clear();
+  this->_nodes.assign(1, PrefixNode());
+  this->_nodes[0].location = -1;
+  this->_regexes = RegexSet();
+  this->_regexLocations.clear();
+
+  for (size_t i = 0; i < locations.size(); ++i) {
+    const std::string& path = locations[i].getPath();
+    switch (locations[i].getMatchType()) {
+      case EXACT:
+        if (!this->_exact.insert(path, i))
+          throw std::runtime_error("Duplicate location: = " + path);
+        break;
+      case PREFIX:
+      case PRIORITY_PREFIX:
+        insertPrefix(path, i);
+        break;
+      case REGEX_CASE:
+      case REGEX_ICASE:
+        this->_regexes.add(path, locations[i].getMatchType() == REGEX_ICASE);
+        this->_regexLocations.push_back(i);
+        break;
+      case NAMED:
+        break;
+    }
+  }
+  this->_regexes.build();
+}
+
+// Returns the index of the matching location, or -1. captures is filled only
+// when a regex location wins.
+long LocationIndex::find(const std::string& path,
+                         const std::vector<LocationConfig>& locations,
+                         std::vector<std::string>* captures) const {
+  const size_t* exact = this->_exact.find(path);
+  if (exact)
+    return *exact;
+
+  long prefix = longestPrefix(path);
+  if (prefix != -1 && locations[prefix].getMatchType() == PRIORITY_PREFIX)
+    return prefix;
+
+  long regex = this->_regexes.match(path, captures);
+  if (regex != -1)
+    return this->_regexLocations[regex];
+  return prefix;
+}
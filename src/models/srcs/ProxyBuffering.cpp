@@ -0,0 +1,74 @@
+#include <BaseBlock.hpp>
+#include <ConfigCache.hpp>
+#include <ProxyBuffering.hpp>
+#include <cstdlib>
+#include <stdexcept>
+
+// Eight 8k buffers, the 64k a client could hold back before, and a 1g
+// temporary file
+#define PROXY_DEFAULT_BUFFERS 8
+#define PROXY_DEFAULT_BUFFER_SIZE 8192
+#define PROXY_DEFAULT_MAX_TEMP_FILE_SIZE (1024ULL * 1024 * 1024)
+
+ProxyBuffering::ProxyBuffering()
+    : enabled(true),
+      buffers(PROXY_DEFAULT_BUFFERS),
+      bufferSize(PROXY_DEFAULT_BUFFER_SIZE),
+      maxTempFileSize(PROXY_DEFAULT_MAX_TEMP_FILE_SIZE) {}
+
+void ProxyBuffering::setEnabled(const std::string& value) {
+  if (value == "on")
+    this->enabled = true;
+  else if (value == "off")
+    this->enabled = false;
+  else
+    throw std::runtime_error("Invalid value for 'proxy_buffering': " + value);
+}
+
+void ProxyBuffering::setBuffers(const std::vector<std::string>& args) {
+  if (args.size() != 2)
+    throw std::runtime_error("Invalid arguments for 'proxy_buffers'");
+  char* end = NULL;
+  long count = std::strtol(args[0].c_str(), &end, 10);
+  if (*end || count < 1 || count > 1024)
+    throw std::runtime_error("Invalid value for 'proxy_buffers': " + args[0]);
+  std::string size(args[1]);
+  size_t bytes;
+  try {
+    bytes = BaseBlock::parseSize(size);
+  } catch (const std::exception&) {
+    throw std::runtime_error("Invalid value for 'proxy_buffers': " + args[1]);
+  }
+  if (bytes < 1024 || bytes > 16 * 1024 * 1024)
+    throw std::runtime_error("Invalid value for 'proxy_buffers': " + args[1]);
+  this->buffers = count;
+  this->bufferSize = bytes;
+}
+
+void ProxyBuffering::setMaxTempFileSize(const std::string& value) {
+  std::string size(value);
+  try {
+    this->maxTempFileSize = BaseBlock::parseSize(size);
+  } catch (const std::exception&) {
+    throw std::runtime_error(
+        "Invalid value for 'proxy_max_temp_file_size': " + value);
+  }
+}
+
+size_t ProxyBuffering::memoryLimit() const {
+  return this->buffers * this->bufferSize;
+}
+
+void ProxyBuffering::writeTo(CacheWriter& out) const {
+  out.u8(this->enabled);
+  out.u64(this->buffers);
+  out.u64(this->bufferSize);
+  out.u64(this->maxTempFileSize);
+}
+
+void ProxyBuffering::readFrom(CacheReader& in) {
+  this->enabled = in.u8();
+  this->buffers = in.u64();
+  this->bufferSize = in.u64();
+  this->maxTempFileSize = in.u64();
+}
@@ -0,0 +1,379 @@
+#include "ProxyCache.hpp"
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#define PROXY_CACHE_MAGIC 0x43505357u  // "WSPC"
+#define PROXY_CACHE_FORMAT 1
+// Temporary files older than this are left over from a crash
+#define PROXY_CACHE_TEMP_AGE 600
+
+// Start of every cache file, in host byte order; magic stays 0 until the
+// response is complete
+struct FileHeader {
+  uint32_t magic;
+  uint32_t format;
+  uint64_t created;
+  uint64_t expires;
+  uint32_t keyLength;
+  uint32_t headLength;
+  uint64_t bodyStart;
+};
+
+static uint64_t fnv1a(const std::string& value, uint64_t h) {
+  for (size_t i = 0; i < value.size(); ++i) {
+    h ^= static_cast<unsigned char>(value[i]);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// 128 bits from two differently seeded FNV-1a passes: collisions between
+// keys are out of the question and a file name is a plain hex string
+static std::string hashKey(const std::string& key) {
+  uint64_t parts[2] = {fnv1a(key, 14695981039346656037ULL),
+                       fnv1a(key, 0x84222325cbf29ce4ULL ^ key.size())};
+  static const char digits[] = "0123456789abcdef";
+  std::string hex;
+  for (int part = 0; part < 2; ++part)
+    for (int shift = 60; shift >= 0; shift -= 4)
+      hex += digits[(parts[part] >> shift) & 0xf];
+  return hex;
+}
+
+static void makeDirectory(const std::string& path) {
+  if (mkdir(path.c_str(), 0700) == -1 && errno != EEXIST)
+    throw std::runtime_error("Cannot create cache directory " + path + ": " +
+                             std::strerror(errno));
+}
+
+static bool readHeader(int fd, FileHeader& header) {
+  return pread(fd, &header, sizeof(header), 0) ==
+             static_cast<ssize_t>(sizeof(header)) &&
+         header.magic == PROXY_CACHE_MAGIC &&
+         header.format == PROXY_CACHE_FORMAT &&
+         header.bodyStart ==
+             sizeof(header) + header.keyLength + header.headLength + 2;
+}
+
+ProxyCache::Fill::Fill(const std::string& key, const std::string& temp,
+                       int fd, time_t created, time_t expires)
+    : _key(key),
+      _temp(temp),
+      _fd(fd),
+      _created(created),
+      _expires(expires),
+      _written(0),
+      _headLength(0),
+      _failed(false) {}
+
+ProxyCache::Fill::~Fill() {
+  if (this->_fd != -1) {
+    close(this->_fd);
+    unlink(this->_temp.c_str());
+  }
+}
+
+void ProxyCache::Fill::write(const char* data, size_t length) {
+  if (this->_failed)
+    return;
+  if (!this->_written) {
+    static const char blank[] = "\r\n\r\n";
+    const char* end = std::search(data, data + length, blank, blank + 4);
+    if (end == data + length) {
+      this->_failed = true;
+      return;
+    }
+    this->_headLength = end - data + 2;
+  }
+  while (length) {
+    ssize_t written = ::write(this->_fd, data, length);
+    if (written <= 0) {
+      if (written == -1 && errno == EINTR)
+        continue;
+      // Disk full or gone: the client still gets its response, the cache
+      // just does not keep it
+      this->_failed = true;
+      return;
+    }
+    data += written;
+    length -= written;
+    this->_written += written;
+  }
+}
+
+ProxyCache::ProxyCache(const ProxyCacheZone& zone)
+    : _zone(zone), _entries(), _lru(), _size(0), _temps(0), _lastManaged(0) {
+  std::string path;
+  std::istringstream parts(zone.path);
+  std::string part;
+  if (!zone.path.empty() && zone.path[0] == '/')
+    path = "/";
+  while (std::getline(parts, part, '/')) {
+    if (part.empty())
+      continue;
+    path += part;
+    makeDirectory(path);
+    path += "/";
+  }
+  time_t now = time(NULL);
+  load(zone.path, 0, now);
+  std::cout << "Proxy cache " << zone.name << ": " << this->_entries.size()
+            << " entr" << (this->_entries.size() == 1 ? "y" : "ies") << ", "
+            << this->_size << " bytes in " << zone.path << std::endl;
+}
+
+ProxyCache::~ProxyCache() {}
+
+void ProxyCache::setLimits(const ProxyCacheZone& zone) {
+  this->_zone.maxSize = zone.maxSize;
+  this->_zone.maxEntries = zone.maxEntries;
+  this->_zone.inactive = zone.inactive;
+}
+
+const ProxyCacheZone& ProxyCache::getZone() const {
+  return this->_zone;
+}
+
+// dir/c/a3/...e4fa3ca3c for levels=1:2: the subdirectories are taken from
+// the end of the hash
+std::string ProxyCache::pathFor(const std::string& key) const {
+  std::string hash = hashKey(key);
+  std::string path = this->_zone.path;
+  size_t end = hash.size();
+  for (size_t i = 0; i < this->_zone.levels.size(); ++i) {
+    end -= this->_zone.levels[i];
+    path += "/" + hash.substr(end, this->_zone.levels[i]);
+  }
+  return path + "/" + hash;
+}
+
+// Rebuilds the index from the files under dir; leftovers of writes that
+// never completed are removed
+void ProxyCache::load(const std::string& dir, unsigned depth, time_t now) {
+  DIR* handle = opendir(dir.c_str());
+  if (!handle)
+    return;
+  struct dirent* item;
+  while ((item = readdir(handle)) != NULL) {
+    std::string name = item->d_name;
+    if (name == "." || name == "..")
+      continue;
+    std::string path = dir + "/" + name;
+    struct stat st;
+    if (lstat(path.c_str(), &st) == -1)
+      continue;
+    if (S_ISDIR(st.st_mode)) {
+      if (depth < this->_zone.levels.size())
+        load(path, depth + 1, now);
+      continue;
+    }
+    if (!S_ISREG(st.st_mode))
+      continue;
+    if (name.compare(0, 4, "tmp.") == 0) {
+      if (now - st.st_mtime > PROXY_CACHE_TEMP_AGE)
+        unlink(path.c_str());
+      continue;
+    }
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+      continue;
+    FileHeader header;
+    std::string key;
+    bool valid = readHeader(fd, header) &&
+                 header.bodyStart <= static_cast<uint64_t>(st.st_size);
+    if (valid) {
+      key.resize(header.keyLength);
+      valid = header.keyLength &&
+              pread(fd, &key[0], key.size(), sizeof(header)) ==
+                  static_cast<ssize_t>(key.size()) &&
+              pathFor(key) == path;
+    }
+    close(fd);
+    if (!valid) {
+      unlink(path.c_str());
+      continue;
+    }
+
+    Entry entry;
+    entry.file = path;
+    entry.size = st.st_size;
+    entry.created = header.created;
+    entry.expires = header.expires;
+    entry.lastUsed = now;
+    entry.updating = false;
+    insert(key, entry);
+  }
+  closedir(handle);
+}
+
+// Takes the key's place in the index; a previous entry's file was already
+// replaced by the rename, so only its accounting goes
+void ProxyCache::insert(const std::string& key, const Entry& entry) {
+  std::map<std::string, Entry>::iterator it = this->_entries.find(key);
+  if (it != this->_entries.end()) {
+    this->_size -= it->second.size;
+    this->_lru.erase(it->second.lruPos);
+    this->_entries.erase(it);
+  }
+  this->_lru.push_front(key);
+  Entry& stored = this->_entries[key];
+  stored = entry;
+  stored.lruPos = this->_lru.begin();
+  this->_size += entry.size;
+}
+
+void ProxyCache::erase(std::map<std::string, Entry>::iterator it) {
+  unlink(it->second.file.c_str());
+  this->_size -= it->second.size;
+  this->_lru.erase(it->second.lruPos);
+  this->_entries.erase(it);
+}
+
+ProxyCache::Entry* ProxyCache::find(const std::string& key, time_t now) {
+  std::map<std::string, Entry>::iterator it = this->_entries.find(key);
+  if (it == this->_entries.end())
+    return NULL;
+  it->second.lastUsed = now;
+  this->_lru.splice(this->_lru.begin(), this->_lru, it->second.lruPos);
+  return &it->second;
+}
+
+bool ProxyCache::isFresh(const Entry& entry, time_t now) {
+  return now < entry.expires;
+}
+
+void ProxyCache::setUpdating(const std::string& key, bool updating) {
+  std::map<std::string, Entry>::iterator it = this->_entries.find(key);
+  if (it != this->_entries.end())
+    it->second.updating = updating;
+}
+
+int ProxyCache::open(const std::string& key,
+                     std::string& head,
+                     off_t& bodyStart,
+                     off_t& bodyEnd) {
+  std::map<std::string, Entry>::iterator it = this->_entries.find(key);
+  if (it == this->_entries.end())
+    return -1;
+
+  int fd = ::open(it->second.file.c_str(), O_RDONLY | O_CLOEXEC);
+  FileHeader header;
+  struct stat st;
+  if (fd != -1 && readHeader(fd, header) && header.keyLength == key.size() &&
+      fstat(fd, &st) == 0 &&
+      header.bodyStart <= static_cast<uint64_t>(st.st_size)) {
+    // Key and head sit next to each other: one read for both
+    std::string stored(header.keyLength + header.headLength, '\0');
+    if (pread(fd, &stored[0], stored.size(), sizeof(header)) ==
+            static_cast<ssize_t>(stored.size()) &&
+        stored.compare(0, key.size(), key) == 0) {
+      head = stored.substr(key.size());
+      bodyStart = header.bodyStart;
+      bodyEnd = st.st_size;
+      return fd;
+    }
+  }
+  if (fd != -1)
+    close(fd);
+  erase(it);
+  return -1;
+}
+
+void ProxyCache::remove(const std::string& key) {
+  std::map<std::string, Entry>::iterator it = this->_entries.find(key);
+  if (it != this->_entries.end())
+    erase(it);
+}
+
+ProxyCache::Fill* ProxyCache::startFill(const std::string& key,
+                                        time_t expires) {
+  std::ostringstream temp;
+  temp << this->_zone.path << "/tmp." << getpid() << "." << ++this->_temps;
+  int fd = ::open(temp.str().c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd == -1)
+    return NULL;
+
+  Fill* fill = new Fill(key, temp.str(), fd, time(NULL), expires);
+  // Placeholder header, rewritten on commit
+  FileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  if (::write(fd, &header, sizeof(header)) !=
+          static_cast<ssize_t>(sizeof(header)) ||
+      ::write(fd, key.data(), key.size()) != static_cast<ssize_t>(key.size()))
+    fill->_failed = true;
+  return fill;
+}
+
+void ProxyCache::commit(Fill* fill) {
+  uint64_t size = sizeof(FileHeader) + fill->_key.size() + fill->_written;
+  if (fill->_failed || !fill->_written ||
+      (this->_zone.maxSize && size > this->_zone.maxSize))
+    return;
+
+  FileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  header.magic = PROXY_CACHE_MAGIC;
+  header.format = PROXY_CACHE_FORMAT;
+  header.created = fill->_created;
+  header.expires = fill->_expires;
+  header.keyLength = fill->_key.size();
+  header.headLength = fill->_headLength;
+  header.bodyStart = sizeof(header) + header.keyLength + header.headLength + 2;
+  if (pwrite(fill->_fd, &header, sizeof(header), 0) !=
+      static_cast<ssize_t>(sizeof(header)))
+    return;
+
+  std::string path = pathFor(fill->_key);
+  try {
+    for (std::string::size_type slash = path.find('/', this->_zone.path.size() + 1);
+         slash != std::string::npos; slash = path.find('/', slash + 1))
+      makeDirectory(path.substr(0, slash));
+  } catch (const std::exception& e) {
+    std::cerr << "Proxy cache " << this->_zone.name << ": " << e.what() << '\n';
+    return;
+  }
+  if (rename(fill->_temp.c_str(), path.c_str()) == -1)
+    return;
+  close(fill->_fd);
+  fill->_fd = -1;
+
+  Entry entry;
+  entry.file = path;
+  entry.size = size;
+  entry.created = fill->_created;
+  entry.expires = fill->_expires;
+  entry.lastUsed = time(NULL);
+  entry.updating = false;
+  insert(fill->_key, entry);
+}
+
+void ProxyCache::manage(time_t now) {
+  if (now == this->_lastManaged)
+    return;
+  this->_lastManaged = now;
+
+  // The LRU list is ordered by last use, so the inactive ones are its tail
+  while (!this->_lru.empty()) {
+    std::map<std::string, Entry>::iterator oldest =
+        this->_entries.find(this->_lru.back());
+    if (now - oldest->second.lastUsed < this->_zone.inactive)
+      break;
+    erase(oldest);
+  }
+  while (!this->_lru.empty() &&
+         ((this->_zone.maxSize && this->_size > this->_zone.maxSize) ||
+          (this->_zone.maxEntries &&
+           this->_entries.size() > this->_zone.maxEntries)))
+    erase(this->_entries.find(this->_lru.back()));
+}
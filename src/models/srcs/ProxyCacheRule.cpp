@@ -0,0 +1,278 @@
+#include <BaseBlock.hpp>
+#include <ConfigCache.hpp>
+#include <ProxyCacheRule.hpp>
+#include <cctype>
+#include <cstdlib>
+#include <stdexcept>
+
+// Index entries per megabyte of keys_zone, as with nginx
+#define PROXY_CACHE_KEYS_PER_MB 8000
+#define PROXY_CACHE_DEFAULT_LOCK_TIMEOUT 5
+
+ProxyCacheZone::ProxyCacheZone()
+    : name(), path(), levels(), maxSize(0), maxEntries(0), inactive(600) {}
+
+static time_t parseTime(const std::string& name, const std::string& value) {
+  try {
+    return BaseBlock::parseSeconds(value);
+  } catch (const std::exception&) {
+    throw std::runtime_error("Invalid value for '" + name + "': " + value);
+  }
+}
+
+static uint64_t parseBytes(const std::string& name, const std::string& value) {
+  std::string size(value);
+  try {
+    return BaseBlock::parseSize(size);
+  } catch (const std::exception&) {
+    throw std::runtime_error("Invalid value for '" + name + "': " + value);
+  }
+}
+
+ProxyCacheZone ProxyCacheZone::parse(const std::vector<std::string>& args) {
+  ProxyCacheZone zone;
+  if (args.empty() || args[0].find('=') != std::string::npos)
+    throw std::runtime_error("Missing directory for 'proxy_cache_path'");
+  zone.path = args[0];
+  while (zone.path.size() > 1 && zone.path[zone.path.size() - 1] == '/')
+    zone.path.erase(zone.path.size() - 1);
+
+  for (size_t i = 1; i < args.size(); ++i) {
+    std::string::size_type eq = args[i].find('=');
+    std::string name = args[i].substr(0, eq);
+    std::string value = eq == std::string::npos ? "" : args[i].substr(eq + 1);
+    if (name == "keys_zone") {
+      std::string::size_type colon = value.find(':');
+      zone.name = value.substr(0, colon);
+      if (colon != std::string::npos)
+        zone.maxEntries = parseBytes(name, value.substr(colon + 1)) *
+                          PROXY_CACHE_KEYS_PER_MB / (1024 * 1024);
+    } else if (name == "levels") {
+      zone.levels.clear();
+      std::string::size_type start = 0;
+      while (start <= value.size()) {
+        std::string::size_type colon = value.find(':', start);
+        std::string level = value.substr(start, colon - start);
+        if (level != "1" && level != "2")
+          throw std::runtime_error("Invalid value for 'levels': " + value);
+        zone.levels.push_back(level[0] - '0');
+        if (colon == std::string::npos)
+          break;
+        start = colon + 1;
+      }
+      if (zone.levels.size() > 3)
+        throw std::runtime_error("Invalid value for 'levels': " + value);
+    } else if (name == "max_size") {
+      zone.maxSize = parseBytes(name, value);
+    } else if (name == "inactive") {
+      zone.inactive = parseTime(name, value);
+    } else {
+      throw std::runtime_error("Unknown proxy_cache_path parameter: " +
+                               args[i]);
+    }
+  }
+  if (zone.name.empty())
+    throw std::runtime_error("Missing keys_zone for 'proxy_cache_path'");
+  return zone;
+}
+
+ProxyCacheRule::ProxyCacheRule()
+    : zoneName(),
+      zone(),
+      key("$scheme$proxy_host$request_uri"),
+      valid(),
+      useStale(0),
+      lock(true),
+      lockTimeout(PROXY_CACHE_DEFAULT_LOCK_TIMEOUT) {}
+
+// The request variables a cache key may use
+static bool isKeyVariable(const std::string& name) {
+  return name == "scheme" || name == "host" || name == "proxy_host" ||
+         name == "request_uri" || name == "uri" || name == "args" ||
+         name == "request_method" || name == "remote_addr" ||
+         (name.compare(0, 7, "cookie_") == 0 && name.size() > 7) ||
+         (name.compare(0, 5, "http_") == 0 && name.size() > 5);
+}
+
+void ProxyCacheRule::setKey(const std::string& key) {
+  for (std::string::size_type pos = key.find('$'); pos != std::string::npos;
+       pos = key.find('$', pos + 1)) {
+    std::string::size_type end = pos + 1;
+    while (end < key.size() &&
+           (std::isalnum(static_cast<unsigned char>(key[end])) ||
+            key[end] == '_'))
+      ++end;
+    if (!isKeyVariable(key.substr(pos + 1, end - pos - 1)))
+      throw std::runtime_error("Unsupported variable in 'proxy_cache_key': " +
+                               key.substr(pos, end - pos));
+  }
+  if (key.empty())
+    throw std::runtime_error("Empty 'proxy_cache_key'");
+  this->key = key;
+}
+
+void ProxyCacheRule::addValid(const std::vector<std::string>& args) {
+  if (args.empty())
+    throw std::runtime_error("Missing time for 'proxy_cache_valid'");
+  time_t ttl = parseTime("proxy_cache_valid", args.back());
+
+  if (args.size() == 1) {
+    this->valid[200] = ttl;
+    this->valid[301] = ttl;
+    this->valid[302] = ttl;
+    return;
+  }
+  for (size_t i = 0; i + 1 < args.size(); ++i) {
+    if (args[i] == "any") {
+      this->valid[0] = ttl;
+      continue;
+    }
+    char* end = NULL;
+    long code = std::strtol(args[i].c_str(), &end, 10);
+    if (*end || code < 200 || code > 599)
+      throw std::runtime_error("Invalid status for 'proxy_cache_valid': " +
+                               args[i]);
+    this->valid[code] = ttl;
+  }
+}
+
+void ProxyCacheRule::setUseStale(const std::vector<std::string>& args) {
+  this->useStale = 0;
+  for (size_t i = 0; i < args.size(); ++i) {
+    if (args[i] == "off" && args.size() == 1)
+      return;
+    if (args[i] == "error")
+      this->useStale |= STALE_ERROR;
+    else if (args[i] == "timeout")
+      this->useStale |= STALE_TIMEOUT;
+    else if (args[i] == "updating")
+      this->useStale |= STALE_UPDATING;
+    else if (args[i] == "http_500")
+      this->useStale |= STALE_HTTP_500;
+    else if (args[i] == "http_502")
+      this->useStale |= STALE_HTTP_502;
+    else if (args[i] == "http_503")
+      this->useStale |= STALE_HTTP_503;
+    else if (args[i] == "http_504")
+      this->useStale |= STALE_HTTP_504;
+    else
+      throw std::runtime_error("Invalid value for 'proxy_cache_use_stale': " +
+                               args[i]);
+  }
+}
+
+void ProxyCacheRule::setLock(const std::string& value) {
+  if (value == "on")
+    this->lock = true;
+  else if (value == "off")
+    this->lock = false;
+  else
+    throw std::runtime_error("Invalid value for 'proxy_cache_lock': " + value);
+}
+
+void ProxyCacheRule::setLockTimeout(const std::string& value) {
+  this->lockTimeout = parseTime("proxy_cache_lock_timeout", value);
+}
+
+void ProxyCacheRule::link(const std::map<std::string, ProxyCacheZone>& zones) {
+  std::map<std::string, ProxyCacheZone>::const_iterator it =
+      zones.find(this->zoneName);
+  if (it == zones.end())
+    throw std::runtime_error("Unknown proxy_cache zone: " + this->zoneName);
+  this->zone = it->second;
+}
+
+// Statuses a cache may keep on the strength of max-age alone (RFC 9111,
+// minus 206 which needs range support)
+static bool isHeuristicallyCacheable(int status) {
+  return status == 200 || status == 203 || status == 204 || status == 300 ||
+         status == 301 || status == 308 || status == 404 || status == 405 ||
+         status == 410 || status == 414 || status == 501;
+}
+
+time_t ProxyCacheRule::ttlFor(int status,
+                              const std::string& cacheControl,
+                              bool setsCookie) const {
+  if (setsCookie)
+    return 0;
+  if (cacheControl.find("no-store") != std::string::npos ||
+      cacheControl.find("no-cache") != std::string::npos ||
+      cacheControl.find("private") != std::string::npos)
+    return 0;
+
+  std::string::size_type pos = cacheControl.find("s-maxage=");
+  if (pos == std::string::npos) {
+    pos = cacheControl.find("max-age=");
+    if (pos != std::string::npos)
+      pos += 8;
+  } else {
+    pos += 9;
+  }
+  if (pos != std::string::npos && isHeuristicallyCacheable(status))
+    return std::atol(cacheControl.c_str() + pos);
+
+  std::map<int, time_t>::const_iterator it = this->valid.find(status);
+  if (it == this->valid.end())
+    it = this->valid.find(0);
+  return it == this->valid.end() ? 0 : it->second;
+}
+
+bool ProxyCacheRule::staleOnStatus(int status) const {
+  switch (status) {
+    case 500:
+      return this->useStale & STALE_HTTP_500;
+    case 502:
+      return this->useStale & STALE_HTTP_502;
+    case 503:
+      return this->useStale & STALE_HTTP_503;
+    case 504:
+      return this->useStale & STALE_HTTP_504;
+    default:
+      return false;
+  }
+}
+
+void ProxyCacheRule::writeTo(CacheWriter& out) const {
+  out.str(this->zoneName);
+  out.str(this->zone.name);
+  out.str(this->zone.path);
+  out.u64(this->zone.levels.size());
+  for (size_t i = 0; i < this->zone.levels.size(); ++i)
+    out.u8(this->zone.levels[i]);
+  out.u64(this->zone.maxSize);
+  out.u64(this->zone.maxEntries);
+  out.u64(this->zone.inactive);
+  out.str(this->key);
+  out.u64(this->valid.size());
+  for (std::map<int, time_t>::const_iterator it = this->valid.begin();
+       it != this->valid.end(); ++it) {
+    out.u16(it->first);
+    out.u64(it->second);
+  }
+  out.u64(this->useStale);
+  out.u8(this->lock);
+  out.u64(this->lockTimeout);
+}
+
+void ProxyCacheRule::readFrom(CacheReader& in) {
+  this->zoneName = in.str();
+  this->zone.name = in.str();
+  this->zone.path = in.str();
+  uint64_t levels = in.u64();
+  this->zone.levels.clear();
+  for (uint64_t i = 0; i < levels; ++i)
+    this->zone.levels.push_back(in.u8());
+  this->zone.maxSize = in.u64();
+  this->zone.maxEntries = in.u64();
+  this->zone.inactive = in.u64();
+  this->key = in.str();
+  uint64_t count = in.u64();
+  this->valid.clear();
+  for (uint64_t i = 0; i < count; ++i) {
+    int status = in.u16();
+    this->valid[status] = in.u64();
+  }
+  this->useStale = in.u64();
+  this->lock = in.u8();
+  this->lockTimeout = in.u64();
+}
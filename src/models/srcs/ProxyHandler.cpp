@@ -0,0 +1,753 @@
+#include "ProxyHandler.hpp"
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include "ConfigSnapshot.hpp"
+#include "HttpRequest.hpp"
+#include "HttpResponse.hpp"
+#include "ProxyCache.hpp"
+#include "ProxySession.hpp"
+#include "SocketManager.hpp"
+
+ProxyHandler::ProxyHandler(SocketManager& manager)
+    : _manager(manager),
+      _upstreams(),
+      _clients(),
+      _configs(),
+      _inFlight(),
+      _waiting(),
+      _parked(),
+      _pool(),
+      _balancer(),
+      _caches() {}
+
+ProxyHandler::~ProxyHandler() {
+  for (std::map<std::string, ProxyCache*>::iterator it = this->_caches.begin();
+       it != this->_caches.end(); ++it)
+    delete it->second;
+}
+
+void ProxyHandler::start(ProxySession* session, const std::string& rawRequest,
+                         const HttpRequest& request,
+                         const sockaddr_in& clientAddr, int epfd) {
+  if (!lookupCache(session, rawRequest, request, clientAddr, epfd))
+    run(session, epfd);
+}
+
+bool ProxyHandler::isUpstream(int fd) const {
+  return this->_upstreams.count(fd);
+}
+
+bool ProxyHandler::hasClient(int fd) const {
+  return this->_clients.count(fd) || this->_waiting.count(fd);
+}
+
+ProxySession* ProxyHandler::findClient(int fd) const {
+  std::map<int, ProxySession*>::const_iterator it = this->_clients.find(fd);
+  return it != this->_clients.end() ? it->second : NULL;
+}
+
+void ProxyHandler::run(ProxySession* session, int epfd) {
+  int clientFd = session->getClientFd();
+
+  this->_clients[clientFd] = session;
+  ConfigSnapshot* snapshot = this->_manager.getClientConfig(clientFd);
+  this->_configs[session] = snapshot;
+  snapshot->retain();
+  this->_manager.setClientEvents(clientFd, 0, epfd);
+  connectUpstream(session, epfd);
+}
+
+// Picks a peer of the session's upstream group unless it has one, then
+// registers a connection to it: a pooled one when there is one, otherwise a
+// new one. The request goes out once it is writable.
+bool ProxyHandler::connectUpstream(ProxySession* session, int epfd) {
+  if (!session->hasPeer()) {
+    const UpstreamGroup& group = session->getGroup();
+    int peer = this->_balancer.select(group, session->getBalanceKey(),
+                                      session->getTried(), time(NULL));
+    if (peer == -1) {
+      std::cerr << "Proxy Error: no live upstreams in " << group.name << '\n';
+      fail(session, 502, epfd);
+      return false;
+    }
+    session->setPeer(peer);
+    int pooled = this->_pool.acquire(session->getUpstream().key, time(NULL));
+    if (pooled != -1)
+      session->useConnection(pooled);
+  }
+  if (session->getUpstreamFd() == -1) {
+    try {
+      session->connectUpstream();
+    } catch (const std::exception& e) {
+      std::cerr << "Proxy Error: " << e.what() << '\n';
+      failOver(session, epfd);
+      return false;
+    }
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLOUT;
+  ev.data.fd = session->getUpstreamFd();
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, session->getUpstreamFd(), &ev) == -1) {
+    fail(session, 502, epfd);
+    return false;
+  }
+  this->_upstreams[session->getUpstreamFd()] = session;
+  return true;
+}
+
+void ProxyHandler::handleEvent(int fd, uint32_t events, int epfd) {
+  ProxySession* session = this->_upstreams[fd];
+
+  if (!session->isConnected()) {
+    if (!session->finishConnect()) {
+      std::cerr << "Proxy Error: could not connect to upstream "
+                << session->getUpstream().key << '\n';
+      failOver(session, epfd);
+      return;
+    }
+  }
+  if (session->hasPendingRequest() && !(events & (EPOLLERR | EPOLLHUP))) {
+    writeRequest(session, epfd);
+    return;
+  }
+  readResponse(session, epfd);
+}
+
+// Request first, then the body in turns with the client socket: while a
+// chunk is being written the client is not read, and while the client has
+// nothing the upstream is not polled
+void ProxyHandler::writeRequest(ProxySession* session, int epfd) {
+  ssize_t written = session->writeRequest();
+  if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+  if (written == -1) {
+    retry(session, epfd);
+    return;
+  }
+  if (session->hasPendingRequest())
+    return;
+  if (session->isStreamingBody()) {
+    setUpstreamEvents(session, 0, epfd);
+    this->_manager.setClientEvents(session->getClientFd(), EPOLLIN, epfd);
+    return;
+  }
+  setUpstreamEvents(session, EPOLLIN, epfd);
+}
+
+void ProxyHandler::readResponse(ProxySession* session, int epfd) {
+  const ResolvedLocation& resolved = session->getContext().resolved;
+  // Unbuffered, once the head went out the rest of a body that needs no
+  // rewriting may bypass user space
+  if (session->isSplicing() ||
+      (!resolved.proxyBuffering.enabled && session->canSplice() &&
+       session->startSplice())) {
+    spliceResponse(session, epfd);
+    return;
+  }
+  int clientFd = session->getClientFd();
+  // A background refresh has nobody to send to
+  std::string discarded;
+  std::string& out =
+      clientFd != -1 ? this->_manager.getSendBuffer(clientFd) : discarded;
+  size_t before = out.size();
+  bool started = session->hasResponseStarted();
+
+  ProxySession::Result result = session->readResponse(out);
+  if (result == ProxySession::ERROR) {
+    retry(session, epfd);
+    return;
+  }
+  if (session->getCache() && !started && session->hasResponseStarted()) {
+    if (resolved.proxyCache.staleOnStatus(session->getStatus()) &&
+        serveStale(session, epfd))
+      return;
+    cacheResponse(session, out, before);
+  } else if (session->getFill() && out.size() > before) {
+    session->getFill()->write(out.data() + before, out.size() - before);
+  }
+  bool arrived = out.size() != before;
+  // The last bytes too go behind what the file still holds
+  if (clientFd != -1 && resolved.proxyBuffering.enabled &&
+      !bufferResponse(session, out, before, epfd))
+    return;
+  if (result == ProxySession::DONE) {
+    finish(session, epfd);
+    return;
+  }
+  if (clientFd == -1)
+    return;
+  if (arrived)
+    this->_manager.setClientEvents(clientFd, EPOLLOUT, epfd);
+  // A slow client pushes back: sending resumes reading once it drained
+  if (!hasRoom(session, clientFd))
+    setUpstreamEvents(session, 0, epfd);
+}
+
+// Moves what does not fit the memory buffers to the end of the client's
+// spill file, created on first need and unlinked right away. Memory always
+// holds the older bytes, so new ones go to the file while it has unsent
+// data. False when the client was closed because the file could not be
+// written.
+bool ProxyHandler::bufferResponse(ProxySession* session, std::string& out,
+                                  size_t before, int epfd) {
+  int clientFd = session->getClientFd();
+  const ProxyBuffering& buffering =
+      session->getContext().resolved.proxyBuffering;
+  FileBody* spill = this->_manager.findFileBody(clientFd);
+  bool fileHolds = spill && spill->offset < spill->end;
+  size_t from = fileHolds ? before : buffering.memoryLimit();
+  if (from >= out.size() || !buffering.maxTempFileSize)
+    return true;
+
+  if (!spill) {
+    char path[] = "/tmp/webserv-proxy-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+      std::cerr << "Proxy Error: cannot create a temporary file: "
+                << strerror(errno) << '\n';
+      this->_manager.closeClient(clientFd, epfd);
+      return false;
+    }
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    FileBody body;
+    body.fd = fd;
+    body.offset = 0;
+    body.end = 0;
+    spill = &this->_manager.addFileBody(clientFd, body);
+  }
+  size_t length = out.size() - from;
+  if (pwrite(spill->fd, out.data() + from, length, spill->end) !=
+      static_cast<ssize_t>(length)) {
+    std::cerr << "Proxy Error: cannot write a temporary file: "
+              << strerror(errno) << '\n';
+    this->_manager.closeClient(clientFd, epfd);
+    return false;
+  }
+  spill->end += length;
+  out.erase(from);
+  return true;
+}
+
+// The pipe is the only buffer between the two sockets: the upstream is read
+// while it has room, the client written while it holds data (and whatever
+// was copied before it is out)
+void ProxyHandler::spliceResponse(ProxySession* session, int epfd) {
+  int clientFd = session->getClientFd();
+
+  ProxySession::Result result = session->spliceFromUpstream();
+  if (result == ProxySession::ERROR) {
+    retry(session, epfd);
+    return;
+  }
+  bool copied = this->_manager.getSendBuffer(clientFd).empty();
+  if (copied && session->hasPipedData()) {
+    size_t allowance = this->_manager.sendAllowance(clientFd, epfd);
+    ssize_t moved = allowance ? session->spliceToClient(allowance) : 0;
+    if (moved == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      this->_manager.closeClient(clientFd, epfd);
+      return;
+    }
+    if (moved > 0)
+      this->_manager.chargeSend(clientFd, moved);
+  }
+  if (result == ProxySession::DONE && !session->hasPipedData()) {
+    finish(session, epfd);
+    return;
+  }
+  setUpstreamEvents(
+      session,
+      result != ProxySession::DONE && session->hasPipeRoom() ? EPOLLIN : 0u,
+      epfd);
+  this->_manager.setClientEvents(
+      clientFd, session->hasPipedData() || !copied ? EPOLLOUT : 0u, epfd);
+}
+
+// The client took some of its backlog: the upstream is read again if that
+// made room
+void ProxyHandler::resumeUpstream(ProxySession* session, int fd, int epfd) {
+  if (hasRoom(session, fd) && session->isConnected() &&
+      !session->hasPendingRequest() && !session->isStreamingBody())
+    setUpstreamEvents(session, EPOLLIN, epfd);
+}
+
+// Whether a client's backlog leaves room for more of the response:
+// unbuffered, one chunk in memory; buffered, the memory buffers and then the
+// temporary file up to proxy_max_temp_file_size
+bool ProxyHandler::hasRoom(ProxySession* session, int fd) {
+  const ProxyBuffering& buffering =
+      session->getContext().resolved.proxyBuffering;
+  size_t memory = this->_manager.getSendBuffer(fd).size();
+  if (!buffering.enabled)
+    return memory <= PROXY_CHUNK;
+  FileBody* spill = this->_manager.findFileBody(fd);
+  if (spill)
+    return static_cast<uint64_t>(spill->end) < buffering.maxTempFileSize;
+  return memory <= buffering.memoryLimit() || buffering.maxTempFileSize;
+}
+
+void ProxyHandler::streamBody(ProxySession* session, int epfd) {
+  int clientFd = session->getClientFd();
+
+  ssize_t moved = session->pumpClientBody();
+  if (moved == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+  if (moved <= 0) {
+    // Client hung up in the middle of the body
+    this->_manager.closeClient(clientFd, epfd);
+    return;
+  }
+  this->_manager.setClientEvents(clientFd, 0, epfd);
+  setUpstreamEvents(session, EPOLLOUT, epfd);
+}
+
+// A pooled connection the upstream closed while it sat idle fails on first
+// use; the request goes out again on a new connection to the same peer.
+// Any other failure is held against the peer.
+void ProxyHandler::retry(ProxySession* session, int epfd) {
+  if (!session->canRetry()) {
+    failOver(session, epfd);
+    return;
+  }
+  int fd = session->getUpstreamFd();
+  epoll_ctl(epfd, EPOLL_CTL_DEL, fd, 0);
+  this->_upstreams.erase(fd);
+  session->resetForRetry();
+  connectUpstream(session, epfd);
+}
+
+// The peer failed: while the client has seen nothing and the body can be
+// sent again, the next peer of the group gets the request
+void ProxyHandler::failOver(ProxySession* session, int epfd) {
+  if (!session->canFailOver()) {
+    fail(session, 502, epfd);
+    return;
+  }
+  int fd = session->getUpstreamFd();
+  if (fd != -1) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, 0);
+    this->_upstreams.erase(fd);
+  }
+  releasePeer(session, true);
+  session->resetForRetry();
+  connectUpstream(session, epfd);
+}
+
+void ProxyHandler::releasePeer(ProxySession* session, bool failed) {
+  if (!session->hasPeer())
+    return;
+  const UpstreamGroup& group = session->getGroup();
+  size_t peer = session->getPeer();
+  time_t now = time(NULL);
+
+  this->_balancer.release(group, peer);
+  if (!failed)
+    this->_balancer.succeed(group, peer);
+  else if (this->_balancer.fail(group, peer, now))
+    std::cerr << "Upstream " << group.peers[peer].spec << " in " << group.name
+              << " failed " << group.peers[peer].maxFails
+              << " time(s), out of rotation for "
+              << group.peers[peer].failTimeout << "s" << '\n';
+  session->dropPeer();
+}
+
+// The response was read to its end: the upstream connection goes back to
+// the pool when it can carry another request, the client gets the rest of
+// its buffer and is closed like any other response
+void ProxyHandler::finish(ProxySession* session, int epfd) {
+  int clientFd = session->getClientFd();
+  int upstreamFd = session->getUpstreamFd();
+
+  epoll_ctl(epfd, EPOLL_CTL_DEL, upstreamFd, 0);
+  this->_upstreams.erase(upstreamFd);
+  if (session->isKeepAlive() && !session->isStreamingBody())
+    this->_pool.release(session->getUpstream().key, session->releaseUpstream(),
+                        time(NULL));
+  session->commitFill();
+  releasePeer(session, false);
+  release(session, epfd);
+  if (clientFd == -1)
+    return;
+
+  if (!this->_manager.hasPendingOutput(clientFd))
+    this->_manager.closeClient(clientFd, epfd);
+  else
+    this->_manager.setClientEvents(clientFd, EPOLLIN | EPOLLOUT, epfd);
+}
+
+// Before anything reached the client it gets a stale cached copy when
+// proxy_cache_use_stale allows it, or else a proper error page; after that
+// the only way to signal the failure is to cut the response short
+void ProxyHandler::fail(ProxySession* session, int code, int epfd) {
+  int clientFd = session->getClientFd();
+
+  releasePeer(session, true);
+  if (clientFd == -1) {
+    release(session, epfd);
+    return;
+  }
+  unsigned stale = code == 504 ? ProxyCacheRule::STALE_TIMEOUT
+                               : ProxyCacheRule::STALE_ERROR;
+  if (!session->hasResponseStarted() &&
+      (session->getContext().resolved.proxyCache.useStale & stale) &&
+      serveStale(session, epfd))
+    return;
+  if (session->hasResponseStarted()) {
+    release(session, epfd);
+    this->_manager.closeClient(clientFd, epfd);
+    return;
+  }
+  HttpResponse res;
+  res.setErrorFromContext(code, session->getContext());
+  this->_manager.queueResponse(clientFd, res, epfd);
+  release(session, epfd);
+}
+
+void ProxyHandler::release(ProxySession* session, int epfd) {
+  int fd = session->getUpstreamFd();
+  if (fd != -1) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, 0);
+    this->_upstreams.erase(fd);
+  }
+  this->_clients.erase(session->getClientFd());
+  // Client went away: the peer is neither to blame nor proven healthy
+  if (session->hasPeer())
+    this->_balancer.release(session->getGroup(), session->getPeer());
+
+  std::vector<int> waiters;
+  releaseLock(session, waiters);
+
+  std::map<ProxySession*, ConfigSnapshot*>::iterator owner =
+      this->_configs.find(session);
+  ConfigSnapshot* snapshot = NULL;
+  if (owner != this->_configs.end()) {
+    snapshot = owner->second;
+    this->_configs.erase(owner);
+  }
+  delete session;
+  if (snapshot)
+    this->_manager.releaseConfig(snapshot);
+  // The entry is in place by now, or is not going to be
+  for (size_t i = 0; i < waiters.size(); ++i) {
+    ProxySession* waiter = unpark(waiters[i]);
+    if (waiter)
+      resumeWaiter(waiter, epfd);
+  }
+}
+
+void ProxyHandler::dropClient(int fd, int epfd) {
+  std::map<int, ProxySession*>::iterator parked = this->_waiting.find(fd);
+  if (parked != this->_waiting.end()) {
+    parked->second->removeWaiter(fd);
+    delete unpark(fd);
+  }
+
+  std::map<int, ProxySession*>::iterator it = this->_clients.find(fd);
+  if (it == this->_clients.end())
+    return;
+  ProxySession* session = it->second;
+  // Only a response still on its way into the cache is worth finishing
+  if (session->getWaiters().empty() ||
+      (session->hasResponseStarted() && !session->getFill())) {
+    release(session, epfd);
+    return;
+  }
+  // Others wait for the entry this response fills: let it finish for them,
+  // reading on even if the client had paused it
+  this->_clients.erase(it);
+  session->detachClient();
+  if (session->hasResponseStarted())
+    setUpstreamEvents(session, EPOLLIN, epfd);
+}
+
+void ProxyHandler::setUpstreamEvents(ProxySession* session, uint32_t events,
+                                     int epfd) {
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.fd = session->getUpstreamFd();
+  epoll_ctl(epfd, EPOLL_CTL_MOD, session->getUpstreamFd(), &ev);
+}
+
+void ProxyHandler::handleTimeouts(int epfd) {
+  time_t now = time(NULL);
+  std::vector<ProxySession*> expired;
+
+  for (std::map<int, ProxySession*>::iterator it = this->_upstreams.begin();
+       it != this->_upstreams.end(); ++it) {
+    if (now - it->second->getLastActivity() > TIMEOUT)
+      expired.push_back(it->second);
+  }
+  for (size_t i = 0; i < expired.size(); ++i) {
+    ProxySession* session = expired[i];
+    // Waiting on the client's body is not the upstream's fault
+    if (session->isStreamingBody() && !session->hasPendingRequest()) {
+      this->_manager.closeClient(session->getClientFd(), epfd);
+      continue;
+    }
+    std::cerr << "Proxy Timeout: upstream " << session->getUpstream().key
+              << " did not answer" << '\n';
+    if (session->canFailOver())
+      failOver(session, epfd);
+    else
+      fail(session, 504, epfd);
+  }
+  // Parked past proxy_cache_lock_timeout: the request goes to the
+  // upstream itself, and what comes back is not stored
+  std::vector<int> late;
+  for (std::map<int, ProxySession*>::iterator it = this->_parked.begin();
+       it != this->_parked.end(); ++it)
+    if (now >= it->second->getLockDeadline())
+      late.push_back(it->first);
+  for (size_t i = 0; i < late.size(); ++i) {
+    this->_waiting[late[i]]->removeWaiter(late[i]);
+    ProxySession* session = unpark(late[i]);
+    session->setCache(NULL, "");
+    run(session, epfd);
+  }
+
+  this->_pool.expire(now);
+  for (std::map<std::string, ProxyCache*>::iterator it = this->_caches.begin();
+       it != this->_caches.end(); ++it)
+    if (it->second)
+      it->second->manage(now);
+}
+
+ProxyCache* ProxyHandler::openCache(const ProxyCacheZone& zone) {
+  std::map<std::string, ProxyCache*>::iterator it =
+      this->_caches.find(zone.path);
+  if (it != this->_caches.end()) {
+    if (it->second)
+      it->second->setLimits(zone);
+    return it->second;
+  }
+  ProxyCache* cache = NULL;
+  try {
+    cache = new ProxyCache(zone);
+  } catch (const std::exception& e) {
+    std::cerr << "Proxy cache " << zone.name << " disabled: " << e.what()
+              << '\n';
+  }
+  this->_caches[zone.path] = cache;
+  return cache;
+}
+
+void ProxyHandler::pruneCaches() {
+  for (std::map<std::string, ProxyCache*>::iterator it = this->_caches.begin();
+       it != this->_caches.end();) {
+    if (!it->second)
+      this->_caches.erase(it++);
+    else
+      ++it;
+  }
+}
+
+// Answers the request from the cache when it can: a fresh entry is sent as
+// is, a stale one while proxy_cache_use_stale updating lets this request
+// refresh it in the background. Otherwise the session is told its key so
+// the response is stored on the way through, and false is returned.
+bool ProxyHandler::lookupCache(ProxySession* session,
+                               const std::string& rawRequest,
+                               const HttpRequest& request,
+                               const sockaddr_in& clientAddr, int epfd) {
+  const ResolvedLocation& resolved = request.getContext().resolved;
+  const std::string& method = request.getMethod();
+  // Only bodiless GET and HEAD requests are answered from the cache
+  if (!resolved.proxyCacheEnabled || (method != "GET" && method != "HEAD") ||
+      !request.getBody().empty() || request.getPendingBody())
+    return false;
+  ProxyCache* cache = openCache(resolved.proxyCache.zone);
+  if (!cache)
+    return false;
+
+  std::string key = ProxySession::cacheKey(rawRequest, request, clientAddr);
+  session->setCache(cache, key);
+  time_t now = time(NULL);
+  ProxyCache::Entry* entry = cache->find(key, now);
+  int clientFd = session->getClientFd();
+  bool headOnly = session->isHeadOnly();
+  if (entry && ProxyCache::isFresh(*entry, now)) {
+    if (sendCached(clientFd, cache, key, "HIT", headOnly, epfd)) {
+      delete session;
+      return true;
+    }
+  } else if (entry &&
+             (resolved.proxyCache.useStale & ProxyCacheRule::STALE_UPDATING)) {
+    // Stale: one request refreshes it, everyone gets the old copy meanwhile
+    bool updating = entry->updating;
+    bool refresh = !updating && !headOnly;
+    if (sendCached(clientFd, cache, key, updating ? "UPDATING" : "STALE",
+                   headOnly, epfd)) {
+      if (refresh)
+        startRefresh(session, epfd);
+      else
+        delete session;
+      return true;
+    }
+  }
+  return resolved.proxyCache.lock && lock(session, epfd);
+}
+
+// The head comes from the file into the send buffer, the body follows
+// from the file with sendfile
+bool ProxyHandler::sendCached(int fd, ProxyCache* cache, const std::string& key,
+                              const std::string& status, bool headOnly,
+                              int epfd) {
+  std::string head;
+  off_t bodyStart = 0;
+  off_t bodyEnd = 0;
+  int file = cache->open(key, head, bodyStart, bodyEnd);
+  if (file == -1)
+    return false;
+
+  this->_manager.getSendBuffer(fd) =
+      head + "X-Cache-Status: " + status + "\r\n\r\n";
+  if (headOnly || bodyStart >= bodyEnd) {
+    close(file);
+  } else {
+    FileBody body;
+    body.fd = file;
+    body.offset = bodyStart;
+    body.end = bodyEnd;
+    this->_manager.addFileBody(fd, body);
+  }
+  this->_manager.setClientEvents(fd, EPOLLIN | EPOLLOUT, epfd);
+  return true;
+}
+
+// The client was answered from the stale entry; the session carries on
+// without it and only fills the cache
+void ProxyHandler::startRefresh(ProxySession* session, int epfd) {
+  ConfigSnapshot* snapshot =
+      this->_manager.getClientConfig(session->getClientFd());
+
+  session->detachClient();
+  session->setUpdating();
+  this->_configs[session] = snapshot;
+  snapshot->retain();
+  connectUpstream(session, epfd);
+}
+
+static std::string lockKey(const ProxySession& session) {
+  return session.getCache()->getZone().path + '\n' + session.getCacheKey();
+}
+
+// A miss with proxy_cache_lock: the first request for the key goes to the
+// upstream and holds the lock until it ends; identical ones arriving
+// meanwhile are parked on it and true is returned for them. HEAD responses
+// are never stored, so a HEAD request can wait but not hold the lock.
+bool ProxyHandler::lock(ProxySession* session, int epfd) {
+  std::string key = lockKey(*session);
+  std::map<std::string, ProxySession*>::iterator leader =
+      this->_inFlight.find(key);
+  if (leader == this->_inFlight.end()) {
+    if (!session->isHeadOnly())
+      this->_inFlight[key] = session;
+    return false;
+  }
+  int clientFd = session->getClientFd();
+  leader->second->addWaiter(clientFd);
+  this->_waiting[clientFd] = leader->second;
+  this->_parked[clientFd] = session;
+  session->setLockDeadline(time(NULL) +
+                           session->getContext().resolved.proxyCache.lockTimeout);
+  this->_manager.setClientEvents(clientFd, 0, epfd);
+  return true;
+}
+
+// Gives the lock up when the session holds it; the clients parked on it are
+// handed back to be resumed
+void ProxyHandler::releaseLock(ProxySession* session,
+                               std::vector<int>& waiters) {
+  waiters = session->getWaiters();
+  if (!session->getCache())
+    return;
+  std::map<std::string, ProxySession*>::iterator inFlight =
+      this->_inFlight.find(lockKey(*session));
+  if (inFlight != this->_inFlight.end() && inFlight->second == session)
+    this->_inFlight.erase(inFlight);
+}
+
+ProxySession* ProxyHandler::unpark(int fd) {
+  this->_waiting.erase(fd);
+  std::map<int, ProxySession*>::iterator parked = this->_parked.find(fd);
+  if (parked == this->_parked.end())
+    return NULL;
+  ProxySession* session = parked->second;
+  this->_parked.erase(parked);
+  return session;
+}
+
+// The lock holder finished: a parked request is answered from the entry it
+// left, or goes to the upstream itself when the response was not stored
+// (not cacheable, or the upstream failed). It does not take the lock again,
+// so an uncacheable URL is not fetched one request at a time.
+void ProxyHandler::resumeWaiter(ProxySession* session, int epfd) {
+  ProxyCache* cache = session->getCache();
+  time_t now = time(NULL);
+  ProxyCache::Entry* entry = cache->find(session->getCacheKey(), now);
+  if (entry && ProxyCache::isFresh(*entry, now) &&
+      sendCached(session->getClientFd(), cache, session->getCacheKey(), "HIT",
+                 session->isHeadOnly(), epfd)) {
+    delete session;
+    return;
+  }
+  run(session, epfd);
+}
+
+// The response head just arrived: it goes into the cache when the rule
+// and the upstream's headers allow, and the client learns it was a miss
+void ProxyHandler::cacheResponse(ProxySession* session, std::string& out,
+                                 size_t before) {
+  const ProxyCacheRule& rule = session->getContext().resolved.proxyCache;
+  time_t ttl = session->isHeadOnly()
+                   ? 0
+                   : rule.ttlFor(session->getStatus(),
+                                 session->getCacheControl(),
+                                 session->isPrivate());
+  if (ttl > 0 && session->startFill(time(NULL) + ttl))
+    session->getFill()->write(out.data() + before, out.size() - before);
+
+  if (session->getClientFd() == -1)
+    return;
+  std::string::size_type headEnd = out.find("\r\n\r\n", before);
+  if (headEnd != std::string::npos)
+    out.insert(headEnd + 2, "X-Cache-Status: MISS\r\n");
+}
+
+// Replaces whatever the upstream sent so far with the cached copy; false
+// when there is none
+bool ProxyHandler::serveStale(ProxySession* session, int epfd) {
+  int clientFd = session->getClientFd();
+  if (clientFd == -1 || !session->getCache() ||
+      !sendCached(clientFd, session->getCache(), session->getCacheKey(),
+                  "STALE", session->isHeadOnly(), epfd))
+    return false;
+  releasePeer(session, false);
+  release(session, epfd);
+  return true;
+}
+
+void ProxyHandler::collect(std::set<ConfigSnapshot*>& snapshots) {
+  for (std::map<ProxySession*, ConfigSnapshot*>::iterator it =
+           this->_configs.begin();
+       it != this->_configs.end(); ++it) {
+    snapshots.insert(it->second);
+    delete it->first;
+  }
+  this->_configs.clear();
+  for (std::map<int, ProxySession*>::iterator it = this->_parked.begin();
+       it != this->_parked.end(); ++it)
+    delete it->second;
+  this->_parked.clear();
+  this->_upstreams.clear();
+  this->_clients.clear();
+  this->_waiting.clear();
+  this->_inFlight.clear();
+}
@@ -0,0 +1,213 @@
+#include <ConfigCache.hpp>
+#include <ProxyPass.hpp>
+#include <netdb.h>
+#include <sys/un.h>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+UpstreamAddress::UpstreamAddress() : key(), host(), addr(), addrLen(0) {}
+
+UpstreamAddress UpstreamAddress::parse(const std::string& spec) {
+  UpstreamAddress address;
+
+  if (spec.compare(0, 5, "unix:") == 0) {
+    std::string path = spec.substr(5);
+    struct sockaddr_un un;
+    if (path.empty() || path.size() >= sizeof(un.sun_path))
+      throw std::runtime_error("Invalid unix socket path: " + spec);
+    std::memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    std::memcpy(un.sun_path, path.c_str(), path.size());
+    std::memcpy(&address.addr, &un, sizeof(un));
+    address.addrLen = sizeof(un);
+    address.key = spec;
+    address.host = "localhost";
+    return address;
+  }
+
+  std::string host = spec;
+  std::string port = "80";
+  std::string::size_type colon = spec.rfind(':');
+  if (colon != std::string::npos) {
+    host = spec.substr(0, colon);
+    port = spec.substr(colon + 1);
+    if (port.empty() || port.find_first_not_of("0123456789") !=
+                            std::string::npos ||
+        std::atoi(port.c_str()) < 1 || std::atoi(port.c_str()) > 65535)
+      throw std::runtime_error("Invalid upstream port: " + spec);
+  }
+  if (host.empty())
+    throw std::runtime_error("Invalid upstream address: " + spec);
+
+  struct addrinfo hints;
+  struct addrinfo* result = NULL;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+  if (rc != 0 || !result)
+    throw std::runtime_error("Could not resolve upstream " + spec + ": " +
+                             gai_strerror(rc));
+  std::memcpy(&address.addr, result->ai_addr, result->ai_addrlen);
+  address.addrLen = result->ai_addrlen;
+  freeaddrinfo(result);
+
+  address.key = host + ":" + port;
+  address.host = port == "80" ? host : host + ":" + port;
+  return address;
+}
+
+// A count for weight= and max_fails=; weights must be positive
+static unsigned parseCount(const std::string& name, const std::string& value,
+                           bool allowZero) {
+  char* end = NULL;
+  long count = std::strtol(value.c_str(), &end, 10);
+  if (value.empty() || *end || count < 0 || (!allowZero && count == 0) ||
+      count > 1000)
+    throw std::runtime_error("Invalid value for '" + name + "': " + value);
+  return static_cast<unsigned>(count);
+}
+
+UpstreamPeer::UpstreamPeer()
+    : spec(), address(), weight(1), maxFails(1), failTimeout(10) {}
+
+UpstreamPeer UpstreamPeer::parse(const std::string& spec,
+                                 const std::vector<std::string>& params) {
+  UpstreamPeer peer;
+  peer.spec = spec;
+  peer.address = UpstreamAddress::parse(spec);
+
+  for (size_t i = 0; i < params.size(); ++i) {
+    std::string::size_type eq = params[i].find('=');
+    std::string name = params[i].substr(0, eq);
+    std::string value = eq == std::string::npos ? "" : params[i].substr(eq + 1);
+    if (name == "weight") {
+      peer.weight = parseCount(name, value, false);
+    } else if (name == "max_fails") {
+      peer.maxFails = parseCount(name, value, true);
+    } else if (name == "fail_timeout") {
+      std::string seconds = value;
+      if (!seconds.empty() && seconds[seconds.size() - 1] == 's')
+        seconds.erase(seconds.size() - 1);
+      peer.failTimeout = parseCount(name, seconds, false);
+    } else {
+      throw std::runtime_error("Unknown upstream server parameter: " +
+                               params[i]);
+    }
+  }
+  return peer;
+}
+
+UpstreamGroup::UpstreamGroup()
+    : name(), balance(ROUND_ROBIN), hashKey(), peers(), signature() {}
+
+void UpstreamGroup::setHashKey(const std::string& key) {
+  if (key != "$request_uri" && key != "$uri" && key != "$remote_addr" &&
+      !(key.compare(0, 8, "$cookie_") == 0 && key.size() > 8))
+    throw std::runtime_error("Unsupported hash key: " + key);
+  this->balance = HASH;
+  this->hashKey = key;
+}
+
+UpstreamGroup UpstreamGroup::single(const std::string& spec) {
+  UpstreamGroup group;
+  group.name = spec;
+  group.peers.push_back(UpstreamPeer::parse(spec, std::vector<std::string>()));
+  return group;
+}
+
+void UpstreamGroup::sign() {
+  std::ostringstream out;
+  out << this->balance << ' ' << this->hashKey;
+  for (size_t i = 0; i < this->peers.size(); ++i)
+    out << ' ' << this->peers[i].address.key << '*' << this->peers[i].weight;
+  this->signature = out.str();
+}
+
+ProxyPass::ProxyPass()
+    : spec(), target(), host(), group(), uri(), hasUri(false) {}
+
+ProxyPass ProxyPass::parse(const std::string& spec) {
+  ProxyPass proxy;
+  proxy.spec = spec;
+
+  std::string rest;
+  if (spec.compare(0, 7, "http://") == 0)
+    rest = spec.substr(7);
+  else if (spec.compare(0, 5, "unix:") == 0)
+    rest = spec;
+  else
+    throw std::runtime_error("proxy_pass must start with http:// or unix: " +
+                             spec);
+
+  proxy.target = rest;
+  if (rest.compare(0, 5, "unix:") == 0) {
+    // http://unix:/path/to.sock:/uri
+    std::string::size_type uri = rest.find(":/", 5);
+    if (uri != std::string::npos) {
+      proxy.target = rest.substr(0, uri);
+      proxy.uri = rest.substr(uri + 1);
+      proxy.hasUri = true;
+    }
+  } else {
+    std::string::size_type slash = rest.find('/');
+    if (slash != std::string::npos) {
+      proxy.target = rest.substr(0, slash);
+      proxy.uri = rest.substr(slash);
+      proxy.hasUri = true;
+    }
+  }
+  if (proxy.target.empty())
+    throw std::runtime_error("Invalid proxy_pass target: " + spec);
+  return proxy;
+}
+
+void ProxyPass::link(const std::map<std::string, UpstreamGroup>& upstreams) {
+  std::map<std::string, UpstreamGroup>::const_iterator named =
+      upstreams.find(this->target);
+  if (named != upstreams.end()) {
+    this->group = named->second;
+    this->host = this->target;
+  } else {
+    this->group = UpstreamGroup::single(this->target);
+    this->host = this->group.peers[0].address.host;
+  }
+  this->group.sign();
+}
+
+void ProxyPass::writeTo(CacheWriter& out) const {
+  out.str(this->spec);
+  out.str(this->host);
+  out.str(this->group.name);
+  out.u8(this->group.balance);
+  out.str(this->group.hashKey);
+  out.u64(this->group.peers.size());
+  for (size_t i = 0; i < this->group.peers.size(); ++i) {
+    const UpstreamPeer& peer = this->group.peers[i];
+    out.str(peer.spec);
+    out.u64(peer.weight);
+    out.u64(peer.maxFails);
+    out.u64(peer.failTimeout);
+  }
+}
+
+void ProxyPass::readFrom(CacheReader& in) {
+  *this = ProxyPass::parse(in.str());
+  this->host = in.str();
+  this->group.name = in.str();
+  this->group.balance = static_cast<UpstreamGroup::Balance>(in.u8());
+  this->group.hashKey = in.str();
+  uint64_t count = in.u64();
+  for (uint64_t i = 0; i < count; ++i) {
+    UpstreamPeer peer;
+    peer.spec = in.str();
+    peer.address = UpstreamAddress::parse(peer.spec);
+    peer.weight = in.u64();
+    peer.maxFails = in.u64();
+    peer.failTimeout = in.u64();
+    this->group.peers.push_back(peer);
+  }
+  this->group.sign();
+}
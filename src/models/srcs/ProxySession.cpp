@@ -0,0 +1,739 @@
+#include "ProxySession.hpp"
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+#include "HttpRequest.hpp"
+#include "HttpUtils.hpp"
+
+ProxySession::ProxySession(const RequestContext& ctx, int clientFd,
+                           const std::string& request, size_t bodyRemaining,
+                           bool headOnly, const std::string& balanceKey)
+    : _ctx(ctx),
+      _clientFd(clientFd),
+      _upstreamFd(-1),
+      _connected(false),
+      _reused(false),
+      _original(request),
+      _request(request),
+      _requestOffset(0),
+      _bodyRemaining(bodyRemaining),
+      _bodyStreamed(false),
+      _headOnly(headOnly),
+      _state(READ_HEAD),
+      _input(),
+      _remaining(0),
+      _keepAlive(false),
+      _responseStarted(false),
+      _lastActivity(time(NULL)),
+      _balanceKey(balanceKey),
+      _peer(-1),
+      _tried(),
+      _status(0),
+      _cacheControl(),
+      _private(false),
+      _cache(NULL),
+      _cacheKey(),
+      _fill(NULL),
+      _updating(false),
+      _waiters(),
+      _lockDeadline(0),
+      _piped(0) {
+  this->_pipe[0] = -1;
+  this->_pipe[1] = -1;
+}
+
+ProxySession::~ProxySession() {
+  closeUpstream();
+  if (this->_pipe[0] != -1) {
+    close(this->_pipe[0]);
+    close(this->_pipe[1]);
+  }
+  delete this->_fill;
+  if (this->_updating)
+    this->_cache->setUpdating(this->_cacheKey, false);
+}
+
+static bool isHopByHop(const std::string& name) {
+  return name == "connection" || name == "keep-alive" ||
+         name == "proxy-connection" || name == "te" || name == "trailer" ||
+         name == "upgrade" || name == "transfer-encoding";
+}
+
+static std::string lowercase(const std::string& value) {
+  std::string result(value);
+  for (size_t i = 0; i < result.size(); ++i)
+    result[i] = std::tolower(static_cast<unsigned char>(result[i]));
+  return result;
+}
+
+static std::string headerName(const std::string& line) {
+  std::string::size_type colon = line.find(':');
+  if (colon == std::string::npos)
+    return std::string();
+  return lowercase(line.substr(0, colon));
+}
+
+static std::string headerValue(const std::string& line) {
+  std::string::size_type colon = line.find(':');
+  std::string::size_type start = line.find_first_not_of(" \t", colon + 1);
+  if (colon == std::string::npos || start == std::string::npos)
+    return std::string();
+  std::string::size_type end = line.find_last_not_of(" \t");
+  return line.substr(start, end - start + 1);
+}
+
+std::string ProxySession::buildRequestHead(const std::string& rawRequest,
+                                           const HttpRequest& request,
+                                           const sockaddr_in& clientAddr) {
+  const RequestContext& ctx = request.getContext();
+  const ProxyPass& proxy = ctx.resolved.proxy;
+  size_t headEnd = rawRequest.find("\r\n\r\n");
+  size_t lineEnd = rawRequest.find("\r\n");
+
+  std::istringstream requestLine(rawRequest.substr(0, lineEnd));
+  std::string method, target;
+  requestLine >> method >> target;
+  if (proxy.hasUri && ctx.location) {
+    const std::string& prefix = ctx.location->getPath();
+    if (target.compare(0, prefix.size(), prefix) == 0)
+      target = proxy.uri + target.substr(prefix.size());
+  }
+
+  std::string head = method + " " + target + " HTTP/1.1\r\n";
+  std::string forwardedFor;
+  bool hasHost = false;
+  size_t pos = lineEnd + 2;
+  while (pos < headEnd) {
+    size_t next = rawRequest.find("\r\n", pos);
+    std::string line = rawRequest.substr(pos, next - pos);
+    pos = next + 2;
+
+    std::string name = headerName(line);
+    if (name.empty() || isHopByHop(name) || name == "expect" ||
+        name == "content-length")
+      continue;
+    if (name == "x-forwarded-for") {
+      forwardedFor = headerValue(line) + ", ";
+      continue;
+    }
+    if (name == "host")
+      hasHost = true;
+    head += line + "\r\n";
+  }
+  if (!hasHost)
+    head += "Host: " + proxy.host + "\r\n";
+  // A chunked body was decoded while the request was read, so it goes on
+  // with a length like any other
+  if (request.isChunked() || request.getHeaders().count("content-length"))
+    head += "Content-Length: " +
+            itoa_custom(request.getBody().size() + request.getPendingBody()) +
+            "\r\n";
+  head += "X-Forwarded-For: " + forwardedFor +
+          inet_ntoa(clientAddr.sin_addr) + "\r\n";
+  head += "Connection: keep-alive\r\n\r\n";
+  return head;
+}
+
+const RequestContext& ProxySession::getContext() const {
+  return this->_ctx;
+}
+
+std::string ProxySession::requestVariable(const std::string& name,
+                                          const std::string& rawRequest,
+                                          const HttpRequest& request,
+                                          const sockaddr_in& clientAddr) {
+  const std::map<std::string, std::string>& headers = request.getHeaders();
+
+  const VariableMap* map = request.getContext().server.findMap(name);
+  if (map)
+    return map->evaluate(rawRequest, request, clientAddr);
+  if (name == "scheme")
+    return "http";
+  if (name == "remote_addr")
+    return inet_ntoa(clientAddr.sin_addr);
+  if (name == "binary_remote_addr")
+    return std::string(reinterpret_cast<const char*>(&clientAddr.sin_addr),
+                       sizeof(clientAddr.sin_addr));
+  if (name == "uri")
+    return request.getPath();
+  if (name == "proxy_host")
+    return request.getContext().resolved.proxy.host;
+  if (name == "host") {
+    std::map<std::string, std::string>::const_iterator host =
+        headers.find("host");
+    if (host == headers.end())
+      return std::string();
+    return lowercase(host->second.substr(0, host->second.find(':')));
+  }
+  if (name == "request_uri" || name == "args" || name == "request_method") {
+    std::istringstream requestLine(rawRequest.substr(0, rawRequest.find("\r\n")));
+    std::string method, target;
+    requestLine >> method >> target;
+    if (name == "request_method")
+      return method;
+    if (name == "request_uri")
+      return target;
+    std::string::size_type query = target.find('?');
+    return query == std::string::npos ? std::string() : target.substr(query + 1);
+  }
+  if (name.compare(0, 5, "http_") == 0) {
+    std::string header = name.substr(5);
+    for (size_t i = 0; i < header.size(); ++i)
+      header[i] = header[i] == '_' ? '-' : std::tolower(static_cast<unsigned char>(header[i]));
+    std::map<std::string, std::string>::const_iterator it = headers.find(header);
+    return it == headers.end() ? std::string() : it->second;
+  }
+  if (name.compare(0, 7, "cookie_") != 0)
+    return std::string();
+
+  std::string cookie = name.substr(7);
+  std::map<std::string, std::string>::const_iterator cookies =
+      headers.find("cookie");
+  if (cookies == headers.end())
+    return std::string();
+  std::istringstream pairs(cookies->second);
+  std::string pair;
+  while (std::getline(pairs, pair, ';')) {
+    std::string::size_type start = pair.find_first_not_of(' ');
+    std::string::size_type eq = pair.find('=');
+    if (start != std::string::npos && eq != std::string::npos &&
+        pair.compare(start, eq - start, cookie) == 0 &&
+        eq - start == cookie.size())
+      return pair.substr(eq + 1);
+  }
+  return std::string();
+}
+
+std::string ProxySession::balanceKey(const std::string& rawRequest,
+                                     const HttpRequest& request,
+                                     const sockaddr_in& clientAddr) {
+  const UpstreamGroup& group = request.getContext().resolved.proxy.group;
+  if (group.balance != UpstreamGroup::HASH)
+    return std::string();
+  return requestVariable(group.hashKey.substr(1), rawRequest, request,
+                         clientAddr);
+}
+
+std::string ProxySession::expandVariables(const std::string& pattern,
+                                          const std::string& rawRequest,
+                                          const HttpRequest& request,
+                                          const sockaddr_in& clientAddr) {
+  std::string expanded;
+  std::string::size_type pos = 0;
+  while (pos < pattern.size()) {
+    std::string::size_type dollar = pattern.find('$', pos);
+    expanded.append(pattern, pos, dollar - pos);
+    if (dollar == std::string::npos)
+      break;
+    std::string::size_type end = dollar + 1;
+    while (end < pattern.size() &&
+           (std::isalnum(static_cast<unsigned char>(pattern[end])) ||
+            pattern[end] == '_'))
+      ++end;
+    expanded += requestVariable(pattern.substr(dollar + 1, end - dollar - 1),
+                           rawRequest, request, clientAddr);
+    pos = end;
+  }
+  return expanded;
+}
+
+std::string ProxySession::cacheKey(const std::string& rawRequest,
+                                   const HttpRequest& request,
+                                   const sockaddr_in& clientAddr) {
+  return expandVariables(request.getContext().resolved.proxyCache.key,
+                         rawRequest, request, clientAddr);
+}
+
+const UpstreamGroup& ProxySession::getGroup() const {
+  return this->_ctx.resolved.proxy.group;
+}
+
+const std::string& ProxySession::getBalanceKey() const {
+  return this->_balanceKey;
+}
+
+const std::vector<bool>& ProxySession::getTried() const {
+  return this->_tried;
+}
+
+bool ProxySession::hasPeer() const {
+  return this->_peer != -1;
+}
+
+size_t ProxySession::getPeer() const {
+  return this->_peer;
+}
+
+void ProxySession::setPeer(size_t peer) {
+  this->_peer = peer;
+}
+
+void ProxySession::dropPeer() {
+  if (this->_peer == -1)
+    return;
+  if (this->_tried.size() < getGroup().peers.size())
+    this->_tried.resize(getGroup().peers.size(), false);
+  this->_tried[this->_peer] = true;
+  this->_peer = -1;
+}
+
+const UpstreamAddress& ProxySession::getUpstream() const {
+  return getGroup().peers[this->_peer].address;
+}
+
+int ProxySession::getClientFd() const {
+  return this->_clientFd;
+}
+
+void ProxySession::detachClient() {
+  this->_clientFd = -1;
+}
+
+int ProxySession::getUpstreamFd() const {
+  return this->_upstreamFd;
+}
+
+time_t ProxySession::getLastActivity() const {
+  return this->_lastActivity;
+}
+
+bool ProxySession::isConnected() const {
+  return this->_connected;
+}
+
+bool ProxySession::isHeadOnly() const {
+  return this->_headOnly;
+}
+
+bool ProxySession::isKeepAlive() const {
+  return this->_keepAlive && this->_state == COMPLETE && this->_input.empty();
+}
+
+bool ProxySession::hasResponseStarted() const {
+  return this->_responseStarted;
+}
+
+bool ProxySession::hasPendingRequest() const {
+  return this->_requestOffset < this->_request.size();
+}
+
+bool ProxySession::isStreamingBody() const {
+  return this->_bodyRemaining > 0;
+}
+
+bool ProxySession::canRetry() const {
+  return this->_reused && !this->_bodyStreamed && !this->_responseStarted &&
+         this->_input.empty();
+}
+
+bool ProxySession::canFailOver() const {
+  return !this->_bodyStreamed && !this->_responseStarted;
+}
+
+int ProxySession::getStatus() const {
+  return this->_status;
+}
+
+const std::string& ProxySession::getCacheControl() const {
+  return this->_cacheControl;
+}
+
+bool ProxySession::isPrivate() const {
+  return this->_private;
+}
+
+void ProxySession::setCache(ProxyCache* cache, const std::string& key) {
+  this->_cache = cache;
+  this->_cacheKey = key;
+}
+
+ProxyCache* ProxySession::getCache() const {
+  return this->_cache;
+}
+
+const std::string& ProxySession::getCacheKey() const {
+  return this->_cacheKey;
+}
+
+void ProxySession::setUpdating() {
+  this->_cache->setUpdating(this->_cacheKey, true);
+  this->_updating = true;
+}
+
+bool ProxySession::startFill(time_t expires) {
+  this->_fill = this->_cache->startFill(this->_cacheKey, expires);
+  return this->_fill != NULL;
+}
+
+ProxyCache::Fill* ProxySession::getFill() const {
+  return this->_fill;
+}
+
+void ProxySession::commitFill() {
+  if (!this->_fill)
+    return;
+  this->_cache->commit(this->_fill);
+  delete this->_fill;
+  this->_fill = NULL;
+}
+
+void ProxySession::addWaiter(int fd) {
+  this->_waiters.push_back(fd);
+}
+
+void ProxySession::removeWaiter(int fd) {
+  std::vector<int>::iterator it =
+      std::find(this->_waiters.begin(), this->_waiters.end(), fd);
+  if (it != this->_waiters.end())
+    this->_waiters.erase(it);
+}
+
+const std::vector<int>& ProxySession::getWaiters() const {
+  return this->_waiters;
+}
+
+void ProxySession::setLockDeadline(time_t deadline) {
+  this->_lockDeadline = deadline;
+}
+
+time_t ProxySession::getLockDeadline() const {
+  return this->_lockDeadline;
+}
+
+bool ProxySession::canSplice() const {
+  return this->_clientFd != -1 && !this->_fill && this->_input.empty() &&
+         (this->_state == LENGTH || this->_state == UNTIL_CLOSE);
+}
+
+bool ProxySession::startSplice() {
+  if (pipe2(this->_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+    this->_pipe[0] = -1;
+    this->_pipe[1] = -1;
+    return false;
+  }
+  return true;
+}
+
+bool ProxySession::isSplicing() const {
+  return this->_pipe[0] != -1;
+}
+
+ProxySession::Result ProxySession::spliceFromUpstream() {
+  if (this->_state == COMPLETE)
+    return DONE;
+  size_t want = PROXY_CHUNK - this->_piped;
+  if (this->_state == LENGTH && this->_remaining < want)
+    want = this->_remaining;
+  if (!want)
+    return AGAIN;
+
+  ssize_t moved = splice(this->_upstreamFd, NULL, this->_pipe[1], NULL, want,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (moved == -1)
+    return errno == EAGAIN || errno == EWOULDBLOCK ? AGAIN : ERROR;
+  if (moved == 0) {
+    if (this->_state != UNTIL_CLOSE)
+      return ERROR;
+    this->_state = COMPLETE;
+    return DONE;
+  }
+  this->_piped += moved;
+  this->_lastActivity = time(NULL);
+  if (this->_state == LENGTH) {
+    this->_remaining -= moved;
+    if (!this->_remaining) {
+      this->_state = COMPLETE;
+      return DONE;
+    }
+  }
+  return AGAIN;
+}
+
+ssize_t ProxySession::spliceToClient(size_t max) {
+  if (!this->_piped || !max)
+    return 0;
+  ssize_t moved = splice(this->_pipe[0], NULL, this->_clientFd, NULL,
+                         std::min(this->_piped, max),
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (moved > 0)
+    this->_piped -= moved;
+  return moved;
+}
+
+bool ProxySession::hasPipedData() const {
+  return this->_piped > 0;
+}
+
+bool ProxySession::hasPipeRoom() const {
+  return this->_piped < PROXY_CHUNK;
+}
+
+void ProxySession::useConnection(int fd) {
+  this->_upstreamFd = fd;
+  this->_connected = true;
+  this->_reused = true;
+}
+
+void ProxySession::connectUpstream() {
+  const UpstreamAddress& upstream = getUpstream();
+
+  int fd = socket(upstream.addr.ss_family, SOCK_STREAM, 0);
+  if (fd == -1)
+    throw std::runtime_error("Failed to create upstream socket");
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  if (upstream.addr.ss_family == AF_INET) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  this->_upstreamFd = fd;
+  this->_reused = false;
+  if (connect(fd, reinterpret_cast<const struct sockaddr*>(&upstream.addr),
+              upstream.addrLen) == 0) {
+    this->_connected = true;
+    return;
+  }
+  if (errno != EINPROGRESS)
+    throw std::runtime_error("Failed to connect to upstream " + upstream.key);
+  this->_connected = false;
+}
+
+bool ProxySession::finishConnect() {
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (getsockopt(this->_upstreamFd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 ||
+      error != 0)
+    return false;
+  this->_connected = true;
+  this->_lastActivity = time(NULL);
+  return true;
+}
+
+void ProxySession::resetForRetry() {
+  closeUpstream();
+  this->_request = this->_original;
+  this->_requestOffset = 0;
+  this->_state = READ_HEAD;
+  this->_input.clear();
+}
+
+ssize_t ProxySession::writeRequest() {
+  ssize_t written =
+      send(this->_upstreamFd, this->_request.data() + this->_requestOffset,
+           this->_request.size() - this->_requestOffset, MSG_NOSIGNAL);
+  if (written > 0) {
+    this->_requestOffset += written;
+    this->_lastActivity = time(NULL);
+    if (this->_requestOffset >= this->_request.size()) {
+      this->_request.clear();
+      this->_requestOffset = 0;
+    }
+  }
+  return written;
+}
+
+// Pulls the next part of the body from the client; it is written upstream
+// before more is read, so at most one chunk of it is held in memory
+ssize_t ProxySession::pumpClientBody() {
+  char buffer[PROXY_CHUNK];
+  size_t want = this->_bodyRemaining;
+  if (want > sizeof(buffer))
+    want = sizeof(buffer);
+
+  ssize_t received = recv(this->_clientFd, buffer, want, 0);
+  if (received > 0) {
+    this->_request.assign(buffer, received);
+    this->_requestOffset = 0;
+    this->_bodyRemaining -= received;
+    this->_bodyStreamed = true;
+    this->_lastActivity = time(NULL);
+  }
+  return received;
+}
+
+// Turns the upstream status line and headers into the HTTP/1.0 head the
+// client gets and picks how the body is delimited. False while the head is
+// incomplete.
+bool ProxySession::parseHead(std::string& out) {
+  while (true) {
+    size_t headEnd = this->_input.find("\r\n\r\n");
+    if (headEnd == std::string::npos)
+      return false;
+
+    size_t lineEnd = this->_input.find("\r\n");
+    std::string statusLine = this->_input.substr(0, lineEnd);
+    std::istringstream status(statusLine);
+    std::string version;
+    int code = 0;
+    status >> version >> code;
+    if (version.compare(0, 5, "HTTP/") != 0 || code < 100 || code > 999)
+      throw std::runtime_error("Invalid upstream status line");
+    // Interim responses (100 Continue) are not forwarded to the client
+    if (code < 200) {
+      this->_input.erase(0, headEnd + 4);
+      continue;
+    }
+
+    std::string head = "HTTP/1.0" + statusLine.substr(version.size()) + "\r\n";
+    bool chunked = false;
+    bool hasLength = false;
+    bool closeRequested = version != "HTTP/1.1";
+    size_t length = 0;
+    this->_status = code;
+    this->_cacheControl.clear();
+    this->_private = false;
+    size_t pos = lineEnd + 2;
+    while (pos < headEnd) {
+      size_t next = this->_input.find("\r\n", pos);
+      std::string line = this->_input.substr(pos, next - pos);
+      pos = next + 2;
+
+      std::string name = headerName(line);
+      std::string value = lowercase(headerValue(line));
+      if (name == "transfer-encoding" && value.find("chunked") != std::string::npos)
+        chunked = true;
+      if (name == "connection" && value.find("close") != std::string::npos)
+        closeRequested = true;
+      if (name == "content-length") {
+        hasLength = true;
+        length = std::strtoul(value.c_str(), NULL, 10);
+      }
+      if (name == "cache-control")
+        this->_cacheControl += value + ",";
+      if (name == "set-cookie" || (name == "vary" && value == "*"))
+        this->_private = true;
+      if (!name.empty() && !isHopByHop(name))
+        head += line + "\r\n";
+    }
+    head += "Connection: close\r\n\r\n";
+    out += head;
+    this->_responseStarted = true;
+    this->_input.erase(0, headEnd + 4);
+
+    this->_keepAlive = !closeRequested;
+    if (this->_headOnly || code == 204 || code == 304)
+      this->_state = COMPLETE;
+    else if (chunked)
+      this->_state = CHUNK_SIZE;
+    else if (hasLength) {
+      this->_remaining = length;
+      this->_state = length ? LENGTH : COMPLETE;
+    } else {
+      this->_keepAlive = false;
+      this->_state = UNTIL_CLOSE;
+    }
+    return true;
+  }
+}
+
+ProxySession::Result ProxySession::parseBody(std::string& out) {
+  while (true) {
+    switch (this->_state) {
+      case READ_HEAD:
+        if (!parseHead(out))
+          return this->_input.size() > PROXY_CHUNK ? ERROR : AGAIN;
+        break;
+      case LENGTH:
+      case CHUNK_DATA: {
+        size_t take = this->_remaining < this->_input.size()
+                          ? this->_remaining
+                          : this->_input.size();
+        out.append(this->_input, 0, take);
+        this->_input.erase(0, take);
+        this->_remaining -= take;
+        if (this->_remaining)
+          return AGAIN;
+        this->_state = this->_state == LENGTH ? COMPLETE : CHUNK_CRLF;
+        break;
+      }
+      case CHUNK_SIZE: {
+        size_t lineEnd = this->_input.find("\r\n");
+        if (lineEnd == std::string::npos)
+          return this->_input.size() > 1024 ? ERROR : AGAIN;
+        char* end = NULL;
+        std::string line = this->_input.substr(0, lineEnd);
+        unsigned long size = std::strtoul(line.c_str(), &end, 16);
+        if (end == line.c_str())
+          return ERROR;
+        this->_input.erase(0, lineEnd + 2);
+        this->_remaining = size;
+        this->_state = size ? CHUNK_DATA : TRAILERS;
+        break;
+      }
+      case CHUNK_CRLF:
+        if (this->_input.size() < 2)
+          return AGAIN;
+        if (this->_input.compare(0, 2, "\r\n") != 0)
+          return ERROR;
+        this->_input.erase(0, 2);
+        this->_state = CHUNK_SIZE;
+        break;
+      case TRAILERS: {
+        // Trailer fields are dropped; they end with an empty line
+        size_t lineEnd = this->_input.find("\r\n");
+        if (lineEnd == std::string::npos)
+          return AGAIN;
+        this->_input.erase(0, lineEnd + 2);
+        if (lineEnd == 0)
+          this->_state = COMPLETE;
+        break;
+      }
+      case UNTIL_CLOSE:
+        out += this->_input;
+        this->_input.clear();
+        return AGAIN;
+      case COMPLETE:
+        return DONE;
+    }
+  }
+}
+
+// Reads what the upstream sent (at most one chunk, so a slow client can
+// push back) and appends the part meant for the client to out
+ProxySession::Result ProxySession::readResponse(std::string& out) {
+  char buffer[PROXY_CHUNK];
+
+  ssize_t bytesRead = recv(this->_upstreamFd, buffer, sizeof(buffer), 0);
+  if (bytesRead == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return AGAIN;
+  if (bytesRead > 0) {
+    this->_input.append(buffer, bytesRead);
+    this->_lastActivity = time(NULL);
+  }
+
+  Result result;
+  try {
+    result = parseBody(out);
+  } catch (const std::exception&) {
+    return ERROR;
+  }
+  if (result != AGAIN || bytesRead > 0)
+    return result;
+  // EOF or error: only a body delimited by the connection ends cleanly
+  if (bytesRead == 0 && this->_state == UNTIL_CLOSE) {
+    this->_state = COMPLETE;
+    return DONE;
+  }
+  return ERROR;
+}
+
+int ProxySession::releaseUpstream() {
+  int fd = this->_upstreamFd;
+  this->_upstreamFd = -1;
+  return fd;
+}
+
+void ProxySession::closeUpstream() {
+  if (this->_upstreamFd != -1) {
+    close(this->_upstreamFd);
+    this->_upstreamFd = -1;
+  }
+  this->_connected = false;
+}
@@ -0,0 +1,251 @@
+#include <RegexSet.hpp>
+#include <cctype>
+#include <stdexcept>
+
+RegexSet::RegexSet() : _patterns(), _states(1) {
+  this->_states[0].fail = 0;
+}
+
+// regex_t cannot be copied; the copy compiles its own patterns again
+RegexSet::RegexSet(const RegexSet& other)
+    : _patterns(other._patterns), _states(other._states) {
+  compileAll();
+}
+
+RegexSet& RegexSet::operator=(const RegexSet& other) {
+  if (this != &other) {
+    freeAll();
+    this->_patterns = other._patterns;
+    this->_states = other._states;
+    compileAll();
+  }
+  return *this;
+}
+
+RegexSet::~RegexSet() {
+  freeAll();
+}
+
+void RegexSet::compileAll() {
+  for (size_t i = 0; i < this->_patterns.size(); ++i) {
+    Pattern& p = this->_patterns[i];
+    int err = regcomp(&p.compiled, p.source.c_str(), p.flags);
+    if (err != 0) {
+      char message[256];
+      regerror(err, &p.compiled, message, sizeof(message));
+      this->_patterns.resize(i);
+      throw std::runtime_error("Invalid regex '" + p.source + "': " + message);
+    }
+  }
+}
+
+void RegexSet::freeAll() {
+  for (size_t i = 0; i < this->_patterns.size(); ++i)
+    regfree(&this->_patterns[i].compiled);
+}
+
+void RegexSet::add(const std::string& pattern, bool caseInsensitive) {
+  Pattern p;
+  p.source = pattern;
+  p.flags = REG_EXTENDED | (caseInsensitive ? REG_ICASE : 0);
+  p.hasLiteral = false;
+
+  regex_t compiled;
+  int err = regcomp(&compiled, pattern.c_str(), p.flags);
+  if (err != 0) {
+    char message[256];
+    regerror(err, &compiled, message, sizeof(message));
+    throw std::runtime_error("Invalid regex '" + pattern + "': " + message);
+  }
+  p.compiled = compiled;
+  this->_patterns.push_back(p);
+}
+
+size_t RegexSet::size() const {
+  return this->_patterns.size();
+}
+
+// Longest run of plain characters that every match must contain, lowercased.
+// Deliberately conservative: alternation disables the prefilter, group
+// contents are skipped, and a character followed by '?', '*' or '{' does
+// not count.
+std::string RegexSet::requiredLiteral(const std::string& pattern) {
+  std::string best;
+  std::string run;
+  int depth = 0;
+
+  if (pattern.find('|') != std::string::npos)
+    return "";
+  for (size_t i = 0; i < pattern.size(); ++i) {
+    char c = pattern[i];
+    bool literal = false;
+
+    if (c == '\\' && i + 1 < pattern.size()) {
+      c = pattern[++i];
+      literal = depth == 0 && ispunct((unsigned char)c);
+    } else if (c == '[') {
+      // Skip the bracket expression, including a leading ']' or '^]' and
+      // the ']' closing any [:class:], [=equiv=] or [.collating.] in it
+      size_t j = i + 1;
+      if (j < pattern.size() && pattern[j] == '^')
+        ++j;
+      if (j < pattern.size() && pattern[j] == ']')
+        ++j;
+      while (j < pattern.size() && pattern[j] != ']') {
+        if (pattern[j] == '[' && j + 1 < pattern.size() &&
+            (pattern[j + 1] == ':' || pattern[j + 1] == '=' ||
+             pattern[j + 1] == '.')) {
+          std::string close = std::string(1, pattern[j + 1]) + "]";
+          size_t end = pattern.find(close, j + 2);
+          if (end == std::string::npos)
+            return "";
+          j = end + 2;
+        } else {
+          ++j;
+        }
+      }
+      i = j;
+    } else if (c == '(') {
+      ++depth;
+    } else if (c == ')') {
+      if (depth > 0)
+        --depth;
+    } else if (c == '?' || c == '*' || c == '{') {
+      if (!run.empty())
+        run.erase(run.size() - 1);
+      if (c == '{')
+        while (i < pattern.size() && pattern[i] != '}')
+          ++i;
+    } else if (c != '.' && c != '^' && c != '$' && c != '+') {
+      literal = depth == 0;
+    }
+
+    if (literal) {
+      run += (char)std::tolower((unsigned char)c);
+    } else {
+      if (run.size() > best.size())
+        best = run;
+      // A '+' keeps the character it repeats required
+      if (c != '+')
+        run.clear();
+      else
+        run = run.empty() ? run : run.substr(run.size() - 1);
+    }
+  }
+  if (run.size() > best.size())
+    best = run;
+  return best;
+}
+
+int RegexSet::child(int state, unsigned char c) const {
+  const std::vector<std::pair<unsigned char, int> >& next =
+      this->_states[state].next;
+  for (size_t i = 0; i < next.size(); ++i)
+    if (next[i].first == c)
+      return next[i].second;
+  return -1;
+}
+
+int RegexSet::step(int state, unsigned char c) const {
+  while (true) {
+    int next = child(state, c);
+    if (next != -1)
+      return next;
+    if (state == 0)
+      return 0;
+    state = this->_states[state].fail;
+  }
+}
+
+void RegexSet::addLiteral(const std::string& literal, size_t pattern) {
+  int state = 0;
+  for (size_t i = 0; i < literal.size(); ++i) {
+    unsigned char c = literal[i];
+    int next = child(state, c);
+    if (next == -1) {
+      this->_states.push_back(State());
+      next = this->_states.size() - 1;
+      this->_states[next].fail = 0;
+      this->_states[state].next.push_back(std::make_pair(c, next));
+    }
+    state = next;
+  }
+  this->_states[state].output.push_back(pattern);
+}
+
+// Breadth-first pass that sets failure links and merges each state's
+// outputs with those of its failure state
+void RegexSet::buildAutomaton() {
+  std::vector<int> queue;
+  for (size_t i = 0; i < this->_states[0].next.size(); ++i)
+    queue.push_back(this->_states[0].next[i].second);
+
+  for (size_t head = 0; head < queue.size(); ++head) {
+    int state = queue[head];
+    for (size_t i = 0; i < this->_states[state].next.size(); ++i) {
+      unsigned char c = this->_states[state].next[i].first;
+      int next = this->_states[state].next[i].second;
+      int fail = this->_states[state].fail;
+      int target = child(fail, c);
+      while (target == -1 && fail != 0) {
+        fail = this->_states[fail].fail;
+        target = child(fail, c);
+      }
+      this->_states[next].fail = (target == -1 || target == next) ? 0 : target;
+      const std::vector<size_t>& inherited =
+          this->_states[this->_states[next].fail].output;
+      this->_states[next].output.insert(this->_states[next].output.end(),
+                                        inherited.begin(), inherited.end());
+      queue.push_back(next);
+    }
+  }
+}
+
+void RegexSet::build() {
+  this->_states.assign(1, State());
+  this->_states[0].fail = 0;
+  for (size_t i = 0; i < this->_patterns.size(); ++i) {
+    std::string literal = requiredLiteral(this->_patterns[i].source);
+    this->_patterns[i].hasLiteral = !literal.empty();
+    if (!literal.empty())
+      addLiteral(literal, i);
+  }
+  buildAutomaton();
+}
+
+long RegexSet::match(const std::string& subject,
+                     std::vector<std::string>* captures) const {
+  if (this->_patterns.empty())
+    return -1;
+
+  std::vector<char> candidate(this->_patterns.size(), 0);
+  int state = 0;
+  for (size_t i = 0; i < subject.size(); ++i) {
+    state = step(state, std::tolower((unsigned char)subject[i]));
+    const std::vector<size_t>& output = this->_states[state].output;
+    for (size_t j = 0; j < output.size(); ++j)
+      candidate[output[j]] = 1;
+  }
+
+  regmatch_t groups[REGEX_MAX_CAPTURES];
+  for (size_t i = 0; i < this->_patterns.size(); ++i) {
+    const Pattern& p = this->_patterns[i];
+    if (p.hasLiteral && !candidate[i])
+      continue;
+    if (regexec(&p.compiled, subject.c_str(), REGEX_MAX_CAPTURES, groups, 0))
+      continue;
+    if (captures) {
+      captures->clear();
+      for (size_t g = 0; g < REGEX_MAX_CAPTURES && g <= p.compiled.re_nsub;
+           ++g) {
+        if (groups[g].rm_so == -1)
+          captures->push_back("");
+        else
+          captures->push_back(subject.substr(
+              groups[g].rm_so, groups[g].rm_eo - groups[g].rm_so));
+      }
+    }
+    return i;
+  }
+  return -1;
+}
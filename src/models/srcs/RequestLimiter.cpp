@@ -0,0 +1,173 @@
+#include "RequestLimiter.hpp"
+#include "HttpResponse.hpp"
+#include "requestContext.hpp"
+
+#define LIMIT_REQ_NONE 0xffffffffu
+
+RequestLimiter::RequestLimiter() : _zones(), _responses() {}
+
+RequestLimiter::~RequestLimiter() {}
+
+uint64_t RequestLimiter::hashKey(const std::string& key) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < key.size(); ++i) {
+    h ^= static_cast<unsigned char>(key[i]);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+void RequestLimiter::open(const LimitReqZone& config) {
+  // What the size buys: the node and its bucket head
+  size_t capacity = config.size / (sizeof(Node) + sizeof(uint32_t));
+  if (!capacity)
+    capacity = 1;
+
+  std::map<std::string, Zone>::iterator it = this->_zones.find(config.name);
+  if (it != this->_zones.end() && it->second.nodes.size() == capacity &&
+      it->second.config.key == config.key) {
+    it->second.config = config;
+    return;
+  }
+  Zone& zone = this->_zones[config.name];
+  zone.config = config;
+  std::vector<Node>(capacity).swap(zone.nodes);
+  std::vector<uint32_t>(capacity, LIMIT_REQ_NONE).swap(zone.buckets);
+  zone.used = 0;
+  zone.newest = LIMIT_REQ_NONE;
+  zone.oldest = LIMIT_REQ_NONE;
+}
+
+void RequestLimiter::prune(const std::set<std::string>& names) {
+  for (std::map<std::string, Zone>::iterator it = this->_zones.begin();
+       it != this->_zones.end();) {
+    if (names.count(it->first))
+      ++it;
+    else
+      this->_zones.erase(it++);
+  }
+}
+
+// A request on a config older than the last reload may name a zone the
+// new one dropped; it gets a fresh table
+RequestLimiter::Zone& RequestLimiter::zoneFor(const LimitReqZone& config) {
+  std::map<std::string, Zone>::iterator it = this->_zones.find(config.name);
+  if (it != this->_zones.end())
+    return it->second;
+  open(config);
+  return this->_zones[config.name];
+}
+
+void RequestLimiter::unlinkLru(Zone& zone, uint32_t index) {
+  Node& node = zone.nodes[index];
+  if (node.newer != LIMIT_REQ_NONE)
+    zone.nodes[node.newer].older = node.older;
+  else
+    zone.newest = node.older;
+  if (node.older != LIMIT_REQ_NONE)
+    zone.nodes[node.older].newer = node.newer;
+  else
+    zone.oldest = node.newer;
+}
+
+void RequestLimiter::pushNewest(Zone& zone, uint32_t index) {
+  Node& node = zone.nodes[index];
+  node.newer = LIMIT_REQ_NONE;
+  node.older = zone.newest;
+  if (zone.newest != LIMIT_REQ_NONE)
+    zone.nodes[zone.newest].newer = index;
+  zone.newest = index;
+  if (zone.oldest == LIMIT_REQ_NONE)
+    zone.oldest = index;
+}
+
+// The key's node, made the most recently used; a key not in the table takes
+// a free node or the least recently used one, with an empty bucket
+RequestLimiter::Node& RequestLimiter::lookup(Zone& zone, uint64_t hash,
+                                             uint64_t now, bool& created) {
+  created = false;
+  uint32_t& head = zone.buckets[hash % zone.buckets.size()];
+  for (uint32_t i = head; i != LIMIT_REQ_NONE; i = zone.nodes[i].next) {
+    if (zone.nodes[i].hash != hash)
+      continue;
+    unlinkLru(zone, i);
+    pushNewest(zone, i);
+    return zone.nodes[i];
+  }
+
+  uint32_t index;
+  if (zone.used < zone.nodes.size()) {
+    index = zone.used++;
+  } else {
+    index = zone.oldest;
+    unlinkLru(zone, index);
+    uint32_t* link =
+        &zone.buckets[zone.nodes[index].hash % zone.buckets.size()];
+    while (*link != index)
+      link = &zone.nodes[*link].next;
+    *link = zone.nodes[index].next;
+  }
+  Node& node = zone.nodes[index];
+  node.hash = hash;
+  node.last = now;
+  node.excess = 0;
+  node.next = head;
+  head = index;
+  pushNewest(zone, index);
+  created = true;
+  return node;
+}
+
+RequestLimiter::Decision RequestLimiter::check(
+    const std::vector<LimitReqRule>& rules,
+    const std::vector<std::string>& keys, uint64_t now, uint64_t& delay) {
+  std::vector<std::pair<Node*, uint64_t> > charges;
+
+  delay = 0;
+  for (size_t i = 0; i < rules.size(); ++i) {
+    if (keys[i].empty())
+      continue;
+    const LimitReqRule& rule = rules[i];
+    Zone& zone = zoneFor(rule.zone);
+    bool created;
+    Node& node = lookup(zone, hashKey(keys[i]), now, created);
+
+    // The bucket drains at the zone's rate since the last request let
+    // through and this one adds a whole request to it; a new key starts
+    // empty
+    uint64_t drained = zone.config.rate * (now - node.last) / 1000;
+    uint64_t excess = 0;
+    if (!created && node.excess + 1000 > drained)
+      excess = node.excess + 1000 - drained;
+    if (excess > rule.burst * 1000)
+      return REJECT;
+    charges.push_back(std::make_pair(&node, excess));
+    if (!rule.nodelay && excess * 1000 / zone.config.rate > delay)
+      delay = excess * 1000 / zone.config.rate;
+  }
+  for (size_t i = 0; i < charges.size(); ++i) {
+    charges[i].first->excess = charges[i].second;
+    charges[i].first->last = now;
+  }
+  return delay ? DELAY : PASS;
+}
+
+const std::string& RequestLimiter::getRejectResponse(const RequestContext& ctx) {
+  const BaseBlock* block = ctx.location;
+  if (!block)
+    block = &ctx.server;
+  std::map<const BaseBlock*, std::string>::iterator it =
+      this->_responses.find(block);
+  if (it != this->_responses.end())
+    return it->second;
+
+  HttpResponse res;
+  res.setErrorFromContext(ctx.resolved.limitReqStatus, ctx);
+  res.setHeader("Retry-After", "1");
+  res.setVersion("HTTP/1.0");
+  return this->_responses[block] = res.build();
+}
+
+void RequestLimiter::drop(const BaseBlock* block) {
+  this->_responses.erase(block);
+}
@@ -0,0 +1,153 @@
+#include <ResolvedLocation.hpp>
+#include <Server.hpp>
+
+ResolvedLocation::ResolvedLocation()
+    : methods(0),
+      root(0),
+      indexFiles(),
+      errorPages(),
+      autoIndex(false),
+      clientMaxBodySize(0),
+      hasReturn(false),
+      returnData(0, ""),
+      uploadDir(),
+      cgiEnabled(false),
+      cgiCacheEnabled(false),
+      cgiCacheValid(0),
+      cgiCacheLockTimeout(0),
+      cgiStatus(false),
+      proxyEnabled(false),
+      proxy(),
+      proxyCacheEnabled(false),
+      proxyCache(),
+      proxyBuffering(),
+      limitReqs(),
+      limitReqStatus(LIMIT_REQ_DEFAULT_STATUS),
+      access(),
+      addHeaders(),
+      limitRate(0),
+      limitRateAfter(0),
+      hasVariables(false) {}
+
+unsigned ResolvedLocation::methodBit(const std::string& method) {
+  if (method == "GET")
+    return METHOD_GET;
+  if (method == "HEAD")
+    return METHOD_HEAD;
+  if (method == "POST")
+    return METHOD_POST;
+  if (method == "PUT")
+    return METHOD_PUT;
+  if (method == "DELETE")
+    return METHOD_DELETE;
+  if (method == "PATCH")
+    return METHOD_PATCH;
+  if (method == "OPTIONS")
+    return METHOD_OPTIONS;
+  return METHOD_OTHER;
+}
+
+// Same precedence the per-request accessors used to apply: the location
+// wins where it sets something, the server fills in the rest
+static bool refersToVariables(const std::string& root,
+                              const ResolvedLocation& resolved) {
+  if (!variableReferences(root).empty() ||
+      !variableReferences(resolved.returnData.second).empty())
+    return true;
+  for (size_t i = 0; i < resolved.addHeaders.size(); ++i)
+    if (!variableReferences(resolved.addHeaders[i].value).empty())
+      return true;
+  return false;
+}
+
+void ResolvedLocation::resolve(const Server& server,
+                               const LocationConfig* location,
+                               size_t internedRoot) {
+  this->root = internedRoot;
+
+  if (!location) {
+    this->methods = METHOD_GET | METHOD_HEAD | METHOD_POST | METHOD_PUT |
+                    METHOD_DELETE | METHOD_PATCH;
+    this->indexFiles = server.getIndexFiles();
+    this->errorPages = server.getErrorPages();
+    this->autoIndex = server.getAutoIndex();
+    this->clientMaxBodySize = server.getClientMaxBodySize();
+    this->hasReturn = server.hasReturn();
+    this->returnData = server.getReturnData();
+    this->uploadDir = server.getRoot();
+    this->cgiEnabled = server.isCgiEnabled();
+    this->cgiCacheEnabled = server.isCgiCacheEnabled();
+    this->cgiCacheValid = server.getCgiCacheValid();
+    this->cgiCacheLockTimeout = server.getCgiCacheLockTimeout();
+    this->cgiStatus = false;
+    this->proxyEnabled = false;
+    this->proxyCacheEnabled = false;
+    this->limitReqs = server.getLimitReqs();
+    this->limitReqStatus = server.getLimitReqStatus();
+    this->access = server.getAccess();
+    this->addHeaders = server.getAddHeaders();
+    this->limitRate = server.getLimitRate();
+    this->limitRateAfter = server.getLimitRateAfter();
+    this->hasVariables =
+        refersToVariables(server.getInternedRoot(internedRoot), *this);
+    return;
+  }
+
+  this->methods = 0;
+  const std::vector<std::string>& names = location->getMethods();
+  for (size_t i = 0; i < names.size(); ++i)
+    this->methods |= methodBit(names[i]);
+  if (!location->getIndexFiles().empty())
+    this->indexFiles = location->getIndexFiles();
+  else
+    this->indexFiles = server.getIndexFiles();
+  this->errorPages = server.getErrorPages();
+  const std::map<u_int16_t, std::string>& own = location->getErrorPages();
+  for (std::map<u_int16_t, std::string>::const_iterator it = own.begin();
+       it != own.end(); ++it)
+    this->errorPages[it->first] = it->second;
+  this->autoIndex = location->getAutoIndex();
+  this->clientMaxBodySize = location->getClientMaxBodySize();
+  if (location->hasReturn()) {
+    this->hasReturn = true;
+    this->returnData = location->getReturnData();
+  } else {
+    this->hasReturn = server.hasReturn();
+    this->returnData = server.getReturnData();
+  }
+  if (!location->getUploadDir().empty())
+    this->uploadDir = location->getUploadDir();
+  else
+    this->uploadDir = server.getRoot();
+  this->cgiEnabled = location->isCgiEnabled();
+  this->cgiCacheEnabled = location->isCgiCacheEnabled();
+  this->cgiCacheValid = location->getCgiCacheValid();
+  this->cgiCacheLockTimeout = location->getCgiCacheLockTimeout();
+  this->cgiStatus = location->isCgiStatus();
+  this->proxyEnabled = location->hasProxyPass();
+  if (this->proxyEnabled) {
+    this->proxy = location->getProxyPass();
+    this->proxyBuffering = location->getProxyBuffering();
+  }
+  this->limitReqs = location->getLimitReqs();
+  this->limitReqStatus = location->getLimitReqStatus();
+  this->access = location->getAccess();
+  this->addHeaders = location->getAddHeaders();
+  this->limitRate = location->getLimitRate();
+  this->limitRateAfter = location->getLimitRateAfter();
+  this->hasVariables =
+      refersToVariables(server.getInternedRoot(internedRoot), *this);
+  this->proxyCacheEnabled = this->proxyEnabled && location->hasProxyCache();
+  if (this->proxyCacheEnabled)
+    this->proxyCache = location->getProxyCache();
+}
+
+bool ResolvedLocation::isMethodAllowed(const std::string& method,
+                                       const LocationConfig* location) const {
+  unsigned bit = methodBit(method);
+  if (!(this->methods & bit))
+    return false;
+  if (bit != METHOD_OTHER)
+    return true;
+  return location && location->isMethodAllowed(method);
+}
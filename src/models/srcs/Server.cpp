@@ -5,7 +5,12 @@
    file
 */
 
-Server::Server() : BaseBlock(), _root("") {
+Server::Server()
+    : BaseBlock(),
+      _root(""),
+      _shutdownTimeout(SHUTDOWN_DEFAULT_TIMEOUT),
+      _limitConns(),
+      _limitConnStatus(LIMIT_CONN_DEFAULT_STATUS) {
   this->_serverNames.push_back("");
   setRoot();
 }
@@ -50,6 +55,13 @@ void Server::insertListen(u_int16_t port, const std::string& addr) {
   this->_listens.push_back(newListen);
 }
 
+// "listen ... default_server;" applies to the address named just before it
+void Server::setDefaultServer() {
+  if (this->_listens.empty())
+    throw std::runtime_error("'default_server' without a listen address");
+  this->_listens.back().defaultServer = true;
+}
+
 void Server::insertServerNames(const std::string& serverName) {
   if (serverName.empty())
     return;
@@ -67,8 +79,9 @@ void Server::insertServerNames(const std::string& serverName) {
 void Server::setRoot(const std::string& root) {
   if (root.empty())
     throw CommonExceptions::InititalaizingException();
-  if (root[root.length() - 1] != '/') {
-    this->_root = root + '/';
+  // A root built from variables is only known per request
+  if (root[root.length() - 1] != '/' || !variableReferences(root).empty()) {
+    this->_root = root[root.length() - 1] != '/' ? root + '/' : root;
     return;
   }
   struct stat st;
@@ -98,10 +111,28 @@ void Server::addLocation(const LocationConfig& location) {
   this->_locations.push_back(location);
 }
 
+LocationConfig& Server::newLocation(const std::string& path,
+                                    MatchType matchType) {
+  this->_locations.push_back(LocationConfig(path, matchType));
+  return this->_locations.back();
+}
+
+void Server::reserveLocations(size_t count) {
+  this->_locations.reserve(count);
+}
+
 const std::vector<LocationConfig>& Server::getLocations() const {
   return this->_locations;
 }
 
+// Builds the CGI tables of the server and of every location it holds
+void Server::compileCgiDispatch() {
+  buildCgiDispatch(*this);
+  for (std::vector<LocationConfig>::iterator it = _locations.begin();
+       it != _locations.end(); ++it)
+    it->buildCgiDispatch(*this);
+}
+
 const std::string& Server::getMatchingServerName(const std::string &hostHeader) const {
   // Extract hostname from Host header (remove port if present)
   std::string hostname = hostHeader;
@@ -127,21 +158,89 @@ const std::string& Server::getMatchingServerName(const std::string &hostHeader)
   return defaultName;
 }
 
+// Must run after the last addLocation(); throws on duplicate locations or
+// regexes that do not compile
+void Server::buildLocationIndex() {
+  this->_locationIndex.build(this->_locations);
+}
+
 const LocationConfig* Server::findLocation(const std::string& path) const {
-  // Find the most specific location that matches the path
-  const LocationConfig* bestMatch = NULL;
-  size_t longestMatch = 0;
-
-  for (std::vector<LocationConfig>::const_iterator it = _locations.begin();
-       it != _locations.end(); ++it) {
-    const std::string& locationPath = it->getPath();
-    if (path.find(locationPath) == 0 && locationPath.length() > longestMatch) {
-      bestMatch = &(*it);
-      longestMatch = locationPath.length();
-    }
+  long index = this->_locationIndex.find(path, this->_locations, NULL);
+  if (index == -1)
+    return NULL;
+  return &this->_locations[index];
+}
+
+// Same lookup; when a regex location wins, its capture groups ($0..$9) are
+// stored in captures
+const LocationConfig* Server::findLocation(
+    const std::string& path,
+    std::vector<std::string>& captures) const {
+  captures.clear();
+  long index = this->_locationIndex.find(path, this->_locations, &captures);
+  if (index == -1)
+    return NULL;
+  return &this->_locations[index];
+}
+
+// Blocks that share a root share one string
+size_t Server::internRoot(const std::string& root) {
+  for (size_t i = 0; i < this->_rootPool.size(); ++i)
+    if (this->_rootPool[i] == root)
+      return i;
+  this->_rootPool.push_back(root);
+  return this->_rootPool.size() - 1;
+}
+
+// Flattens server -> location inheritance into one ResolvedLocation per
+// location. Must run after the last addLocation() and once the server
+// directives are final: a server-level directive may follow the locations
+// that inherit it.
+void Server::resolveLocations() {
+  this->_rootPool.clear();
+  this->_resolvedServer.resolve(*this, NULL, internRoot(this->_root));
+  this->_resolved.assign(this->_locations.size(), ResolvedLocation());
+  for (size_t i = 0; i < this->_locations.size(); ++i) {
+    LocationConfig& location = this->_locations[i];
+    location.inheritFromServer(*this);
+    // Only use location's root if it's explicitly set (not the default)
+    std::string root = this->_root;
+    if (!location.getRoot().empty() && location.getRoot() != DEFAULT_ROOT_PATH)
+      root = location.getRoot();
+    this->_resolved[i].resolve(*this, &location, internRoot(root));
   }
+}
 
-  return bestMatch;
+void Server::linkUpstreams(
+    const std::map<std::string, UpstreamGroup>& upstreams,
+    const std::map<std::string, ProxyCacheZone>& zones,
+    const std::map<std::string, LimitReqZone>& limitZones) {
+  bool linked = linkLimitReqs(limitZones);
+  for (size_t i = 0; i < this->_locations.size(); ++i) {
+    if (this->_locations[i].linkLimitReqs(limitZones))
+      linked = true;
+    if (!this->_locations[i].hasProxyPass() &&
+        !this->_locations[i].hasProxyCache())
+      continue;
+    this->_locations[i].linkProxyPass(upstreams, zones);
+    linked = true;
+  }
+  if (linked)
+    resolveLocations();
+}
+
+// location must be NULL or one of this server's own locations
+const ResolvedLocation& Server::getResolved(
+    const LocationConfig* location) const {
+  if (!location || this->_resolved.empty())
+    return this->_resolvedServer;
+  return this->_resolved[location - &this->_locations[0]];
+}
+
+const std::string& Server::getInternedRoot(size_t root) const {
+  if (root >= this->_rootPool.size())
+    return this->_root;
+  return this->_rootPool[root];
 }
 
 u_int16_t Server::getServerPort(std::string server) const {
@@ -163,10 +262,135 @@ const std::string& Server::getServerAddr(std::string server) const {
     return defaultAddr;
 }
 
+void Server::setShutdownTimeout(const std::string& seconds) {
+  this->_shutdownTimeout = parseSeconds(seconds);
+}
+
+time_t Server::getShutdownTimeout() const {
+  return this->_shutdownTimeout;
+}
+
+void Server::addLimitConn(const std::vector<std::string>& args) {
+  LimitConnRule rule = LimitConnRule::parse(args);
+  for (size_t i = 0; i < this->_limitConns.size(); ++i)
+    if (this->_limitConns[i].zoneName == rule.zoneName)
+      throw std::runtime_error("Duplicate limit_conn zone: " + rule.zoneName);
+  this->_limitConns.push_back(rule);
+}
+
+const std::vector<LimitConnRule>& Server::getLimitConns() const {
+  return this->_limitConns;
+}
+
+void Server::setLimitConnStatus(const std::string& code) {
+  char* end = NULL;
+  long status = std::strtol(code.c_str(), &end, 10);
+  if (*end || status < 400 || status > 599)
+    throw std::runtime_error("Invalid value for 'limit_conn_status': " + code);
+  this->_limitConnStatus = status;
+}
+
+u_int16_t Server::getLimitConnStatus() const {
+  return this->_limitConnStatus;
+}
+
+void Server::linkLimitConns(
+    const std::map<std::string, LimitConnZone>& zones) {
+  for (size_t i = 0; i < this->_limitConns.size(); ++i)
+    this->_limitConns[i].link(zones);
+}
+
+// Variable names a block's root, return and add_header values refer to
+static void blockReferences(const BaseBlock& block, const std::string& root,
+                            std::set<std::string>& names) {
+  std::set<std::string> found = variableReferences(root);
+  names.insert(found.begin(), found.end());
+  found = variableReferences(block.getReturnData().second);
+  names.insert(found.begin(), found.end());
+  const std::vector<AddHeader>& headers = block.getAddHeaders();
+  for (size_t i = 0; i < headers.size(); ++i) {
+    found = variableReferences(headers[i].value);
+    names.insert(found.begin(), found.end());
+  }
+}
+
+void Server::linkMaps(const std::map<std::string, VariableMap>& maps) {
+  std::set<std::string> pending;
+  blockReferences(*this, this->_root, pending);
+  for (size_t i = 0; i < this->_locations.size(); ++i)
+    blockReferences(this->_locations[i], this->_locations[i].getRoot(),
+                    pending);
+
+  std::set<std::string> linked;
+  this->_maps.clear();
+  while (!pending.empty()) {
+    std::string name = *pending.begin();
+    pending.erase(pending.begin());
+    std::map<std::string, VariableMap>::const_iterator it = maps.find(name);
+    if (it == maps.end() || !linked.insert(name).second)
+      continue;
+    this->_maps.push_back(it->second);
+    std::set<std::string> more = it->second.getReferences();
+    pending.insert(more.begin(), more.end());
+  }
+}
+
+const VariableMap* Server::findMap(const std::string& name) const {
+  for (size_t i = 0; i < this->_maps.size(); ++i)
+    if (this->_maps[i].getVariable() == name)
+      return &this->_maps[i];
+  return NULL;
+}
+
 void Server::enableCgi(bool enabled) {
     setCgiEnabled(enabled);
 }
 
 bool Server::isCgiEnabled() const {
     return BaseBlock::isCgiEnabled();
-}
\ No newline at end of file
+}
+void Server::writeTo(CacheWriter& out) const {
+  writeBlock(out);
+  out.u64(this->_listens.size());
+  for (size_t i = 0; i < this->_listens.size(); ++i) {
+    out.u16(this->_listens[i].port);
+    out.str(this->_listens[i].addr);
+    out.u8(this->_listens[i].defaultServer);
+  }
+  out.strings(this->_serverNames);
+  out.str(this->_root);
+  out.u64(this->_shutdownTimeout);
+  out.u64(this->_limitConns.size());
+  for (size_t i = 0; i < this->_limitConns.size(); ++i)
+    this->_limitConns[i].writeTo(out);
+  out.u16(this->_limitConnStatus);
+  out.u64(this->_maps.size());
+  for (size_t i = 0; i < this->_maps.size(); ++i)
+    this->_maps[i].writeTo(out);
+  out.u64(this->_locations.size());
+  for (size_t i = 0; i < this->_locations.size(); ++i)
+    this->_locations[i].writeTo(out);
+}
+
+void Server::readFrom(CacheReader& in) {
+  readBlock(in);
+  this->_listens.resize(in.u64());
+  for (size_t i = 0; i < this->_listens.size(); ++i) {
+    this->_listens[i].port = in.u16();
+    this->_listens[i].addr = in.str();
+    this->_listens[i].defaultServer = in.u8();
+  }
+  this->_serverNames = in.strings();
+  this->_root = in.str();
+  this->_shutdownTimeout = in.u64();
+  this->_limitConns.assign(in.u64(), LimitConnRule());
+  for (size_t i = 0; i < this->_limitConns.size(); ++i)
+    this->_limitConns[i].readFrom(in);
+  this->_limitConnStatus = in.u16();
+  this->_maps.assign(in.u64(), VariableMap());
+  for (size_t i = 0; i < this->_maps.size(); ++i)
+    this->_maps[i].readFrom(in);
+  this->_locations.assign(in.u64(), LocationConfig());
+  for (size_t i = 0; i < this->_locations.size(); ++i)
+    this->_locations[i].readFrom(in);
+}
@@ -5,21 +5,39 @@
 #include "HttpRequest.hpp"
 #include "requestContext.hpp"
 #include "ResourceGuards.hpp"
+#include "CgiHandle.hpp"
+#include "CgiSession.hpp"
+#include "ProxySession.hpp"
+#include "ConfigCache.hpp"
+#include "ConfigSnapshot.hpp"
+#include "Container.hpp"
+#include "parser.hpp"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <cstdlib>
 #include <cstring>
+#include <strings.h>
 #include <cerrno>
 #include <iostream>
 #include <vector>
 #include <sstream>
 #include <string>
 #include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <sys/sendfile.h>
+#include <signal.h>
+#include <time.h>
 #include <fcntl.h>
 #include <map>
+#include <algorithm>
+#include <limits>
+#include <climits>
+#include <set>
 
 // the parentheses () mean default construction.
 SocketManager::SocketManager()
@@ -27,20 +45,157 @@ SocketManager::SocketManager()
       requestBuffers(),
       lastActivity(),
       sendBuffers(),
-      serverList(),
+      listenerKeys(),
+      configPath(),
+      configLoader(),
+      binaryPath(),
+      signalFd(-1),
+      upgradePid(-1),
+      upgradeParent(-1),
+      config(NULL),
+      shuttingDown(false),
+      shutdownDeadline(0),
+      drainConnections(0),
+      drainChildren(0),
+      proxies(*this),
+      spareFd(open("/dev/null", O_RDONLY | O_CLOEXEC)),
       httpParser(new HttpParser()),
       responseBuilder(new HttpResponse())
 {
 }
 
 // Add this setter to initialize the server list
-void SocketManager::setServers(const std::vector<Server> &servers)
+void SocketManager::setServers(std::vector<Server> &servers)
 {
-    serverList = servers;
+    installConfig(new ConfigSnapshot(servers));
+}
+
+void SocketManager::setConfigPath(const std::string &path)
+{
+    configPath = path;
+}
+
+bool SocketManager::loadServers(std::vector<Server> &servers)
+{
+    std::string compiled = ConfigCache::pathFor(configPath);
+    if (ConfigCache::read(compiled, servers))
+    {
+        std::cout << "Using compiled configuration " << compiled << std::endl;
+        return true;
+    }
+    if (access(compiled.c_str(), F_OK) == 0)
+        std::cout << "Compiled configuration " << compiled << " is out of date, parsing "
+                  << configPath << std::endl;
+    Container container = parser(configLoader.load(configPath));
+    container.releaseServers(servers);
+    return false;
+}
+
+// Makes snapshot the config new connections are accepted under; the one it
+// replaces lives on until its last connection or CGI child is done
+void SocketManager::installConfig(ConfigSnapshot *snapshot)
+{
+    snapshot->retain();
+    ConfigSnapshot *previous = config;
+    config = snapshot;
+    if (previous)
+        releaseConfig(previous);
+
+    // One microcache serves every location; it gets the largest budget any
+    // cache-enabled block asks for
+    size_t cacheBudget = config->getCgiCacheBudget();
+    if (cacheBudget)
+        cgiCache.setMaxSize(cacheBudget);
+
+    // Cache zones are opened (and their files indexed) up front rather than
+    // on the first request; one that failed gets another try on reload
+    proxies.pruneCaches();
+    // limit_req and limit_conn zones keep their counts across reloads
+    // unless resized
+    std::set<std::string> limitZones;
+    std::set<std::string> connZones;
+    const std::vector<Server> &servers = config->getServers();
+    for (size_t i = 0; i < servers.size(); ++i)
+    {
+        const std::vector<LimitConnRule> &connRules = servers[i].getLimitConns();
+        for (size_t k = 0; k < connRules.size(); ++k)
+        {
+            connectionLimiter.open(connRules[k].zone);
+            connZones.insert(connRules[k].zone.name);
+        }
+        const std::vector<LocationConfig> &locations = servers[i].getLocations();
+        for (size_t j = 0; j <= locations.size(); ++j)
+        {
+            const BaseBlock &block = j < locations.size() ? static_cast<const BaseBlock &>(locations[j])
+                                                          : static_cast<const BaseBlock &>(servers[i]);
+            const std::vector<LimitReqRule> &rules = block.getLimitReqs();
+            for (size_t k = 0; k < rules.size(); ++k)
+            {
+                requestLimiter.open(rules[k].zone);
+                limitZones.insert(rules[k].zone.name);
+            }
+            if (j < locations.size() && locations[j].hasProxyCache())
+                proxies.openCache(locations[j].getProxyCache().zone);
+        }
+    }
+    requestLimiter.prune(limitZones);
+    connectionLimiter.prune(connZones);
+}
+
+void SocketManager::releaseConfig(ConfigSnapshot *snapshot)
+{
+    if (!snapshot->release())
+        return;
+    const std::vector<Server> &servers = snapshot->getServers();
+    for (size_t i = 0; i < servers.size(); ++i)
+    {
+        cgiAdmission.drop(&servers[i]);
+        requestLimiter.drop(&servers[i]);
+        connectionLimiter.drop(&servers[i]);
+        forbiddenResponses.erase(&servers[i]);
+        const std::vector<LocationConfig> &locations = servers[i].getLocations();
+        for (size_t j = 0; j < locations.size(); ++j)
+        {
+            cgiAdmission.drop(&locations[j]);
+            requestLimiter.drop(&locations[j]);
+        }
+    }
+    delete snapshot;
 }
 
 SocketManager::~SocketManager()
 {
+    std::set<CgiSession *> sessions;
+    for (std::map<int, CgiSession *>::iterator it = cgiClients.begin(); it != cgiClients.end(); ++it)
+        sessions.insert(it->second);
+    for (std::map<int, CgiSession *>::iterator it = cgiPipes.begin(); it != cgiPipes.end(); ++it)
+        sessions.insert(it->second);
+    for (std::map<std::string, CgiSession *>::iterator it = cgiInFlight.begin(); it != cgiInFlight.end(); ++it)
+        sessions.insert(it->second);
+    cgiAdmission.collect(sessions);
+    for (std::set<CgiSession *>::iterator it = sessions.begin(); it != sessions.end(); ++it)
+        delete *it;
+    for (std::map<int, CgiSession *>::iterator it = cgiParked.begin(); it != cgiParked.end(); ++it)
+        delete it->second;
+
+    std::set<ConfigSnapshot *> snapshots;
+    proxies.collect(snapshots);
+    for (std::map<int, ConfigSnapshot *>::iterator it = clientConfigs.begin(); it != clientConfigs.end(); ++it)
+        snapshots.insert(it->second);
+    for (std::map<CgiSession *, ConfigSnapshot *>::iterator it = cgiConfigs.begin(); it != cgiConfigs.end(); ++it)
+        snapshots.insert(it->second);
+    if (config)
+        snapshots.insert(config);
+    for (std::set<ConfigSnapshot *>::iterator it = snapshots.begin(); it != snapshots.end(); ++it)
+        delete *it;
+    for (std::map<int, FileBody>::iterator it = sendFiles.begin(); it != sendFiles.end(); ++it)
+        close(it->second.fd);
+    for (std::map<int, sockaddr_in>::iterator it = clientAddresses.begin(); it != clientAddresses.end(); ++it)
+        close(it->first);
+    if (signalFd != -1)
+        close(signalFd);
+    if (spareFd != -1)
+        close(spareFd);
     closeSocket();
     // httpParser and responseBuilder auto-deleted by std::auto_ptr
 }
@@ -79,81 +234,114 @@ std::vector<ServerSocketInfo> convertServersToSocketInfo(const std::vector<Serve
 
 bool SocketManager::initSockets(const std::vector<ServerSocketInfo> &servers)
 {
-    std::map<std::string, int> existingSockets;
-
     for (size_t i = 0; i < servers.size(); ++i)
     {
         const ServerSocketInfo &server = servers[i];
         std::string key = server.host + ":" + server.port;
 
-        if (existingSockets.count(key))
+        if (listenerKeys.count(key))
         {
             std::cout << "Reusing existing socket for " << key
-                      << " (fd=" << existingSockets[key] << ")" << std::endl;
+                      << " (fd=" << listenerKeys[key] << ")" << std::endl;
             continue;
         }
 
-        struct addrinfo hints;
-        struct addrinfo *res = NULL;
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_family = AF_UNSPEC;
-        hints.ai_socktype = SOCK_STREAM;
-        hints.ai_flags = AI_PASSIVE;
-
-        const char *bindHost;
-        if (server.host.empty())
-            bindHost = "0.0.0.0";
-        else
-            bindHost = server.host.c_str();
-
-        if (getaddrinfo(bindHost, server.port.c_str(), &hints, &res) != 0)
+        int listen_fd = openListener(server.host, server.port);
+        if (listen_fd == -1)
         {
-            std::cerr << "getaddrinfo failed for " << key << std::endl;
             closeSocket();
             continue;
         }
 
-        int listen_fd = -1;
-        struct addrinfo *p;
-        for (p = res; p != NULL; p = p->ai_next)
-        {
-            SocketGuard socketGuard(socket(p->ai_family, p->ai_socktype, p->ai_protocol));
-            if (!socketGuard.isValid())
-                continue;
+        listeningSockets.push_back(listen_fd);
+        listenerKeys[key] = listen_fd;
+    }
+    if (listeningSockets.empty())
+        return false;
+    return true;
+}
+
+// Binds and listens on host:port; returns the socket or -1
+int SocketManager::openListener(const std::string &host, const std::string &port)
+{
+    std::string key = host + ":" + port;
+
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    const char *bindHost;
+    if (host.empty())
+        bindHost = "0.0.0.0";
+    else
+        bindHost = host.c_str();
+
+    if (getaddrinfo(bindHost, port.c_str(), &hints, &res) != 0)
+    {
+        std::cerr << "getaddrinfo failed for " << key << std::endl;
+        return -1;
+    }
 
-            int opt = 1;
-            setsockopt(socketGuard.get(), SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    int listen_fd = -1;
+    struct addrinfo *p;
+    for (p = res; p != NULL; p = p->ai_next)
+    {
+        SocketGuard socketGuard(socket(p->ai_family, p->ai_socktype, p->ai_protocol));
+        if (!socketGuard.isValid())
+            continue;
 
-            if (bind(socketGuard.get(), p->ai_addr, p->ai_addrlen) == 0)
+        int opt = 1;
+        setsockopt(socketGuard.get(), SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+        if (bind(socketGuard.get(), p->ai_addr, p->ai_addrlen) == 0)
+        {
+            if (listen(socketGuard.get(), 10) == -1)
             {
-                if (listen(socketGuard.get(), 10) == -1)
-                {
-                    std::cerr << "listen failed for " << key << std::endl;
-                    // SocketGuard auto-closes on continue
-                }
-                else
-                {
-                    listen_fd = socketGuard.release(); // Success - transfer ownership
-                    break;
-                }
+                std::cerr << "listen failed for " << key << std::endl;
+                // SocketGuard auto-closes on continue
+            }
+            else if (fcntl(socketGuard.get(), F_SETFL, O_NONBLOCK) == -1)
+            {
+                std::cerr << "fcntl failed for " << key << std::endl;
+            }
+            else
+            {
+                // Non-blocking: during a binary upgrade two processes
+                // accept on it and only one of them wins each connection
+                listen_fd = socketGuard.release(); // Success - transfer ownership
+                break;
             }
-            // SocketGuard auto-closes on loop iteration if bind failed
         }
-        freeaddrinfo(res);
+        // SocketGuard auto-closes on loop iteration if bind failed
+    }
+    freeaddrinfo(res);
 
-        if (listen_fd == -1)
+    if (listen_fd == -1)
+        std::cerr << "Failed to bind any address for " << key << std::endl;
+    return listen_fd;
+}
+
+// Stops accepting on one address; connections already accepted there are
+// separate sockets and carry on
+void SocketManager::closeListener(const std::string &key, int epfd)
+{
+    std::map<std::string, int>::iterator it = listenerKeys.find(key);
+    if (it == listenerKeys.end())
+        return;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, it->second, 0);
+    close(it->second);
+    for (size_t i = 0; i < listeningSockets.size(); ++i)
+    {
+        if (listeningSockets[i] == it->second)
         {
-            std::cerr << "Failed to bind any address for " << key << std::endl;
-            closeSocket();
-            continue;
+            listeningSockets.erase(listeningSockets.begin() + i);
+            break;
         }
-
-        listeningSockets.push_back(listen_fd);
-        existingSockets[key] = listen_fd;
     }
-    if (listeningSockets.empty())
-        return false;
-    return true;
+    listenerKeys.erase(it);
 }
 
 const std::vector<int> &SocketManager::getSockets() const
@@ -171,6 +359,7 @@ void SocketManager::closeSocket()
         }
     }
     listeningSockets.clear();
+    listenerKeys.clear();
 }
 
 bool SocketManager::isServerSocket(int fd) const
@@ -191,28 +380,139 @@ void SocketManager::acceptNewClient(int readyServerFd, int epfd)
     
     SocketGuard connectionGuard(accept(readyServerFd, (sockaddr *)&tempClientAddr, &tempClientLen));
     if (!connectionGuard.isValid())
+    {
+        if (errno == EMFILE || errno == ENFILE)
+            shedConnection(readyServerFd);
         return;
+    }
 
     if (fcntl(connectionGuard.get(), F_SETFL, O_NONBLOCK) == -1)
     {
         return; // SocketGuard auto-closes
     }
-    
-    // Store the client address for this specific connection
-    clientAddresses[connectionGuard.get()] = tempClientAddr;
-    
+
+    // The local address never changes for a connection, so its vhost table
+    // is looked up once here instead of on every request
+    sockaddr_in localAddr;
+    socklen_t localLen = sizeof(localAddr);
+    std::memset(&localAddr, 0, sizeof(localAddr));
+    long routes = -1;
+    if (getsockname(connectionGuard.get(), (sockaddr *)&localAddr, &localLen) == 0)
+        routes = config->getRouter().findTable(inet_ntoa(localAddr.sin_addr), ntohs(localAddr.sin_port));
+
+    // allow/deny and limit_conn are decided before anything is read; no Host
+    // header yet, so the default server of the address applies. Its
+    // allow/deny only speaks for the address when every vhost on it has the
+    // same list, and its limit_conn only when it is the address's one
+    // server; otherwise both wait for the request to be routed.
+    const Server &defaultServer = config->getServer(config->getRouter().route(routes, ""));
+    if (config->getRouter().sharesAccess(routes) && !defaultServer.getAccess().empty() &&
+        !defaultServer.getAccess().allows(tempClientAddr.sin_addr))
+    {
+        const std::string &response = getForbiddenResponse(defaultServer);
+        send(connectionGuard.get(), response.data(), response.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        return; // SocketGuard auto-closes
+    }
+    if (config->getRouter().servesOne(routes) && !defaultServer.getLimitConns().empty() &&
+        !limitConnection(connectionGuard.get(), defaultServer, tempClientAddr, localAddr))
+    {
+        const std::string &response = connectionLimiter.getRejectResponse(defaultServer);
+        send(connectionGuard.get(), response.data(), response.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        return; // SocketGuard auto-closes
+    }
+
     struct epoll_event ev;
     ev.events = EPOLLIN | EPOLLOUT;
     ev.data.fd = connectionGuard.get();
 
     if (epoll_ctl(epfd, EPOLL_CTL_ADD, connectionGuard.get(), &ev) == -1)
     {
+        connectionLimiter.release(connectionGuard.get());
         return; // SocketGuard auto-closes
     }
+
+    // Store the client address for this specific connection; only once
+    // epoll has it, so a failed registration leaves nothing behind
+    clientAddresses[connectionGuard.get()] = tempClientAddr;
+    clientRoutes[connectionGuard.get()] = routes;
+    // The connection is served by the config it arrived under, even if a
+    // reload swaps in another one meanwhile
+    clientConfigs[connectionGuard.get()] = config;
+    config->retain();
     std::cout << "Accepted new client fd=" << connectionGuard.get() << std::endl;
     connectionGuard.release(); // Success - epoll now manages the FD
 }
 
+// Counts the connection against the server's limit_conn zones; false, with
+// nothing counted, when it is over one of them
+bool SocketManager::limitConnection(int fd, const Server &server, const sockaddr_in &clientAddr,
+                                    const sockaddr_in &localAddr)
+{
+    const std::vector<LimitConnRule> &rules = server.getLimitConns();
+    std::vector<std::string> keys(rules.size());
+    for (size_t i = 0; i < rules.size(); ++i)
+    {
+        const std::string &key = rules[i].zone.key;
+        if (key == "$binary_remote_addr")
+            keys[i].assign(reinterpret_cast<const char *>(&clientAddr.sin_addr), sizeof(clientAddr.sin_addr));
+        else if (key == "$remote_addr")
+            keys[i] = inet_ntoa(clientAddr.sin_addr);
+        else if (!server.getServerNames().empty() && !server.getServerNames()[0].empty())
+            keys[i] = server.getServerNames()[0];
+        else
+            keys[i] = std::string(inet_ntoa(localAddr.sin_addr)) + ":" + initToString(ntohs(localAddr.sin_port));
+    }
+    return connectionLimiter.acquire(fd, rules, keys);
+}
+
+// A vhost sharing its address with others counts a connection once its
+// Host header has routed it there. One over a limit gets the server's
+// pre-built response and is closed once it is sent.
+bool SocketManager::limitRoutedConnection(int fd, const Server &server, const sockaddr_in &clientAddr, int epfd)
+{
+    if (server.getLimitConns().empty() || connectionLimiter.holds(fd))
+        return true;
+    sockaddr_in localAddr;
+    socklen_t localLen = sizeof(localAddr);
+    std::memset(&localAddr, 0, sizeof(localAddr));
+    getsockname(fd, (sockaddr *)&localAddr, &localLen);
+    if (limitConnection(fd, server, clientAddr, localAddr))
+        return true;
+    sendBuffers[fd] = connectionLimiter.getRejectResponse(server);
+    setClientEvents(fd, EPOLLIN | EPOLLOUT, epfd);
+    return false;
+}
+
+// The 403 a server's allow/deny sends at accept, built once per server
+const std::string &SocketManager::getForbiddenResponse(const Server &server)
+{
+    std::map<const Server *, std::string>::iterator it = forbiddenResponses.find(&server);
+    if (it != forbiddenResponses.end())
+        return it->second;
+
+    RequestContext ctx(server, NULL);
+    HttpResponse res;
+    res.setErrorFromContext(403, ctx);
+    res.setHeader("Connection", "close");
+    res.setVersion("HTTP/1.0");
+    return forbiddenResponses[&server] = res.build();
+}
+
+// Out of descriptors: the listening socket stays readable, and level
+// triggered epoll would spin on it. A descriptor kept in reserve is given
+// up to take the connection off the queue and close it, then taken back.
+void SocketManager::shedConnection(int listenFd)
+{
+    if (spareFd == -1)
+        return;
+    close(spareFd);
+    int fd = accept(listenFd, NULL, NULL);
+    if (fd != -1)
+        close(fd);
+    spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    std::cerr << "Out of file descriptors: dropped a new connection" << std::endl;
+}
+
 // Checks
 bool SocketManager::isRequestTooLarge(int fd)
 {
@@ -264,7 +564,7 @@ bool SocketManager::hasNonPrintableCharacters(int fd)
     return false;
 }
 
-bool SocketManager::isBodyTooLarge(int fd)
+bool SocketManager::isBodyTooLarge(int fd, size_t limit)
 {
     size_t header_end = requestBuffers[fd].find("\r\n\r\n");
     if (header_end == std::string::npos)
@@ -304,17 +604,44 @@ bool SocketManager::isBodyTooLarge(int fd)
         iss >> content_length;
     }
 
-    if (content_length > MAX_BODY_SIZE)
+    if (content_length > limit)
         return true;
 
-    // Check if body already received exceeds content_length or MAX_BODY_SIZE
+    // Check if body already received exceeds content_length or the limit
     size_t body_received = requestBuffers[fd].size() - (header_end + 4);
-    if (body_received > content_length || body_received > MAX_BODY_SIZE)
+    if (body_received > content_length || body_received > limit)
         return true;
 
     return false;
 }
 
+// Bodies for CGI and proxy_pass locations are streamed into the script or
+// upstream instead of being buffered, so only the configured
+// client_max_body_size applies to them.
+// Everything else still has to fit in MAX_BODY_SIZE.
+size_t SocketManager::getBodyLimit(int fd)
+{
+    size_t line_end = requestBuffers[fd].find("\r\n");
+    if (line_end == std::string::npos)
+        return MAX_BODY_SIZE;
+
+    std::istringstream lineStream(requestBuffers[fd].substr(0, line_end));
+    std::string method, target;
+    lineStream >> method >> target;
+
+    std::string cleanPath;
+    std::map<std::string, std::string> query;
+    HttpRequest::parseQuery(target, cleanPath, query);
+
+    Server &server = selectServerForClient(fd);
+    RequestContext ctx(server, server.findLocation(cleanPath));
+    if (!ctx.isCgiEnabled() && !ctx.resolved.proxyEnabled)
+        return MAX_BODY_SIZE;
+    if (ctx.getClientMaxBodySize() == 0)
+        return std::numeric_limits<size_t>::max();
+    return ctx.getClientMaxBodySize();
+}
+
 bool SocketManager::hasInvalidPercentEncoding(int fd)
 {
     size_t line_end = requestBuffers[fd].find("\r\n");
@@ -378,34 +705,51 @@ void SocketManager::sendHttpError(int fd, const std::string &status, int epfd)
     epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
 }
 
-Server &SocketManager::selectServerForClient(int clientFd)
+// Value of the Host header, or "" while the headers are incomplete
+static std::string extractHost(const std::string &raw)
 {
+    size_t header_end = raw.find("\r\n\r\n");
+    if (header_end == std::string::npos)
+        return "";
 
-    struct sockaddr_in serverAddr;
-    socklen_t addrlen = sizeof(serverAddr);
-    if (getsockname(clientFd, (struct sockaddr *)&serverAddr, &addrlen) == -1)
+    size_t pos = raw.find("\r\n");
+    while (pos < header_end)
     {
-        return serverList[0];
+        size_t start = pos + 2;
+        pos = raw.find("\r\n", start);
+        if (pos - start < 5 || strncasecmp(raw.c_str() + start, "host:", 5) != 0)
+            continue;
+        size_t begin = raw.find_first_not_of(" \t", start + 5);
+        size_t end = raw.find_last_not_of(" \t", pos - 1);
+        if (begin == std::string::npos || begin > end || begin >= pos)
+            return "";
+        return raw.substr(begin, end - begin + 1);
     }
-    std::string serverIP = inet_ntoa(serverAddr.sin_addr);
-    u_int16_t serverPort = ntohs(serverAddr.sin_port);
+    return "";
+}
 
-    for (size_t i = 0; i < serverList.size(); ++i)
-    {
-        const std::vector<ListenCtx> &listens = serverList[i].getListens();
-        for (size_t j = 0; j < listens.size(); ++j)
-        {
-            if (listens[j].port == serverPort &&
-                (listens[j].addr == "0.0.0.0" || listens[j].addr == serverIP))
-            {
-                return serverList[i];
-            }
-        }
-    }
-    return serverList[0];
+// Routes by listen address and Host header through the vhost tables. The
+// answer is kept for the connection once the headers are complete; before
+// that (early errors) the default server of the address is used.
+Server &SocketManager::selectServerForClient(int clientFd)
+{
+    std::map<int, ConfigSnapshot *>::iterator owner = clientConfigs.find(clientFd);
+    ConfigSnapshot *snapshot = owner != clientConfigs.end() ? owner->second : config;
+
+    std::map<int, size_t>::iterator cached = clientServers.find(clientFd);
+    if (cached != clientServers.end())
+        return snapshot->getServer(cached->second);
+
+    std::map<int, long>::iterator routes = clientRoutes.find(clientFd);
+    long table = routes != clientRoutes.end() ? routes->second : -1;
+
+    const std::string &raw = requestBuffers[clientFd];
+    size_t server = snapshot->getRouter().route(table, extractHost(raw));
+    if (raw.find("\r\n\r\n") != std::string::npos)
+        clientServers[clientFd] = server;
+    return snapshot->getServer(server);
 }
 
-// dummy full until omran finishes the parsing
 HttpRequest *SocketManager::fillRequest(const std::string &rawRequest, Server &server)
 {
     // std::cout << "=== Raw request ===\n" << rawRequest << "\n=== End ===" << std::endl;
@@ -433,10 +777,11 @@ HttpRequest *SocketManager::fillRequest(const std::string &rawRequest, Server &s
     HttpRequest::parseQuery(path, cleanPath, query);
     
     // Find matching location for this path
-    const LocationConfig *location = server.findLocation(cleanPath);
+    std::vector<std::string> captures;
+    const LocationConfig *location = server.findLocation(cleanPath, captures);
     
     // Create RequestContext with server and location
-    RequestContext ctx(server, location);
+    RequestContext ctx(server, location, captures);
 
     // Create appropriate HttpRequest subclass
     HttpRequest *request = makeRequestByMethod(method, ctx);
@@ -462,6 +807,22 @@ HttpRequest *SocketManager::fillRequest(const std::string &rawRequest, Server &s
             request->addHeader(key, value);
     }
 
+    // A Content-Length body is taken verbatim. Whatever has not arrived yet
+    // stays on the socket; handlers that can stream it (CGI) pick it up
+    // from there instead of waiting for the whole body to be buffered.
+    size_t bodyStart = rawRequest.find("\r\n\r\n");
+    if (!request->isChunked() && bodyStart != std::string::npos &&
+        request->getHeaders().count("content-length"))
+    {
+        std::string received = rawRequest.substr(bodyStart + 4);
+        size_t expected = request->contentLength();
+        if (received.size() > expected)
+            received.erase(expected);
+        request->appendBody(received);
+        request->setPendingBody(expected - received.size());
+        return request;
+    }
+
     // Parse the body (if present)
     std::string body, chunk;
     while (std::getline(stream, chunk))
@@ -534,9 +895,15 @@ HttpRequest *SocketManager::fillRequest(const std::string &rawRequest, Server &s
     return request;
 }
 
-void SocketManager::processFullRequest(int readyServerFd, int epfd, const std::string &rawRequest, sockaddr_in &clientAddr)
+void SocketManager::processFullRequest(int readyServerFd, int epfd, const std::string &rawRequest, sockaddr_in &clientAddr,
+                                       bool admitted)
 {
     Server &myServer = selectServerForClient(readyServerFd);
+    if (!admitted && !limitRoutedConnection(readyServerFd, myServer, clientAddr, epfd))
+    {
+        requestBuffers[readyServerFd].clear();
+        return;
+    }
 
     RequestGuard request(fillRequest(rawRequest, myServer));
     if (!request.isValid())
@@ -546,6 +913,13 @@ void SocketManager::processFullRequest(int readyServerFd, int epfd, const std::s
         return;
     }
 
+    // A server may listen on several ports; CGI's SERVER_PORT is the one
+    // this connection came in on
+    sockaddr_in localAddr;
+    socklen_t localLen = sizeof(localAddr);
+    if (getsockname(readyServerFd, (sockaddr *)&localAddr, &localLen) == 0)
+        request->setLocalPort(ntohs(localAddr.sin_port));
+
     // Validate the request before handling it
     // std::string validationError;
     // if (!request->validate(validationError))
@@ -566,103 +940,851 @@ void SocketManager::processFullRequest(int readyServerFd, int epfd, const std::s
     //     return; // RequestGuard automatically deletes on scope exit
     // }
 
+    request->expandVariables(rawRequest, clientAddr);
+
+    // allow/deny of the block the request was routed to; a denied client is
+    // not charged against limit_req either
+    const AccessList &access = request->getContext().resolved.access;
+    if (!access.empty() && !access.allows(clientAddr.sin_addr))
+    {
+        HttpResponse res;
+        res.setErrorFromContext(403, request->getContext());
+        queueResponse(readyServerFd, res, epfd);
+        requestBuffers[readyServerFd].clear();
+        return;
+    }
+
+    // Ahead of every handler, so a request over the rate costs no file
+    // access, CGI child or upstream connection
+    if (!admitted && !request->getContext().resolved.limitReqs.empty() &&
+        !admitRequest(readyServerFd, *request.get(), rawRequest, clientAddr, epfd))
+    {
+        requestBuffers[readyServerFd].clear();
+        return;
+    }
+
+    const ResolvedLocation &resolved = request->getContext().resolved;
+    if (resolved.limitRate && !sendRates.count(readyServerFd))
+    {
+        SendRate &rate = sendRates[readyServerFd];
+        rate.rate = resolved.limitRate;
+        rate.after = resolved.limitRateAfter;
+        rate.sent = 0;
+        rate.start = 0;
+        rate.due = 0;
+        rate.paused = false;
+        rate.events = EPOLLIN | EPOLLOUT;
+    }
+
+    if (request->getContext().resolved.cgiStatus)
+    {
+        sendCgiStatus(readyServerFd, epfd);
+        requestBuffers[readyServerFd].clear();
+        return;
+    }
+
+    if (request->getContext().resolved.proxyEnabled)
+    {
+        const std::string &method = request->getMethod();
+        if (!request->getContext().isMethodAllowed(method == "HEAD" ? "GET" : method))
+        {
+            HttpResponse res;
+            res.setErrorFromContext(405, request->getContext());
+            queueResponse(readyServerFd, res, epfd);
+        }
+        else
+        {
+            std::string upstreamRequest = ProxySession::buildRequestHead(rawRequest, *request.get(), clientAddr);
+            if (request->isChunked() || request->getHeaders().count("content-length"))
+                upstreamRequest += request->getBody();
+            ProxySession *session =
+                new ProxySession(request->getContext(), readyServerFd, upstreamRequest, request->getPendingBody(),
+                                 method == "HEAD", ProxySession::balanceKey(rawRequest, *request.get(), clientAddr));
+            proxies.start(session, rawRequest, *request.get(), clientAddr, epfd);
+        }
+        requestBuffers[readyServerFd].clear();
+        return;
+    }
+
     HttpResponse res;
     request->handle(res, clientAddr, epfd);
-    res.setVersion("HTTP/1.0");
-    sendBuffers[readyServerFd] = res.build();
 
-    struct epoll_event ev;
-    ev.events = EPOLLIN | EPOLLOUT;
-    ev.data.fd = readyServerFd;
-    epoll_ctl(epfd, EPOLL_CTL_MOD, readyServerFd, &ev);
+    // CGI handlers only prepare the child; it runs inside the event loop
+    CgiSession *session = request->releaseCgiSession();
+    if (session)
+    {
+        session->setClientFd(readyServerFd);
+        startCgiSession(session, epfd);
+        requestBuffers[readyServerFd].clear();
+        return;
+    }
+    addHeaders(res, request->getContext().getAddHeaders());
+    queueResponse(readyServerFd, res, epfd);
 
     requestBuffers[readyServerFd].clear();
     // RequestGuard automatically deletes request when function exits
 }
 
-bool SocketManager::isRequestMalformed(int fd)
+// add_header applies to successful responses and redirects unless always
+void SocketManager::addHeaders(HttpResponse &res, const std::vector<AddHeader> &headers)
 {
-    return isRequestLineMalformed(fd) || hasNonPrintableCharacters(fd) || hasInvalidPercentEncoding(fd);
+    int status = res.getStatusCode();
+    bool eligible = status == 200 || status == 201 || status == 204 || status == 206 || status == 301 ||
+                    status == 302 || status == 303 || status == 304 || status == 307 || status == 308;
+    for (size_t i = 0; i < headers.size(); ++i)
+        if (eligible || headers[i].always)
+            res.setHeader(headers[i].name, headers[i].value);
 }
 
-bool SocketManager::validateRequestSize(int fd, int epfd)
+static uint64_t monotonicMs()
 {
-    size_t header_end = requestBuffers[fd].find("\r\n\r\n");
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
 
-    if (header_end == std::string::npos && requestBuffers[fd].size() > MAX_HEADER_SIZE)
+// True when the request may go on now. Otherwise it was answered with the
+// block's pre-built limit_req_status response, or put aside until its turn
+// with the connection muted meanwhile.
+bool SocketManager::admitRequest(int fd, const HttpRequest &request, const std::string &rawRequest,
+                                 const sockaddr_in &clientAddr, int epfd)
+{
+    const RequestContext &ctx = request.getContext();
+    const std::vector<LimitReqRule> &rules = ctx.resolved.limitReqs;
+    std::vector<std::string> keys(rules.size());
+    for (size_t i = 0; i < rules.size(); ++i)
+        keys[i] = ProxySession::expandVariables(rules[i].zone.key, rawRequest, request, clientAddr);
+
+    uint64_t now = monotonicMs();
+    uint64_t delay;
+    RequestLimiter::Decision decision = requestLimiter.check(rules, keys, now, delay);
+    if (decision == RequestLimiter::PASS)
+        return true;
+    if (decision == RequestLimiter::REJECT)
     {
-        sendHttpError(fd, "431 Request Header Fields Too Large", epfd);
+        sendBuffers[fd] = requestLimiter.getRejectResponse(ctx);
+        setClientEvents(fd, EPOLLIN | EPOLLOUT, epfd);
         return false;
     }
+    DelayedRequest &delayed = limitDelayed[fd];
+    delayed.due = now + delay;
+    delayed.raw = rawRequest;
+    limitQueue.insert(std::make_pair(delayed.due, fd));
+    setClientEvents(fd, 0, epfd);
+    return false;
+}
 
-    if (header_end != std::string::npos)
+void SocketManager::handleLimitDelays(int epfd)
+{
+    uint64_t now = monotonicMs();
+    while (!limitQueue.empty() && limitQueue.begin()->first <= now)
     {
-        if (requestBuffers[fd].size() > MAX_REQUEST_SIZE || isBodyTooLarge(fd))
-        {
-            sendHttpError(fd, "413 Payload Too Large", epfd);
-            requestBuffers[fd].clear();
-            return false;
-        }
+        int fd = limitQueue.begin()->second;
+        limitQueue.erase(limitQueue.begin());
+        std::map<int, DelayedRequest>::iterator delayed = limitDelayed.find(fd);
+        std::string raw;
+        raw.swap(delayed->second.raw);
+        limitDelayed.erase(delayed);
+        setClientEvents(fd, EPOLLIN | EPOLLOUT, epfd);
+        processFullRequest(fd, epfd, raw, clientAddresses[fd], true);
     }
+}
 
-    return true;
+// A connection over its limit_rate gets EPOLLOUT back once the rate has
+// made up for what it sent; it is woken by the timer, never by sleeping
+size_t SocketManager::sendAllowance(int fd, int epfd)
+{
+    std::map<int, SendRate>::iterator it = sendRates.find(fd);
+    if (it == sendRates.end())
+        return static_cast<size_t>(-1);
+    SendRate &rate = it->second;
+    if (rate.paused)
+        return 0;
+    uint64_t now = monotonicMs();
+    if (!rate.start)
+        rate.start = now;
+
+    // A twentieth of a second's worth at least, so a throttled connection
+    // is not woken for every few bytes the clock lets through
+    uint64_t quantum = rate.rate / 20 ? rate.rate / 20 : 1;
+    uint64_t allowed = rate.after + rate.rate * (now - rate.start) / 1000;
+    if (allowed >= rate.sent + quantum || (rate.sent < rate.after && allowed > rate.sent))
+        return allowed - rate.sent;
+
+    uint64_t owed = rate.sent + quantum - rate.after;
+    rate.due = rate.start + (owed * 1000 + rate.rate - 1) / rate.rate;
+    if (rate.due <= now)
+        rate.due = now + 1;
+    rate.paused = true;
+    rateQueue.insert(std::make_pair(rate.due, fd));
+    struct epoll_event ev;
+    ev.events = rate.events & ~static_cast<uint32_t>(EPOLLOUT);
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+    return 0;
 }
 
-void SocketManager::handleRequest(int readyServerFd, int epfd)
+void SocketManager::chargeSend(int fd, size_t bytes)
 {
-    char buf[4096];
+    std::map<int, SendRate>::iterator it = sendRates.find(fd);
+    if (it != sendRates.end())
+        it->second.sent += bytes;
+}
 
-    ssize_t n = recv(readyServerFd, buf, sizeof(buf), 0);
-    if (n <= 0)
+void SocketManager::handleRateDelays(int epfd)
+{
+    uint64_t now = monotonicMs();
+    while (!rateQueue.empty() && rateQueue.begin()->first <= now)
     {
-        close(readyServerFd);
-        epoll_ctl(epfd, EPOLL_CTL_DEL, readyServerFd, 0);
-        requestBuffers.erase(readyServerFd);
-        lastActivity.erase(readyServerFd);
-        clientAddresses.erase(readyServerFd);
-        std::cout << "Closed client fd=" << readyServerFd << std::endl;
-        return;
+        int fd = rateQueue.begin()->second;
+        rateQueue.erase(rateQueue.begin());
+        SendRate &rate = sendRates[fd];
+        rate.paused = false;
+        setClientEvents(fd, rate.events, epfd);
     }
+}
 
-    lastActivity[readyServerFd] = time(NULL);
-    requestBuffers[readyServerFd].append(buf, n);
-
-    // Early malformed request validation
-    if (isRequestMalformed(readyServerFd))
-    {
-        sendHttpError(readyServerFd, "400 Bad Request", epfd);
-        requestBuffers[readyServerFd].clear();
-        return;
-    }
+// epoll_wait timeout: the once a second housekeeping, or sooner when a
+// held back request or a throttled connection comes due
+int SocketManager::nextTimeout() const
+{
+    if (limitQueue.empty() && rateQueue.empty())
+        return 1000;
+    uint64_t now = monotonicMs();
+    uint64_t due = limitQueue.empty() ? rateQueue.begin()->first : limitQueue.begin()->first;
+    if (!rateQueue.empty() && rateQueue.begin()->first < due)
+        due = rateQueue.begin()->first;
+    if (due <= now)
+        return 0;
+    return due - now < 1000 ? static_cast<int>(due - now) : 1000;
+}
 
-    // Request size validation
-    if (!validateRequestSize(readyServerFd, epfd))
-        return;
+void SocketManager::queueResponse(int fd, HttpResponse &res, int epfd)
+{
+    res.setVersion("HTTP/1.0");
+    sendBuffers[fd] = res.build();
+    FileBody body;
+    body.offset = 0;
+    body.fd = res.takeBodyFile(body.end);
+    if (body.fd != -1)
+        sendFiles[fd] = body;
+    setClientEvents(fd, EPOLLIN | EPOLLOUT, epfd);
+}
 
-    // If everything looks good and headers are complete, process request
-    size_t header_end = requestBuffers[readyServerFd].find("\r\n\r\n");
-    if (header_end != std::string::npos)
+void SocketManager::setClientEvents(int fd, uint32_t events, int epfd)
+{
+    // A paused connection keeps what it asks for until limit_rate wakes it
+    std::map<int, SendRate>::iterator rate = sendRates.empty() ? sendRates.end() : sendRates.find(fd);
+    if (rate != sendRates.end())
     {
-        // Use the stored client address for this connection
-        sockaddr_in actualClientAddr = clientAddresses[readyServerFd];
-        processFullRequest(readyServerFd, epfd, requestBuffers[readyServerFd], actualClientAddr);
-        requestBuffers[readyServerFd].clear();
+        rate->second.events = events;
+        if (rate->second.paused)
+            events &= ~static_cast<uint32_t>(EPOLLOUT);
     }
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
 }
 
-void SocketManager::handleTimeouts(int epfd)
+void SocketManager::closeClient(int fd, int epfd)
 {
-    time_t now = time(NULL);
-    std::map<int, time_t>::iterator it = lastActivity.begin();
+    std::map<int, CgiSession *>::iterator waiting = cgiWaiting.find(fd);
+    if (waiting != cgiWaiting.end())
+    {
+        waiting->second->removeWaiter(fd);
+        delete unparkCgiWaiter(fd);
+    }
 
-    while (it != lastActivity.end())
+    std::map<int, CgiSession *>::iterator cgi = cgiClients.find(fd);
+    if (cgi != cgiClients.end())
+    {
+        CgiSession *session = cgi->second;
+        if (session->getWaiters().empty())
+            releaseCgiSession(session, epfd);
+        else
+        {
+            // Others are parked on this run: let it finish for them
+            cgiClients.erase(cgi);
+            session->setClientFd(-1);
+        }
+    }
+
+    proxies.dropClient(fd, epfd);
+
+    std::map<int, DelayedRequest>::iterator delayed = limitDelayed.find(fd);
+    if (delayed != limitDelayed.end())
+    {
+        std::multimap<uint64_t, int>::iterator due = limitQueue.lower_bound(delayed->second.due);
+        while (due->second != fd)
+            ++due;
+        limitQueue.erase(due);
+        limitDelayed.erase(delayed);
+    }
+
+    std::map<int, SendRate>::iterator rate = sendRates.find(fd);
+    if (rate != sendRates.end())
+    {
+        if (rate->second.paused)
+        {
+            std::multimap<uint64_t, int>::iterator due = rateQueue.lower_bound(rate->second.due);
+            while (due->second != fd)
+                ++due;
+            rateQueue.erase(due);
+        }
+        sendRates.erase(rate);
+    }
+
+    connectionLimiter.release(fd);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, 0);
+    close(fd);
+    requestBuffers.erase(fd);
+    lastActivity.erase(fd);
+    sendBuffers.erase(fd);
+    std::map<int, FileBody>::iterator file = sendFiles.find(fd);
+    if (file != sendFiles.end())
+    {
+        close(file->second.fd);
+        sendFiles.erase(file);
+    }
+    clientAddresses.erase(fd);
+    clientRoutes.erase(fd);
+    clientServers.erase(fd);
+    std::map<int, ConfigSnapshot *>::iterator owner = clientConfigs.find(fd);
+    if (owner != clientConfigs.end())
+    {
+        ConfigSnapshot *snapshot = owner->second;
+        clientConfigs.erase(owner);
+        releaseConfig(snapshot);
+    }
+}
+
+std::string &SocketManager::getSendBuffer(int fd)
+{
+    return sendBuffers[fd];
+}
+
+FileBody *SocketManager::findFileBody(int fd)
+{
+    std::map<int, FileBody>::iterator it = sendFiles.find(fd);
+    return it != sendFiles.end() ? &it->second : NULL;
+}
+
+FileBody &SocketManager::addFileBody(int fd, const FileBody &body)
+{
+    return sendFiles[fd] = body;
+}
+
+bool SocketManager::hasPendingOutput(int fd) const
+{
+    std::map<int, std::string>::const_iterator pending = sendBuffers.find(fd);
+    return (pending != sendBuffers.end() && !pending->second.empty()) || sendFiles.count(fd);
+}
+
+// The snapshot a client was accepted under, which its requests resolve in
+ConfigSnapshot *SocketManager::getClientConfig(int fd)
+{
+    std::map<int, ConfigSnapshot *>::iterator it = clientConfigs.find(fd);
+    return it != clientConfigs.end() ? it->second : config;
+}
+
+void SocketManager::startCgiSession(CgiSession *session, int epfd)
+{
+    int clientFd = session->getClientFd();
+
+    if (!session->getCacheKey().empty())
+    {
+        const std::string *cached = cgiCache.lookup(session->getCacheKey(), time(NULL));
+        if (cached)
+        {
+            sendBuffers[clientFd] = *cached;
+            setClientEvents(clientFd, EPOLLIN | EPOLLOUT, epfd);
+            delete session;
+            return;
+        }
+        // Collapse concurrent misses onto the run that is already going
+        std::map<std::string, CgiSession *>::iterator leader = cgiInFlight.find(session->getCacheKey());
+        if (leader != cgiInFlight.end())
+        {
+            leader->second->addWaiter(clientFd);
+            cgiWaiting[clientFd] = leader->second;
+            cgiParked[clientFd] = session;
+            session->setLockDeadline(time(NULL) + session->getContext().resolved.cgiCacheLockTimeout);
+            setClientEvents(clientFd, 0, epfd);
+            return;
+        }
+    }
+
+    cgiClients[clientFd] = session;
+    if (!session->getCacheKey().empty())
+        cgiInFlight[session->getCacheKey()] = session;
+    // The session's context points into its client's config: keep that
+    // alive even if the client goes away and waiters keep the script running
+    ConfigSnapshot *snapshot = clientConfigs.count(clientFd) ? clientConfigs[clientFd] : config;
+    cgiConfigs[session] = snapshot;
+    snapshot->retain();
+
+    switch (cgiAdmission.admit(session, time(NULL)))
+    {
+    case CgiAdmission::REJECT:
+        rejectCgiSession(session, epfd);
+        return;
+    case CgiAdmission::QUEUE:
+        // Leave the rest of the body in the socket until a slot frees up
+        setClientEvents(clientFd, 0, epfd);
+        return;
+    case CgiAdmission::ADMIT:
+        runCgiSession(session, epfd);
+        return;
+    }
+}
+
+// Spawns an admitted session and wires its pipes into the event loop. The
+// client may already be gone when a queued run finally starts; its result
+// then only goes to the requests collapsed onto it.
+void SocketManager::runCgiSession(CgiSession *session, int epfd)
+{
+    int clientFd = session->getClientFd();
+
+    try
+    {
+        session->spawn();
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "CGI Execution Error: " << e.what() << '\n';
+        failCgiSession(session, 500, epfd);
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = session->getStdoutFd();
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, session->getStdoutFd(), &ev) == -1)
+    {
+        failCgiSession(session, 500, epfd);
+        return;
+    }
+    cgiPipes[session->getStdoutFd()] = session;
+
+    if (clientFd == -1 || (!session->hasBufferedInput() && !session->isStreamingBody()))
+    {
+        session->closeStdin();
+        if (clientFd != -1)
+            setClientEvents(clientFd, 0, epfd);
+        return;
+    }
+
+    // The buffered part of the body goes first; once it has drained, the
+    // stdin pipe hands over to the client socket (see handleCgiEvent).
+    ev.events = session->hasBufferedInput() ? (uint32_t)EPOLLOUT : 0;
+    ev.data.fd = session->getStdinFd();
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, session->getStdinFd(), &ev) == -1)
+    {
+        failCgiSession(session, 500, epfd);
+        return;
+    }
+    cgiPipes[session->getStdinFd()] = session;
+    setClientEvents(clientFd, session->hasBufferedInput() ? 0 : (uint32_t)EPOLLIN, epfd);
+}
+
+void SocketManager::handleCgiEvent(int fd, uint32_t events, int epfd)
+{
+    CgiSession *session = cgiPipes[fd];
+
+    if (fd == session->getStdoutFd())
+    {
+        try
+        {
+            if (session->readOutput())
+                finishCgiSession(session, epfd);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "CGI Execution Error: " << e.what() << '\n';
+            failCgiSession(session, 500, epfd);
+        }
+        return;
+    }
+
+    // stdin: either the script closed its end or the pipe has room again
+    if (events & (EPOLLERR | EPOLLHUP))
+    {
+        setClientEvents(session->getClientFd(), 0, epfd);
+        releaseCgiStdin(session, epfd);
+        return;
+    }
+    if (session->hasBufferedInput())
+    {
+        ssize_t written = session->writeBufferedInput();
+        if (written == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            releaseCgiStdin(session, epfd);
+            return;
+        }
+        if (session->hasBufferedInput())
+            return;
+    }
+    if (!session->isStreamingBody())
+    {
+        releaseCgiStdin(session, epfd);
+        return;
+    }
+
+    // Stop watching the pipe and resume pulling from the client
+    struct epoll_event ev;
+    ev.events = 0;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+    setClientEvents(session->getClientFd(), EPOLLIN, epfd);
+}
+
+// Called when the client socket of a running CGI request is readable. Flow
+// control works both ways: while the pipe is full the socket is not polled
+// (TCP backpressure reaches the client), and while the socket is empty the
+// pipe is not polled.
+void SocketManager::streamCgiBody(CgiSession *session, int epfd)
+{
+    int clientFd = session->getClientFd();
+
+    if (session->getStdinFd() == -1)
+    {
+        setClientEvents(clientFd, 0, epfd);
+        return;
+    }
+
+    ssize_t moved = session->pumpClientBody();
+    if (moved == 0 || (moved == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+        // Client hung up or the script closed stdin before reading it all
+        setClientEvents(clientFd, 0, epfd);
+        releaseCgiStdin(session, epfd);
+        return;
+    }
+    if (moved > 0 && !session->hasBufferedInput())
+    {
+        if (!session->isStreamingBody())
+        {
+            setClientEvents(clientFd, 0, epfd);
+            releaseCgiStdin(session, epfd);
+        }
+        return;
+    }
+
+    // The pipe is full (or a recv() fallback chunk is waiting to be written):
+    // park the socket until the script drains some input
+    setClientEvents(clientFd, 0, epfd);
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.fd = session->getStdinFd();
+    epoll_ctl(epfd, EPOLL_CTL_MOD, session->getStdinFd(), &ev);
+}
+
+// The script closed stdout. The response is built once the child has
+// exited; one still running waits for its SIGCHLD (or the CGI timeout)
+// without holding up the loop.
+void SocketManager::finishCgiSession(CgiSession *session, int epfd)
+{
+    releaseCgiStdin(session, epfd);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, session->getStdoutFd(), 0);
+    cgiPipes.erase(session->getStdoutFd());
+    session->closeStdout();
+
+    int code;
+    if (session->reap(code))
+        completeCgiSession(session, code, epfd);
+    else
+        cgiExiting.insert(session);
+}
+
+void SocketManager::reapCgiSessions(int epfd)
+{
+    for (size_t i = 0; i < cgiKilled.size();)
+    {
+        if (waitpid(cgiKilled[i], NULL, WNOHANG) == 0)
+        {
+            ++i;
+            continue;
+        }
+        cgiKilled[i] = cgiKilled.back();
+        cgiKilled.pop_back();
+    }
+
+    std::vector<CgiSession *> exiting(cgiExiting.begin(), cgiExiting.end());
+    for (size_t i = 0; i < exiting.size(); ++i)
+    {
+        int code;
+        if (!exiting[i]->reap(code))
+            continue;
+        cgiExiting.erase(exiting[i]);
+        completeCgiSession(exiting[i], code, epfd);
+    }
+}
+
+void SocketManager::completeCgiSession(CgiSession *session, int code, int epfd)
+{
+    HttpResponse res;
+
+    if (code != 0)
+    {
+        std::cerr << "CGI Execution Error: " << CgiHandle::CgiExecutionException().what() << '\n';
+        res.setErrorFromContext(500, session->getContext());
+    }
+    else
+    {
+        try
+        {
+            CgiHandle cgiHandler;
+            cgiHandler.parseCgiResponse(session->getOutput(), res);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Invalid CGI Response: " << e.what() << '\n';
+            res.setErrorFromContext(502, session->getContext());
+        }
+    }
+    deliverCgiResponse(session, res, epfd);
+    releaseCgiSession(session, epfd);
+}
+
+// Sends the outcome of a run to its client and to every request that was
+// collapsed onto it, and keeps a copy in the microcache when allowed
+void SocketManager::deliverCgiResponse(CgiSession *session, HttpResponse &res, int epfd)
+{
+    res.setVersion("HTTP/1.0");
+    std::string raw = res.build();
+
+    if (!session->getCacheKey().empty())
+        cgiCache.store(session->getCacheKey(), raw, CgiCache::ttlFor(res, session->getCacheTtl()), time(NULL));
+    sendToCgiClients(session, raw, epfd);
+}
+
+void SocketManager::sendToCgiClients(CgiSession *session, const std::string &raw, int epfd)
+{
+    if (session->getClientFd() != -1)
+    {
+        sendBuffers[session->getClientFd()] = raw;
+        setClientEvents(session->getClientFd(), EPOLLIN | EPOLLOUT, epfd);
+    }
+    const std::vector<int> &waiters = session->getWaiters();
+    for (size_t i = 0; i < waiters.size(); ++i)
+    {
+        sendBuffers[waiters[i]] = raw;
+        setClientEvents(waiters[i], EPOLLIN | EPOLLOUT, epfd);
+        delete unparkCgiWaiter(waiters[i]);
+    }
+}
+
+void SocketManager::failCgiSession(CgiSession *session, int code, int epfd)
+{
+    HttpResponse res;
+
+    res.setErrorFromContext(code, session->getContext());
+    deliverCgiResponse(session, res, epfd);
+    releaseCgiSession(session, epfd);
+}
+
+// Turns a request away with the pool's pre-built 503 (queue full or waited
+// too long); nothing about the response depends on the request itself
+void SocketManager::rejectCgiSession(CgiSession *session, int epfd)
+{
+    sendToCgiClients(session, cgiAdmission.getBusyResponse(session), epfd);
+    releaseCgiSession(session, epfd);
+}
+
+void SocketManager::sendCgiStatus(int fd, int epfd)
+{
+    HttpResponse res;
+
+    res.setStatus(200, "OK");
+    res.setHeader("Content-Type", "text/plain");
+    res.setBody(cgiAdmission.report());
+    queueResponse(fd, res, epfd);
+}
+
+void SocketManager::releaseCgiStdin(CgiSession *session, int epfd)
+{
+    int fd = session->getStdinFd();
+    if (fd == -1)
+        return;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, 0);
+    cgiPipes.erase(fd);
+    session->closeStdin();
+}
+
+// Unregisters the session and kills the child if it is still running; the
+// child is left to reapCgiSessions rather than waited for here
+void SocketManager::releaseCgiSession(CgiSession *session, int epfd)
+{
+    releaseCgiStdin(session, epfd);
+    cgiExiting.erase(session);
+    if (session->getStdoutFd() != -1)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, session->getStdoutFd(), 0);
+        cgiPipes.erase(session->getStdoutFd());
+    }
+    if (session->getClientFd() != -1)
+        cgiClients.erase(session->getClientFd());
+    const std::vector<int> &waiters = session->getWaiters();
+    for (size_t i = 0; i < waiters.size(); ++i)
+        delete unparkCgiWaiter(waiters[i]);
+    std::map<std::string, CgiSession *>::iterator inFlight = cgiInFlight.find(session->getCacheKey());
+    if (inFlight != cgiInFlight.end() && inFlight->second == session)
+        cgiInFlight.erase(inFlight);
+
+    CgiSession *next = NULL;
+    if (cgiAdmission.release(session))
+        next = cgiAdmission.next(session);
+    std::map<CgiSession *, ConfigSnapshot *>::iterator owner = cgiConfigs.find(session);
+    ConfigSnapshot *snapshot = owner != cgiConfigs.end() ? owner->second : NULL;
+    if (owner != cgiConfigs.end())
+        cgiConfigs.erase(owner);
+    pid_t killed = session->terminate();
+    if (killed > 0)
+        cgiKilled.push_back(killed);
+    delete session;
+    if (snapshot)
+        releaseConfig(snapshot);
+    if (next)
+        runCgiSession(next, epfd);
+}
+
+// Forgets a client parked on another run of its script and hands back the
+// request it came with
+CgiSession *SocketManager::unparkCgiWaiter(int fd)
+{
+    cgiWaiting.erase(fd);
+    std::map<int, CgiSession *>::iterator parked = cgiParked.find(fd);
+    if (parked == cgiParked.end())
+        return NULL;
+    CgiSession *session = parked->second;
+    cgiParked.erase(parked);
+    return session;
+}
+
+void SocketManager::handleCgiTimeouts(int epfd)
+{
+    time_t now = time(NULL);
+    std::set<CgiSession *> expiredSet;
+
+    for (std::map<int, CgiSession *>::iterator it = cgiPipes.begin(); it != cgiPipes.end(); ++it)
+    {
+        if (now - it->second->getLastActivity() > CGI_TIMEOUT)
+            expiredSet.insert(it->second);
+    }
+    for (std::set<CgiSession *>::iterator it = cgiExiting.begin(); it != cgiExiting.end(); ++it)
+    {
+        if (now - (*it)->getLastActivity() > CGI_TIMEOUT)
+            expiredSet.insert(*it);
+    }
+    std::vector<CgiSession *> expired(expiredSet.begin(), expiredSet.end());
+    for (size_t i = 0; i < expired.size(); ++i)
+    {
+        std::cerr << "CGI Timeout: " << CgiHandle::CgiTimeoutException().what() << '\n';
+        failCgiSession(expired[i], 504, epfd);
+    }
+
+    std::vector<CgiSession *> unserved;
+    cgiAdmission.expire(now, unserved);
+    for (size_t i = 0; i < unserved.size(); ++i)
+        rejectCgiSession(unserved[i], epfd);
+
+    // Parked past cgi_cache_lock_timeout: the run it waits on is stuck or
+    // slow, so the request runs the script itself and leaves the cache alone
+    std::vector<int> late;
+    for (std::map<int, CgiSession *>::iterator it = cgiParked.begin(); it != cgiParked.end(); ++it)
+        if (now >= it->second->getLockDeadline())
+            late.push_back(it->first);
+    for (size_t i = 0; i < late.size(); ++i)
+    {
+        cgiWaiting[late[i]]->removeWaiter(late[i]);
+        CgiSession *session = unparkCgiWaiter(late[i]);
+        session->setCache("", 0);
+        startCgiSession(session, epfd);
+    }
+}
+
+bool SocketManager::isRequestMalformed(int fd)
+{
+    return isRequestLineMalformed(fd) || hasNonPrintableCharacters(fd) || hasInvalidPercentEncoding(fd);
+}
+
+bool SocketManager::validateRequestSize(int fd, int epfd)
+{
+    size_t header_end = requestBuffers[fd].find("\r\n\r\n");
+
+    if (header_end == std::string::npos && requestBuffers[fd].size() > MAX_HEADER_SIZE)
+    {
+        sendHttpError(fd, "431 Request Header Fields Too Large", epfd);
+        return false;
+    }
+
+    if (header_end != std::string::npos)
+    {
+        if (requestBuffers[fd].size() > MAX_REQUEST_SIZE || isBodyTooLarge(fd, getBodyLimit(fd)))
+        {
+            sendHttpError(fd, "413 Payload Too Large", epfd);
+            requestBuffers[fd].clear();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void SocketManager::handleRequest(int readyServerFd, int epfd)
+{
+    char buf[4096];
+
+    ssize_t n = recv(readyServerFd, buf, sizeof(buf), 0);
+    if (n <= 0)
+    {
+        closeClient(readyServerFd, epfd);
+        std::cout << "Closed client fd=" << readyServerFd << std::endl;
+        return;
+    }
+
+    lastActivity[readyServerFd] = time(NULL);
+    requestBuffers[readyServerFd].append(buf, n);
+
+    // Early malformed request validation
+    if (isRequestMalformed(readyServerFd))
+    {
+        sendHttpError(readyServerFd, "400 Bad Request", epfd);
+        requestBuffers[readyServerFd].clear();
+        return;
+    }
+
+    // Request size validation
+    if (!validateRequestSize(readyServerFd, epfd))
+        return;
+
+    // If everything looks good and headers are complete, process request
+    size_t header_end = requestBuffers[readyServerFd].find("\r\n\r\n");
+    if (header_end != std::string::npos)
+    {
+        // Use the stored client address for this connection
+        sockaddr_in actualClientAddr = clientAddresses[readyServerFd];
+        processFullRequest(readyServerFd, epfd, requestBuffers[readyServerFd], actualClientAddr);
+        requestBuffers[readyServerFd].clear();
+    }
+}
+
+void SocketManager::handleTimeouts(int epfd)
+{
+    time_t now = time(NULL);
+    std::map<int, time_t>::iterator it = lastActivity.begin();
+
+    while (it != lastActivity.end())
     {
         int fd = it->first;
         std::string &buf = requestBuffers[fd];
 
         bool headersComplete = (buf.find("\r\n\r\n") != std::string::npos);
 
-        if (!headersComplete && now - it->second > CLIENT_TIMEOUT)
+        if (!headersComplete && !cgiClients.count(fd) && !cgiWaiting.count(fd) && !proxies.hasClient(fd) &&
+            !sendFiles.count(fd) && !limitDelayed.count(fd) && !sendRates.count(fd) &&
+            now - it->second > CLIENT_TIMEOUT)
         {
             sendHttpError(fd, "408 Request Timeout", epfd);
             struct epoll_event ev;
@@ -682,23 +1804,392 @@ void SocketManager::sendBuffer(int fd, int epfd)
     std::map<int, std::string>::iterator it = sendBuffers.find(fd);
     if (it == sendBuffers.end())
         return;
+    bool fileBody = sendFiles.count(fd);
+    if (fileBody && it->second.empty())
+    {
+        sendFileBody(fd, epfd);
+        return;
+    }
+    ProxySession *proxy = proxies.findClient(fd);
+    if (proxy && proxy->isSplicing() && it->second.empty())
+    {
+        proxies.spliceResponse(proxy, epfd);
+        return;
+    }
 
-    ssize_t sent = send(fd, it->second.c_str(), it->second.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    size_t allowance = sendAllowance(fd, epfd);
+    if (!allowance)
+        return;
+    ssize_t sent = send(fd, it->second.c_str(), std::min(it->second.size(), allowance), MSG_NOSIGNAL | MSG_DONTWAIT);
 
     if (sent > 0)
     {
         it->second.erase(0, sent);
+        chargeSend(fd, sent);
     }
 
+    // A proxied response is still arriving: wait for more instead of closing
+    if (proxy && sent > 0)
+    {
+        if (proxy->isSplicing())
+        {
+            if (it->second.empty())
+                proxies.spliceResponse(proxy, epfd);
+            return;
+        }
+        proxies.resumeUpstream(proxy, fd, epfd);
+        if (it->second.empty() && !fileBody)
+            setClientEvents(fd, 0, epfd);
+        return;
+    }
+
+    // The head is out; the body follows from its file on the next EPOLLOUT
+    if (fileBody && it->second.empty() && sent > 0)
+        return;
     if (it->second.empty() || sent <= 0)
+        closeClient(fd, epfd);
+}
+
+// The kernel copies straight from the page cache to the socket; whatever
+// does not fit in the socket buffer waits for the next EPOLLOUT
+void SocketManager::sendFileBody(int fd, int epfd)
+{
+    FileBody &body = sendFiles[fd];
+    size_t count = body.end - body.offset;
+    if (body.offset < body.end)
     {
-        close(fd);
-        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, 0);
-        requestBuffers.erase(fd);
-        lastActivity.erase(fd);
-        sendBuffers.erase(fd);
-        clientAddresses.erase(fd);
+        size_t allowance = sendAllowance(fd, epfd);
+        if (!allowance)
+            return;
+        count = std::min(count, allowance);
+    }
+    ssize_t sent = body.offset < body.end ? sendfile(fd, body.fd, &body.offset, count) : 0;
+    if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (sent > 0)
+        chargeSend(fd, sent);
+    bool failed = sent == -1 || (sent == 0 && body.offset < body.end);
+
+    // A proxied response spilling into the file may still grow
+    ProxySession *proxy = proxies.findClient(fd);
+    if (proxy && !failed)
+    {
+        // Drained: the file starts over, so it only ever holds unsent bytes
+        if (body.offset >= body.end)
+        {
+            if (ftruncate(body.fd, 0) == 0)
+            {
+                body.offset = 0;
+                body.end = 0;
+            }
+            setClientEvents(fd, 0, epfd);
+        }
+        proxies.resumeUpstream(proxy, fd, epfd);
+        return;
+    }
+    if (failed || body.offset >= body.end)
+        closeClient(fd, epfd);
+}
+
+// Re-reads the config file and switches new connections over to it. Only
+// listeners whose address appeared or disappeared are touched; a config
+// that fails to parse, route or bind leaves the running one untouched.
+bool SocketManager::reloadConfig(int epfd)
+{
+    std::cout << "Reloading configuration from " << configPath << std::endl;
+
+    ConfigSnapshot *next = NULL;
+    try
+    {
+        std::vector<Server> servers;
+        if (!loadServers(servers))
+            std::cout << "Configuration files: " << configLoader.getMisses()
+                      << " read, " << configLoader.getHits() << " unchanged" << std::endl;
+        next = new ConfigSnapshot(servers);
+    }
+    catch (const std::exception &e)
+    {
+        delete next;
+        std::cerr << "Reload rejected, keeping the running configuration: " << e.what() << std::endl;
+        return false;
+    }
+
+    std::vector<std::string> keys = next->getListenKeys();
+    std::map<std::string, int> opened;
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        if (listenerKeys.count(keys[i]))
+            continue;
+        size_t colon = keys[i].rfind(':');
+        int fd = openListener(keys[i].substr(0, colon), keys[i].substr(colon + 1));
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (fd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1)
+        {
+            if (fd != -1)
+                close(fd);
+            for (std::map<std::string, int>::iterator it = opened.begin(); it != opened.end(); ++it)
+            {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, it->second, 0);
+                close(it->second);
+            }
+            delete next;
+            std::cerr << "Reload rejected, cannot listen on " << keys[i]
+                      << "; keeping the running configuration" << std::endl;
+            return false;
+        }
+        opened[keys[i]] = fd;
+    }
+
+    // Nothing can fail from here on
+    for (std::map<std::string, int>::iterator it = opened.begin(); it != opened.end(); ++it)
+    {
+        listeningSockets.push_back(it->second);
+        listenerKeys[it->first] = it->second;
+    }
+    std::set<std::string> wanted(keys.begin(), keys.end());
+    std::vector<std::string> stale;
+    for (std::map<std::string, int>::iterator it = listenerKeys.begin(); it != listenerKeys.end(); ++it)
+    {
+        if (!wanted.count(it->first))
+            stale.push_back(it->first);
+    }
+    for (size_t i = 0; i < stale.size(); ++i)
+        closeListener(stale[i], epfd);
+
+    installConfig(next);
+    // Cached CGI output was produced under the old locations
+    cgiCache.clear();
+
+    std::cout << "Configuration reloaded: " << opened.size() << " listener(s) opened, "
+              << stale.size() << " closed" << std::endl;
+    return true;
+}
+
+void SocketManager::handleSignal(int epfd)
+{
+    struct signalfd_siginfo info;
+    while (read(signalFd, &info, sizeof(info)) == sizeof(info))
+    {
+        if (info.ssi_signo == SIGTERM || info.ssi_signo == SIGQUIT)
+            beginShutdown(epfd);
+        else if (info.ssi_signo == SIGUSR2)
+            startUpgrade();
+        else if (info.ssi_signo == SIGCHLD)
+        {
+            reapCgiSessions(epfd);
+            checkUpgrade();
+        }
+        else if (info.ssi_signo == SIGHUP && shuttingDown)
+            std::cout << "Ignoring SIGHUP: shutting down" << std::endl;
+        else if (info.ssi_signo == SIGHUP)
+            reloadConfig(epfd);
+    }
+}
+
+// Resolved once at startup: argv[0] may be a bare name looked up through PATH
+// or relative to a working directory, neither of which execv understands
+void SocketManager::setBinaryPath(const std::string &fallback)
+{
+    char path[PATH_MAX];
+    ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (length > 0)
+        binaryPath.assign(path, length);
+    else
+        binaryPath = fallback;
+}
+
+// Picks up the listeners an older binary handed over on SIGUSR2. Those the
+// config still names are reused by initSockets, the rest are closed. Call
+// after setServers() and before initSockets().
+void SocketManager::inheritListeners()
+{
+    const char *parent = getenv(UPGRADE_PARENT_ENV);
+    if (parent)
+        upgradeParent = atoi(parent);
+    const char *handed = getenv(UPGRADE_LISTEN_FDS_ENV);
+    if (!handed)
+        return;
+    std::string list = handed;
+    unsetenv(UPGRADE_LISTEN_FDS_ENV);
+    unsetenv(UPGRADE_PARENT_ENV);
+
+    std::vector<std::string> wantedKeys = config->getListenKeys();
+    std::set<std::string> wanted(wantedKeys.begin(), wantedKeys.end());
+    std::vector<std::string> entries = split(list, ';');
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        size_t eq = entries[i].rfind('=');
+        if (eq == std::string::npos)
+            continue;
+        std::string key = entries[i].substr(0, eq);
+        int fd = atoi(entries[i].c_str() + eq + 1);
+
+        int accepting = 0;
+        socklen_t len = sizeof(accepting);
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) == -1 || !accepting)
+        {
+            std::cerr << "Ignoring inherited fd " << fd << " for " << key << ": not a listening socket" << std::endl;
+            continue;
+        }
+        if (!wanted.count(key) || listenerKeys.count(key))
+        {
+            close(fd);
+            continue;
+        }
+        listeningSockets.push_back(fd);
+        listenerKeys[key] = fd;
+        std::cout << "Inherited listener " << key << " (fd=" << fd << ")" << std::endl;
+    }
+}
+
+// nginx-style binary upgrade: fork, keep only the listeners open and exec
+// the binary found at our own path (which a deploy has replaced) with the
+// same config. Both serve until the new one is up and asks this one to
+// drain; if it exits first, this one just keeps going.
+void SocketManager::startUpgrade()
+{
+    if (shuttingDown || upgradePid > 0)
+    {
+        std::cout << "Ignoring SIGUSR2: " << (shuttingDown ? "shutting down" : "upgrade already running")
+                  << std::endl;
+        return;
     }
+
+    std::ostringstream fds;
+    std::set<int> keep;
+    for (std::map<std::string, int>::iterator it = listenerKeys.begin(); it != listenerKeys.end(); ++it)
+    {
+        fds << it->first << "=" << it->second << ";";
+        keep.insert(it->second);
+    }
+    std::ostringstream self;
+    self << getpid();
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        std::cerr << "Upgrade failed: fork: " << strerror(errno) << std::endl;
+        return;
+    }
+    if (pid == 0)
+    {
+        long maxFd = sysconf(_SC_OPEN_MAX);
+        if (maxFd < 0)
+            maxFd = 1024;
+        for (int fd = 3; fd < maxFd; ++fd)
+        {
+            if (!keep.count(fd))
+                close(fd);
+        }
+        sigset_t noSignals;
+        sigemptyset(&noSignals);
+        sigprocmask(SIG_SETMASK, &noSignals, NULL);
+        setenv(UPGRADE_LISTEN_FDS_ENV, fds.str().c_str(), 1);
+        setenv(UPGRADE_PARENT_ENV, self.str().c_str(), 1);
+        char *argv[] = {const_cast<char *>(binaryPath.c_str()), const_cast<char *>(configPath.c_str()), NULL};
+        execv(argv[0], argv);
+        std::cerr << "Upgrade failed: exec " << binaryPath << ": " << strerror(errno) << std::endl;
+        _exit(127);
+    }
+    upgradePid = pid;
+    std::cout << "Upgrade: started " << binaryPath << " as pid " << pid << " with " << keep.size()
+              << " listener(s); serving until it takes over" << std::endl;
+}
+
+// SIGCHLD: CGI children are reaped by reapCgiSessions; this only notices a
+// new binary that died before taking over (the rollback case)
+void SocketManager::checkUpgrade()
+{
+    if (upgradePid <= 0)
+        return;
+    int status;
+    if (waitpid(upgradePid, &status, WNOHANG) != upgradePid)
+        return;
+    if (shuttingDown)
+        std::cout << "Upgraded binary (pid " << upgradePid << ") exited" << std::endl;
+    else if (WIFEXITED(status))
+        std::cerr << "Upgrade rolled back: new binary exited with status " << WEXITSTATUS(status)
+                  << "; this process keeps serving" << std::endl;
+    else
+        std::cerr << "Upgrade rolled back: new binary was killed by signal " << WTERMSIG(status)
+                  << "; this process keeps serving" << std::endl;
+    upgradePid = -1;
+}
+
+// Called once the listeners are in the event loop: if we were started by
+// an upgrade, the old binary can now drain and exit
+void SocketManager::announceReady()
+{
+    if (upgradeParent <= 0)
+        return;
+    if (getppid() == upgradeParent && kill(upgradeParent, SIGQUIT) == 0)
+        std::cout << "Upgrade: serving; asked the old binary (pid " << upgradeParent << ") to drain" << std::endl;
+    upgradeParent = -1;
+}
+
+// Stops accepting and closes connections that are not in the middle of a
+// request; the rest get until shutdown_timeout to finish, CGI included
+void SocketManager::beginShutdown(int epfd)
+{
+    if (shuttingDown)
+        return;
+    shuttingDown = true;
+    time_t timeout = config->getShutdownTimeout();
+    shutdownDeadline = time(NULL) + timeout;
+
+    std::vector<std::string> keys;
+    for (std::map<std::string, int>::iterator it = listenerKeys.begin(); it != listenerKeys.end(); ++it)
+        keys.push_back(it->first);
+    for (size_t i = 0; i < keys.size(); ++i)
+        closeListener(keys[i], epfd);
+
+    std::vector<int> idle;
+    for (std::map<int, sockaddr_in>::iterator it = clientAddresses.begin(); it != clientAddresses.end(); ++it)
+    {
+        int fd = it->first;
+        std::map<int, std::string>::iterator pending = requestBuffers.find(fd);
+        if ((pending == requestBuffers.end() || pending->second.empty()) && !sendBuffers.count(fd) &&
+            !cgiClients.count(fd) && !cgiWaiting.count(fd) && !proxies.hasClient(fd) && !limitDelayed.count(fd))
+            idle.push_back(fd);
+    }
+    for (size_t i = 0; i < idle.size(); ++i)
+        closeClient(idle[i], epfd);
+
+    drainConnections = clientAddresses.size();
+    drainChildren = cgiConfigs.size();
+    std::cout << "Shutting down: stopped accepting on " << keys.size() << " listener(s), closed "
+              << idle.size() << " idle connection(s); waiting up to " << timeout << "s for "
+              << drainConnections << " connection(s) and " << drainChildren << " CGI child(ren)"
+              << std::endl;
+}
+
+// True once nothing is left to wait for or the shutdown timeout passed
+bool SocketManager::isDrained()
+{
+    size_t connections = clientAddresses.size();
+    size_t children = cgiConfigs.size();
+
+    if (!connections && !children)
+    {
+        std::cout << "Shutdown: all requests drained" << std::endl;
+        return true;
+    }
+    if (time(NULL) >= shutdownDeadline)
+    {
+        std::cout << "Shutdown timeout reached: dropping " << connections << " connection(s) and "
+                  << children << " CGI child(ren)" << std::endl;
+        return true;
+    }
+    if (connections != drainConnections || children != drainChildren)
+    {
+        drainConnections = connections;
+        drainChildren = children;
+        std::cout << "Draining: " << connections << " connection(s), " << children
+                  << " CGI child(ren) left" << std::endl;
+    }
+    return false;
 }
 
 void SocketManager::handleClients()
@@ -709,6 +2200,27 @@ void SocketManager::handleClients()
 
     int epfd = epollGuard.get();
 
+    // Signals arrive as readable events on a signalfd instead of
+    // interrupting the loop; SIGHUP reloads the configuration, SIGTERM and
+    // SIGQUIT drain and stop
+    sigset_t handled;
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGHUP);
+    sigaddset(&handled, SIGTERM);
+    sigaddset(&handled, SIGQUIT);
+    sigaddset(&handled, SIGUSR2);
+    sigaddset(&handled, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &handled, NULL) == -1)
+        throw std::runtime_error("Failed to block signals");
+    signalFd = signalfd(-1, &handled, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signalFd == -1)
+        throw std::runtime_error("Failed to create signalfd");
+    struct epoll_event signalEvent;
+    signalEvent.events = EPOLLIN;
+    signalEvent.data.fd = signalFd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, signalFd, &signalEvent) == -1)
+        throw std::runtime_error("Failed to add signalfd to epoll");
+
     for (size_t i = 0; i < listeningSockets.size(); ++i)
     {
         int listening_fd = listeningSockets[i];
@@ -719,10 +2231,11 @@ void SocketManager::handleClients()
         if (epoll_ctl(epfd, EPOLL_CTL_ADD, listening_fd, &event) == -1)
             throw std::runtime_error("Failed to add server socket to epoll");
     }
+    announceReady();
     std::vector<struct epoll_event> events(1024);
     while (true)
     {
-        int n = epoll_wait(epfd, &events[0], events.size(), 1000);
+        int n = epoll_wait(epfd, &events[0], events.size(), nextTimeout());
         if (n == -1)
         {
             if (errno == EINTR)
@@ -734,22 +2247,47 @@ void SocketManager::handleClients()
         {
             int readyServerFd = events[i].data.fd;
 
+            if (readyServerFd == signalFd)
+            {
+                handleSignal(epfd);
+                continue;
+            }
+            if (cgiPipes.count(readyServerFd))
+            {
+                handleCgiEvent(readyServerFd, events[i].events, epfd);
+                continue;
+            }
+            if (proxies.isUpstream(readyServerFd))
+            {
+                proxies.handleEvent(readyServerFd, events[i].events, epfd);
+                continue;
+            }
+            // Stale event for a descriptor released earlier in this batch
+            if (!isServerSocket(readyServerFd) && !clientAddresses.count(readyServerFd))
+                continue;
             if (events[i].events & (EPOLLHUP | EPOLLERR))
             {
                 std::cerr << "Closing fd " << readyServerFd << " due to EPOLLHUP/EPOLLERR" << std::endl;
-                close(readyServerFd);
-                epoll_ctl(epfd, EPOLL_CTL_DEL, readyServerFd, 0);
-                requestBuffers.erase(readyServerFd);
-                lastActivity.erase(readyServerFd);
+                closeClient(readyServerFd, epfd);
                 continue;
             }
             if (isServerSocket(readyServerFd))
                 acceptNewClient(readyServerFd, epfd);
+            else if ((events[i].events & EPOLLIN) && cgiClients.count(readyServerFd))
+                streamCgiBody(cgiClients[readyServerFd], epfd);
+            else if ((events[i].events & EPOLLIN) && proxies.findClient(readyServerFd))
+                proxies.streamBody(proxies.findClient(readyServerFd), epfd);
             else if (events[i].events & EPOLLIN)
                 handleRequest(readyServerFd, epfd);
             if (events[i].events & EPOLLOUT)
                 sendBuffer(readyServerFd, epfd);
         }
         handleTimeouts(epfd);
+        handleCgiTimeouts(epfd);
+        proxies.handleTimeouts(epfd);
+        handleLimitDelays(epfd);
+        handleRateDelays(epfd);
+        if (shuttingDown && isDrained())
+            return;
     }
 }
@@ -0,0 +1,261 @@
+#include "UpstreamBalancer.hpp"
+#include <unistd.h>
+#include <algorithm>
+#include <sstream>
+
+// Points per unit of weight on the hash ring; enough for an even spread over
+// a handful of peers without making the ring large
+#define UPSTREAM_RING_POINTS 100
+
+UpstreamBalancer::PeerState::PeerState()
+    : active(0), fails(0), firstFail(0), downUntil(0), currentWeight(0) {}
+
+UpstreamBalancer::UpstreamBalancer()
+    : _groups(), _random(static_cast<uint32_t>(time(NULL)) ^
+                         (static_cast<uint32_t>(getpid()) << 16) ^ 0x9e3779b9u) {
+  if (!this->_random)
+    this->_random = 1;
+}
+
+// FNV-1a, then a murmur3 finalizer so nearby keys land far apart on the ring
+uint32_t UpstreamBalancer::hash(const std::string& value) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < value.size(); ++i) {
+    h ^= static_cast<unsigned char>(value[i]);
+    h *= 16777619u;
+  }
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+uint32_t UpstreamBalancer::nextRandom() {
+  // xorshift32
+  uint32_t x = this->_random;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  this->_random = x;
+  return x;
+}
+
+UpstreamBalancer::GroupState& UpstreamBalancer::stateFor(
+    const UpstreamGroup& group) {
+  GroupState& state = this->_groups[group.name];
+  if (state.signature == group.signature &&
+      state.peers.size() == group.peers.size())
+    return state;
+
+  state.signature = group.signature;
+  state.peers.assign(group.peers.size(), PeerState());
+  state.ring.clear();
+  if (group.balance == UpstreamGroup::HASH) {
+    for (size_t i = 0; i < group.peers.size(); ++i) {
+      for (unsigned n = 0; n < group.peers[i].weight * UPSTREAM_RING_POINTS;
+           ++n) {
+        std::ostringstream point;
+        point << group.peers[i].address.key << '-' << n;
+        state.ring.push_back(std::make_pair(hash(point.str()), i));
+      }
+    }
+    std::sort(state.ring.begin(), state.ring.end());
+  }
+  return state;
+}
+
+// State of exactly this definition of the group; NULL once a reload
+// replaced it, so requests started under the old one do not count
+UpstreamBalancer::GroupState* UpstreamBalancer::findState(
+    const UpstreamGroup& group) {
+  std::map<std::string, GroupState>::iterator it = this->_groups.find(group.name);
+  if (it == this->_groups.end() || it->second.signature != group.signature)
+    return NULL;
+  return &it->second;
+}
+
+int UpstreamBalancer::roundRobin(const UpstreamGroup& group,
+                                 GroupState& state,
+                                 const std::vector<bool>& candidates) {
+  long total = 0;
+  int best = -1;
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    if (!candidates[i])
+      continue;
+    PeerState& peer = state.peers[i];
+    peer.currentWeight += group.peers[i].weight;
+    total += group.peers[i].weight;
+    if (best == -1 || peer.currentWeight > state.peers[best].currentWeight)
+      best = i;
+  }
+  if (best != -1)
+    state.peers[best].currentWeight -= total;
+  return best;
+}
+
+// Fewest requests in flight relative to weight; ties go round-robin
+int UpstreamBalancer::leastConnections(const UpstreamGroup& group,
+                                       GroupState& state,
+                                       const std::vector<bool>& candidates) {
+  int best = -1;
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    if (!candidates[i])
+      continue;
+    if (best == -1 ||
+        static_cast<unsigned long>(state.peers[i].active) *
+                group.peers[best].weight <
+            static_cast<unsigned long>(state.peers[best].active) *
+                group.peers[i].weight)
+      best = i;
+  }
+  if (best == -1)
+    return -1;
+
+  std::vector<bool> tied(candidates.size(), false);
+  for (size_t i = 0; i < candidates.size(); ++i)
+    tied[i] = candidates[i] &&
+              static_cast<unsigned long>(state.peers[i].active) *
+                      group.peers[best].weight ==
+                  static_cast<unsigned long>(state.peers[best].active) *
+                      group.peers[i].weight;
+  return roundRobin(group, state, tied);
+}
+
+// The first usable peer clockwise from the key's point
+int UpstreamBalancer::hashed(const UpstreamGroup& group,
+                             GroupState& state,
+                             const std::vector<bool>& candidates,
+                             const std::string& key) {
+  if (key.empty() || state.ring.empty())
+    return roundRobin(group, state, candidates);
+
+  std::vector<std::pair<uint32_t, size_t> >::const_iterator it =
+      std::lower_bound(state.ring.begin(), state.ring.end(),
+                       std::make_pair(hash(key), static_cast<size_t>(0)));
+  for (size_t n = 0; n < state.ring.size(); ++n, ++it) {
+    if (it == state.ring.end())
+      it = state.ring.begin();
+    if (candidates[it->second])
+      return it->second;
+  }
+  return -1;
+}
+
+// Power of two choices: two peers drawn at random (by weight), the less
+// loaded one wins. Close to least_conn without every request going to the
+// same momentarily idle peer.
+int UpstreamBalancer::twoChoices(const UpstreamGroup& group,
+                                 GroupState& state,
+                                 const std::vector<bool>& candidates) {
+  int picks[2] = {-1, -1};
+  for (int pick = 0; pick < 2; ++pick) {
+    unsigned long total = 0;
+    for (size_t i = 0; i < candidates.size(); ++i)
+      if (candidates[i] && static_cast<int>(i) != picks[0])
+        total += group.peers[i].weight;
+    if (!total)
+      break;
+    unsigned long point = nextRandom() % total;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+      if (!candidates[i] || static_cast<int>(i) == picks[0])
+        continue;
+      if (point < group.peers[i].weight) {
+        picks[pick] = i;
+        break;
+      }
+      point -= group.peers[i].weight;
+    }
+  }
+  if (picks[1] == -1)
+    return picks[0];
+  const PeerState& a = state.peers[picks[0]];
+  const PeerState& b = state.peers[picks[1]];
+  if (static_cast<unsigned long>(b.active) * group.peers[picks[0]].weight <
+      static_cast<unsigned long>(a.active) * group.peers[picks[1]].weight)
+    return picks[1];
+  return picks[0];
+}
+
+int UpstreamBalancer::select(const UpstreamGroup& group,
+                             const std::string& hashKey,
+                             const std::vector<bool>& tried,
+                             time_t now) {
+  GroupState& state = stateFor(group);
+
+  std::vector<bool> candidates(group.peers.size(), false);
+  bool any = false;
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    candidates[i] = !(i < tried.size() && tried[i]) &&
+                    now >= state.peers[i].downUntil;
+    any = any || candidates[i];
+  }
+  // Every untried peer is down: as nginx does, they are all brought back
+  // and tried again rather than failing the request for fail_timeout
+  if (!any) {
+    for (size_t i = 0; i < candidates.size(); ++i) {
+      if (i < tried.size() && tried[i])
+        continue;
+      state.peers[i].downUntil = 0;
+      state.peers[i].fails = 0;
+      candidates[i] = true;
+      any = true;
+    }
+  }
+  if (!any)
+    return -1;
+
+  int peer = -1;
+  switch (group.balance) {
+    case UpstreamGroup::ROUND_ROBIN:
+      peer = roundRobin(group, state, candidates);
+      break;
+    case UpstreamGroup::LEAST_CONN:
+      peer = leastConnections(group, state, candidates);
+      break;
+    case UpstreamGroup::HASH:
+      peer = hashed(group, state, candidates, hashKey);
+      break;
+    case UpstreamGroup::RANDOM_TWO:
+      peer = twoChoices(group, state, candidates);
+      break;
+  }
+  if (peer != -1)
+    ++state.peers[peer].active;
+  return peer;
+}
+
+void UpstreamBalancer::release(const UpstreamGroup& group, size_t peer) {
+  GroupState* state = findState(group);
+  if (state && peer < state->peers.size() && state->peers[peer].active)
+    --state->peers[peer].active;
+}
+
+void UpstreamBalancer::succeed(const UpstreamGroup& group, size_t peer) {
+  GroupState* state = findState(group);
+  if (state && peer < state->peers.size())
+    state->peers[peer].fails = 0;
+}
+
+bool UpstreamBalancer::fail(const UpstreamGroup& group,
+                            size_t peer,
+                            time_t now) {
+  // Nothing to fail over to: the only peer of a group is never taken out
+  GroupState* state = findState(group);
+  if (!state || peer >= state->peers.size() || !group.peers[peer].maxFails ||
+      group.peers.size() == 1)
+    return false;
+
+  PeerState& peerState = state->peers[peer];
+  time_t window = group.peers[peer].failTimeout;
+  if (!peerState.fails || now - peerState.firstFail >= window) {
+    peerState.fails = 0;
+    peerState.firstFail = now;
+  }
+  if (++peerState.fails < group.peers[peer].maxFails)
+    return false;
+  peerState.fails = 0;
+  peerState.downUntil = now + window;
+  return true;
+}
@@ -0,0 +1,81 @@
+#include "UpstreamPool.hpp"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+
+UpstreamPool::UpstreamPool()
+    : _idle(),
+      _maxPerUpstream(UPSTREAM_KEEPALIVE_MAX),
+      _timeout(UPSTREAM_KEEPALIVE_TIMEOUT) {}
+
+UpstreamPool::~UpstreamPool() {
+  clear();
+}
+
+// An idle connection must have nothing to read: EOF means the upstream
+// closed it, data means it broke the protocol
+static bool isAlive(int fd) {
+  char byte;
+  ssize_t n = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int UpstreamPool::acquire(const std::string& key, time_t now) {
+  std::map<std::string, std::vector<Idle> >::iterator it = this->_idle.find(key);
+  if (it == this->_idle.end())
+    return -1;
+
+  std::vector<Idle>& idle = it->second;
+  while (!idle.empty()) {
+    Idle last = idle.back();
+    idle.pop_back();
+    if (now - last.since <= this->_timeout && isAlive(last.fd))
+      return last.fd;
+    close(last.fd);
+  }
+  return -1;
+}
+
+void UpstreamPool::release(const std::string& key, int fd, time_t now) {
+  std::vector<Idle>& idle = this->_idle[key];
+  if (idle.size() >= this->_maxPerUpstream) {
+    close(fd);
+    return;
+  }
+  Idle entry;
+  entry.fd = fd;
+  entry.since = now;
+  idle.push_back(entry);
+}
+
+void UpstreamPool::expire(time_t now) {
+  for (std::map<std::string, std::vector<Idle> >::iterator it =
+           this->_idle.begin();
+       it != this->_idle.end(); ++it) {
+    std::vector<Idle>& idle = it->second;
+    // Oldest first: stop at the first one still inside the timeout
+    size_t stale = 0;
+    while (stale < idle.size() && now - idle[stale].since > this->_timeout)
+      close(idle[stale++].fd);
+    if (stale)
+      idle.erase(idle.begin(), idle.begin() + stale);
+  }
+}
+
+void UpstreamPool::clear() {
+  for (std::map<std::string, std::vector<Idle> >::iterator it =
+           this->_idle.begin();
+       it != this->_idle.end(); ++it)
+    for (size_t i = 0; i < it->second.size(); ++i)
+      close(it->second[i].fd);
+  this->_idle.clear();
+}
+
+size_t UpstreamPool::size() const {
+  size_t total = 0;
+  for (std::map<std::string, std::vector<Idle> >::const_iterator it =
+           this->_idle.begin();
+       it != this->_idle.end(); ++it)
+    total += it->second.size();
+  return total;
+}
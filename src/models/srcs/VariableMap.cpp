@@ -0,0 +1,379 @@
+#include <ConfigCache.hpp>
+#include <HttpRequest.hpp>
+#include <ProxySession.hpp>
+#include <VariableMap.hpp>
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+
+#define MAP_NONE 0xffffffffu
+// Displacements tried per bucket for every slot of the table before it is
+// given up on and a larger one is tried
+#define MAP_DISPLACEMENT_ROUNDS 32
+
+VariableMap::VariableMap()
+    : _variable(),
+      _source(),
+      _default(),
+      _hostnames(false),
+      _entries(),
+      _exactKeys(),
+      _exactEntries(),
+      _displacements(),
+      _leading(),
+      _trailing(),
+      _regexes(),
+      _regexEntries() {}
+
+static std::string lowercase(std::string value) {
+  for (size_t i = 0; i < value.size(); ++i)
+    value[i] = std::tolower(static_cast<unsigned char>(value[i]));
+  return value;
+}
+
+static bool isNameChar(char c) {
+  return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+std::set<std::string> variableReferences(const std::string& pattern) {
+  std::set<std::string> names;
+  for (std::string::size_type pos = pattern.find('$');
+       pos != std::string::npos; pos = pattern.find('$', pos + 1)) {
+    std::string::size_type end = pos + 1;
+    while (end < pattern.size() && isNameChar(pattern[end]))
+      ++end;
+    if (end > pos + 1 &&
+        !std::isdigit(static_cast<unsigned char>(pattern[pos + 1])))
+      names.insert(pattern.substr(pos + 1, end - pos - 1));
+  }
+  return names;
+}
+
+// The variables ProxySession::requestVariable answers; a map may not
+// shadow them
+static bool isBuiltinVariable(const std::string& name) {
+  return name == "scheme" || name == "remote_addr" ||
+         name == "binary_remote_addr" || name == "uri" ||
+         name == "proxy_host" || name == "host" || name == "request_uri" ||
+         name == "args" || name == "request_method" ||
+         name.compare(0, 5, "http_") == 0 ||
+         name.compare(0, 7, "cookie_") == 0;
+}
+
+void VariableMap::setSource(const std::string& source) {
+  if (variableReferences(source).empty())
+    throw std::runtime_error("Missing variable in 'map' source: " + source);
+  this->_source = source;
+}
+
+void VariableMap::setVariable(const std::string& variable) {
+  if (variable.size() < 2 || variable[0] != '$' ||
+      std::isdigit(static_cast<unsigned char>(variable[1])))
+    throw std::runtime_error("Invalid 'map' variable: " + variable);
+  for (size_t i = 1; i < variable.size(); ++i)
+    if (!isNameChar(variable[i]))
+      throw std::runtime_error("Invalid 'map' variable: " + variable);
+  if (isBuiltinVariable(variable.substr(1)))
+    throw std::runtime_error("Variable " + variable + " cannot be mapped");
+  this->_variable = variable.substr(1);
+}
+
+void VariableMap::addEntry(const std::vector<std::string>& args) {
+  if (args.size() == 1 && args[0] == "hostnames") {
+    this->_hostnames = true;
+    return;
+  }
+  if (args.size() != 2)
+    throw std::runtime_error("Invalid map entry: expected a key and a value");
+  if (args[0] == "default") {
+    this->_default = args[1];
+    return;
+  }
+  // "\default", "\hostnames" and "\~..." stand for the literal keys
+  if (args[0].empty() || args[0] == "\\")
+    throw std::runtime_error("Empty map key");
+  Entry entry;
+  entry.key = args[0];
+  entry.value = args[1];
+  this->_entries.push_back(entry);
+}
+
+uint64_t VariableMap::hashKey(const std::string& key) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < key.size(); ++i) {
+    h ^= static_cast<unsigned char>(key[i]);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+void VariableMap::insertLabels(std::vector<LabelNode>& trie,
+                               const std::vector<std::string>& labels,
+                               size_t entry) {
+  size_t node = 0;
+  for (size_t i = 0; i < labels.size(); ++i) {
+    std::map<std::string, size_t>::iterator it =
+        trie[node].children.find(labels[i]);
+    if (it != trie[node].children.end()) {
+      node = it->second;
+      continue;
+    }
+    LabelNode child;
+    child.entry = -1;
+    trie.push_back(child);
+    trie[node].children[labels[i]] = trie.size() - 1;
+    node = trie.size() - 1;
+  }
+  if (trie[node].entry == -1)
+    trie[node].entry = entry;
+}
+
+// As with server names, a wildcard stands for at least one label
+long VariableMap::longestLabels(const std::vector<LabelNode>& trie,
+                                const std::vector<std::string>& labels) {
+  long best = -1;
+  size_t node = 0;
+  for (size_t i = 0; i + 1 < labels.size(); ++i) {
+    std::map<std::string, size_t>::const_iterator it =
+        trie[node].children.find(labels[i]);
+    if (it == trie[node].children.end())
+      break;
+    node = it->second;
+    if (trie[node].entry != -1)
+      best = trie[node].entry;
+  }
+  return best;
+}
+
+// The slot a key of hash h lands in under displacement d
+static size_t slotFor(uint64_t h, uint64_t d, size_t slots) {
+  return ((h & 0xffffffffu) + (d / slots) * ((h >> 32) | 1) + d % slots) %
+         slots;
+}
+
+// Hash and displace: keys are spread over buckets by their hash, and each
+// bucket, largest first, gets the first displacement that sends all of its
+// keys to free slots. A key's slot is then a function of its hash and its
+// bucket's displacement alone, so a lookup never probes twice.
+bool VariableMap::buildPerfectHash(
+    const std::vector<std::pair<std::string, size_t> >& keys, size_t slots) {
+  size_t buckets = keys.size() / 4 + 1;
+  std::vector<uint64_t> hashes(keys.size());
+  std::vector<std::vector<size_t> > members(buckets);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    hashes[i] = hashKey(keys[i].first);
+    members[hashes[i] % buckets].push_back(i);
+  }
+  std::vector<std::pair<size_t, size_t> > order;
+  for (size_t b = 0; b < buckets; ++b)
+    if (!members[b].empty())
+      order.push_back(std::make_pair(members[b].size(), b));
+  std::sort(order.rbegin(), order.rend());
+
+  this->_exactKeys.assign(slots, std::string());
+  this->_exactEntries.assign(slots, MAP_NONE);
+  this->_displacements.assign(buckets, 0);
+  std::vector<size_t> placed;
+  for (size_t o = 0; o < order.size(); ++o) {
+    const std::vector<size_t>& bucket = members[order[o].second];
+    bool found = false;
+    uint64_t tries = static_cast<uint64_t>(slots) * MAP_DISPLACEMENT_ROUNDS;
+    for (uint64_t d = 0; d < tries && !found; ++d) {
+      placed.clear();
+      for (size_t k = 0; k < bucket.size(); ++k) {
+        size_t slot = slotFor(hashes[bucket[k]], d, slots);
+        if (this->_exactEntries[slot] != MAP_NONE ||
+            std::find(placed.begin(), placed.end(), slot) != placed.end())
+          break;
+        placed.push_back(slot);
+      }
+      if (placed.size() != bucket.size())
+        continue;
+      for (size_t k = 0; k < bucket.size(); ++k) {
+        this->_exactKeys[placed[k]] = keys[bucket[k]].first;
+        this->_exactEntries[placed[k]] = keys[bucket[k]].second;
+      }
+      this->_displacements[order[o].second] = d;
+      found = true;
+    }
+    if (!found)
+      return false;
+  }
+  return true;
+}
+
+long VariableMap::findExact(const std::string& key) const {
+  if (this->_exactKeys.empty())
+    return -1;
+  uint64_t h = hashKey(key);
+  uint64_t d = this->_displacements[h % this->_displacements.size()];
+  size_t slot = slotFor(h, d, this->_exactKeys.size());
+  if (this->_exactEntries[slot] == MAP_NONE || this->_exactKeys[slot] != key)
+    return -1;
+  return this->_exactEntries[slot];
+}
+
+void VariableMap::build() {
+  std::vector<std::pair<std::string, size_t> > exact;
+  std::set<std::string> seen;
+  this->_leading.assign(1, LabelNode());
+  this->_leading[0].entry = -1;
+  this->_trailing.assign(1, LabelNode());
+  this->_trailing[0].entry = -1;
+  this->_regexes = RegexSet();
+  this->_regexEntries.clear();
+
+  for (size_t i = 0; i < this->_entries.size(); ++i) {
+    const std::string& key = this->_entries[i].key;
+    if (key[0] == '~') {
+      bool caseless = key.size() > 1 && key[1] == '*';
+      this->_regexes.add(key.substr(caseless ? 2 : 1), caseless);
+      this->_regexEntries.push_back(i);
+      continue;
+    }
+    std::string name = lowercase(key[0] == '\\' ? key.substr(1) : key);
+    if (this->_hostnames && key[0] != '\\') {
+      if (name[0] == '.') {
+        if (seen.insert(name.substr(1)).second)
+          exact.push_back(std::make_pair(name.substr(1), i));
+        name = "*" + name;
+      }
+      if (name.size() > 2 && name.compare(0, 2, "*.") == 0) {
+        std::vector<std::string> labels = split(name.substr(2), '.');
+        std::vector<std::string> reversed(labels.rbegin(), labels.rend());
+        insertLabels(this->_leading, reversed, i);
+        continue;
+      }
+      if (name.size() > 2 && name.compare(name.size() - 2, 2, ".*") == 0) {
+        insertLabels(this->_trailing,
+                     split(name.substr(0, name.size() - 2), '.'), i);
+        continue;
+      }
+    }
+    if (!seen.insert(name).second)
+      throw std::runtime_error("Duplicate map key: " + key);
+    exact.push_back(std::make_pair(name, i));
+  }
+  this->_regexes.build();
+
+  this->_exactKeys.clear();
+  this->_exactEntries.clear();
+  this->_displacements.clear();
+  if (exact.empty())
+    return;
+  size_t slots = exact.size() + exact.size() / 4 + 1;
+  while (!buildPerfectHash(exact, slots))
+    slots += slots / 8 + 1;
+}
+
+void VariableMap::compile() {
+  if (this->_variable.empty() || this->_source.empty())
+    throw std::runtime_error("Incomplete 'map'");
+  build();
+}
+
+const std::string& VariableMap::getVariable() const {
+  return this->_variable;
+}
+
+size_t VariableMap::size() const {
+  return this->_entries.size();
+}
+
+std::set<std::string> VariableMap::getReferences() const {
+  std::set<std::string> names = variableReferences(this->_source);
+  std::set<std::string> fromDefault = variableReferences(this->_default);
+  names.insert(fromDefault.begin(), fromDefault.end());
+  for (size_t i = 0; i < this->_entries.size(); ++i) {
+    std::set<std::string> fromValue =
+        variableReferences(this->_entries[i].value);
+    names.insert(fromValue.begin(), fromValue.end());
+  }
+  return names;
+}
+
+std::string VariableMap::expandValue(const std::string& value,
+                                     const std::vector<std::string>& captures,
+                                     const std::string& rawRequest,
+                                     const HttpRequest& request,
+                                     const sockaddr_in& clientAddr) const {
+  if (value.find('$') == std::string::npos)
+    return value;
+  std::string expanded;
+  std::string::size_type pos = 0;
+  while (pos < value.size()) {
+    std::string::size_type dollar = value.find('$', pos);
+    expanded.append(value, pos, dollar - pos);
+    if (dollar == std::string::npos)
+      break;
+    if (dollar + 1 < value.size() &&
+        std::isdigit(static_cast<unsigned char>(value[dollar + 1]))) {
+      size_t group = value[dollar + 1] - '0';
+      if (group < captures.size())
+        expanded += captures[group];
+      pos = dollar + 2;
+      continue;
+    }
+    std::string::size_type end = dollar + 1;
+    while (end < value.size() && isNameChar(value[end]))
+      ++end;
+    expanded += ProxySession::requestVariable(
+        value.substr(dollar + 1, end - dollar - 1), rawRequest, request,
+        clientAddr);
+    pos = end;
+  }
+  return expanded;
+}
+
+std::string VariableMap::evaluate(const std::string& rawRequest,
+                                  const HttpRequest& request,
+                                  const sockaddr_in& clientAddr) const {
+  std::string subject = ProxySession::expandVariables(this->_source, rawRequest,
+                                                      request, clientAddr);
+  std::string key = lowercase(subject);
+  if (this->_hostnames && !key.empty() && key[key.size() - 1] == '.')
+    key.erase(key.size() - 1);
+
+  std::vector<std::string> captures;
+  long entry = findExact(key);
+  if (entry == -1 && this->_hostnames) {
+    std::vector<std::string> labels = split(key, '.');
+    entry = longestLabels(this->_leading, std::vector<std::string>(
+                                              labels.rbegin(), labels.rend()));
+    if (entry == -1)
+      entry = longestLabels(this->_trailing, labels);
+  }
+  if (entry == -1 && this->_regexes.size()) {
+    long regex = this->_regexes.match(subject, &captures);
+    if (regex != -1)
+      entry = this->_regexEntries[regex];
+  }
+  const std::string& value =
+      entry == -1 ? this->_default : this->_entries[entry].value;
+  return expandValue(value, captures, rawRequest, request, clientAddr);
+}
+
+void VariableMap::writeTo(CacheWriter& out) const {
+  out.str(this->_variable);
+  out.str(this->_source);
+  out.str(this->_default);
+  out.u8(this->_hostnames);
+  out.u64(this->_entries.size());
+  for (size_t i = 0; i < this->_entries.size(); ++i) {
+    out.str(this->_entries[i].key);
+    out.str(this->_entries[i].value);
+  }
+}
+
+void VariableMap::readFrom(CacheReader& in) {
+  this->_variable = in.str();
+  this->_source = in.str();
+  this->_default = in.str();
+  this->_hostnames = in.u8();
+  this->_entries.assign(in.u64(), Entry());
+  for (size_t i = 0; i < this->_entries.size(); ++i) {
+    this->_entries[i].key = in.str();
+    this->_entries[i].value = in.str();
+  }
+  build();
+}
@@ -0,0 +1,195 @@
+#include <Server.hpp>
+#include <VhostRouter.hpp>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+VhostRouter::VhostRouter() : _tables(), _byListen() {}
+
+VhostRouter::~VhostRouter() {}
+
+static std::string listenKey(const std::string& addr, u_int16_t port) {
+  std::ostringstream key;
+  key << addr << ":" << port;
+  return key.str();
+}
+
+static std::string lowercase(std::string name) {
+  for (size_t i = 0; i < name.size(); ++i)
+    name[i] = std::tolower(static_cast<unsigned char>(name[i]));
+  return name;
+}
+
+void VhostRouter::insertLabels(std::vector<LabelNode>& trie,
+                               const std::vector<std::string>& labels,
+                               size_t server) {
+  size_t node = 0;
+  for (size_t i = 0; i < labels.size(); ++i) {
+    std::map<std::string, size_t>::iterator it =
+        trie[node].children.find(labels[i]);
+    if (it != trie[node].children.end()) {
+      node = it->second;
+      continue;
+    }
+    LabelNode child;
+    child.server = -1;
+    trie.push_back(child);
+    trie[node].children[labels[i]] = trie.size() - 1;
+    node = trie.size() - 1;
+  }
+  // First server to claim a name keeps it, as with exact names
+  if (trie[node].server == -1)
+    trie[node].server = server;
+}
+
+// A wildcard stands for at least one label, so the match has to stop short
+// of the last label of the host
+long VhostRouter::longestLabels(const std::vector<LabelNode>& trie,
+                                const std::vector<std::string>& labels) {
+  long best = -1;
+  size_t node = 0;
+  for (size_t i = 0; i + 1 < labels.size(); ++i) {
+    std::map<std::string, size_t>::const_iterator it =
+        trie[node].children.find(labels[i]);
+    if (it == trie[node].children.end())
+      break;
+    node = it->second;
+    if (trie[node].server != -1)
+      best = trie[node].server;
+  }
+  return best;
+}
+
+void VhostRouter::insertName(Table& table, std::string name, size_t server) {
+  name = lowercase(name);
+  if (name.empty())
+    return;
+
+  if (name[0] == '.') {
+    insertName(table, name.substr(1), server);
+    insertName(table, "*" + name, server);
+    return;
+  }
+  if (name.size() > 2 && name.compare(0, 2, "*.") == 0) {
+    std::vector<std::string> labels = split(name.substr(2), '.');
+    std::vector<std::string> reversed(labels.rbegin(), labels.rend());
+    insertLabels(table.leading, reversed, server);
+    return;
+  }
+  if (name.size() > 2 && name.compare(name.size() - 2, 2, ".*") == 0) {
+    insertLabels(table.trailing, split(name.substr(0, name.size() - 2), '.'),
+                 server);
+    return;
+  }
+  if (name.find('*') != std::string::npos)
+    throw std::runtime_error("Invalid wildcard server_name: " + name);
+  if (!table.exact.insert(name, server))
+    std::cerr << "Conflicting server_name \"" << name << "\", ignored"
+              << std::endl;
+}
+
+void VhostRouter::build(const std::vector<Server>& servers) {
+  this->_tables.clear();
+  this->_byListen.clear();
+
+  for (size_t i = 0; i < servers.size(); ++i) {
+    const std::vector<ListenCtx>& listens = servers[i].getListens();
+    for (size_t j = 0; j < listens.size(); ++j) {
+      std::string key = listenKey(listens[j].addr, listens[j].port);
+      const size_t* found = this->_byListen.find(key);
+      size_t index;
+      if (found)
+        index = *found;
+      else {
+        index = this->_tables.size();
+        this->_tables.push_back(Table());
+        Table& table = this->_tables.back();
+        table.leading.resize(1);
+        table.leading[0].server = -1;
+        table.trailing.resize(1);
+        table.trailing[0].server = -1;
+        table.defaultServer = -1;
+        table.explicitDefault = false;
+        table.firstServer = i;
+        table.oneServer = true;
+        table.sharedAccess = true;
+        this->_byListen.insert(key, index);
+      }
+
+      Table& table = this->_tables[index];
+      if (table.firstServer != static_cast<long>(i))
+        table.oneServer = false;
+      if (!(servers[i].getAccess() ==
+            servers[table.firstServer].getAccess()))
+        table.sharedAccess = false;
+      if (listens[j].defaultServer) {
+        if (table.explicitDefault)
+          throw std::runtime_error("Duplicate default_server for " + key);
+        table.defaultServer = i;
+        table.explicitDefault = true;
+      } else if (table.defaultServer == -1)
+        table.defaultServer = i;
+
+      const std::vector<std::string>& names = servers[i].getServerNames();
+      for (size_t k = 0; k < names.size(); ++k)
+        insertName(table, names[k], i);
+    }
+  }
+}
+
+long VhostRouter::findTable(const std::string& addr, u_int16_t port) const {
+  const size_t* table = this->_byListen.find(listenKey(addr, port));
+  if (!table)
+    table = this->_byListen.find(listenKey("0.0.0.0", port));
+  if (!table)
+    return -1;
+  return *table;
+}
+
+bool VhostRouter::sharesAccess(long table) const {
+  if (table < 0 || static_cast<size_t>(table) >= this->_tables.size())
+    return true;
+  return this->_tables[table].sharedAccess;
+}
+
+bool VhostRouter::servesOne(long table) const {
+  if (table < 0 || static_cast<size_t>(table) >= this->_tables.size())
+    return true;
+  return this->_tables[table].oneServer;
+}
+
+size_t VhostRouter::route(long table, const std::string& host) const {
+  if (table < 0 || static_cast<size_t>(table) >= this->_tables.size())
+    return 0;
+  const Table& routes = this->_tables[table];
+
+  // "Host: [::1]:8080", "Host: Example.com.:8080" -> "::1", "example.com"
+  std::string name;
+  if (!host.empty() && host[0] == '[')
+    name = host.substr(1, host.find(']') - 1);
+  else
+    name = host.substr(0, host.find(':'));
+  if (!name.empty() && name[name.size() - 1] == '.')
+    name.erase(name.size() - 1);
+  name = lowercase(name);
+
+  if (!name.empty()) {
+    const size_t* exact = routes.exact.find(name);
+    if (exact)
+      return *exact;
+
+    std::vector<std::string> labels = split(name, '.');
+    if (routes.leading.size() > 1) {
+      std::vector<std::string> reversed(labels.rbegin(), labels.rend());
+      long server = longestLabels(routes.leading, reversed);
+      if (server != -1)
+        return server;
+    }
+    if (routes.trailing.size() > 1) {
+      long server = longestLabels(routes.trailing, labels);
+      if (server != -1)
+        return server;
+    }
+  }
+  return routes.defaultServer;
+}
@@ -1,19 +1,77 @@
 #include <stdio.h>
+#include <HashTable.hpp>
 #include <iostream>
 #include <parser.hpp>
+#include <sstream>
 #include <string>
 #include <vector>
 #include "utils.hpp"
 
+// Character classes, so the lexer decides what a byte is with one table
+// read instead of scanning DEF_SYMBOL and calling isspace() per character
+enum CharClass { CHAR_WORD, CHAR_SPACE, CHAR_SYMBOL, CHAR_QUOTE, CHAR_COMMENT };
+
+static const unsigned char* charClasses() {
+  static unsigned char table[256];
+  static bool built = false;
+  if (!built) {
+    for (int c = 0; c < 256; ++c)
+      table[c] = isspace(c) ? CHAR_SPACE : CHAR_WORD;
+    for (const char* s = DEF_SYMBOL; *s; ++s)
+      table[static_cast<unsigned char>(*s)] = CHAR_SYMBOL;
+    table[static_cast<unsigned char>('"')] = CHAR_QUOTE;
+    table[static_cast<unsigned char>('\'')] = CHAR_QUOTE;
+    table[static_cast<unsigned char>('#')] = CHAR_COMMENT;
+    built = true;
+  }
+  return table;
+}
+
+// Every directive and block name, built once; a word is classified with a
+// single hash lookup however many directives exist
+static const HashTable<TokenType>& keywords() {
+  static HashTable<TokenType> table;
+  static bool built = false;
+  if (!built) {
+    static const char* levels[] = {"server", "http", "location", "upstream",
+                                   "map"};
+    static const char* attributes[] = {
+        "root",          "client_max_body_size", "listen",
+        "index",         "error_page",           "server_name",
+        "autoindex",     "redirect",             "return",
+        "cgi",           "allow_methods",        "upload_dir",
+        "cgi_enabled",   "transfer_encoding",    "cgi_pass",
+        "cgi_cache",     "cgi_cache_valid",      "cgi_cache_max_size",
+        "cgi_queue",     "cgi_max_concurrent",   "cgi_status",
+        "include",       "shutdown_timeout",     "proxy_pass",
+        "least_conn",    "hash",                 "random",
+        "proxy_cache",   "proxy_cache_path",     "proxy_cache_key",
+        "proxy_cache_valid",                     "proxy_cache_use_stale",
+        "proxy_cache_lock",                      "proxy_cache_lock_timeout",
+        "cgi_cache_lock_timeout",                "proxy_buffering",
+        "proxy_buffers",                         "proxy_max_temp_file_size",
+        "limit_req_zone",                        "limit_req",
+        "limit_req_status",                      "limit_conn_zone",
+        "limit_conn",                            "limit_conn_status",
+        "allow",                                 "deny",
+        "add_header",                            "limit_rate",
+        "limit_rate_after"};
+    for (size_t i = 0; i < sizeof(levels) / sizeof(*levels); ++i)
+      table.insert(levels[i], LEVEL);
+    for (size_t i = 0; i < sizeof(attributes) / sizeof(*attributes); ++i)
+      table.insert(attributes[i], ATTRIBUTE);
+    built = true;
+  }
+  return table;
+}
+
 bool isLevel(const std::string& s) {
-  return s == "server" || s == "http" || s == "location";
+  const TokenType* type = keywords().find(s.data(), s.size());
+  return type && *type == LEVEL;
 }
 bool isAttribute(const std::string& s) {
-  return s == "root" || s == "client_max_body_size" || s == "listen" ||
-         s == "index" || s == "error_page" || s == "server_name" ||
-         s == "autoindex" || s == "redirect" || s == "return" || s == "cgi" ||
-         s == "allow_methods" || s == "upload_dir" || s == "cgi_enabled" ||
-         s == "transfer_encoding" || s == "cgi_pass";
+  const TokenType* type = keywords().find(s.data(), s.size());
+  return type && *type == ATTRIBUTE;
 }
 bool isAllDigits(const std::string& s) {
   for (size_t i = 0; i < s.size(); ++i)
@@ -22,104 +80,136 @@ bool isAllDigits(const std::string& s) {
   return !s.empty();
 }
 
-static Token handleQuoted(std::string::const_iterator& it,
-                          const std::string& content) {
-  char quoteChar = *it;
-  ++it;
-  std::string buffer;
-
-  while (it != content.end() && *it != quoteChar) {
-    buffer += *it;
-    ++it;
-  }
-  if (it == content.end()) {
-    throw std::runtime_error("Unclosed quote");
-  }
-  ++it;
-
-  Token token;
-  token.type = STRING;
-  token.value = buffer;
-  token.quoted = 1;
+// Tokens are appended in place and their text is cut from the input in one
+// piece, so lexing stays linear in the size of the file
+static Token& appendToken(std::vector<Token>& tokens,
+                          TokenType type,
+                          const char* begin,
+                          const char* end,
+                          int quoted,
+                          const std::string* file,
+                          size_t line) {
+  tokens.push_back(Token());
+  Token& token = tokens.back();
+  token.type = type;
+  token.value.assign(begin, end);
+  token.quoted = quoted;
+  token.file = file;
+  token.line = line;
   return token;
 }
 
-static Token handleSymbol(std::string::const_iterator& it) {
-  Token token;
-  token.type = SYMBOL;
-  token.value = std::string(1, *it);
-  token.quoted = 0;
-  ++it;
-  return token;
-}
-
-static Token handleWord(std::string::const_iterator& it,
-                        const std::string& content) {
-  std::string buffer;
-  while (it != content.end() && !isspace(*it) &&
-         std::string(DEF_SYMBOL).find(*it) == std::string::npos) {
-    buffer += *it;
-    ++it;
-  }
-
-  Token token;
-  token.quoted = 0;
-  if (isAllDigits(buffer))
-    token.type = NUMBER;
-  else if (isAttribute(buffer))
-    token.type = ATTRIBUTE;
-  else if (isLevel(buffer))
-    token.type = LEVEL;
-  else
-    token.type = STRING;
+ConfigError::ConfigError(const std::string& what) : std::runtime_error(what) {}
 
-  token.value = buffer;
-  token.quoted = 0;
-  return token;
+std::string locate(const Token& token, const std::string& what) {
+  std::ostringstream out;
+  out << (token.file ? *token.file : "line") << ":" << token.line << ": "
+      << what;
+  return out.str();
 }
 
-std::vector<Token> lexer(const std::string& content) {
+std::vector<Token> lexer(const std::string& content, const std::string* file) {
+  const unsigned char* classes = charClasses();
   std::vector<Token> tokens;
-  std::string::const_iterator it = content.begin();
-
-  while (it != content.end()) {
-    if (isspace(*it)) {
-      ++it;
-      continue;
-    }
+  size_t line = 1;
+  // Directives average well over eight bytes of source per token
+  tokens.reserve(content.size() / 8 + 16);
 
-    // Handle comments - skip everything after # until end of line
-    if (*it == '#') {
-      while (it != content.end() && *it != '\n') {
+  const char* it = content.data();
+  const char* end = it + content.size();
+  while (it != end) {
+    switch (classes[static_cast<unsigned char>(*it)]) {
+      case CHAR_SPACE:
+        if (*it == '\n')
+          ++line;
         ++it;
+        break;
+      // Handle comments - skip everything after # until end of line
+      case CHAR_COMMENT:
+        while (it != end && *it != '\n')
+          ++it;
+        break;
+      case CHAR_QUOTE: {
+        char quoteChar = *it++;
+        const char* start = it;
+        size_t startLine = line;
+        while (it != end && *it != quoteChar)
+          if (*it++ == '\n')
+            ++line;
+        if (it == end) {
+          Token at;
+          at.file = file;
+          at.line = startLine;
+          throw ConfigError(locate(at, "Unclosed quote"));
+        }
+        appendToken(tokens, STRING, start, it, 1, file, startLine);
+        ++it;
+        break;
+      }
+      case CHAR_SYMBOL:
+        appendToken(tokens, SYMBOL, it, it + 1, 0, file, line);
+        ++it;
+        break;
+      default: {
+        const char* start = it;
+        while (it != end && classes[static_cast<unsigned char>(*it)] !=
+                                CHAR_SPACE &&
+               classes[static_cast<unsigned char>(*it)] != CHAR_SYMBOL)
+          ++it;
+        Token& token = appendToken(tokens, STRING, start, it, 0, file, line);
+        const TokenType* keyword = keywords().find(start, it - start);
+        if (isAllDigits(token.value))
+          token.type = NUMBER;
+        else if (keyword)
+          token.type = *keyword;
+        break;
       }
-      continue;
-    }
-
-    if (*it == '"' || *it == '\'') {
-      tokens.push_back(handleQuoted(it, content));
-    } else if (std::string(DEF_SYMBOL).find(*it) != std::string::npos) {
-      tokens.push_back(handleSymbol(it));
-    } else {
-      tokens.push_back(handleWord(it, content));
     }
   }
   return tokens;
 }
 
+// A regex: the word after a location's '~' or '~*', or a map key starting
+// with '~'. It may hold any printable character but '{', '}', ';', quotes
+// and '#', which still need the regex quoted.
+static bool isRegexToken(const std::vector<Token>& tokens, size_t i,
+                         bool inMap) {
+  const Token& token = tokens[i];
+  if (token.quoted || token.type == SYMBOL)
+    return false;
+  if (i >= 2 && !tokens[i - 1].quoted && tokens[i - 2].value == "location" &&
+      (tokens[i - 1].value == "~" || tokens[i - 1].value == "~*"))
+    return true;
+  return inMap && token.value.size() > 1 && token.value[0] == '~' &&
+         (tokens[i - 1].value == "{" || tokens[i - 1].value == ";");
+}
+
 int isAllowedTokens(const std::vector<Token>& tokens) {
-  for (std::vector<Token>::const_iterator it = tokens.begin();
-       it != tokens.end(); ++it) {
+  const unsigned char* classes = charClasses();
+  bool inMap = false;
+  for (size_t index = 0; index < tokens.size(); ++index) {
+    std::vector<Token>::const_iterator it = tokens.begin() + index;
     const std::string& val = it->value;
 
+    if (it->type == LEVEL && val == "map")
+      inMap = true;
+    else if (it->type == SYMBOL && val == "}")
+      inMap = false;
     if (it->type == SYMBOL) {
-      if (std::string(DEF_SYMBOL).find(val[0]) == std::string::npos) {
-        throw std::runtime_error("Invalid symbol: " + val);
+      if (classes[static_cast<unsigned char>(val[0])] != CHAR_SYMBOL) {
+        throw ConfigError(locate(*it, "Invalid symbol: " + val));
       }
     } else if (it->type == NUMBER) {
       for (size_t i = 0; i < val.size(); i++) {
         if (!isdigit(val[i])) {
-          throw std::runtime_error("Invalid number: " + val);
+          throw ConfigError(locate(*it, "Invalid number: " + val));
+        }
+      }
+    } else if (isRegexToken(tokens, index, inMap)) {
+      for (size_t i = 0; i < val.size(); i++) {
+        if (!isgraph(static_cast<unsigned char>(val[i]))) {
+          throw ConfigError(locate(
+              *it, "Invalid regex: " + val + " (quote it: \"" + val + "\")"));
         }
       }
     } else if (it->type == STRING || it->type == KEYWORD) {
@@ -130,7 +220,7 @@ int isAllowedTokens(const std::vector<Token>& tokens) {
             c != '=' && c != ':' && c != '?' && c != '&' && c != '%' &&
             c != '@' && c != '!' && c != '*' && c != '+' && c != '~' &&
             c != '^' && c != '$' && c != '\\' && it->quoted == 0) {
-          throw std::runtime_error("Invalid identifier: " + val);
+          throw ConfigError(locate(*it, "Invalid identifier: " + val));
         }
       }
     }
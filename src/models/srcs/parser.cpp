@@ -7,6 +7,58 @@ bool expect(std::string expected, Token token) {
   return token.value == expected;
 }
 
+// Called from a catch block: errors that do not carry a location yet get the
+// one of the token being parsed; the innermost block that knows wins
+static void rethrowAt(const Token& token) {
+  try {
+    throw;
+  } catch (const ConfigError&) {
+    throw;
+  } catch (const std::exception& e) {
+    throw ConfigError(locate(token, e.what()));
+  }
+}
+
+// Parse: cgi_queue <size> [timeout=<seconds>];
+static size_t parseCgiQueueDirective(const std::vector<Token>& tokens,
+                                     size_t i,
+                                     BaseBlock& block) {
+  std::string size = tokens[i].value;
+  std::string timeout;
+  i++;
+  if (i < tokens.size() && tokens[i].value.compare(0, 8, "timeout=") == 0) {
+    timeout = tokens[i].value.substr(8);
+    if (timeout.empty()) {
+      throw std::runtime_error("Missing value for 'cgi_queue' timeout");
+    }
+    i++;
+  }
+  if (i >= tokens.size() || tokens[i].value != ";") {
+    throw std::runtime_error("Expected ';' after 'cgi_queue' directive");
+  }
+  i++;
+  block.setCgiQueue(size, timeout);
+  return i;
+}
+
+// Collects the arguments of a directive up to its ';'
+static size_t parseArguments(const std::vector<Token>& tokens,
+                             size_t i,
+                             const std::string& directive,
+                             std::vector<std::string>& args) {
+  while (i < tokens.size() && tokens[i].value != ";") {
+    if (tokens[i].value == "{" || tokens[i].value == "}")
+      break;
+    args.push_back(tokens[i].value);
+    i++;
+  }
+  if (i >= tokens.size() || tokens[i].value != ";") {
+    throw std::runtime_error("Expected ';' after '" + directive +
+                             "' directive");
+  }
+  return i + 1;
+}
+
 static size_t parseLocationDirective(const std::vector<Token>& tokens,
                                      size_t i,
                                      LocationConfig& location) {
@@ -69,6 +121,16 @@ static size_t parseLocationDirective(const std::vector<Token>& tokens,
         throw std::runtime_error("Expected ';' after 'error_page' directive");
       }
       i++;
+    } else if (locationDirective == "client_max_body_size" &&
+               i < tokens.size()) {
+      std::string sizeStr = tokens[i].value;
+      location.setClientMaxBodySize(sizeStr);
+      i++;
+      if (i >= tokens.size() || tokens[i].value != ";") {
+        throw std::runtime_error(
+            "Expected ';' after 'client_max_body_size' directive");
+      }
+      i++;
     } else if (locationDirective == "upload_dir" && i < tokens.size()) {
       location.setUploadDir(tokens[i].value);
       i++;
@@ -134,6 +196,149 @@ static size_t parseLocationDirective(const std::vector<Token>& tokens,
       }
       i++;
       location.setCgiPassMapping(extension, interpreter);
+    } else if (locationDirective == "cgi_cache" && i < tokens.size()) {
+      std::string value = tokens[i].value;
+      i++;
+      if (i >= tokens.size() || tokens[i].value != ";") {
+        throw std::runtime_error("Expected ';' after 'cgi_cache' directive");
+      }
+      i++;
+      if (value == "on") {
+        location.setCgiCache(true);
+      } else if (value == "off") {
+        location.setCgiCache(false);
+      } else {
+        throw std::runtime_error("Invalid value for 'cgi_cache': " + value);
+      }
+    } else if (locationDirective == "cgi_cache_valid" && i < tokens.size()) {
+      location.setCgiCacheValid(tokens[i].value);
+      i++;
+      if (i >= tokens.size() || tokens[i].value != ";") {
+        throw std::runtime_error(
+            "Expected ';' after 'cgi_cache_valid' directive");
+      }
+      i++;
+    } else if (locationDirective == "cgi_cache_lock_timeout" &&
+               i < tokens.size()) {
+      location.setCgiCacheLockTimeout(tokens[i].value);
+      i++;
+      if (i >= tokens.size() || tokens[i].value != ";") {
+        throw std::runtime_error(
+            "Expected ';' after 'cgi_cache_lock_timeout' directive");
+      }
+      i++;
+    } else if (locationDirective == "cgi_cache_max_size" &&
+               i < tokens.size()) {
+      std::string sizeStr = tokens[i].value;
+      location.setCgiCacheMaxSize(sizeStr);
+      i++;
+      if (i >= tokens.size() || tokens[i].value != ";") {
+        throw std::runtime_error(
+            "Expected ';' after 'cgi_cache_max_size' directive");
+      }
+      i++;
+    } else if (locationDirective == "cgi_max_concurrent" &&
+               i < tokens.size()) {
+      location.setCgiMaxConcurrent(tokens[i].value);
+      i++;
+      if (i >= tokens.size() || tokens[i].value != ";") {
+        throw std::runtime_error(
+            "Expected ';' after 'cgi_max_concurrent' directive");
+      }
+      i++;
+    } else if (locationDirective == "cgi_queue" && i < tokens.size()) {
+      i = parseCgiQueueDirective(tokens, i, location);
+    } else if (locationDirective == "proxy_pass" && i < tokens.size()) {
+      location.setProxyPass(tokens[i].value);
+      i++;
+      if (i >= tokens.size() || tokens[i].value != ";") {
+        throw std::runtime_error("Expected ';' after 'proxy_pass' directive");
+      }
+      i++;
+      if (location.getProxyPass().hasUri &&
+          (location.getMatchType() == REGEX_CASE ||
+           location.getMatchType() == REGEX_ICASE)) {
+        throw std::runtime_error(
+            "proxy_pass cannot have a URI part in a regex location");
+      }
+    } else if (locationDirective == "proxy_cache" ||
+               locationDirective == "proxy_cache_key" ||
+               locationDirective == "proxy_cache_valid" ||
+               locationDirective == "proxy_cache_use_stale" ||
+               locationDirective == "proxy_cache_lock" ||
+               locationDirective == "proxy_cache_lock_timeout" ||
+               locationDirective == "proxy_buffering" ||
+               locationDirective == "proxy_buffers" ||
+               locationDirective == "proxy_max_temp_file_size") {
+      std::vector<std::string> args;
+      i = parseArguments(tokens, i, locationDirective, args);
+      if (locationDirective == "proxy_cache_valid") {
+        location.addProxyCacheValid(args);
+      } else if (locationDirective == "proxy_cache_use_stale") {
+        location.setProxyCacheUseStale(args);
+      } else if (locationDirective == "proxy_buffers") {
+        location.setProxyBuffers(args);
+      } else if (args.size() != 1) {
+        throw std::runtime_error("Invalid arguments for '" +
+                                 locationDirective + "'");
+      } else if (locationDirective == "proxy_cache") {
+        location.setProxyCache(args[0]);
+      } else if (locationDirective == "proxy_cache_lock") {
+        location.setProxyCacheLock(args[0]);
+      } else if (locationDirective == "proxy_cache_lock_timeout") {
+        location.setProxyCacheLockTimeout(args[0]);
+      } else if (locationDirective == "proxy_buffering") {
+        location.setProxyBuffering(args[0]);
+      } else if (locationDirective == "proxy_max_temp_file_size") {
+        location.setProxyMaxTempFileSize(args[0]);
+      } else {
+        location.setProxyCacheKey(args[0]);
+      }
+    } else if (locationDirective == "limit_req" ||
+               locationDirective == "limit_req_status") {
+      std::vector<std::string> args;
+      i = parseArguments(tokens, i, locationDirective, args);
+      if (locationDirective == "limit_req") {
+        location.addLimitReq(args);
+      } else if (args.size() != 1) {
+        throw std::runtime_error("Invalid arguments for 'limit_req_status'");
+      } else {
+        location.setLimitReqStatus(args[0]);
+      }
+    } else if (locationDirective == "allow" || locationDirective == "deny") {
+      std::vector<std::string> args;
+      i = parseArguments(tokens, i, locationDirective, args);
+      if (args.size() != 1)
+        throw std::runtime_error("Invalid arguments for '" +
+                                 locationDirective + "'");
+      location.addAccessRule(locationDirective == "allow", args[0]);
+    } else if (locationDirective == "add_header") {
+      std::vector<std::string> args;
+      i = parseArguments(tokens, i, locationDirective, args);
+      location.addHeader(args);
+    } else if (locationDirective == "limit_rate" ||
+               locationDirective == "limit_rate_after") {
+      std::vector<std::string> args;
+      i = parseArguments(tokens, i, locationDirective, args);
+      if (args.size() != 1)
+        throw std::runtime_error("Invalid arguments for '" +
+                                 locationDirective + "'");
+      if (locationDirective == "limit_rate")
+        location.setLimitRate(args[0]);
+      else
+        location.setLimitRateAfter(args[0]);
+    } else if (locationDirective == "cgi_status" && i < tokens.size()) {
+      std::string value = tokens[i].value;
+      i++;
+      if (i >= tokens.size() || tokens[i].value != ";") {
+        throw std::runtime_error("Expected ';' after 'cgi_status' directive");
+      }
+      i++;
+      if (value == "on") {
+        location.setCgiStatus(true);
+      } else if (value != "off") {
+        throw std::runtime_error("Invalid value for 'cgi_status': " + value);
+      }
     } else if (locationDirective == "return" && i < tokens.size()) {
       // Parse: return <code> <url>;
       if (tokens[i].type != NUMBER) {
@@ -230,7 +435,7 @@ static size_t parseLocation(const std::vector<Token>& tokens,
     throw std::runtime_error("Location path cannot be empty");
   }
 
-  LocationConfig location(path, matchType);
+  LocationConfig& location = server.newLocation(path, matchType);
 
   int locationBraceLevel = 0;
   if (i >= tokens.size() || tokens[i].value != "{") {
@@ -259,7 +464,12 @@ static size_t parseLocation(const std::vector<Token>& tokens,
       }
     }
 
-    i = parseLocationDirective(tokens, i, location);
+    size_t directive = i;
+    try {
+      i = parseLocationDirective(tokens, i, location);
+    } catch (...) {
+      rethrowAt(tokens[directive]);
+    }
   }
 
   if (locationBraceLevel != 0) {
@@ -271,7 +481,11 @@ static size_t parseLocation(const std::vector<Token>& tokens,
 
   location.inheritCgiPassFromParent(server.getCgiPassMap());
 
-  server.addLocation(location);
+  location.inheritClientMaxBodySize(server.getClientMaxBodySize());
+
+  location.inheritCgiCacheFromParent(server);
+
+  location.inheritCgiLimitsFromParent(server);
   return i;
 }
 
@@ -338,6 +552,11 @@ static size_t parseBasicServerDirective(const std::vector<Token>& tokens,
       }
 
       std::string listenValue = tokens[i].value;
+      if (listenValue == "default_server") {
+        server.setDefaultServer();
+        i++;
+        continue;
+      }
       u_int16_t port = 80;
       std::string addr = "0.0.0.0";
 
@@ -417,6 +636,100 @@ static size_t parseBasicServerDirective(const std::vector<Token>& tokens,
     }
     i++;
     server.setCgiPassMapping(extension, interpreter);
+  } else if (directive == "cgi_cache" && i < tokens.size()) {
+    if (tokens[i].value == "on") {
+      server.setCgiCache(true);
+    } else if (tokens[i].value != "off") {
+      throw std::runtime_error("Invalid value for 'cgi_cache': " +
+                               tokens[i].value);
+    }
+    i++;
+    if (i >= tokens.size() || tokens[i].value != ";") {
+      throw std::runtime_error("Expected ';' after 'cgi_cache' directive");
+    }
+    i++;
+  } else if (directive == "cgi_cache_valid" && i < tokens.size()) {
+    server.setCgiCacheValid(tokens[i].value);
+    i++;
+    if (i >= tokens.size() || tokens[i].value != ";") {
+      throw std::runtime_error(
+          "Expected ';' after 'cgi_cache_valid' directive");
+    }
+    i++;
+  } else if (directive == "cgi_cache_lock_timeout" && i < tokens.size()) {
+    server.setCgiCacheLockTimeout(tokens[i].value);
+    i++;
+    if (i >= tokens.size() || tokens[i].value != ";") {
+      throw std::runtime_error(
+          "Expected ';' after 'cgi_cache_lock_timeout' directive");
+    }
+    i++;
+  } else if (directive == "cgi_cache_max_size" && i < tokens.size()) {
+    std::string sizeStr = tokens[i].value;
+    server.setCgiCacheMaxSize(sizeStr);
+    i++;
+    if (i >= tokens.size() || tokens[i].value != ";") {
+      throw std::runtime_error(
+          "Expected ';' after 'cgi_cache_max_size' directive");
+    }
+    i++;
+  } else if (directive == "cgi_max_concurrent" && i < tokens.size()) {
+    server.setCgiMaxConcurrent(tokens[i].value);
+    i++;
+    if (i >= tokens.size() || tokens[i].value != ";") {
+      throw std::runtime_error(
+          "Expected ';' after 'cgi_max_concurrent' directive");
+    }
+    i++;
+  } else if (directive == "cgi_queue" && i < tokens.size()) {
+    i = parseCgiQueueDirective(tokens, i, server);
+  } else if (directive == "limit_req" || directive == "limit_req_status") {
+    std::vector<std::string> args;
+    i = parseArguments(tokens, i, directive, args);
+    if (directive == "limit_req") {
+      server.addLimitReq(args);
+    } else if (args.size() != 1) {
+      throw std::runtime_error("Invalid arguments for 'limit_req_status'");
+    } else {
+      server.setLimitReqStatus(args[0]);
+    }
+  } else if (directive == "limit_conn" || directive == "limit_conn_status") {
+    std::vector<std::string> args;
+    i = parseArguments(tokens, i, directive, args);
+    if (directive == "limit_conn") {
+      server.addLimitConn(args);
+    } else if (args.size() != 1) {
+      throw std::runtime_error("Invalid arguments for 'limit_conn_status'");
+    } else {
+      server.setLimitConnStatus(args[0]);
+    }
+  } else if (directive == "allow" || directive == "deny") {
+    std::vector<std::string> args;
+    i = parseArguments(tokens, i, directive, args);
+    if (args.size() != 1)
+      throw std::runtime_error("Invalid arguments for '" + directive + "'");
+    server.addAccessRule(directive == "allow", args[0]);
+  } else if (directive == "add_header") {
+    std::vector<std::string> args;
+    i = parseArguments(tokens, i, directive, args);
+    server.addHeader(args);
+  } else if (directive == "limit_rate" || directive == "limit_rate_after") {
+    std::vector<std::string> args;
+    i = parseArguments(tokens, i, directive, args);
+    if (args.size() != 1)
+      throw std::runtime_error("Invalid arguments for '" + directive + "'");
+    if (directive == "limit_rate")
+      server.setLimitRate(args[0]);
+    else
+      server.setLimitRateAfter(args[0]);
+  } else if (directive == "shutdown_timeout" && i < tokens.size()) {
+    server.setShutdownTimeout(tokens[i].value);
+    i++;
+    if (i >= tokens.size() || tokens[i].value != ";") {
+      throw std::runtime_error(
+          "Expected ';' after 'shutdown_timeout' directive");
+    }
+    i++;
   }
   return i;
 }
@@ -439,17 +752,37 @@ static size_t parseServerDirective(const std::vector<Token>& tokens,
     } else {
       i = parseBasicServerDirective(tokens, i, server, directive);
     }
+  } else if (tokens[i].value == "{") {
+    // Nothing consumes these: without the throws the server loop would spin
+    // on the same token forever
+    throw std::runtime_error("Unexpected '{' in server block");
+  } else if (tokens[i].value != "}") {
+    throw std::runtime_error("Unknown server directive: " + tokens[i].value);
   }
   return i;
 }
 
-static size_t parseServer(const std::vector<Token>& tokens,
-                          size_t i,
-                          Container& container,
-                          int& httpBraceLevel) {
-  Server server;
+static size_t parseServerBlock(const std::vector<Token>& tokens,
+                               size_t i,
+                               Container& container,
+                               int& httpBraceLevel) {
+  // Built in place: a Server owns compiled location tables and regexes, and
+  // copying it into the container doubled the cost of every server block
+  Server& server = container.newServer();
   i++;
 
+  // Same for its locations: up to the next server block is an upper bound
+  size_t locationBlocks = 0;
+  for (size_t t = i; t < tokens.size(); ++t) {
+    if (tokens[t].type != LEVEL)
+      continue;
+    if (tokens[t].value == "server")
+      break;
+    if (tokens[t].value == "location")
+      ++locationBlocks;
+  }
+  server.reserveLocations(locationBlocks);
+
   int serverBraceLevel = 0;
   if (i >= tokens.size() || tokens[i].value != "{") {
     throw std::runtime_error("Expected '{' after 'server'");
@@ -474,15 +807,204 @@ static size_t parseServer(const std::vector<Token>& tokens,
       }
     }
 
-    i = parseServerDirective(tokens, i, server, serverBraceLevel,
-                             httpBraceLevel);
+    size_t directive = i;
+    try {
+      i = parseServerDirective(tokens, i, server, serverBraceLevel,
+                               httpBraceLevel);
+    } catch (...) {
+      rethrowAt(tokens[directive]);
+    }
   }
 
   if (serverBraceLevel != 0) {
     throw std::runtime_error("Unclosed 'server' block: missing '}'");
   }
 
-  container.insertServer(server);
+  server.buildLocationIndex();
+  server.compileCgiDispatch();
+  server.resolveLocations();
+  return i;
+}
+
+// Errors that concern the block as a whole (unbalanced braces, duplicate
+// locations) are reported at its 'server' keyword
+static size_t parseServer(const std::vector<Token>& tokens,
+                          size_t i,
+                          Container& container,
+                          int& httpBraceLevel) {
+  try {
+    return parseServerBlock(tokens, i, container, httpBraceLevel);
+  } catch (...) {
+    rethrowAt(tokens[i]);
+  }
+  return i;
+}
+
+// Parse: server <address> [weight=N] [max_fails=N] [fail_timeout=Ns];
+//        least_conn; | hash <key> [consistent]; | random two [least_conn];
+static size_t parseUpstreamDirective(const std::vector<Token>& tokens,
+                                     size_t i,
+                                     UpstreamGroup& group) {
+  std::string directive = tokens[i].value;
+  std::vector<std::string> args;
+  i++;
+  while (i < tokens.size() && tokens[i].value != ";") {
+    if (tokens[i].value == "{" || tokens[i].value == "}")
+      break;
+    args.push_back(tokens[i].value);
+    i++;
+  }
+  if (i >= tokens.size() || tokens[i].value != ";") {
+    throw std::runtime_error("Expected ';' after '" + directive +
+                             "' directive");
+  }
+  i++;
+
+  if (directive == "server") {
+    if (args.empty())
+      throw std::runtime_error("Missing address for upstream 'server'");
+    std::vector<std::string> params(args.begin() + 1, args.end());
+    group.peers.push_back(UpstreamPeer::parse(args[0], params));
+  } else if (directive == "least_conn" && args.empty()) {
+    group.balance = UpstreamGroup::LEAST_CONN;
+  } else if (directive == "hash" && !args.empty() &&
+             (args.size() == 1 || (args.size() == 2 && args[1] == "consistent"))) {
+    group.setHashKey(args[0]);
+  } else if (directive == "random" && !args.empty() && args[0] == "two" &&
+             (args.size() == 1 || (args.size() == 2 && args[1] == "least_conn"))) {
+    group.balance = UpstreamGroup::RANDOM_TWO;
+  } else if (directive == "least_conn" || directive == "hash" ||
+             directive == "random") {
+    throw std::runtime_error("Invalid arguments for '" + directive + "'");
+  } else {
+    throw std::runtime_error("Unknown upstream directive: " + directive);
+  }
+  return i;
+}
+
+// Parse: upstream <name> { ... }
+static size_t parseUpstream(const std::vector<Token>& tokens,
+                            size_t i,
+                            Container& container) {
+  size_t keyword = i;
+  try {
+    i++;
+    if (i >= tokens.size() || tokens[i].type == SYMBOL) {
+      throw std::runtime_error("Expected name after 'upstream'");
+    }
+    UpstreamGroup& group = container.newUpstream(tokens[i].value);
+    i++;
+    if (i >= tokens.size() || tokens[i].value != "{") {
+      throw std::runtime_error("Expected '{' after upstream name");
+    }
+    i++;
+    while (i < tokens.size() && tokens[i].value != "}") {
+      size_t directive = i;
+      try {
+        i = parseUpstreamDirective(tokens, i, group);
+      } catch (...) {
+        rethrowAt(tokens[directive]);
+      }
+    }
+    if (i >= tokens.size()) {
+      throw std::runtime_error("Unclosed 'upstream' block: missing '}'");
+    }
+    i++;
+    if (group.peers.empty()) {
+      throw std::runtime_error("Upstream " + group.name + " has no servers");
+    }
+  } catch (...) {
+    rethrowAt(tokens[keyword]);
+  }
+  return i;
+}
+
+// Parse: map <source> $<variable> { <key> <value>; ... }
+static size_t parseMap(const std::vector<Token>& tokens,
+                       size_t i,
+                       Container& container) {
+  size_t keyword = i;
+  try {
+    VariableMap map;
+    if (i + 3 >= tokens.size() || tokens[i + 1].type == SYMBOL ||
+        tokens[i + 2].type == SYMBOL || tokens[i + 3].value != "{") {
+      throw std::runtime_error("Expected 'map <source> $<variable> {'");
+    }
+    map.setSource(tokens[i + 1].value);
+    map.setVariable(tokens[i + 2].value);
+    i += 4;
+    while (i < tokens.size() && tokens[i].value != "}") {
+      size_t entry = i;
+      try {
+        std::vector<std::string> args;
+        while (i < tokens.size() && tokens[i].type != SYMBOL) {
+          args.push_back(tokens[i].value);
+          i++;
+        }
+        if (i >= tokens.size() || tokens[i].value != ";") {
+          throw std::runtime_error("Expected ';' after map entry");
+        }
+        i++;
+        map.addEntry(args);
+      } catch (...) {
+        rethrowAt(tokens[entry]);
+      }
+    }
+    if (i >= tokens.size()) {
+      throw std::runtime_error("Unclosed 'map' block: missing '}'");
+    }
+    i++;
+    map.compile();
+    container.addMap(map);
+  } catch (...) {
+    rethrowAt(tokens[keyword]);
+  }
+  return i;
+}
+
+// Parse: proxy_cache_path <dir> keys_zone=<name> [levels=..] [max_size=..]
+//        [inactive=..];
+static size_t parseCachePath(const std::vector<Token>& tokens,
+                             size_t i,
+                             Container& container) {
+  size_t keyword = i;
+  try {
+    std::vector<std::string> args;
+    i = parseArguments(tokens, i + 1, "proxy_cache_path", args);
+    container.addCacheZone(ProxyCacheZone::parse(args));
+  } catch (...) {
+    rethrowAt(tokens[keyword]);
+  }
+  return i;
+}
+
+// Parse: limit_req_zone <key> zone=<name>:<size> rate=<rate>;
+static size_t parseLimitReqZone(const std::vector<Token>& tokens,
+                                size_t i,
+                                Container& container) {
+  size_t keyword = i;
+  try {
+    std::vector<std::string> args;
+    i = parseArguments(tokens, i + 1, "limit_req_zone", args);
+    container.addLimitReqZone(LimitReqZone::parse(args));
+  } catch (...) {
+    rethrowAt(tokens[keyword]);
+  }
+  return i;
+}
+
+// Parse: limit_conn_zone <key> zone=<name>:<size>;
+static size_t parseLimitConnZone(const std::vector<Token>& tokens,
+                                 size_t i,
+                                 Container& container) {
+  size_t keyword = i;
+  try {
+    std::vector<std::string> args;
+    i = parseArguments(tokens, i + 1, "limit_conn_zone", args);
+    container.addLimitConnZone(LimitConnZone::parse(args));
+  } catch (...) {
+    rethrowAt(tokens[keyword]);
+  }
   return i;
 }
 
@@ -492,78 +1014,110 @@ Container parser(const std::vector<Token>& tokens) {
   if (tokens.empty())
     throw std::runtime_error("Empty configuration");
 
+  // Size the server list up front so growing it never copies servers
+  size_t serverBlocks = 0;
+  for (size_t t = 0; t < tokens.size(); ++t)
+    if (tokens[t].type == LEVEL && tokens[t].value == "server")
+      ++serverBlocks;
+  container.reserveServers(serverBlocks);
+
   size_t i = 0;
   int httpBraceLevel = 0;
 
-  // Check if config starts with 'http' block or directly with 'server' blocks
-  bool hasHttpBlock = expect("http", tokens[0]);
+  try {
+    // Check if config starts with 'http' block or directly with 'server' blocks
+    bool hasHttpBlock = expect("http", tokens[0]);
 
-  if (hasHttpBlock) {
-    // Parse with http block wrapper
-    i = 1;
-    if (i >= tokens.size() || tokens[i].value != "{") {
-      throw std::runtime_error("Expected '{' after 'http'");
-    }
-    httpBraceLevel++;
-    i++;
+    if (hasHttpBlock) {
+      // Parse with http block wrapper
+      i = 1;
+      if (i >= tokens.size() || tokens[i].value != "{") {
+        throw std::runtime_error("Expected '{' after 'http'");
+      }
+      httpBraceLevel++;
+      i++;
 
-    while (i < tokens.size() && httpBraceLevel > 0) {
-      if (tokens[i].value == "{") {
-        httpBraceLevel++;
-      } else if (tokens[i].value == "}") {
-        if (httpBraceLevel <= 0) {
-          throw std::runtime_error("Unexpected '}' outside of any block");
+      while (i < tokens.size() && httpBraceLevel > 0) {
+        if (tokens[i].value == "{") {
+          httpBraceLevel++;
+        } else if (tokens[i].value == "}") {
+          if (httpBraceLevel <= 0) {
+            throw std::runtime_error("Unexpected '}' outside of any block");
+          }
+          httpBraceLevel--;
+          if (httpBraceLevel == 0) {
+            i++;
+            break;
+          }
         }
-        httpBraceLevel--;
-        if (httpBraceLevel == 0) {
+
+        if (tokens[i].type == LEVEL && tokens[i].value == "server") {
+          i = parseServer(tokens, i, container, httpBraceLevel);
+        } else if (tokens[i].type == LEVEL && tokens[i].value == "upstream") {
+          i = parseUpstream(tokens, i, container);
+        } else if (tokens[i].type == LEVEL && tokens[i].value == "map") {
+          i = parseMap(tokens, i, container);
+        } else if (tokens[i].value == "proxy_cache_path") {
+          i = parseCachePath(tokens, i, container);
+        } else if (tokens[i].value == "limit_req_zone") {
+          i = parseLimitReqZone(tokens, i, container);
+        } else if (tokens[i].value == "limit_conn_zone") {
+          i = parseLimitConnZone(tokens, i, container);
+        } else {
           i++;
-          break;
         }
       }
 
-      if (tokens[i].type == LEVEL && tokens[i].value == "server") {
-        i = parseServer(tokens, i, container, httpBraceLevel);
-      } else {
-        i++;
+      if (httpBraceLevel != 0) {
+        throw std::runtime_error("Unclosed 'http' block: missing '}'");
       }
-    }
 
-    if (httpBraceLevel != 0) {
-      throw std::runtime_error("Unclosed 'http' block: missing '}'");
-    }
-
-    if (i < tokens.size()) {
-      while (i < tokens.size() && tokens[i].value == ";") {
-        i++;
-      }
       if (i < tokens.size()) {
-        throw std::runtime_error("Unexpected tokens after 'http' block");
-      }
-    }
-  } else {
-    // Parse server blocks directly without http wrapper
-    while (i < tokens.size()) {
-      // Skip semicolons between server blocks
-      while (i < tokens.size() && tokens[i].value == ";") {
-        i++;
+        while (i < tokens.size() && tokens[i].value == ";") {
+          i++;
+        }
+        if (i < tokens.size()) {
+          throw std::runtime_error("Unexpected tokens after 'http' block");
+        }
       }
+    } else {
+      // Parse server blocks directly without http wrapper
+      while (i < tokens.size()) {
+        // Skip semicolons between server blocks
+        while (i < tokens.size() && tokens[i].value == ";") {
+          i++;
+        }
 
-      if (i >= tokens.size()) {
-        break;
-      }
+        if (i >= tokens.size()) {
+          break;
+        }
 
-      if (tokens[i].type == LEVEL && tokens[i].value == "server") {
-        int dummyBraceLevel = 0;  // Reset for each server block
-        i = parseServer(tokens, i, container, dummyBraceLevel);
-      } else {
-        throw std::runtime_error("Expected 'server' block at top level");
+        if (tokens[i].type == LEVEL && tokens[i].value == "server") {
+          int dummyBraceLevel = 0;  // Reset for each server block
+          i = parseServer(tokens, i, container, dummyBraceLevel);
+        } else if (tokens[i].type == LEVEL && tokens[i].value == "upstream") {
+          i = parseUpstream(tokens, i, container);
+        } else if (tokens[i].type == LEVEL && tokens[i].value == "map") {
+          i = parseMap(tokens, i, container);
+        } else if (tokens[i].value == "proxy_cache_path") {
+          i = parseCachePath(tokens, i, container);
+        } else if (tokens[i].value == "limit_req_zone") {
+          i = parseLimitReqZone(tokens, i, container);
+        } else if (tokens[i].value == "limit_conn_zone") {
+          i = parseLimitConnZone(tokens, i, container);
+        } else {
+          throw std::runtime_error("Expected 'server' block at top level");
+        }
       }
     }
+  } catch (...) {
+    rethrowAt(tokens[i < tokens.size() ? i : tokens.size() - 1]);
   }
 
   if (container.getServers().empty()) {
     throw std::runtime_error("No server blocks defined in configuration");
   }
+  container.linkUpstreams();
 
   return container;
 }
\ No newline at end of file
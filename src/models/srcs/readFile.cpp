@@ -2,12 +2,25 @@
 #include <iostream>
 #include <sstream>
 
+// Sizes the file first and reads it with a single call, so large configs
+// are not copied through a stringstream
 std::string readFile(const std::string& filename) {
-  std::ifstream file(filename.c_str());
+  std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
   if (!file.is_open()) {
     throw std::runtime_error("Could not open file: " + filename);
   }
-  std::stringstream buffer;
-  buffer << file.rdbuf();
-  return buffer.str();
+  file.seekg(0, std::ios::end);
+  std::streamoff size = file.tellg();
+  file.seekg(0, std::ios::beg);
+  if (size <= 0) {
+    // Not seekable (a pipe or /dev/stdin): fall back to streaming it
+    file.clear();
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+  }
+  std::string content(static_cast<size_t>(size), '\0');
+  if (!file.read(&content[0], size))
+    throw std::runtime_error("Could not read file: " + filename);
+  return content;
 }
@@ -1,4 +1,5 @@
 #include "requestContext.hpp"
+#include "ProxySession.hpp"
 #include <fstream>
 #include <iostream>
 #include <sstream>
@@ -20,80 +21,125 @@ Location (Specific Path Configuration):
     - Example: "But the conference room allows 100 people max"
 */
 
+// Everything below reads the ResolvedLocation the server compiled for this
+// location at config load; no inheritance is worked out per request.
 RequestContext::RequestContext(const Server& srv, const LocationConfig* loc)
-    : server(srv), location(loc), rootDir("") {
-  rootDir = server.getRoot();
-  // Only use location's root if it's explicitly set (not the default)
-  if (location && !location->getRoot().empty() &&
-      location->getRoot() != DEFAULT_ROOT_PATH)
-    rootDir = location->getRoot();
+    : server(srv),
+      location(loc),
+      resolved(srv.getResolved(loc)),
+      rootDir(srv.getInternedRoot(resolved.root)),
+      captures(),
+      _expandedReturn(),
+      _returnExpanded(false),
+      _expandedHeaders(),
+      _headersExpanded(false) {}
+
+// A regex location may refer to its capture groups as $1..$9 in root and
+// return; they are substituted once here, for this request
+RequestContext::RequestContext(const Server& srv,
+                               const LocationConfig* loc,
+                               const std::vector<std::string>& regexCaptures)
+    : server(srv),
+      location(loc),
+      resolved(srv.getResolved(loc)),
+      rootDir(srv.getInternedRoot(resolved.root)),
+      captures(regexCaptures),
+      _expandedReturn(),
+      _returnExpanded(false),
+      _expandedHeaders(),
+      _headersExpanded(false) {
+  if (captures.empty() || !location)
+    return;
+  rootDir = expandCaptures(rootDir);
+  if (location->hasReturn()) {
+    _expandedReturn.first = location->getReturnData().first;
+    _expandedReturn.second = expandCaptures(location->getReturnData().second);
+    _returnExpanded = true;
+  }
+}
+
+// Runs after any $1..$9 substitution, so only named variables are left
+void RequestContext::expandVariables(const std::string& rawRequest,
+                                     const HttpRequest& request,
+                                     const sockaddr_in& clientAddr) {
+  if (!resolved.hasVariables)
+    return;
+  rootDir =
+      ProxySession::expandVariables(rootDir, rawRequest, request, clientAddr);
+  if (resolved.hasReturn) {
+    const std::pair<u_int16_t, std::string>& data = getReturnData();
+    _expandedReturn.first = data.first;
+    _expandedReturn.second = ProxySession::expandVariables(
+        data.second, rawRequest, request, clientAddr);
+    _returnExpanded = true;
+  }
+  _expandedHeaders = resolved.addHeaders;
+  for (size_t i = 0; i < _expandedHeaders.size(); ++i)
+    _expandedHeaders[i].value = ProxySession::expandVariables(
+        _expandedHeaders[i].value, rawRequest, request, clientAddr);
+  _headersExpanded = true;
+}
+
+std::string RequestContext::expandCaptures(const std::string& value) const {
+  if (captures.empty() || value.find('$') == std::string::npos)
+    return value;
+
+  std::string result;
+  for (size_t i = 0; i < value.size(); ++i) {
+    if (value[i] == '$' && i + 1 < value.size() && isdigit(value[i + 1])) {
+      size_t group = value[i + 1] - '0';
+      if (group < captures.size())
+        result += captures[group];
+      ++i;
+    } else {
+      result += value[i];
+    }
+  }
+  return result;
 }
 
 // index files are the default files that a web server serves when someone
 // requests a dir (instead of a specific file)
 const std::vector<std::string>& RequestContext::getIndexFiles() const {
-  if (location && !location->getIndexFiles().empty())
-    return location->getIndexFiles();
-  return server.getIndexFiles();
+  return resolved.indexFiles;
 }
 
 size_t RequestContext::getClientMaxBodySize() const {
-  if (location)
-    return location->getClientMaxBodySize();
-  return server.getClientMaxBodySize();
+  return resolved.clientMaxBodySize;
 }
 
 bool RequestContext::getAutoIndex() const {
-  if (location)
-    return location->getAutoIndex();
-  return server.getAutoIndex();
+  return resolved.autoIndex;
 }
 
 bool RequestContext::isMethodAllowed(const std::string& method) const {
-  if (location)
-    return location->isMethodAllowed(method);
-  return (method == "GET" || method == "HEAD" || method == "POST" ||
-          method == "PUT" || method == "DELETE" || method == "PATCH");
+  return resolved.isMethodAllowed(method, location);
 }
 
 // converts a relative URL path (from an HTTP request) into an absolute file
 // system path that your server can use to find the actual file.
 std::string RequestContext::getFullPath(const std::string& requestPath) const {
-  std::string fullPath = "";
-
   // If empty, return rootDir
   if (requestPath.empty())
     return rootDir;
 
-  // Check if requestPath is absolute (starts with '/')
-  if (!requestPath.empty() && requestPath[0] == '/') {
-    // Treat absolute paths as relative to rootDir for security
-    fullPath = rootDir;
-    if (!fullPath.empty() && fullPath[fullPath.length() - 1] != '/')
-      fullPath += '/';
-
-    // Remove leading slash from requestPath
-    fullPath += requestPath.substr(1);
-  } else {
-    // Relative path, just combine with rootDir
-    fullPath = rootDir;
-    if (!fullPath.empty() && fullPath[fullPath.length() - 1] != '/')
-      fullPath += '/';
-
-    fullPath += requestPath;
-  }
-
+  std::string fullPath;
+  fullPath.reserve(rootDir.size() + requestPath.size() + 1);
+  fullPath = rootDir;
+  if (!fullPath.empty() && fullPath[fullPath.length() - 1] != '/')
+    fullPath += '/';
+  // Treat absolute paths as relative to rootDir for security
+  fullPath.append(requestPath, requestPath[0] == '/' ? 1 : 0,
+                  std::string::npos);
   return fullPath;
 }
 
 const std::string* RequestContext::getErrorPage(const u_int16_t code) const {
-  // Try location first, then server
-  if (location) {
-    const std::string* errorPage = location->getErrorPage(code);
-    if (errorPage)
-      return errorPage;
-  }
-  return server.getErrorPage(code);
+  std::map<u_int16_t, std::string>::const_iterator it =
+      resolved.errorPages.find(code);
+  if (it == resolved.errorPages.end())
+    return NULL;
+  return &it->second;
 }
 
 std::string RequestContext::getErrorPageContent(u_int16_t code) const {
@@ -124,13 +170,30 @@ std::string RequestContext::getErrorPageContent(u_int16_t code) const {
 }
 
 bool RequestContext::hasReturn() const {
-  if (location && location->hasReturn())
-    return true;
-  return server.hasReturn();
+  return resolved.hasReturn;
 }
 
 const std::pair<u_int16_t, std::string>& RequestContext::getReturnData() const {
-  if (location && location->hasReturn())
-    return location->getReturnData();
-  return server.getReturnData();
+  if (_returnExpanded)
+    return _expandedReturn;
+  return resolved.returnData;
+}
+
+const std::string& RequestContext::getUploadDir() const {
+  return resolved.uploadDir;
+}
+
+bool RequestContext::isCgiEnabled() const {
+  return resolved.cgiEnabled;
+}
+
+const std::vector<AddHeader>& RequestContext::getAddHeaders() const {
+  return _headersExpanded ? _expandedHeaders : resolved.addHeaders;
+}
+
+// The dispatch table itself stays on its block (it carries a stat cache)
+const CgiDispatch& RequestContext::getCgiDispatch() const {
+  if (location)
+    return location->getCgiDispatch();
+  return server.getCgiDispatch();
 }
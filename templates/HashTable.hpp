@@ -0,0 +1,81 @@
+#ifndef HASHTABLE_HPP
+#define HASHTABLE_HPP
+
+#include <string>
+#include <vector>
+
+// Separate-chaining hash table keyed by strings, for lookups that run on
+// every request against tables built once at config load. Lookups hash the
+// key once (FNV-1a) and compare only within one short bucket.
+template <typename T>
+class HashTable {
+ private:
+  struct Entry {
+    std::string key;
+    T value;
+  };
+
+  std::vector<std::vector<Entry> > _buckets;
+  size_t _size;
+
+  static size_t hash(const char* key, size_t len) {
+    size_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+      h ^= (unsigned char)key[i];
+      h *= 16777619u;
+    }
+    return h;
+  }
+
+  void grow() {
+    std::vector<std::vector<Entry> > old;
+    old.swap(this->_buckets);
+    this->_buckets.resize(old.size() * 2);
+    for (size_t b = 0; b < old.size(); ++b)
+      for (size_t i = 0; i < old[b].size(); ++i)
+        this->_buckets[hash(old[b][i].key.data(), old[b][i].key.size()) %
+                       this->_buckets.size()]
+            .push_back(old[b][i]);
+  }
+
+ public:
+  HashTable() : _buckets(16), _size(0) {}
+
+  // Returns false (and keeps the existing value) if the key is present
+  bool insert(const std::string& key, const T& value) {
+    if (find(key))
+      return false;
+    if (this->_size >= this->_buckets.size())
+      grow();
+    Entry entry;
+    entry.key = key;
+    entry.value = value;
+    this->_buckets[hash(key.data(), key.size()) % this->_buckets.size()]
+        .push_back(entry);
+    ++this->_size;
+    return true;
+  }
+
+  const T* find(const char* key, size_t len) const {
+    const std::vector<Entry>& bucket =
+        this->_buckets[hash(key, len) % this->_buckets.size()];
+    for (size_t i = 0; i < bucket.size(); ++i)
+      if (bucket[i].key.size() == len &&
+          bucket[i].key.compare(0, len, key, len) == 0)
+        return &bucket[i].value;
+    return NULL;
+  }
+
+  const T* find(const std::string& key) const {
+    return find(key.data(), key.size());
+  }
+
+  size_t size() const { return this->_size; }
+
+  void clear() {
+    this->_buckets.assign(16, std::vector<Entry>());
+    this->_size = 0;
+  }
+};
+
+#endif
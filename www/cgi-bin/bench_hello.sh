@@ -0,0 +1,6 @@
+#!/bin/bash
+# Benchmark fixture: smallest possible CGI response
+
+echo "Content-Type: text/plain"
+echo ""
+echo "hello"
@@ -0,0 +1,7 @@
+#!/bin/bash
+# Benchmark fixture: consumes the whole request body and reports its size
+
+size=$(wc -c)
+echo "Content-Type: text/plain"
+echo ""
+echo "$size"